@@ -0,0 +1,71 @@
+#include "announce.h"
+
+#include <string.h>
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v >> 16);
+    put_u16(p + 2, v);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)get_u16(p) << 16 | get_u16(p + 2);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+size_t announce_encode(const Announcement *a, uint8_t *buf, size_t len) {
+    size_t name_len = strnlen(a->name, ANNOUNCE_MAX_NAME);
+    size_t key_len = (a->capabilities & CAP_SECURE) ? ANNOUNCE_KEY_SIZE : 0;
+    size_t total = ANNOUNCE_HEADER_SIZE + name_len + key_len;
+    if (len < total) return 0;
+
+    buf[0] = 'P';
+    buf[1] = 'N';
+    buf[2] = ANNOUNCE_VERSION;
+    buf[3] = (uint8_t)name_len;
+    put_u32(buf + 4, a->capabilities);
+    put_u64(buf + 8, a->node_id);
+    put_u32(buf + 16, a->seq);
+    put_u16(buf + 20, a->ttl);
+    put_u16(buf + 22, 0);
+    memcpy(buf + ANNOUNCE_HEADER_SIZE, a->name, name_len);
+    memcpy(buf + ANNOUNCE_HEADER_SIZE + name_len, a->public_key, key_len);
+    return total;
+}
+
+bool announce_decode(const uint8_t *buf, size_t len, Announcement *a) {
+    if (len < ANNOUNCE_HEADER_SIZE) return false;
+    if (buf[0] != 'P' || buf[1] != 'N' || buf[2] != ANNOUNCE_VERSION) return false;
+
+    size_t name_len = buf[3];
+    uint32_t capabilities = get_u32(buf + 4);
+    size_t key_len = (capabilities & CAP_SECURE) ? ANNOUNCE_KEY_SIZE : 0;
+    if (name_len > ANNOUNCE_MAX_NAME || len < ANNOUNCE_HEADER_SIZE + name_len + key_len) return false;
+
+    a->version = buf[2];
+    a->capabilities = capabilities;
+    a->node_id = get_u64(buf + 8);
+    a->seq = get_u32(buf + 16);
+    a->ttl = get_u16(buf + 20);
+    memcpy(a->name, buf + ANNOUNCE_HEADER_SIZE, name_len);
+    a->name[name_len] = '\0';
+    if (key_len) memcpy(a->public_key, buf + ANNOUNCE_HEADER_SIZE + name_len, key_len);
+    else memset(a->public_key, 0, sizeof(a->public_key));
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef PUTTYNET_ANNOUNCE_H
+#define PUTTYNET_ANNOUNCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Discovery announcement wire format, all fields big-endian:
+//
+//   0  magic 'P' 'N'     2 bytes
+//   2  version           1 byte
+//   3  name length       1 byte
+//   4  capabilities      4 bytes
+//   8  node id           8 bytes
+//  16  sequence number   4 bytes
+//  20  ttl (seconds)     2 bytes, 0 means the node is leaving
+//  22  reserved          2 bytes
+//  24  name              name length bytes, not NUL terminated
+//      public key        32 bytes, only with CAP_SECURE (crypto.h)
+
+const uint8_t ANNOUNCE_VERSION = 1;
+const size_t ANNOUNCE_HEADER_SIZE = 24;
+const size_t ANNOUNCE_MAX_NAME = 63;
+const size_t ANNOUNCE_KEY_SIZE = 32;
+const size_t ANNOUNCE_MAX_SIZE = ANNOUNCE_HEADER_SIZE + ANNOUNCE_MAX_NAME + ANNOUNCE_KEY_SIZE;
+
+// Capability bits
+const uint32_t CAP_VOICE = 1u << 0;
+const uint32_t CAP_MESSAGE = 1u << 1;
+const uint32_t CAP_FILE = 1u << 2;
+const uint32_t CAP_SECURE = 1u << 3;   // carries a public key; messages and calls are encrypted
+
+struct Announcement {
+    uint8_t version;
+    uint32_t capabilities;
+    uint64_t node_id;
+    uint32_t seq;
+    uint16_t ttl;
+    char name[ANNOUNCE_MAX_NAME + 1];
+    uint8_t public_key[ANNOUNCE_KEY_SIZE];   // with CAP_SECURE
+};
+
+// Returns the encoded size, or 0 if buf is too small
+size_t announce_encode(const Announcement *a, uint8_t *buf, size_t len);
+
+// Returns false for anything that is not a well-formed announcement of our version
+bool announce_decode(const uint8_t *buf, size_t len, Announcement *a);
+
+#endif
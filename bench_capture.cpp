@@ -0,0 +1,569 @@
+// Compile with: g++ -O2 bench_capture.cpp capture.cpp wifi.cpp -o bench_capture -pthread
+//
+// Wi-Fi capture, offline and live. A recording is synthesized first: --frames
+// monitor-mode frames from --devices transmitters, beacons, probe requests,
+// data and ACKs under radiotap headers of both common shapes, some with an
+// FCS and some truncated. It is written as pcap and as pcapng, both files
+// are replayed through the parser --seconds each, and every tally (frames,
+// bytes, transmitters, SSIDs, signal sum) has to match what was written.
+//
+// Run as root, the frames are then injected into a tap device that claims
+// to be a radiotap monitor interface, for --seconds, and captured twice:
+// through the TPACKET_V3 ring and, as a baseline, with one recvfrom per
+// frame, the way pcap_next works. Each reports frames captured, kernel
+// drops and the capture thread's CPU time per frame. Last the ring runs
+// with --threads sockets in transmitter fanout, which must never split a
+// transmitter's frames between threads.
+//
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_capture [--frames N] [--devices N] [--seconds S] [--threads N] [--dir PATH] [--pcap FILE]
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+const char *TAP_NAME = "pncap0";
+const size_t INJECT_FRAMES = 65536;      // distinct frames cycled through the tap
+
+static double run_seconds = 1.0;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double thread_cpu_sec() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void result(const char *test, const char *metric, double value) {
+    printf("{\"bench\":\"capture\",\"test\":\"%s\",\"metric\":\"%s\",\"value\":%.6g}\n", test, metric, value);
+    fflush(stdout);
+}
+
+// What a run saw, or what the recording holds
+struct Tally {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t transmitters;
+    uint64_t ssids;
+    uint64_t bad_fcs;
+    int64_t signal;
+
+    bool operator==(const Tally &o) const {
+        return frames == o.frames && bytes == o.bytes && transmitters == o.transmitters &&
+               ssids == o.ssids && bad_fcs == o.bad_fcs && signal == o.signal;
+    }
+};
+
+static void tally_frames(const WifiFrame *frames, size_t count, void *user) {
+    Tally *t = (Tally *)user;
+    for (size_t i = 0; i < count; i++) {
+        const WifiFrame &f = frames[i];
+        t->bytes += f.len;
+        t->transmitters += f.transmitter != NULL;
+        t->ssids += f.ssid != NULL;
+        t->bad_fcs += f.bad_fcs;
+        if (f.has_signal) t->signal += f.signal_dbm;
+    }
+    t->frames += count;
+}
+
+// The recording: captured bytes one after another, and where each starts
+struct Recording {
+    std::vector<uint8_t> data;
+    std::vector<size_t> offsets;
+    uint64_t malformed = 0;
+    Tally expect;
+
+    size_t size(size_t i) const {
+        return (i + 1 < offsets.size() ? offsets[i + 1] : data.size()) - offsets[i];
+    }
+};
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+// Transmitter i's address: locally administered, the index in the last
+// four bytes, which is what transmitter fanout hashes
+static void device_mac(uint32_t i, uint8_t *mac) {
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    mac[2] = i >> 24;
+    mac[3] = i >> 16;
+    mac[4] = i >> 8;
+    mac[5] = i;
+}
+
+static uint32_t mac_device(const uint8_t *mac) {
+    return (uint32_t)mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5];
+}
+
+// One frame: radiotap, then 802.11, then maybe an FCS
+static void synthesize_frame(Recording *rec, std::mt19937 &rng, uint32_t devices) {
+    uint8_t buf[512];
+    memset(buf, 0, sizeof(buf));
+    uint32_t device = rng() % devices;
+    bool extended = rng() % 4 == 0;
+    bool fcs = rng() % 3 == 0;
+    bool bad = fcs && rng() % 50 == 0;
+    bool truncated = rng() % 200 == 0;
+    int8_t signal = (int8_t)(-30 - (int)(device % 60) - (int)(rng() % 7) + 3);
+
+    // TSFT, flags, rate, channel, signal, noise; the extended shape adds an
+    // empty second present word, which moves every field along
+    size_t off = 8;
+    uint32_t present = 0x6f;
+    if (extended) {
+        put_le32(buf + 8, 0);
+        present |= 1u << 31;
+        off = 16;
+    }
+    put_le32(buf + 4, present);
+    put_le32(buf + off, (uint32_t)rng());
+    put_le32(buf + off + 4, (uint32_t)rng());
+    buf[off + 8] = (fcs ? 0x10 : 0) | (bad ? 0x40 : 0);
+    buf[off + 9] = 2;
+    put_le16(buf + off + 10, 2412 + 5 * (device % 13));
+    put_le16(buf + off + 12, 0x00a0);
+    buf[off + 14] = (uint8_t)signal;
+    buf[off + 15] = (uint8_t)-95;
+    size_t rt_len = off + 16;
+    put_le16(buf + 2, (uint16_t)rt_len);
+
+    uint8_t *f = buf + rt_len;
+    uint8_t mac[WIFI_MAC_SIZE];
+    device_mac(device, mac);
+    static const uint8_t broadcast[WIFI_MAC_SIZE] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    uint32_t kind = rng() % 20;
+    size_t len;
+    bool has_transmitter = true, has_ssid = false;
+    if (kind < 8) {
+        // Beacon: fixed fields, the SSID, supported rates
+        f[0] = 0x80;
+        memcpy(f + 4, broadcast, 6);
+        memcpy(f + 10, mac, 6);
+        memcpy(f + 16, mac, 6);
+        size_t ssid_len = 4 + device % 20;
+        uint8_t *ie = f + 24 + 12;
+        ie[0] = 0;
+        ie[1] = (uint8_t)ssid_len;
+        for (size_t i = 0; i < ssid_len; i++) ie[2 + i] = 'a' + (device + i) % 26;
+        ie += 2 + ssid_len;
+        ie[0] = 1;
+        ie[1] = 8;
+        len = ie + 10 - f;
+        has_ssid = true;
+    } else if (kind < 16) {
+        // Probe request, wildcard SSID half the time
+        f[0] = 0x40;
+        memcpy(f + 4, broadcast, 6);
+        memcpy(f + 10, mac, 6);
+        memcpy(f + 16, broadcast, 6);
+        size_t ssid_len = kind % 2 ? 0 : 6;
+        uint8_t *ie = f + 24;
+        ie[0] = 0;
+        ie[1] = (uint8_t)ssid_len;
+        memcpy(ie + 2, "corner", ssid_len);
+        ie += 2 + ssid_len;
+        ie[0] = 1;
+        ie[1] = 4;
+        len = ie + 6 - f;
+        has_ssid = true;
+    } else if (kind < 19) {
+        // Data to the access point
+        f[0] = 0x08;
+        f[1] = 0x01;
+        f[4] = 0x02;
+        memcpy(f + 10, mac, 6);
+        len = 24 + 64 + rng() % 400;
+    } else {
+        // ACK: no transmitter
+        f[0] = 0xd4;
+        memcpy(f + 4, mac, 6);
+        len = 10;
+        has_transmitter = false;
+    }
+    if (truncated) len = 8;
+    size_t total = rt_len + len + (fcs ? 4 : 0);
+
+    rec->offsets.push_back(rec->data.size());
+    rec->data.insert(rec->data.end(), buf, buf + total);
+    if (truncated) {
+        rec->malformed++;
+        return;
+    }
+    rec->expect.frames++;
+    rec->expect.bytes += len;
+    rec->expect.transmitters += has_transmitter;
+    rec->expect.ssids += has_ssid;
+    rec->expect.bad_fcs += bad;
+    rec->expect.signal += signal;
+}
+
+static bool write_pcap(const Recording &rec, const char *path) {
+    PcapWriter writer;
+    if (!writer.open(path, WIFI_LINK_RADIOTAP)) return false;
+    bool ok = true;
+    for (size_t i = 0; i < rec.offsets.size() && ok; i++) {
+        ok = writer.write(rec.data.data() + rec.offsets[i], rec.size(i), 1700000000ull * 1000000000ull + i * 1000);
+    }
+    return writer.close() && ok;
+}
+
+// The same frames as pcapng: a section, an interface with nanosecond
+// timestamps and an enhanced packet block each
+static bool write_pcapng(const Recording &rec, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    uint8_t block[64];
+    memset(block, 0, sizeof(block));
+    put_le32(block, 0x0a0d0d0a);
+    put_le32(block + 4, 28);
+    put_le32(block + 8, 0x1a2b3c4d);
+    put_le16(block + 12, 1);
+    memset(block + 16, 0xff, 8);
+    put_le32(block + 24, 28);
+    bool ok = fwrite(block, 28, 1, file) == 1;
+
+    memset(block, 0, sizeof(block));
+    put_le32(block, 1);
+    put_le32(block + 4, 32);
+    put_le16(block + 8, WIFI_LINK_RADIOTAP);
+    put_le32(block + 12, 65535);
+    put_le16(block + 16, 9);
+    put_le16(block + 18, 1);
+    block[20] = 9;
+    put_le32(block + 28, 32);
+    ok = fwrite(block, 32, 1, file) == 1 && ok;
+
+    static const uint8_t pad[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < rec.offsets.size() && ok; i++) {
+        size_t len = rec.size(i);
+        size_t padded = (len + 3) & ~(size_t)3;
+        uint64_t ts = 1700000000ull * 1000000000ull + i * 1000;
+        put_le32(block, 6);
+        put_le32(block + 4, (uint32_t)(32 + padded));
+        put_le32(block + 8, 0);
+        put_le32(block + 12, (uint32_t)(ts >> 32));
+        put_le32(block + 16, (uint32_t)ts);
+        put_le32(block + 20, (uint32_t)len);
+        put_le32(block + 24, (uint32_t)len);
+        ok = fwrite(block, 28, 1, file) == 1 && ok;
+        ok = fwrite(rec.data.data() + rec.offsets[i], len, 1, file) == 1 && ok;
+        ok = fwrite(pad, padded - len, 1, file) == (padded > len ? 1u : 0u) && ok;
+        ok = fwrite(block + 4, 4, 1, file) == 1 && ok;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+// Replay path until the time runs out; every pass must tally as expected
+static bool run_replay(const char *test, const char *path, const Tally *expect) {
+    uint64_t passes = 0, frames = 0, malformed = 0;
+    bool ok = true;
+    double start = now_sec();
+    while (now_sec() < start + run_seconds || passes == 0) {
+        Tally seen;
+        memset(&seen, 0, sizeof(seen));
+        CaptureStats stats;
+        if (!capture_read_pcap(path, tally_frames, &seen, &stats)) return false;
+        if (expect && !(seen == *expect)) ok = false;
+        frames += stats.frames;
+        malformed = stats.malformed;
+        passes++;
+    }
+    double sec = now_sec() - start;
+    double fps = frames / sec;
+    result(test, "frames_per_sec", fps);
+    result(test, "ns_per_frame", sec * 1e9 / frames);
+    result(test, "matches", ok);
+    fprintf(stderr, "replay %-7s %9.2f M frames/s  %6.1f ns/frame  %llu malformed per pass%s\n", test, fps / 1e6,
+            sec * 1e9 / frames, (unsigned long long)malformed, ok ? "" : "  MISMATCH");
+    return ok;
+}
+
+// A tap device that says it is a radiotap monitor interface, up
+static int open_tap() {
+    int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("/dev/net/tun");
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, TAP_NAME, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0 || ioctl(fd, TUNSETLINK, (unsigned long)ARPHRD_IEEE80211_RADIOTAP) < 0) {
+        perror("tap");
+        close(fd);
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, TAP_NAME, IFNAMSIZ - 1);
+    ifr.ifr_flags = IFF_UP;
+    int up = ioctl(sock, SIOCSIFFLAGS, &ifr);
+    close(sock);
+    if (up < 0) {
+        perror("SIOCSIFFLAGS");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Write the recording's first frames into the tap for the run's length
+static uint64_t inject(int tap, const Recording &rec) {
+    size_t count = std::min(rec.offsets.size(), INJECT_FRAMES);
+    uint64_t sent = 0;
+    double end = now_sec() + run_seconds;
+    while (now_sec() < end) {
+        for (size_t i = 0; i < 256; i++, sent++) {
+            size_t at = sent % count;
+            if (write(tap, rec.data.data() + rec.offsets[at], rec.size(at)) < 0) {
+                perror("write tap");
+                return sent;
+            }
+        }
+    }
+    return sent;
+}
+
+struct RingRun {
+    Tally seen;
+    std::atomic<double> cpu;
+};
+
+static void ring_frames(const WifiFrame *frames, size_t count, void *user) {
+    RingRun *run = (RingRun *)user;
+    tally_frames(frames, count, &run->seen);
+    run->cpu.store(thread_cpu_sec(), std::memory_order_relaxed);
+}
+
+static void report_live(const char *test, uint64_t injected, uint64_t captured, uint64_t drops, double cpu) {
+    result(test, "injected", injected);
+    result(test, "captured", captured);
+    result(test, "kernel_drops", drops);
+    result(test, "cpu_ns_per_frame", captured ? cpu * 1e9 / captured : 0);
+    fprintf(stderr, "live %-9s %9llu injected  %9llu captured  %8llu dropped  %6.1f ns CPU per frame\n", test,
+            (unsigned long long)injected, (unsigned long long)captured, (unsigned long long)drops,
+            captured ? cpu * 1e9 / captured : 0);
+}
+
+static bool run_ring(int tap, const Recording &rec) {
+    CaptureConfig config;
+    config.interface = TAP_NAME;
+    RingRun run;
+    memset(&run.seen, 0, sizeof(run.seen));
+    run.cpu.store(0);
+    Capture capture;
+    if (!capture.start(config, ring_frames, &run)) return false;
+    uint64_t injected = inject(tap, rec);
+    usleep(100 * 1000);     // the last block times out
+    capture.stop();
+    CaptureStats stats;
+    capture.get_stats(&stats);
+    report_live("ring", injected, stats.frames + stats.malformed, stats.drops, run.cpu.load());
+    result("ring", "wakeups", stats.wakeups);
+    result("ring", "blocks", stats.blocks);
+    return stats.frames > 0;
+}
+
+// One recvfrom per frame into a copy, as pcap_next does
+static bool run_recvfrom(int tap, const Recording &rec) {
+    int sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    if (sock < 0) {
+        perror("socket AF_PACKET");
+        return false;
+    }
+    int size = 32 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+    struct timeval timeout = {0, 100 * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = (int)if_nametoindex(TAP_NAME);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind AF_PACKET");
+        close(sock);
+        return false;
+    }
+
+    std::atomic<bool> injecting(true);
+    Tally seen;
+    memset(&seen, 0, sizeof(seen));
+    uint64_t received = 0;
+    double cpu = 0;
+    std::thread reader([&] {
+        uint8_t buf[4096];
+        for (;;) {
+            ssize_t n = recvfrom(sock, buf, sizeof(buf), 0, NULL, NULL);
+            if (n < 0) {
+                if (injecting.load()) continue;
+                break;
+            }
+            received++;
+            WifiFrame frame;
+            if (wifi_parse(buf, (size_t)n, WIFI_LINK_RADIOTAP, 0, &frame)) tally_frames(&frame, 1, &seen);
+        }
+        cpu = thread_cpu_sec();
+    });
+    uint64_t injected = inject(tap, rec);
+    injecting.store(false);
+    reader.join();
+
+    struct tpacket_stats kernel;
+    socklen_t len = sizeof(kernel);
+    memset(&kernel, 0, sizeof(kernel));
+    getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &kernel, &len);
+    close(sock);
+    report_live("recvfrom", injected, received, kernel.tp_drops, cpu);
+    return received > 0;
+}
+
+// Transmitter fanout: which thread saw each device first, and how often a
+// device turned up on another
+struct FanoutRun {
+    std::vector<std::atomic<uint8_t>> owner;
+    std::atomic<int> next_thread;
+    std::atomic<uint64_t> split;
+    std::atomic<uint64_t> per_thread[64];
+
+    FanoutRun(size_t devices) : owner(devices), next_thread(0), split(0) {
+        for (auto &o : owner) o.store(0);
+        for (auto &n : per_thread) n.store(0);
+    }
+};
+
+static void fanout_frames(const WifiFrame *frames, size_t count, void *user) {
+    FanoutRun *run = (FanoutRun *)user;
+    static thread_local int thread_id = 0;
+    if (thread_id == 0) thread_id = run->next_thread.fetch_add(1) + 1;
+    for (size_t i = 0; i < count; i++) {
+        if (frames[i].transmitter == NULL) continue;
+        uint32_t device = mac_device(frames[i].transmitter);
+        if (device >= run->owner.size()) continue;
+        uint8_t expected = 0;
+        if (!run->owner[device].compare_exchange_strong(expected, (uint8_t)thread_id) && expected != thread_id) {
+            run->split.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    run->per_thread[(thread_id - 1) % 64].fetch_add(count, std::memory_order_relaxed);
+}
+
+static bool run_fanout(int tap, const Recording &rec, uint32_t devices, int threads) {
+    CaptureConfig config;
+    config.interface = TAP_NAME;
+    config.threads = threads;
+    config.fanout = CAPTURE_FANOUT_TRANSMITTER;
+    std::unique_ptr<FanoutRun> run(new FanoutRun(devices));
+    Capture capture;
+    if (!capture.start(config, fanout_frames, run.get())) return false;
+    uint64_t injected = inject(tap, rec);
+    usleep(100 * 1000);
+    capture.stop();
+    CaptureStats stats;
+    capture.get_stats(&stats);
+
+    uint64_t split = run->split.load();
+    result("fanout", "threads", threads);
+    result("fanout", "captured", stats.frames);
+    result("fanout", "kernel_drops", stats.drops);
+    result("fanout", "split_transmitters", split);
+    fprintf(stderr, "fanout %d threads  %llu injected  %llu captured  %llu dropped  split", threads,
+            (unsigned long long)injected, (unsigned long long)stats.frames, (unsigned long long)stats.drops);
+    for (int i = 0; i < threads && i < 64; i++) fprintf(stderr, " %llu", (unsigned long long)run->per_thread[i].load());
+    fprintf(stderr, "  %llu frames on a second thread%s\n", (unsigned long long)split, split ? "  FAILED" : "");
+    return split == 0 && stats.frames > 0;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t frames = 1000000;
+    uint32_t devices = 5000;
+    int threads = 2;
+    const char *dir = "/tmp";
+    const char *pcap = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--devices") == 0 && i + 1 < argc) devices = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (strcmp(argv[i], "--pcap") == 0 && i + 1 < argc) pcap = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--frames N] [--devices N] [--seconds S] [--threads N] [--dir PATH] "
+                    "[--pcap FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (devices < 1) devices = 1;
+
+    // Someone else's recording: no tallies to check it against
+    if (pcap) return run_replay("file", pcap, NULL) ? 0 : 1;
+
+    Recording rec;
+    std::mt19937 rng(7);
+    memset(&rec.expect, 0, sizeof(rec.expect));
+    rec.data.reserve(frames * 160);
+    for (uint64_t i = 0; i < frames; i++) synthesize_frame(&rec, rng, devices);
+    fprintf(stderr, "recording: %llu frames from %u devices, %.1f MB, %llu truncated\n",
+            (unsigned long long)rec.offsets.size(), devices, rec.data.size() / 1e6, (unsigned long long)rec.malformed);
+
+    char pcap_path[512], pcapng_path[512];
+    snprintf(pcap_path, sizeof(pcap_path), "%s/bench_capture.pcap", dir);
+    snprintf(pcapng_path, sizeof(pcapng_path), "%s/bench_capture.pcapng", dir);
+    if (!write_pcap(rec, pcap_path) || !write_pcapng(rec, pcapng_path)) return 1;
+
+    bool ok = run_replay("pcap", pcap_path, &rec.expect);
+    ok = run_replay("pcapng", pcapng_path, &rec.expect) && ok;
+    unlink(pcap_path);
+    unlink(pcapng_path);
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "not root: skipping live capture\n");
+        return ok ? 0 : 1;
+    }
+    int tap = open_tap();
+    if (tap < 0) return 1;
+    ok = run_ring(tap, rec) && ok;
+    ok = run_recvfrom(tap, rec) && ok;
+    if (threads > 1) ok = run_fanout(tap, rec, devices, threads) && ok;
+    close(tap);
+    return ok ? 0 : 1;
+}
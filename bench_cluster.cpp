@@ -0,0 +1,558 @@
+// Compile with: g++ -O2 bench_cluster.cpp discovery.cpp announce.cpp peers.cpp gossip.cpp mesh.cpp messaging.cpp reliable.cpp crypto.cpp probes.cpp -o bench_cluster `pkg-config --cflags --libs libcrypto` -pthread
+//
+// Scaling on loopback. This process is the node under test: the real
+// discovery thread and peer table, and a Reliable endpoint. A forked
+// simulator process plays the other nodes, each announcing and
+// heartbeating with its own node id as a real node would. The simulator is
+// its own process, so getrusage() here sees only what the node itself
+// spends. For each node count:
+//
+//   convergence   all nodes announce at once; time until every one is in
+//                 the peer table. Announcements the kernel drops are made
+//                 up by the next heartbeats, five seconds later.
+//   steady cpu    CPU the node spends per simulated node per second, with
+//                 the peer table full and heartbeats coming in
+//   churn         the simulator joins and leaves fresh nodes as fast as it
+//                 can; announcements the discovery thread gets through
+//   departure     every node says goodbye; time until the table is empty
+//   messages      min(nodes, 64) senders on their own ports: latency of
+//                 paced messages, then throughput when they all send
+//                 flat out
+//
+// Every result goes to stdout as one JSON object per line; the table on
+// stderr is for people, followed by the hot-path probes. --compare reads an
+// earlier run's output and fails if any result got worse by more than
+// --tolerance percent. --trace writes the last spans as Chrome trace JSON.
+//
+// Usage: bench_cluster [--nodes 10,100,1000,10000] [--messages N] [--steady SECONDS]
+//                      [--compare baseline.jsonl] [--tolerance PERCENT] [--trace trace.json]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "discovery.h"
+#include "peers.h"
+#include "probes.h"
+#include "reliable.h"
+
+const int DISCOVERY_BENCH_PORT = 25000;
+const int RECEIVER_PORT = 25001;
+const int SENDER_BASE_PORT = 25100;
+const size_t MAX_SENDERS = 64;
+const size_t PAYLOAD = 64;
+const int CHURN_MS = 1000;
+const size_t SENDER_POOL = 256;      // datagram buffers per simulated sender
+
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Simulator, in the child process
+
+enum Op : uint8_t {
+    OP_JOIN,      // arg: node count; answers at once, heartbeats go on until OP_LEAVE
+    OP_CHURN,     // arg: milliseconds; answers with announcements sent
+    OP_LEAVE,     // answers with goodbyes sent
+    OP_QUIT,
+};
+
+struct Command {
+    Op op;
+    uint32_t arg;
+};
+
+struct SimNode {
+    uint64_t id;
+    uint32_t seq;
+    uint64_t next_ms;
+};
+
+class Simulator {
+public:
+    Simulator() : rng(11), jitter(-DISCOVERY_INTERVAL_MS / 4, DISCOVERY_INTERVAL_MS / 4) {
+        sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        to = loopback(DISCOVERY_BENCH_PORT);
+        int size = 4 << 20;
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    void run(int commands, int replies) {
+        for (;;) {
+            uint64_t now = now_us() / 1000;
+            int timeout = -1;
+            if (next_due != UINT64_MAX) timeout = next_due > now ? (int)(next_due - now) : 0;
+
+            struct pollfd pfd = {commands, POLLIN, 0};
+            if (poll(&pfd, 1, timeout) > 0) {
+                Command command;
+                if (!read_all(commands, &command, sizeof(command))) return;
+                uint64_t answer = 0;
+                switch (command.op) {
+                case OP_JOIN: answer = join(command.arg); break;
+                case OP_CHURN: answer = churn(command.arg); break;
+                case OP_LEAVE: answer = leave(); break;
+                case OP_QUIT: return;
+                }
+                if (write(replies, &answer, sizeof(answer)) != sizeof(answer)) return;
+            }
+            heartbeat();
+        }
+    }
+
+private:
+    void queue(uint64_t id, uint32_t seq, uint16_t ttl) {
+        Announcement a;
+        memset(&a, 0, sizeof(a));
+        a.node_id = id;
+        a.seq = seq;
+        a.ttl = ttl;
+        a.capabilities = CAP_MESSAGE;
+        snprintf(a.name, sizeof(a.name), "sim-%llx", (unsigned long long)id);
+
+        size_t i = pending.size();
+        pending.emplace_back();
+        pending[i].len = announce_encode(&a, pending[i].buf, sizeof(pending[i].buf));
+        if (pending.size() == DISCOVERY_BATCH) flush();
+    }
+
+    void flush() {
+        struct mmsghdr msgs[DISCOVERY_BATCH];
+        struct iovec iovs[DISCOVERY_BATCH];
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < pending.size(); i++) {
+            iovs[i].iov_base = pending[i].buf;
+            iovs[i].iov_len = pending[i].len;
+            msgs[i].msg_hdr.msg_name = &to;
+            msgs[i].msg_hdr.msg_namelen = sizeof(to);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        size_t done = 0;
+        while (done < pending.size()) {
+            int n = sendmmsg(sock, msgs + done, pending.size() - done, 0);
+            if (n <= 0) break;
+            done += n;
+        }
+        pending.clear();
+    }
+
+    uint64_t join(uint32_t count) {
+        uint64_t now = now_us() / 1000;
+        for (uint32_t i = 0; i < count; i++) {
+            SimNode node = {next_id++, 1, now + DISCOVERY_INTERVAL_MS + jitter(rng)};
+            nodes.push_back(node);
+            queue(node.id, node.seq, DISCOVERY_TTL_SEC);
+        }
+        flush();
+        schedule();
+        return count;
+    }
+
+    void heartbeat() {
+        uint64_t now = now_us() / 1000;
+        if (next_due == UINT64_MAX || now < next_due) return;
+        for (SimNode &node : nodes) {
+            if (node.next_ms > now) continue;
+            queue(node.id, ++node.seq, DISCOVERY_TTL_SEC);
+            node.next_ms = now + DISCOVERY_INTERVAL_MS + jitter(rng);
+        }
+        flush();
+        schedule();
+    }
+
+    // Wake at most every 10 ms, so 10k nodes cost a few scans a second
+    void schedule() {
+        next_due = UINT64_MAX;
+        for (const SimNode &node : nodes) next_due = std::min(next_due, node.next_ms);
+        if (next_due != UINT64_MAX) next_due += 10;
+    }
+
+    // Short-lived nodes: a join with a one second ttl, then the goodbye.
+    // Whatever goodbyes are dropped expire on their own.
+    uint64_t churn(uint32_t ms) {
+        uint64_t end = now_us() + ms * 1000ull, sent = 0;
+        while (now_us() < end) {
+            for (int i = 0; i < DISCOVERY_BATCH / 2; i++) {
+                uint64_t id = next_id++;
+                queue(id, 1, 1);
+                queue(id, 2, 0);
+            }
+            sent += DISCOVERY_BATCH;
+        }
+        flush();
+        return sent;
+    }
+
+    // Goodbyes paced at one batch per 200 us, so none are lost
+    uint64_t leave() {
+        uint64_t sent = 0;
+        for (SimNode &node : nodes) {
+            queue(node.id, ++node.seq, 0);
+            if (++sent % DISCOVERY_BATCH == 0) usleep(200);
+        }
+        flush();
+        nodes.clear();
+        next_due = UINT64_MAX;
+        return sent;
+    }
+
+    struct Datagram {
+        uint8_t buf[ANNOUNCE_MAX_SIZE];
+        size_t len;
+    };
+
+    int sock;
+    struct sockaddr_in to;
+    std::vector<SimNode> nodes;
+    std::vector<Datagram> pending;
+    uint64_t next_id = 0x51300000000ull;
+    uint64_t next_due = UINT64_MAX;
+    std::mt19937 rng;
+    std::uniform_int_distribution<int> jitter;
+};
+
+static int sim_commands = -1;
+static int sim_replies = -1;
+
+static uint64_t simulate(Op op, uint32_t arg) {
+    Command command = {op, arg};
+    uint64_t answer = 0;
+    if (write(sim_commands, &command, sizeof(command)) != sizeof(command) ||
+        (op != OP_QUIT && !read_all(sim_replies, &answer, sizeof(answer)))) {
+        fprintf(stderr, "simulator gone\n");
+        exit(1);
+    }
+    return answer;
+}
+
+// Forked before any thread exists in this process
+static pid_t start_simulator() {
+    int down[2], up[2];
+    if (pipe(down) < 0 || pipe(up) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(down[1]);
+        close(up[0]);
+        Simulator simulator;
+        simulator.run(down[0], up[1]);
+        _exit(0);
+    }
+    close(down[0]);
+    close(up[1]);
+    sim_commands = down[1];
+    sim_replies = up[0];
+    return pid;
+}
+
+// Results
+
+struct Result {
+    size_t nodes;
+    std::string metric;
+    double value;
+    bool higher_is_better;
+};
+
+static std::vector<Result> results;
+
+static void report(size_t nodes, const char *metric, double value, bool higher_is_better) {
+    results.push_back({nodes, metric, value, higher_is_better});
+    printf("{\"bench\":\"cluster\",\"nodes\":%zu,\"metric\":\"%s\",\"value\":%.6g,\"better\":\"%s\"}\n", nodes,
+           metric, value, higher_is_better ? "higher" : "lower");
+    fflush(stdout);
+}
+
+// Anything more than tolerance percent worse than the baseline run
+static int compare(const char *path, double tolerance) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    std::map<std::pair<size_t, std::string>, double> baseline;
+    char line[512], metric[64];
+    size_t nodes;
+    double value;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "{\"bench\":\"cluster\",\"nodes\":%zu,\"metric\":\"%63[^\"]\",\"value\":%lf", &nodes,
+                   metric, &value) == 3) {
+            baseline[{nodes, metric}] = value;
+        }
+    }
+    fclose(f);
+
+    int regressions = 0;
+    for (const Result &r : results) {
+        auto it = baseline.find({r.nodes, r.metric});
+        if (it == baseline.end() || it->second == 0) continue;
+        double change = (r.value - it->second) / it->second * 100;
+        if (r.higher_is_better) change = -change;
+        if (change > tolerance) {
+            fprintf(stderr, "regression: %s at %zu nodes: %.6g, was %.6g (%.0f%% worse)\n", r.metric.c_str(),
+                    r.nodes, r.value, it->second, change);
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+// Node under test
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Poll until done() or timeout; returns the wait in ms, or -1 on timeout
+template <typename F>
+static double wait_for(F done, uint64_t timeout_ms) {
+    uint64_t start = now_us();
+    while (!done()) {
+        if (now_us() - start > timeout_ms * 1000) return -1;
+        usleep(500);
+    }
+    return (now_us() - start) / 1000.0;
+}
+
+static std::vector<uint32_t> latencies_us;      // messaging thread only while sending
+static std::atomic<uint64_t> delivered(0);
+
+static void on_deliver(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *data, size_t, void *) {
+    uint64_t sent_us;
+    memcpy(&sent_us, data, sizeof(sent_us));
+    if (latencies_us.size() < latencies_us.capacity()) latencies_us.push_back((uint32_t)(now_us() - sent_us));
+    delivered.fetch_add(1, std::memory_order_release);
+}
+
+static void on_ignore(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *, size_t, void *) {
+}
+
+struct Sender {
+    Messenger *messenger;
+    Reliable *reliable;
+};
+
+static double percentile(std::vector<uint32_t> &samples, double p) {
+    if (samples.empty()) return 0;
+    size_t i = std::min(samples.size() - 1, (size_t)(p / 100 * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + i, samples.end());
+    return samples[i];
+}
+
+// Send count messages round robin over the senders, sleeping gap_us between
+// rounds. Returns false if they were not all delivered within 10 s.
+static bool send_messages(std::vector<Sender> &senders, uint64_t count, uint64_t gap_us) {
+    struct sockaddr_in to = loopback(RECEIVER_PORT);
+    uint8_t payload[PAYLOAD];
+    memset(payload, 0x5a, sizeof(payload));
+    uint64_t target = delivered.load() + count;
+
+    for (uint64_t i = 0; i < count; i++) {
+        Sender &s = senders[i % senders.size()];
+        for (;;) {
+            uint64_t t = now_us();
+            memcpy(payload, &t, sizeof(t));
+            if (s.reliable->send(&to, FRAME_TEXT, payload, sizeof(payload))) break;
+            usleep(100);
+        }
+        if (gap_us && (i + 1) % senders.size() == 0) usleep(gap_us);
+    }
+    return wait_for([&] { return delivered.load(std::memory_order_acquire) >= target; }, 10000) >= 0;
+}
+
+static void bench_messages(size_t nodes, uint64_t messages) {
+    size_t count = std::min(nodes, MAX_SENDERS);
+    Messenger rx_messenger(1);
+    Reliable rx(&rx_messenger, on_deliver, NULL);
+    if (!rx_messenger.start(RECEIVER_PORT, Reliable::on_message, &rx)) return;
+
+    std::vector<Sender> senders;
+    for (size_t i = 0; i < count; i++) {
+        Sender s;
+        s.messenger = new Messenger(100 + i, SENDER_POOL);
+        s.reliable = new Reliable(s.messenger, on_ignore, NULL);
+        if (!s.messenger->start(SENDER_BASE_PORT + i, Reliable::on_message, s.reliable)) {
+            delete s.reliable;
+            delete s.messenger;
+            break;
+        }
+        senders.push_back(s);
+    }
+
+    if (!senders.empty()) {
+        // Latency: 2000 messages/s in all, well below what the link carries
+        uint64_t paced = std::min<uint64_t>(messages, 2000);
+        latencies_us.clear();
+        latencies_us.reserve(paced);
+        bool ok = send_messages(senders, paced, 500 * senders.size());
+        std::vector<uint32_t> samples;
+        samples.swap(latencies_us);
+        report(nodes, "message_latency_p50_us", ok ? percentile(samples, 50) : -1, false);
+        report(nodes, "message_latency_p99_us", ok ? percentile(samples, 99) : -1, false);
+
+        // Throughput: everyone flat out
+        uint64_t start = now_us();
+        ok = send_messages(senders, messages, 0);
+        report(nodes, "message_throughput_per_sec", ok ? messages / ((now_us() - start) / 1e6) : 0, true);
+    }
+
+    for (Sender &s : senders) {
+        s.messenger->stop();
+        delete s.reliable;
+        delete s.messenger;
+    }
+    rx_messenger.stop();
+}
+
+static bool bench_discovery(size_t nodes, int steady_sec) {
+    DiscoveryStats before, after;
+    discovery_get_stats(&before);
+
+    // All at once, as when a rack powers up
+    uint64_t start = now_us();
+    simulate(OP_JOIN, nodes);
+    double converged = wait_for([&] { return peers_count() >= nodes; }, 3 * DISCOVERY_INTERVAL_MS);
+    if (converged >= 0) converged = (now_us() - start) / 1000.0;
+    discovery_get_stats(&after);
+    report(nodes, "discovery_convergence_ms", converged, false);
+    report(nodes, "discovery_burst_drops", (double)(after.drops - before.drops), false);
+    if (converged < 0) {
+        fprintf(stderr, "%zu nodes: only %zu in the peer table\n", nodes, peers_count());
+        simulate(OP_LEAVE, 0);
+        wait_for([] { return peers_count() == 0; }, 2 * DISCOVERY_TTL_SEC * 1000);
+        return false;
+    }
+
+    // Heartbeats only; this thread sleeps through it
+    double cpu = cpu_seconds();
+    uint64_t window_start = now_us();
+    sleep(steady_sec);
+    cpu = cpu_seconds() - cpu;
+    double window = (now_us() - window_start) / 1e6;
+    report(nodes, "discovery_cpu_us_per_node_sec", cpu * 1e6 / window / nodes, false);
+
+    discovery_get_stats(&before);
+    uint64_t sent = simulate(OP_CHURN, CHURN_MS);
+    usleep(100000);  // let the discovery thread drain what is queued
+    discovery_get_stats(&after);
+    uint64_t handled = after.packets - before.packets;
+    report(nodes, "churn_updates_per_sec", handled / (CHURN_MS / 1000.0), true);
+    report(nodes, "churn_drop_ratio", sent ? (double)(sent - std::min(sent, handled)) / sent : 0, false);
+
+    // Churned nodes whose goodbye was dropped time out after a second
+    wait_for([&] { return peers_count() <= nodes; }, 3000);
+
+    start = now_us();
+    simulate(OP_LEAVE, 0);
+    double departed = wait_for([] { return peers_count() == 0; }, 2 * DISCOVERY_TTL_SEC * 1000);
+    report(nodes, "departure_ms", departed >= 0 ? (now_us() - start) / 1000.0 : -1, false);
+    return departed >= 0;
+}
+
+static std::vector<size_t> parse_counts(const char *list) {
+    std::vector<size_t> counts;
+    for (const char *p = list; *p;) {
+        char *end;
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p) break;
+        if (n > 0) counts.push_back(n);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return counts;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> counts = {10, 100, 1000, 10000};
+    uint64_t messages = 50000;
+    int steady_sec = DISCOVERY_INTERVAL_MS / 1000;
+    const char *baseline = NULL;
+    const char *trace = NULL;
+    double tolerance = 25;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) counts = parse_counts(argv[++i]);
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) messages = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--steady") == 0 && i + 1 < argc) steady_sec = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) baseline = argv[++i];
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace = argv[++i];
+        else {
+            fprintf(stderr, "usage: %s [--nodes 10,100,...] [--messages N] [--steady SECONDS] "
+                            "[--compare baseline.jsonl] [--tolerance PERCENT] [--trace trace.json]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    pid_t simulator = start_simulator();
+    if (simulator < 0) {
+        perror("simulator");
+        return 1;
+    }
+
+    Announcement self;
+    memset(&self, 0, sizeof(self));
+    self.node_id = 1;
+    self.capabilities = CAP_MESSAGE;
+    strcpy(self.name, "under-test");
+    if (trace != NULL) trace_enable(true);
+    if (!discovery_start(DISCOVERY_BENCH_PORT, &self)) return 1;
+
+    bool ok = true;
+    for (size_t nodes : counts) {
+        size_t first = results.size();
+        ok = bench_discovery(nodes, steady_sec) && ok;
+        bench_messages(nodes, messages);
+        for (size_t i = first; i < results.size(); i++) {
+            fprintf(stderr, "%6zu nodes  %-30s %12.1f\n", nodes, results[i].metric.c_str(), results[i].value);
+        }
+    }
+
+    discovery_stop();
+    simulate(OP_QUIT, 0);
+    waitpid(simulator, NULL, 0);
+
+    fputc('\n', stderr);
+    probes_dump(stderr);
+    if (trace != NULL && !trace_write_chrome(trace)) perror(trace);
+
+    if (baseline != NULL && compare(baseline, tolerance) > 0) return 1;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,335 @@
+// Compile with: g++ -O2 bench_crypto.cpp crypto.cpp messaging.cpp probes.cpp -o bench_crypto `pkg-config --cflags --libs libcrypto` -pthread
+//
+// Message encryption cost, three ways. First the AEADs alone: a batch of
+// MESSAGE_BATCH datagrams of each --sizes is sealed and then opened in
+// place, as a flush and a recvmmsg batch do, for both ciphers. Then the
+// key agreement a new peer costs: X25519 and HKDF. Last the messaging path
+// end to end on loopback, as bench_messaging runs it: one sender fanning
+// --messages out to --receivers endpoints, once in plaintext and once
+// sealed with each cipher, reporting messages per second and the process
+// CPU time per message, so the overhead reads as a share of the plaintext
+// cost. The three runs repeat --rounds times and the overhead compares
+// their medians. Next to it goes the cipher floor: sealing and opening one
+// full datagram, split over the messages that fill it, as a share of the
+// same plaintext cost.
+//
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_crypto [--sizes 64,256,1400] [--seconds S] [--receivers N] [--messages N] [--payload B]
+//                     [--rounds N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include "crypto.h"
+#include "messaging.h"
+
+#define MAX_SIZES 16
+
+const int BASE_PORT = 23500;
+const uint64_t WINDOW = 8192;
+
+static double run_seconds = 1.0;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void result(const char *test, const char *cipher, size_t size, const char *metric, double value) {
+    printf("{\"bench\":\"crypto\",\"test\":\"%s\",\"cipher\":\"%s\",\"size\":%zu,\"metric\":\"%s\",\"value\":%.6g}\n",
+           test, cipher, size, metric, value);
+    fflush(stdout);
+}
+
+// Seal a batch of datagrams, then open it, until the time runs out. round_ns
+// gets what one datagram costs both ends.
+static bool run_aead(CryptoCipher cipher, size_t size, double *round_ns) {
+    SessionKeys keys;
+    if (!crypto_derive(crypto_public_key(), &keys)) return false;
+    Aead aead;
+    if (!aead.init(cipher, keys.send_key, keys.send_salt)) {
+        fprintf(stderr, "%s unavailable\n", crypto_cipher_name(cipher));
+        return false;
+    }
+
+    std::vector<uint8_t> batch(MESSAGE_BATCH * (MESSAGE_HEADER_SIZE + size + MESSAGE_TAG_SIZE), 0x5a);
+    size_t stride = MESSAGE_HEADER_SIZE + size + MESSAGE_TAG_SIZE;
+    uint64_t packet = 1;
+    double seal_sec = 0, open_sec = 0;
+    uint64_t batches = 0;
+    bool ok = true;
+    double end = now_sec() + run_seconds;
+    while (now_sec() < end || batches < 3) {
+        uint64_t first = packet;
+        double t0 = now_sec();
+        for (int i = 0; i < MESSAGE_BATCH; i++) {
+            uint8_t *p = batch.data() + i * stride;
+            ok = aead.seal(packet++, p, MESSAGE_HEADER_SIZE, p + MESSAGE_HEADER_SIZE, size,
+                           p + MESSAGE_HEADER_SIZE + size) && ok;
+        }
+        double t1 = now_sec();
+        for (int i = 0; i < MESSAGE_BATCH; i++) {
+            uint8_t *p = batch.data() + i * stride;
+            ok = aead.open(first + i, p, MESSAGE_HEADER_SIZE, p + MESSAGE_HEADER_SIZE, size,
+                           p + MESSAGE_HEADER_SIZE + size) && ok;
+        }
+        double t2 = now_sec();
+        seal_sec += t1 - t0;
+        open_sec += t2 - t1;
+        batches++;
+    }
+
+    // A flipped bit must not open
+    uint8_t *p = batch.data();
+    aead.seal(packet, p, MESSAGE_HEADER_SIZE, p + MESSAGE_HEADER_SIZE, size, p + MESSAGE_HEADER_SIZE + size);
+    p[MESSAGE_HEADER_SIZE] ^= 1;
+    ok = !aead.open(packet, p, MESSAGE_HEADER_SIZE, p + MESSAGE_HEADER_SIZE, size, p + MESSAGE_HEADER_SIZE + size) && ok;
+
+    const char *name = crypto_cipher_name(cipher);
+    double datagrams = (double)batches * MESSAGE_BATCH;
+    double seal_ns = seal_sec * 1e9 / datagrams;
+    double open_ns = open_sec * 1e9 / datagrams;
+    double seal_gbps = datagrams * size / seal_sec / 1e9;
+    double open_gbps = datagrams * size / open_sec / 1e9;
+    *round_ns = seal_ns + open_ns;
+    result("aead", name, size, "seal_ns", seal_ns);
+    result("aead", name, size, "open_ns", open_ns);
+    result("aead", name, size, "seal_gbytes_per_sec", seal_gbps);
+    result("aead", name, size, "open_gbytes_per_sec", open_gbps);
+    fprintf(stderr, "%-18s %5zu bytes  seal %7.1f ns %6.2f GB/s  open %7.1f ns %6.2f GB/s%s\n", name, size,
+            seal_ns, seal_gbps, open_ns, open_gbps, ok ? "" : "  FAILED");
+    return ok;
+}
+
+static bool run_derive() {
+    // A peer's key: any other X25519 public key will do
+    SessionKeys keys;
+    uint8_t peer[CRYPTO_PUBLIC_KEY_SIZE];
+    memcpy(peer, crypto_public_key(), sizeof(peer));
+    peer[0] ^= 0x40;
+
+    uint64_t n = 0;
+    bool ok = true;
+    double start = now_sec();
+    double end = start + run_seconds;
+    while (now_sec() < end || n < 3) {
+        ok = crypto_derive(peer, &keys) && ok;
+        n++;
+    }
+    double us = (now_sec() - start) * 1e6 / n;
+    result("derive", "x25519-hkdf-sha256", 0, "derive_us", us);
+    fprintf(stderr, "key agreement       %7.1f us per peer%s\n", us, ok ? "" : "  FAILED");
+    return ok;
+}
+
+struct Receiver {
+    Messenger *messenger;
+    std::atomic<uint64_t> received;
+};
+
+static std::atomic<uint64_t> total_received(0);
+
+static void on_message(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *, size_t, void *user) {
+    Receiver *r = (Receiver *)user;
+    r->received.fetch_add(1, std::memory_order_relaxed);
+    total_received.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void on_ignore(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *, size_t, void *) {
+}
+
+// Every endpoint lives in this process and so shares its key
+static bool own_key(const struct sockaddr_in *, uint8_t *public_key, void *) {
+    memcpy(public_key, crypto_public_key(), CRYPTO_PUBLIC_KEY_SIZE);
+    return true;
+}
+
+// The producer waits off the CPU: spinning would bill the wait to the
+// process, and the slower sealed runs would wait the most
+static void idle() {
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+// One pass of bench_messaging's loop; returns CPU seconds per message
+static double run_messaging(CryptoCipher cipher, int receivers, uint64_t messages, size_t payload, int port) {
+    bool secure = cipher != CIPHER_NONE;
+    crypto_force_cipher(cipher);
+    total_received.store(0);
+
+    std::vector<Receiver> rx(receivers);
+    std::vector<struct sockaddr_in> addrs(receivers);
+    for (int i = 0; i < receivers; i++) {
+        rx[i].messenger = new Messenger(100 + i);
+        rx[i].received.store(0);
+        if (secure) rx[i].messenger->set_keys(own_key, NULL);
+        if (!rx[i].messenger->start(port + 1 + i, on_message, &rx[i])) return -1;
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addrs[i].sin_port = htons(port + 1 + i);
+    }
+    Messenger sender(1, 16384);
+    sender.max_queued = 1024;
+    if (secure) sender.set_keys(own_key, NULL);
+    if (!sender.start(port, on_ignore, NULL)) return -1;
+
+    std::vector<uint8_t> buf(payload, 0x5a);
+    uint64_t expected = messages * receivers;
+    uint64_t queued = 0;
+    double cpu_start = cpu_sec();
+    double start = now_sec();
+    for (uint64_t m = 0; m < messages; m++) {
+        while (queued - total_received.load(std::memory_order_relaxed) > WINDOW) idle();
+        size_t done = 0;
+        while (done < (size_t)receivers) {
+            done += sender.send_many(addrs.data() + done, receivers - done, FRAME_TEXT, buf.data(), payload);
+            if (done < (size_t)receivers) idle();
+        }
+        queued += receivers;
+    }
+
+    // Wait for stragglers; whatever has not arrived after a quiet second is lost
+    uint64_t last = 0;
+    while (total_received.load() < expected) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        uint64_t got = total_received.load();
+        if (got == last && now_sec() - start > 1) break;
+        last = got;
+    }
+    uint64_t got = total_received.load();
+    double seconds = now_sec() - start;
+    double cpu = cpu_sec() - cpu_start;
+
+    MessagingStats st;
+    sender.get_stats(&st);
+    uint64_t rejected = 0, unkeyed = st.unkeyed;
+    for (Receiver &r : rx) {
+        MessagingStats rs;
+        r.messenger->get_stats(&rs);
+        rejected += rs.rejected;
+        unkeyed += rs.unkeyed;
+    }
+    sender.stop();
+    for (Receiver &r : rx) {
+        r.messenger->stop();
+        delete r.messenger;
+    }
+
+    const char *name = crypto_cipher_name(cipher);
+    double cpu_ns = got ? cpu * 1e9 / got : 0;
+    result("messaging", name, payload, "messages_per_sec", got / seconds);
+    result("messaging", name, payload, "cpu_ns_per_message", cpu_ns);
+    result("messaging", name, payload, "delivered_ratio", (double)got / expected);
+    fprintf(stderr, "messaging %-18s %5zu bytes  %9.0f messages/s  %7.1f ns CPU each  %llu of %llu  "
+            "%llu rejected  %llu unkeyed\n", name, payload, got / seconds, cpu_ns, (unsigned long long)got,
+            (unsigned long long)expected, (unsigned long long)rejected, (unsigned long long)unkeyed);
+    return rejected == 0 && unkeyed == 0 && got > 0 ? cpu_ns : -1;
+}
+
+static int parse_sizes(const char *arg, size_t *sizes) {
+    int n = 0;
+    for (const char *p = arg; *p && n < MAX_SIZES;) {
+        sizes[n++] = strtoul(p, NULL, 10);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t sizes[MAX_SIZES] = {64, 256, 1400};
+    int num_sizes = 3;
+    int receivers = 4;
+    uint64_t messages = 100000;
+    size_t payload = 64;
+    int rounds = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) num_sizes = parse_sizes(argv[++i], sizes);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--receivers") == 0 && i + 1 < argc) receivers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) messages = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--payload") == 0 && i + 1 < argc) payload = (size_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) rounds = std::max(atoi(argv[++i]), 1);
+        else {
+            fprintf(stderr, "usage: %s [--sizes 64,256,...] [--seconds S] [--receivers N] [--messages N] "
+                    "[--payload B] [--rounds N]\n", argv[0]);
+            return 2;
+        }
+    }
+    payload = std::min(std::max<size_t>(payload, 1), MESSAGE_MAX_PAYLOAD);
+
+    if (!crypto_init()) return 1;
+    fprintf(stderr, "preferred cipher: %s\n", crypto_cipher_name(crypto_cipher()));
+
+    // What the cipher alone costs per message once datagrams are packed
+    // full, which is what the messaging run does. No batching can get the
+    // sealed run under this; only a faster cipher can.
+    size_t body = MESSAGE_MTU - MESSAGE_HEADER_SIZE - MESSAGE_TAG_SIZE;
+    size_t per_datagram = std::min<size_t>(body / (MESSAGE_FRAME_HEADER_SIZE + payload), 255);
+    static const CryptoCipher ciphers[] = {CIPHER_AES_256_GCM, CIPHER_CHACHA20_POLY1305};
+    double floor_ns[3] = {0, 0, 0};
+    bool ok = true;
+    for (CryptoCipher cipher : ciphers) {
+        double ns;
+        for (int i = 0; i < num_sizes; i++) {
+            if (sizes[i] > 0) ok = run_aead(cipher, sizes[i], &ns) && ok;
+        }
+        ok = run_aead(cipher, body, &ns) && ok;
+        floor_ns[cipher] = ns / per_datagram;
+    }
+    ok = run_derive() && ok;
+
+    // Rounds interleave the three runs, so a noisy neighbour or a frequency
+    // change lands on all of them, and each keeps its median
+    static const CryptoCipher runs[] = {CIPHER_NONE, CIPHER_AES_256_GCM, CIPHER_CHACHA20_POLY1305};
+    const int num_runs = sizeof(runs) / sizeof(runs[0]);
+    std::vector<double> cpu_ns[num_runs];
+    for (int round = 0; round < rounds; round++) {
+        for (int r = 0; r < num_runs; r++) {
+            double ns = run_messaging(runs[r], receivers, messages, payload, BASE_PORT + r * (receivers + 1));
+            if (ns > 0) cpu_ns[r].push_back(ns);
+            else ok = false;
+        }
+    }
+    double median[num_runs];
+    for (int r = 0; r < num_runs; r++) {
+        std::sort(cpu_ns[r].begin(), cpu_ns[r].end());
+        median[r] = cpu_ns[r].empty() ? 0 : cpu_ns[r][cpu_ns[r].size() / 2];
+    }
+
+    double plain = median[0];
+    for (int r = 1; r < num_runs; r++) {
+        CryptoCipher cipher = runs[r];
+        double sealed = median[r];
+        if (plain <= 0 || sealed <= 0) {
+            ok = false;
+            continue;
+        }
+        double overhead = (sealed - plain) / plain * 100;
+        double floor = floor_ns[cipher] / plain * 100;
+        result("messaging", crypto_cipher_name(cipher), payload, "cpu_overhead_percent", overhead);
+        result("messaging", crypto_cipher_name(cipher), payload, "cipher_floor_percent", floor);
+        fprintf(stderr, "%-18s CPU overhead over plaintext: %+.1f%%, of which the cipher alone: %.1f%% "
+                "(%.1f ns per message, %zu per datagram)\n", crypto_cipher_name(cipher), overhead, floor,
+                floor_ns[cipher], per_datagram);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+// Compile with: g++ -O2 bench_effects.cpp effects.cpp mixer.cpp -o bench_effects `pkg-config --cflags --libs gstreamer-1.0 gstreamer-app-1.0`
+//
+// Sound effect latency: from the trigger until the first audible sample is
+// rendered. Old is what puttyNet used to do, a playbin restarted with a new
+// uri per effect. Cached is effects.cpp. Both play a generated tone into a
+// clock-synced fakesink, so the sound card's own buffer (7.5 ms for cached
+// effects, the device default for playbin) comes on top. Then a burst of
+// overlapping triggers checks that none cuts off another, and a quiet second
+// counts the blocks the mixer makes while idle and checks that the chain is
+// still PLAYING.
+//
+// Usage: bench_effects [triggers]
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <gst/gst.h>
+
+#include "effects.h"
+
+static const char *SOUND_DIR = "/tmp";
+static const char *TONE = "puttynet_bench_tone.wav";
+
+static std::atomic<gint64> heard_us(0);
+static std::atomic<int> peak(0);
+
+// 200 ms of 1 kHz at 48 kHz mono, as a plain WAV file
+static bool write_tone(const std::string &path) {
+    const uint32_t rate = 48000, samples = rate / 5;
+    std::vector<int16_t> pcm(samples);
+    for (uint32_t i = 0; i < samples; i++) pcm[i] = (int16_t)(8000 * sin(2 * M_PI * 1000 * i / rate));
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) return false;
+    uint32_t data_bytes = samples * 2, riff_bytes = 36 + data_bytes, fmt_bytes = 16, byte_rate = rate * 2;
+    uint16_t pcm_format = 1, channels = 1, align = 2, bits = 16;
+    fwrite("RIFF", 1, 4, f);
+    fwrite(&riff_bytes, 4, 1, f);
+    fwrite("WAVEfmt ", 1, 8, f);
+    fwrite(&fmt_bytes, 4, 1, f);
+    fwrite(&pcm_format, 2, 1, f);
+    fwrite(&channels, 2, 1, f);
+    fwrite(&rate, 4, 1, f);
+    fwrite(&byte_rate, 4, 1, f);
+    fwrite(&align, 2, 1, f);
+    fwrite(&bits, 2, 1, f);
+    fwrite("data", 1, 4, f);
+    fwrite(&data_bytes, 4, 1, f);
+    fwrite(pcm.data(), 2, samples, f);
+    return fclose(f) == 0;
+}
+
+// fakesink hands off after waiting for the buffer's render time
+static void on_handoff(GstElement *, GstBuffer *buffer, GstPad *, gpointer) {
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) return;
+    const int16_t *samples = (const int16_t *)map.data;
+    int loudest = 0;
+    for (size_t i = 0; i < map.size / sizeof(int16_t); i++) loudest = std::max(loudest, abs(samples[i]));
+    gst_buffer_unmap(buffer, &map);
+
+    if (loudest > 2000 && heard_us.load() == 0) heard_us.store(g_get_monotonic_time());
+    int seen = peak.load();
+    while (loudest > seen && !peak.compare_exchange_weak(seen, loudest)) {
+    }
+}
+
+template <typename F>
+static bool spin(int ms, F done) {
+    gint64 deadline = g_get_monotonic_time() + ms * 1000;
+    while (!done()) {
+        if (g_get_monotonic_time() > deadline) return false;
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(100);
+    }
+    return true;
+}
+
+struct Result {
+    double total = 0, high = 0;
+    int count = 0;
+    void add(double ms) {
+        total += ms;
+        high = std::max(high, ms);
+        count++;
+    }
+};
+
+// Trigger, then wait for the tone to be heard and to finish
+template <typename F>
+static void trigger(F play, Result *result) {
+    heard_us.store(0);
+    gint64 start = g_get_monotonic_time();
+    play();
+    if (spin(1000, [] { return heard_us.load() != 0; })) result->add((heard_us.load() - start) / 1000.0);
+    spin(300, [] { return false; });
+}
+
+static Result run_playbin(const std::string &path, int triggers) {
+    Result result;
+    GstElement *playbin = gst_element_factory_make("playbin", NULL);
+    GstElement *sink = gst_element_factory_make("fakesink", NULL);
+    if (playbin == NULL || sink == NULL) return result;
+    g_object_set(sink, "sync", TRUE, "signal-handoffs", TRUE, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(on_handoff), NULL);
+    g_object_set(playbin, "audio-sink", sink, NULL);
+
+    std::string uri = "file://" + path;
+    for (int i = 0; i < triggers; i++) {
+        trigger([&] {
+            gst_element_set_state(playbin, GST_STATE_READY);
+            g_object_set(playbin, "uri", uri.c_str(), NULL);
+            gst_element_set_state(playbin, GST_STATE_PLAYING);
+        }, &result);
+    }
+    gst_element_set_state(playbin, GST_STATE_NULL);
+    gst_object_unref(playbin);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    int triggers = argc > 1 ? atoi(argv[1]) : 20;
+    gst_init(&argc, &argv);
+
+    std::string path = std::string(SOUND_DIR) + "/" + TONE;
+    if (!write_tone(path)) {
+        fprintf(stderr, "cannot write %s\n", path.c_str());
+        return 1;
+    }
+
+    Result old = run_playbin(path, triggers);
+
+    const char *names[] = {TONE};
+    if (!effects_init(SOUND_DIR, names, 1, "fakesink name=ear sync=true signal-handoffs=true")) {
+        fprintf(stderr, "effects_init failed\n");
+        return 1;
+    }
+    GstElement *ear = effects_get_element("ear");
+    g_signal_connect(ear, "handoff", G_CALLBACK(on_handoff), NULL);
+    gst_object_unref(ear);
+    spin(200, [] { return false; });
+
+    Result cached;
+    for (int i = 0; i < triggers; i++) trigger([] { effects_play(TONE); }, &cached);
+
+    // Eight overlapping triggers 5 ms apart: the tone should sum, not restart
+    peak.store(0);
+    for (int i = 0; i < 8; i++) {
+        effects_play(TONE);
+        spin(5, [] { return false; });
+    }
+    spin(400, [] { return false; });
+
+    // Idle: the mixer should be asleep, the chain still playing
+    EffectsStats before;
+    effects_get_stats(&before);
+    spin(1000, [] { return false; });
+    GstElement *src = effects_get_element("effects");
+    GstState state = GST_STATE_NULL;
+    gst_element_get_state(src, &state, NULL, 0);
+    gst_object_unref(src);
+
+    EffectsStats stats;
+    effects_get_stats(&stats);
+    uint64_t idle_blocks = stats.blocks - before.blocks;
+    effects_shutdown();
+    remove(path.c_str());
+
+    printf("decode:    %zu effects, %zu bytes cached in %.1f ms\n", stats.effects, stats.cached_bytes,
+           stats.decode_ms);
+    printf("playbin:   avg %.1f ms, max %.1f ms to first sound over %d triggers\n",
+           old.count ? old.total / old.count : 0.0, old.high, old.count);
+    printf("cached:    avg %.1f ms, max %.1f ms to first sound over %d triggers (mixer side max %.1f ms)\n",
+           cached.count ? cached.total / cached.count : 0.0, cached.high, cached.count, stats.max_trigger_ms);
+    printf("overlap:   peak %d for one tone at 8000, %llu played, %llu stolen\n", peak.load(),
+           (unsigned long long)stats.played, (unsigned long long)stats.stolen);
+    printf("idle:      %llu blocks mixed in 1 s of silence, %llu wakeups by triggers, chain %s\n",
+           (unsigned long long)idle_blocks, (unsigned long long)stats.wakeups, gst_element_state_get_name(state));
+    return cached.count == triggers && cached.high < 10 && peak.load() > 8000 && idle_blocks == 0 &&
+           state == GST_STATE_PLAYING ? 0 : 1;
+}
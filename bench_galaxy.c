@@ -0,0 +1,241 @@
+// Compile with: gcc -O2 bench_galaxy.c galaxy_render.c galaxy_stars.c -o bench_galaxy `pkg-config --cflags --libs epoxy egl` -lm
+//
+// Star rendering offscreen, with no window and no display: EGL on Mesa's
+// surfaceless platform, drawing into a framebuffer object. Without a GPU
+// Mesa falls back to llvmpipe, so this runs anywhere; LIBGL_ALWAYS_SOFTWARE=1
+// forces the software rasterizer on a machine that has one.
+//
+// Each star count runs twice through galaxy_render: "cached", as galaxy
+// draws, and "sprites", with every star drawn every frame as it would be
+// once the stars move. Each run draws frames until --seconds are up, every
+// one finished with glFinish(), and reports frames per second, the p99
+// frame time, and the CPU time spent issuing the frame before glFinish().
+// llvmpipe shades vertices inside the draw call, so under it the submit
+// time is most of the frame. --legacy adds the old immediate-mode loop (a
+// glColor3f and glVertex3f per star between glBegin and glEnd) on a
+// compatibility context, for comparison.
+//
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_galaxy [--stars 1000,10000,100000,1000000] [--size 1280x720] [--seconds S] [--legacy]
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <epoxy/gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "galaxy_render.h"
+
+#define MAX_COUNTS 16
+#define MAX_FRAMES 100000
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static int width = 1280, height = 720;
+static double run_seconds = 2.0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool open_display(void) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display != NULL) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+    return eglBindAPI(EGL_OPENGL_API);
+}
+
+// A context with a color renderbuffer the size of the window to draw into
+static EGLContext open_context(bool core) {
+    EGLint attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, core ? 3 : 2,
+        EGL_CONTEXT_MINOR_VERSION, core ? 3 : 1,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK,
+        core ? EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT : EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE,
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        return EGL_NO_CONTEXT;
+    }
+
+    GLuint fbo, color;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) return EGL_NO_CONTEXT;
+    return context;
+}
+
+// What galaxy.c used to do every frame
+static void draw_legacy(const Star *stars, size_t count, float rotation) {
+    glViewport(0, 0, width, height);
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glPointSize(2.0f);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(-2, 2, -2, 2, 1.0, 10.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glTranslatef(0, 0, -3.0f);
+    glRotatef(rotation, 0, 0, 1);
+
+    glBegin(GL_POINTS);
+    for (size_t i = 0; i < count; i++) {
+        glColor3f(stars[i].r / 255.0f, stars[i].g / 255.0f, stars[i].b / 255.0f);
+        glVertex3f(stars[i].x, stars[i].y, stars[i].z);
+    }
+    glEnd();
+}
+
+// Pixels the frame lit, to catch a renderer that draws nothing
+static size_t lit_pixels(void) {
+    size_t lit = 0;
+    unsigned char *pixels = malloc((size_t)width * height * 4);
+    if (pixels == NULL) return 0;
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        if (pixels[4 * i] | pixels[4 * i + 1] | pixels[4 * i + 2]) lit++;
+    }
+    free(pixels);
+    return lit;
+}
+
+static void result(const char *renderer, size_t stars, const char *metric, double value) {
+    printf("{\"bench\":\"galaxy\",\"renderer\":\"%s\",\"stars\":%zu,\"width\":%d,\"height\":%d,"
+           "\"metric\":\"%s\",\"value\":%.6g}\n",
+           renderer, stars, width, height, metric, value);
+    fflush(stdout);
+}
+
+enum Mode {
+    MODE_CACHED,
+    MODE_SPRITES,
+    MODE_IMMEDIATE,
+};
+
+static const char *const MODE_NAMES[] = {"cached", "sprites", "immediate"};
+
+static bool run(const Star *stars, size_t count, enum Mode mode) {
+    const char *name = MODE_NAMES[mode];
+    bool legacy = mode == MODE_IMMEDIATE;
+    EGLContext context = open_context(!legacy);
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "%s: no OpenGL context (EGL error 0x%x)\n", name, eglGetError());
+        return false;
+    }
+
+    static bool described = false;
+    if (!described) fprintf(stderr, "%s, %dx%d\n", (const char *)glGetString(GL_RENDERER), width, height);
+    described = true;
+
+    GalaxyRenderer renderer;
+    if (!legacy && !galaxy_renderer_init(&renderer, stars, count)) return false;
+    if (!legacy) renderer.cached = mode == MODE_CACHED;
+
+    // The first frame on its own: it uploads, compiles and, cached, draws the layer
+    double first = now_sec();
+    if (legacy) draw_legacy(stars, count, 0);
+    else galaxy_renderer_draw(&renderer, width, height, 0);
+    glFinish();
+    double first_ms = (now_sec() - first) * 1000;
+
+    static double frame_ms[MAX_FRAMES];
+    double submit_ms = 0;
+    int frames = 0;
+    float rotation = 0.2f;
+    double start = now_sec();
+    double end = start + run_seconds;
+    for (double t = start; (t < end || frames < 3) && frames < MAX_FRAMES;) {
+        if (legacy) draw_legacy(stars, count, rotation);
+        else galaxy_renderer_draw(&renderer, width, height, rotation);
+        submit_ms += (now_sec() - t) * 1000;
+        glFinish();
+        double done = now_sec();
+        frame_ms[frames++] = (done - t) * 1000;
+        t = done;
+        rotation += 0.2f;
+    }
+    double elapsed = now_sec() - start;
+    size_t lit = lit_pixels();
+
+    qsort(frame_ms, frames, sizeof(double), compare_double);
+    double fps = frames / elapsed;
+    double p99 = frame_ms[(int)(0.99 * (frames - 1))];
+    result(name, count, "fps", fps);
+    result(name, count, "frame_p99_ms", p99);
+    result(name, count, "submit_ms", submit_ms / frames);
+    result(name, count, "first_frame_ms", first_ms);
+    fprintf(stderr, "%-9s %8zu stars  %8.1f fps  p99 %7.2f ms  submit %7.3f ms  first %8.1f ms  %zu pixels lit\n",
+            name, count, fps, p99, submit_ms / frames, first_ms, lit);
+
+    if (!legacy) galaxy_renderer_free(&renderer);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    return lit > 0;
+}
+
+static int parse_counts(const char *arg, size_t *counts) {
+    int n = 0;
+    for (const char *p = arg; *p && n < MAX_COUNTS;) {
+        counts[n++] = strtoul(p, NULL, 10);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t counts[MAX_COUNTS] = {1000, 10000, 100000, 1000000};
+    int num_counts = 4;
+    bool legacy = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stars") == 0 && i + 1 < argc) num_counts = parse_counts(argv[++i], counts);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) sscanf(argv[++i], "%dx%d", &width, &height);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--legacy") == 0) legacy = true;
+        else {
+            fprintf(stderr, "usage: %s [--stars 1000,10000,...] [--size WxH] [--seconds S] [--legacy]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (!open_display()) {
+        fprintf(stderr, "No EGL display (EGL error 0x%x)\n", eglGetError());
+        return 1;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < num_counts; i++) {
+        Star *stars = malloc(counts[i] * sizeof(Star));
+        if (stars == NULL) return 1;
+        galaxy_generate(stars, counts[i], 7);
+        ok = run(stars, counts[i], MODE_CACHED) && ok;
+        ok = run(stars, counts[i], MODE_SPRITES) && ok;
+        if (legacy) ok = run(stars, counts[i], MODE_IMMEDIATE) && ok;
+        free(stars);
+    }
+
+    eglTerminate(display);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+// Compile with: gcc -O2 bench_galaxy_sim.c galaxy_sim.c galaxy_stars.c -o bench_galaxy_sim -pthread -lm
+//
+// Orbit simulation throughput, with no window: galaxy_sim stepping the
+// stars galaxy_generate() makes, as galaxy does every frame. Each star
+// count runs three ways: the plain C kernels on one thread, the best SIMD
+// kernels on one thread, and the SIMD kernels on --threads workers (one
+// per core by default), so the vector and the threading gains show apart.
+//
+// Each run steps for --seconds and reports steps per second, nanoseconds
+// per star per step, how long galaxy_sim_step() takes to return (what the
+// render callback pays before it can draw), the ranges stolen between
+// workers, and how far the total angular momentum drifted, which should
+// stay at float rounding.
+//
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_galaxy_sim [--stars 10000,100000,1000000,10000000] [--threads N] [--seconds S]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "galaxy_sim.h"
+#include "galaxy_stars.h"
+
+#define MAX_COUNTS 16
+
+static double run_seconds = 2.0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *kernels, int threads, size_t stars, const char *metric, double value) {
+    printf("{\"bench\":\"galaxy_sim\",\"kernels\":\"%s\",\"threads\":%d,\"stars\":%zu,"
+           "\"metric\":\"%s\",\"value\":%.6g}\n",
+           kernels, threads, stars, metric, value);
+    fflush(stdout);
+}
+
+static bool run(const Star *stars, size_t count, bool scalar, int threads) {
+    galaxy_sim_force_scalar(scalar);
+    GalaxySim *sim = galaxy_sim_new(stars, count, threads);
+    if (sim == NULL) {
+        fprintf(stderr, "%zu stars: out of memory\n", count);
+        return false;
+    }
+    const char *kernels = galaxy_sim_kernels();
+    threads = galaxy_sim_threads(sim);
+    double momentum = galaxy_sim_angular_momentum(sim);
+
+    // One step first, to fault the back buffer in
+    galaxy_sim_step(sim, 1.0f / 60);
+    galaxy_sim_wait(sim);
+
+    int steps = 0;
+    double call_sec = 0;
+    double start = now_sec();
+    double end = start + run_seconds;
+    for (double t = start; t < end || steps < 3; steps++) {
+        galaxy_sim_step(sim, 1.0f / 60);
+        double returned = now_sec();
+        call_sec += returned - t;
+        galaxy_sim_wait(sim);
+        t = now_sec();
+    }
+    double elapsed = now_sec() - start;
+
+    double drift = fabs(galaxy_sim_angular_momentum(sim) - momentum) / fabs(momentum);
+    double per_second = steps / elapsed;
+    double ns_per_star = elapsed * 1e9 / steps / count;
+    double call_us = call_sec * 1e6 / steps;
+    uint64_t steals = galaxy_sim_steals(sim);
+    result(kernels, threads, count, "steps_per_sec", per_second);
+    result(kernels, threads, count, "ns_per_star", ns_per_star);
+    result(kernels, threads, count, "step_call_us", call_us);
+    result(kernels, threads, count, "steals", (double)steals);
+    result(kernels, threads, count, "momentum_drift", drift);
+    fprintf(stderr, "%-6s %2d threads %9zu stars  %9.1f steps/s  %6.3f ns/star  call %6.1f us  %6llu steals  drift %.2e\n",
+            kernels, threads, count, per_second, ns_per_star, call_us, (unsigned long long)steals, drift);
+
+    galaxy_sim_free(sim);
+    return drift < 1e-3;
+}
+
+static int parse_counts(const char *arg, size_t *counts) {
+    int n = 0;
+    for (const char *p = arg; *p && n < MAX_COUNTS;) {
+        counts[n++] = strtoul(p, NULL, 10);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t counts[MAX_COUNTS] = {10000, 100000, 1000000, 10000000};
+    int num_counts = 4;
+    int threads = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stars") == 0 && i + 1 < argc) num_counts = parse_counts(argv[++i], counts);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--stars 10000,100000,...] [--threads N] [--seconds S]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; i < num_counts; i++) {
+        Star *stars = malloc(counts[i] * sizeof(Star));
+        if (stars == NULL) return 1;
+        galaxy_generate(stars, counts[i], 7);
+        ok = run(stars, counts[i], true, 1) && ok;
+        ok = run(stars, counts[i], false, 1) && ok;
+        ok = run(stars, counts[i], false, threads) && ok;
+        free(stars);
+    }
+    return ok ? 0 : 1;
+}
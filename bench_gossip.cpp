@@ -0,0 +1,246 @@
+// Compile with: g++ -O2 bench_gossip.cpp gossip.cpp -o bench_gossip
+//
+// SWIM convergence benchmark: N gossip nodes, each on its own loopback UDP
+// port, all driven from one epoll loop. The multicast beacon is emulated by
+// sending it to every other node, optionally with loss. Reports how long the
+// cluster takes to agree on its membership after a join, a crash and a
+// graceful leave, and the steady-state traffic per node.
+//
+// One thread runs every node, so past a few hundred nodes a pass over the
+// cluster takes longer than an ack timeout and the bench starts suspecting
+// healthy nodes; raise the period along with the node count.
+//
+// Usage: bench_gossip [nodes] [period ms] [beacon loss %]
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gossip.h"
+#include "timer_wheel.h"
+
+const int BASE_PORT = 25000;
+
+struct SimNode {
+    int fd;
+    int port;
+    bool up;
+    uint64_t start_ms;
+    uint64_t next_tick;
+    Gossip *gossip;
+};
+
+static std::vector<SimNode> nodes;
+static std::mt19937 rng(42);
+static double beacon_loss = 0;
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+static void on_send(const struct sockaddr *to, const uint8_t *data, size_t len, void *user) {
+    SimNode *node = (SimNode *)user;
+    if (to != NULL) {
+        sendto(node->fd, data, len, 0, to, sizeof(struct sockaddr_in));
+        return;
+    }
+
+    // The multicast group: everyone else that is up, minus the lost copies
+    std::uniform_real_distribution<double> coin(0, 1);
+    for (SimNode &other : nodes) {
+        if (&other == node || !other.up || coin(rng) < beacon_loss) continue;
+        struct sockaddr_in addr = loopback(other.port);
+        sendto(node->fd, data, len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+}
+
+static void on_member(const struct sockaddr *, const Announcement *, bool, void *) {
+}
+
+static size_t count_up() {
+    size_t up = 0;
+    for (SimNode &n : nodes) up += n.up;
+    return up;
+}
+
+// Every running node sees exactly the other running nodes
+static bool converged() {
+    size_t up = count_up();
+    for (SimNode &n : nodes) {
+        if (n.up && n.gossip->members() != up - 1) return false;
+    }
+    return true;
+}
+
+static void totals(GossipStats *sum) {
+    memset(sum, 0, sizeof(*sum));
+    for (SimNode &n : nodes) {
+        GossipStats s;
+        n.gossip->get_stats(&s);
+        sum->packets_sent += s.packets_sent;
+        sum->bytes_sent += s.bytes_sent;
+        sum->packets_received += s.packets_received;
+        sum->suspected += s.suspected;
+        sum->failed += s.failed;
+        sum->refuted += s.refuted;
+    }
+}
+
+// Run the cluster until done() holds or timeout_ms passes; returns the time taken
+template <typename F>
+static uint64_t run_until(int epoll_fd, uint64_t timeout_ms, F done) {
+    uint64_t start = monotonic_ms();
+    std::vector<struct epoll_event> events(256);
+    uint8_t buf[GOSSIP_MTU];
+
+    uint64_t next = start;
+    for (;;) {
+        // Deliver what arrived before running timers, so a slow pass over
+        // the nodes does not turn queued acks into suspicions
+        uint64_t now = monotonic_ms();
+        int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), next > now ? (int)(next - now) : 0);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        now = monotonic_ms();
+        for (int i = 0; i < n; i++) {
+            SimNode *node = (SimNode *)events[i].data.ptr;
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t len;
+            while ((len = recvfrom(node->fd, buf, sizeof(buf), MSG_DONTWAIT,
+                                   (struct sockaddr *)&from, &from_len)) > 0) {
+                if (node->up) node->gossip->handle((struct sockaddr *)&from, buf, len, now);
+                from_len = sizeof(from);
+            }
+        }
+
+        if (done(now)) return now - start;
+        if (now - start >= timeout_ms) return UINT64_MAX;
+
+        next = now + 10;
+        for (SimNode &node : nodes) {
+            if (!node.up) continue;
+            if (now >= node.next_tick) node.next_tick = node.gossip->tick(now);
+            next = std::min(next, node.next_tick);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 256;
+    uint32_t period = argc > 2 ? atoi(argv[2]) : 100;
+    beacon_loss = (argc > 3 ? atof(argv[3]) : 0) / 100;
+
+    // Timers scaled down from the defaults so a run takes seconds, not minutes
+    GossipConfig config;
+    config.period_ms = period;
+    config.ack_timeout_ms = period * 2 / 5;
+    config.beacon_ms = period * 10;
+    config.push_pull_ms = period * 30;
+
+    int epoll_fd = epoll_create1(0);
+    nodes.resize(count);
+    for (int i = 0; i < count; i++) {
+        SimNode &n = nodes[i];
+        n.port = BASE_PORT + i;
+        n.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        int size = 1 << 20;
+        setsockopt(n.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        struct sockaddr_in addr = loopback(n.port);
+        if (bind(n.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            return 1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &n;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, n.fd, &ev);
+        n.up = false;
+        n.gossip = NULL;
+    }
+
+    // Join: nodes boot over one second, as after a power cut
+    uint64_t now = monotonic_ms();
+    uint64_t last_start = now;
+    for (int i = 0; i < count; i++) {
+        SimNode &n = nodes[i];
+        n.start_ms = now + (uint64_t)i * 1000 / count;
+        last_start = n.start_ms;
+
+        Announcement self;
+        memset(&self, 0, sizeof(self));
+        self.node_id = 1000 + i;
+        self.capabilities = CAP_VOICE;
+        snprintf(self.name, sizeof(self.name), "node-%d", i);
+        n.gossip = new Gossip(&self, config, on_send, on_member, &n, n.start_ms);
+        n.next_tick = n.start_ms;
+    }
+    uint64_t join_ms = run_until(epoll_fd, 60000, [&](uint64_t t) {
+        for (SimNode &n : nodes) {
+            if (!n.up && t >= n.start_ms) n.up = true;
+        }
+        return t >= last_start && count_up() == (size_t)count && converged();
+    });
+    if (join_ms != UINT64_MAX) join_ms -= std::min<uint64_t>(join_ms, last_start - now);
+
+    // Steady state
+    GossipStats before, after;
+    totals(&before);
+    uint64_t steady_periods = 30;
+    run_until(epoll_fd, steady_periods * period, [](uint64_t) { return false; });
+    totals(&after);
+    double packets_sent = (double)(after.packets_sent - before.packets_sent) / count / steady_periods;
+    double packets_received = (double)(after.packets_received - before.packets_received) / count / steady_periods;
+    double bytes_sent = (double)(after.bytes_sent - before.bytes_sent) / count / steady_periods;
+
+    // Crash 1% of the nodes without a goodbye
+    int crashed = std::max(1, count / 100);
+    std::vector<int> order(count);
+    for (int i = 0; i < count; i++) order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    for (int i = 0; i < crashed; i++) {
+        SimNode &n = nodes[order[i]];
+        n.up = false;
+        close(n.fd);
+    }
+    uint64_t failure_ms = run_until(epoll_fd, 60000, [](uint64_t) { return converged(); });
+
+    // One node leaves politely
+    SimNode &leaver = nodes[order[crashed]];
+    leaver.gossip->leave();
+    leaver.up = false;
+    uint64_t leave_ms = run_until(epoll_fd, 60000, [](uint64_t) { return converged(); });
+
+    GossipStats end;
+    totals(&end);
+
+    printf("nodes:               %d, period %u ms, %.0f%% beacon loss\n", count, period, beacon_loss * 100);
+    printf("join convergence:    %llu ms (%.1f periods) after the last node started\n",
+           (unsigned long long)join_ms, (double)join_ms / period);
+    printf("per node per period: %.2f packets sent, %.2f received, %.0f bytes sent\n",
+           packets_sent, packets_received, bytes_sent);
+    printf("broadcast discovery: %d announcements received per node per heartbeat\n", count - 1);
+    printf("crash detection:     %d crashed, all agreed after %llu ms (%.1f periods)\n", crashed,
+           (unsigned long long)failure_ms, (double)failure_ms / period);
+    printf("graceful leave:      all agreed after %llu ms (%.1f periods)\n",
+           (unsigned long long)leave_ms, (double)leave_ms / period);
+    printf("suspicions:          %llu raised, %llu refuted, %llu members declared dead\n",
+           (unsigned long long)end.suspected, (unsigned long long)end.refuted, (unsigned long long)end.failed);
+
+    return join_ms != UINT64_MAX && failure_ms != UINT64_MAX && leave_ms != UINT64_MAX ? 0 : 1;
+}
@@ -0,0 +1,481 @@
+// Compile with: g++ -O2 bench_mesh.cpp discovery.cpp announce.cpp peers.cpp gossip.cpp mesh.cpp messaging.cpp crypto.cpp probes.cpp -o bench_mesh `pkg-config --cflags --libs libcrypto` -pthread
+//
+// Mesh relaying over a real multi-hop topology. Needs root: --nodes
+// network namespaces are wired into a chain with veth pairs, one /24 per
+// link and no IP forwarding, so each node reaches only its neighbours. A
+// forked process per namespace runs a node as Core would in mesh mode:
+// discovery, sealed messaging with the relay hooks, and the voice relay.
+// The first node then talks to the last, through every node in between:
+//
+//   convergence   until the first node has every other in its peer table
+//   rtt           a message to the last node and its echo, p50 and p99
+//   throughput    the first node sends --messages as fast as it can; the
+//                 last node's receive rate and what got through
+//   relay cpu     CPU per datagram forwarded, on each relay
+//   voice         --voice call-sized packets into the first node's loopback
+//                 relay, counted where the last node's voice would listen
+//   departure     the last node leaves; until the first has dropped it
+//
+// Every result goes to stdout as one JSON object per line; the summary on
+// stderr is for people. The namespaces are removed again at the end.
+//
+// Usage: bench_mesh [--nodes N] [--messages N] [--payload B] [--voice N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "crypto.h"
+#include "discovery.h"
+#include "mesh.h"
+#include "messaging.h"
+#include "peers.h"
+
+const int MESSAGE_BENCH_PORT = 26000;
+const int VOICE_BENCH_PORT = 26002;
+const int DISCOVERY_BENCH_PORT = 26001;
+const uint8_t FRAME_BENCH = 10;      // counted; FRAME_TEXT is echoed
+const size_t VOICE_PACKET = 160;
+const uint64_t CONVERGE_LIMIT_MS = 30000;
+
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_ns() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int run(const std::string &command) {
+    int status = system(command.c_str());
+    if (status != 0) fprintf(stderr, "failed: %s\n", command.c_str());
+    return status;
+}
+
+static std::string ns_name(int i) {
+    return "pnmesh" + std::to_string(i);
+}
+
+// Node i: 10.77.i.1 towards i + 1 and 10.77.(i-1).2 towards i - 1
+static bool build_chain(int nodes) {
+    for (int i = 0; i < nodes; i++) {
+        if (run("ip netns add " + ns_name(i)) != 0) return false;
+        run("ip -n " + ns_name(i) + " link set lo up");
+    }
+    for (int i = 0; i + 1 < nodes; i++) {
+        std::string a = "m" + std::to_string(i) + "a", b = "m" + std::to_string(i) + "b";
+        std::string net = "10.77." + std::to_string(i);
+        if (run("ip link add " + a + " netns " + ns_name(i) + " type veth peer name " + b + " netns " +
+                ns_name(i + 1)) != 0) {
+            return false;
+        }
+        run("ip -n " + ns_name(i) + " addr add " + net + ".1/24 brd + dev " + a);
+        run("ip -n " + ns_name(i + 1) + " addr add " + net + ".2/24 brd + dev " + b);
+        run("ip -n " + ns_name(i) + " link set " + a + " up");
+        run("ip -n " + ns_name(i + 1) + " link set " + b + " up");
+    }
+    return true;
+}
+
+static void remove_chain(int nodes) {
+    for (int i = 0; i < nodes; i++) {
+        std::string command = "ip netns del " + ns_name(i) + " 2>/dev/null";
+        if (system(command.c_str()) < 0) perror("system");
+    }
+}
+
+// A node, in its own process and namespace
+
+enum Op : uint8_t {
+    OP_CONVERGE,      // arg: peers expected; answers milliseconds, or -1
+    OP_PING,          // arg: round trips to the last node; answers p50 and p99 microseconds
+    OP_FLOOD,         // arg: messages to the last node; answers messages queued and seconds
+    OP_RECEIVED,      // answers messages received and their rate
+    OP_RELAYED,       // answers datagrams forwarded and CPU ns since the last OP_RELAYED
+    OP_VOICE,         // arg: packets into the voice relay; answers packets sent
+    OP_VOICE_HEARD,   // answers packets heard on the voice port
+    OP_LEAVE,         // stop discovery; answers at once
+    OP_DROPPED,       // arg: peers expected; answers milliseconds until down to that
+    OP_QUIT,
+};
+
+struct Command {
+    Op op;
+    uint32_t arg;
+};
+
+struct Reply {
+    double a;
+    double b;
+};
+
+static int node_index = 0;
+static int node_count = 0;
+static size_t payload = 256;
+static Messenger *messenger = NULL;
+static std::atomic<uint64_t> echoes(0);
+static std::atomic<uint64_t> received(0);
+static std::atomic<uint64_t> first_us(0);
+static std::atomic<uint64_t> last_us(0);
+
+static bool lookup_key(const struct sockaddr_in *addr, uint8_t *public_key, void *) {
+    PeerKey key;
+    peer_key_init(&key, (const struct sockaddr *)addr, 0);
+    PeerReader reader;
+    for (const Node &node : reader->table.all()) {
+        if ((node.capabilities & CAP_SECURE) && memcmp(node.key.addr, key.addr, sizeof(key.addr)) == 0) {
+            memcpy(public_key, node.public_key, sizeof(node.public_key));
+            return true;
+        }
+    }
+    return false;
+}
+
+static void on_message(const struct sockaddr_in *from, uint64_t, uint8_t type, const uint8_t *data, size_t len,
+                       void *) {
+    if (type == FRAME_TEXT) {
+        if (node_index == node_count - 1) messenger->send(from, FRAME_TEXT, data, len);
+        else echoes.fetch_add(1);
+    } else if (type == FRAME_BENCH) {
+        uint64_t now = now_us();
+        if (received.fetch_add(1) == 0) first_us.store(now);
+        last_us.store(now);
+    }
+}
+
+// The last node's messaging address, found by its announced name
+static bool last_node(struct sockaddr_in *to) {
+    char name[32];
+    snprintf(name, sizeof(name), "mesh-%d", node_count - 1);
+    PeerReader reader;
+    for (const Node &node : reader->table.all()) {
+        if (strcmp(node.name, name) != 0) continue;
+        memset(to, 0, sizeof(*to));
+        to->sin_family = AF_INET;
+        memcpy(&to->sin_addr, node.key.addr + 12, 4);
+        to->sin_port = htons(MESSAGE_BENCH_PORT);
+        return true;
+    }
+    return false;
+}
+
+static Reply converge(uint32_t expected, bool down) {
+    uint64_t start = now_us();
+    struct sockaddr_in to;
+    for (;;) {
+        size_t peers = peers_count();
+        bool done = down ? peers <= expected
+                         : peers >= expected && last_node(&to) && mesh_remote_node(&to) != 0;
+        if (done) return {(now_us() - start) / 1000.0, 0};
+        if (now_us() - start > CONVERGE_LIMIT_MS * 1000) return {-1, 0};
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+static Reply ping(uint32_t count) {
+    struct sockaddr_in to;
+    if (!last_node(&to)) return {-1, -1};
+    std::vector<double> rtts;
+    uint8_t data[64] = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t want = echoes.load() + 1;
+        uint64_t start = now_us();
+        if (!messenger->send(&to, FRAME_TEXT, data, sizeof(data))) continue;
+        while (echoes.load() < want && now_us() - start < 1000000) std::this_thread::yield();
+        if (echoes.load() >= want) rtts.push_back(now_us() - start);
+    }
+    if (rtts.empty()) return {-1, -1};
+    std::sort(rtts.begin(), rtts.end());
+    return {rtts[rtts.size() / 2], rtts[rtts.size() * 99 / 100]};
+}
+
+static Reply flood(uint32_t count) {
+    struct sockaddr_in to;
+    if (!last_node(&to)) return {0, 0};
+    std::vector<uint8_t> data(payload, 0x5a);
+    uint64_t start = now_us();
+    uint64_t sent = 0;
+    while (sent < count) {
+        if (messenger->send(&to, FRAME_BENCH, data.data(), data.size())) sent++;
+        else std::this_thread::yield();   // the peer's queue is full; let the thread flush it
+    }
+    return {(double)sent, (now_us() - start) / 1e6};
+}
+
+static Reply voice_send(uint32_t count) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(MESH_VOICE_PORT);
+    uint8_t packet[VOICE_PACKET] = {0x80};
+    uint64_t sent = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (sendto(sock, packet, sizeof(packet), 0, (struct sockaddr *)&to, sizeof(to)) > 0) sent++;
+        // Paced like a handful of calls, not a flood the relays must drop
+        if (i % 16 == 15) std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    close(sock);
+    return {(double)sent, 0};
+}
+
+// Where the last node's voice chains would listen, read as they would
+static std::atomic<uint64_t> voice_heard(0);
+static std::atomic<bool> voice_done(false);
+
+static int voice_port_socket() {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct timeval timeout = {0, 100000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(VOICE_BENCH_PORT);
+    int size = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) perror("bind voice");
+    return sock;
+}
+
+static void voice_listen(int sock) {
+    uint8_t buf[2048];
+    while (!voice_done.load()) {
+        if (recv(sock, buf, sizeof(buf), 0) > 0) voice_heard.fetch_add(1);
+    }
+}
+
+static void node_main(int index, int commands, int replies) {
+    std::string path = "/var/run/netns/" + ns_name(index);
+    int ns = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ns < 0 || setns(ns, CLONE_NEWNET) < 0) {
+        perror(path.c_str());
+        _exit(1);
+    }
+    close(ns);
+
+    node_index = index;
+    if (!crypto_init()) _exit(1);
+    Announcement self;
+    memset(&self, 0, sizeof(self));
+    self.node_id = index + 1;
+    self.capabilities = CAP_MESSAGE | CAP_SECURE;
+    snprintf(self.name, sizeof(self.name), "mesh-%d", index);
+    memcpy(self.public_key, crypto_public_key(), sizeof(self.public_key));
+
+    int voice = voice_port_socket();
+    std::thread listener(voice_listen, voice);
+    messenger = new Messenger(self.node_id);
+    messenger->set_keys(lookup_key, NULL);
+    messenger->set_relay(mesh_route, mesh_relay, NULL);
+    if (!mesh_start(MESSAGE_BENCH_PORT, VOICE_BENCH_PORT) || !messenger->start(MESSAGE_BENCH_PORT, on_message, NULL) ||
+        !discovery_start(DISCOVERY_BENCH_PORT, &self, DISCOVERY_MESH)) {
+        _exit(1);
+    }
+    // The call runs between the two ends
+    if (index == 0) mesh_set_call(node_count);
+    if (index == node_count - 1) mesh_set_call(1);
+
+    double cpu_mark = cpu_ns();
+    uint64_t relayed_mark = 0;
+    bool discovering = true;
+    Command command;
+    while (read_all(commands, &command, sizeof(command)) && command.op != OP_QUIT) {
+        Reply reply = {0, 0};
+        switch (command.op) {
+        case OP_CONVERGE: reply = converge(command.arg, false); break;
+        case OP_PING: reply = ping(command.arg); break;
+        case OP_FLOOD: reply = flood(command.arg); break;
+        case OP_RECEIVED: {
+            double seconds = (last_us.load() - first_us.load()) / 1e6;
+            reply = {(double)received.load(), seconds > 0 ? received.load() / seconds : 0};
+            break;
+        }
+        case OP_RELAYED: {
+            MessagingStats stats;
+            messenger->get_stats(&stats);
+            double cpu = cpu_ns();
+            reply = {(double)(stats.relayed - relayed_mark), cpu - cpu_mark};
+            relayed_mark = stats.relayed;
+            cpu_mark = cpu;
+            break;
+        }
+        case OP_VOICE: reply = voice_send(command.arg); break;
+        case OP_VOICE_HEARD: reply = {(double)voice_heard.load(), 0}; break;
+        case OP_LEAVE:
+            discovery_stop();
+            discovering = false;
+            break;
+        case OP_DROPPED: reply = converge(command.arg, true); break;
+        case OP_QUIT: break;
+        }
+        if (write(replies, &reply, sizeof(reply)) != sizeof(reply)) break;
+    }
+
+    if (discovering) discovery_stop();
+    messenger->stop();
+    mesh_stop();
+    voice_done.store(true);
+    listener.join();
+    _exit(0);
+}
+
+// The parent's side
+
+struct Child {
+    pid_t pid;
+    int commands;
+    int replies;
+};
+
+static std::vector<Child> children;
+
+static Reply ask(int index, Op op, uint32_t arg = 0) {
+    Command command = {op, arg};
+    Reply reply = {-1, -1};
+    if (write(children[index].commands, &command, sizeof(command)) != sizeof(command) ||
+        !read_all(children[index].replies, &reply, sizeof(reply))) {
+        fprintf(stderr, "node %d gone\n", index);
+    }
+    return reply;
+}
+
+static void result(const char *metric, double value, const char *better, int node = -1) {
+    if (node < 0) {
+        printf("{\"bench\":\"mesh\",\"nodes\":%d,\"metric\":\"%s\",\"value\":%.6g,\"better\":\"%s\"}\n",
+               node_count, metric, value, better);
+    } else {
+        printf("{\"bench\":\"mesh\",\"nodes\":%d,\"relay\":%d,\"metric\":\"%s\",\"value\":%.6g,\"better\":\"%s\"}\n",
+               node_count, node, metric, value, better);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    int nodes = 4;
+    uint32_t messages = 200000;
+    uint32_t voice_packets = 20000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--nodes") == 0 && i + 1 < argc) nodes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) messages = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--payload") == 0 && i + 1 < argc) payload = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--voice") == 0 && i + 1 < argc) voice_packets = strtoul(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "usage: %s [--nodes N] [--messages N] [--payload B] [--voice N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (nodes < 2 || nodes > MESH_INFINITY || payload == 0 || payload > MESSAGE_MAX_PAYLOAD) {
+        fprintf(stderr, "2 to %d nodes, payloads up to %zu bytes\n", MESH_INFINITY, MESSAGE_MAX_PAYLOAD);
+        return 2;
+    }
+    if (geteuid() != 0) {
+        fprintf(stderr, "%s needs root for the namespaces\n", argv[0]);
+        return 2;
+    }
+    node_count = nodes;
+
+    remove_chain(nodes);
+    if (!build_chain(nodes)) {
+        remove_chain(nodes);
+        return 1;
+    }
+
+    for (int i = 0; i < nodes; i++) {
+        int commands[2], replies[2];
+        if (pipe(commands) < 0 || pipe(replies) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(commands[1]);
+            close(replies[0]);
+            node_main(i, commands[0], replies[1]);
+        }
+        close(commands[0]);
+        close(replies[1]);
+        children.push_back({pid, commands[1], replies[0]});
+    }
+
+    int last = nodes - 1;
+    bool ok = true;
+    Reply converged = ask(0, OP_CONVERGE, nodes - 1);
+    result("convergence_ms", converged.a, "lower");
+    fprintf(stderr, "%d nodes, %d hops: converged in %.0f ms\n", nodes, nodes - 1, converged.a);
+    ok = converged.a >= 0;
+
+    if (ok) {
+        Reply rtt = ask(0, OP_PING, 1000);
+        result("rtt_p50_us", rtt.a, "lower");
+        result("rtt_p99_us", rtt.b, "lower");
+        fprintf(stderr, "rtt through %d relays: p50 %.0f us, p99 %.0f us\n", nodes - 2, rtt.a, rtt.b);
+
+        for (int i = 1; i < last; i++) ask(i, OP_RELAYED);
+        Reply flood = ask(0, OP_FLOOD, messages);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        Reply got = ask(last, OP_RECEIVED);
+        result("throughput_msgs_per_sec", got.b, "higher");
+        result("delivered_ratio", got.a / flood.a, "higher");
+        fprintf(stderr, "%.0f messages of %zu B queued in %.2f s; %.0f delivered (%.1f%%) at %.0f msgs/s\n",
+                flood.a, payload, flood.b, got.a, 100 * got.a / flood.a, got.b);
+        for (int i = 1; i < last; i++) {
+            Reply relay = ask(i, OP_RELAYED);
+            double per = relay.a > 0 ? relay.b / relay.a : 0;
+            result("relayed_datagrams", relay.a, "higher", i);
+            result("relay_cpu_ns_per_datagram", per, "lower", i);
+            fprintf(stderr, "relay %d: %.0f datagrams forwarded, %.0f ns CPU each\n", i, relay.a, per);
+        }
+
+        ask(0, OP_VOICE, voice_packets);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        Reply heard = ask(last, OP_VOICE_HEARD);
+        result("voice_delivered_ratio", heard.a / voice_packets, "higher");
+        fprintf(stderr, "voice: %.0f of %u packets through the relays\n", heard.a, voice_packets);
+
+        ask(last, OP_LEAVE);
+        Reply dropped = ask(0, OP_DROPPED, nodes - 2);
+        result("departure_ms", dropped.a, "lower");
+        fprintf(stderr, "departure seen in %.0f ms\n", dropped.a);
+        ok = got.a > 0 && heard.a > 0 && dropped.a >= 0;
+    }
+
+    for (int i = 0; i < nodes; i++) {
+        Command quit = {OP_QUIT, 0};
+        if (write(children[i].commands, &quit, sizeof(quit)) < 0) kill(children[i].pid, SIGKILL);
+    }
+    for (int i = 0; i < nodes; i++) waitpid(children[i].pid, NULL, 0);
+    remove_chain(nodes);
+    return ok ? 0 : 1;
+}
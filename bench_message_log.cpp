@@ -0,0 +1,160 @@
+// Compile with: g++ -O2 bench_message_log.cpp message_log.cpp -o bench_message_log -pthread
+//
+// Message history: several threads append chat messages spread over a number
+// of conversations, then the log is reopened and one conversation is paged
+// through at random, the way a chat window scrolls. Ingest is compared with
+// plain 1 MiB writes plus fdatasync to the same disk. Runs in a scratch
+// directory under the current one, so point it at the disk you care about.
+//
+// Usage: bench_message_log [messages] [conversations] [payload bytes] [threads]
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "message_log.h"
+
+const size_t PAGE = 50;         // messages on screen
+const int SCROLLS = 1000;
+
+static double now_sec() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static long minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void remove_dir(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) return;
+    while (struct dirent *entry = readdir(d)) {
+        if (entry->d_name[0] != '.') unlink((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// The disk's own pace for the same amount of data and the same sync cadence
+static double raw_write_mbps(const std::string &dir, size_t total) {
+    std::string path = dir + "/raw";
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    posix_fallocate(fd, 0, total);
+    std::vector<uint8_t> chunk(1 << 20, 0x5a);
+    double start = now_sec();
+    for (size_t done = 0; done < total; done += chunk.size()) {
+        if (pwrite(fd, chunk.data(), chunk.size(), done) < 0) perror("pwrite");
+        fdatasync(fd);
+    }
+    double seconds = now_sec() - start;
+    close(fd);
+    unlink(path.c_str());
+    return total / seconds / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    size_t messages = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    uint64_t conversations = argc > 2 ? strtoull(argv[2], NULL, 10) : 100;
+    size_t payload = argc > 3 ? atoi(argv[3]) : 200;
+    int threads = argc > 4 ? atoi(argv[4]) : 4;
+
+    char dir_template[] = "bench_message_log.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+
+    MessageLogConfig config;
+    MessageLog log(config);
+    if (!log.open(dir.c_str())) return 1;
+
+    // Ingest
+    std::atomic<size_t> next(0);
+    double start = now_sec();
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; t++) {
+        writers.emplace_back([&, t] {
+            std::vector<char> text(payload, 'a' + t);
+            for (size_t i; (i = next.fetch_add(1)) < messages;) {
+                uint64_t conversation = i % conversations;
+                memcpy(text.data(), &i, std::min(sizeof(i), payload));
+                while (!log.append(conversation, conversation, 1, text.data(), payload, i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread &w : writers) w.join();
+    log.flush();
+    double ingest = now_sec() - start;
+
+    MessageLogStats stats;
+    log.get_stats(&stats);
+    log.close();
+    double raw = raw_write_mbps(dir, stats.bytes);
+
+    // Reopen and scroll the first conversation
+    long faults = minor_faults();
+    start = now_sec();
+    if (!log.open(dir.c_str())) return 1;
+    double open_ms = (now_sec() - start) * 1000;
+    long open_faults = minor_faults() - faults;
+
+    start = now_sec();
+    size_t count = log.count(0);
+    double count_us = (now_sec() - start) * 1e6;
+
+    std::mt19937 rng(1);
+    const LogRecord *page[PAGE];
+    uint64_t checksum = 0;
+    faults = minor_faults();
+    start = now_sec();
+    for (int s = 0; s < SCROLLS; s++) {
+        size_t first = count > PAGE ? rng() % (count - PAGE) : 0;
+        size_t n = log.read(0, first, page, PAGE);
+        for (size_t i = 0; i < n; i++) checksum += page[i]->time_ms + ((const uint8_t *)(page[i] + 1))[0];
+    }
+    double scroll_us = (now_sec() - start) * 1e6 / SCROLLS;
+    long scroll_faults = minor_faults() - faults;
+
+    // Drop one conversation and reclaim its space
+    log.forget(1, 0);
+    log.flush();
+    start = now_sec();
+    log.compact(0);
+    double compact_ms = (now_sec() - start) * 1000;
+    MessageLogStats after;
+    log.get_stats(&after);
+    size_t forgotten = log.count(1);
+    log.close();
+    remove_dir(dir);
+
+    size_t record_bytes = stats.bytes / (stats.records ? stats.records : 1);
+    printf("ingest:      %zu messages of %zu bytes over %llu conversations, %d threads\n",
+           messages, payload, (unsigned long long)conversations, threads);
+    printf("             %.0f messages/s, %.0f MB/s (raw 1 MiB writes + fdatasync: %.0f MB/s)\n",
+           messages / ingest, stats.bytes / ingest / 1e6, raw);
+    printf("             %llu commits, %.0f messages per fdatasync, %zu bytes per record\n",
+           (unsigned long long)stats.commits, (double)stats.records / stats.commits, record_bytes);
+    printf("open:        %.2f ms, %ld page faults, %llu segments\n", open_ms, open_faults,
+           (unsigned long long)after.segments);
+    printf("count:       %zu messages in conversation 0, %.1f us\n", count, count_us);
+    printf("scroll:      %.1f us per %zu-message page, %.1f page faults per page (checksum %llu)\n",
+           scroll_us, PAGE, (double)scroll_faults / SCROLLS, (unsigned long long)checksum % 1000);
+    printf("compact:     %.0f ms, %.1f MB reclaimed, %zu messages left in the forgotten conversation\n",
+           compact_ms, after.compacted / 1e6, forgotten);
+    return count == (messages + conversations - 1) / conversations && forgotten == 0 ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+// Compile with: g++ -O2 bench_messaging.cpp messaging.cpp crypto.cpp probes.cpp -o bench_messaging `pkg-config --cflags --libs libcrypto` -pthread
+//
+// Loopback messaging benchmark: one sender fans every message out to a set
+// of receiving endpoints and reports delivered messages/s and the p50/p99
+// send-to-receive latency.
+//
+// Usage: bench_messaging [receivers] [messages per receiver] [payload bytes]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "messaging.h"
+
+const int BASE_PORT = 23000;
+
+// Messages the sender may have outstanding before it waits for receivers
+const uint64_t WINDOW = 8192;
+
+struct Receiver {
+    Messenger *messenger;
+    std::vector<uint32_t> latency_us;
+    std::atomic<uint64_t> received;
+};
+
+static std::atomic<uint64_t> total_received(0);
+
+static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void on_message(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *data, size_t, void *user) {
+    Receiver *r = (Receiver *)user;
+    uint64_t sent;
+    memcpy(&sent, data, sizeof(sent));
+    uint64_t n = r->received.load(std::memory_order_relaxed);
+    if (n < r->latency_us.size()) r->latency_us[n] = (uint32_t)((now_ns() - sent) / 1000);
+    r->received.store(n + 1, std::memory_order_relaxed);
+    total_received.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void on_ignore(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *, size_t, void *) {
+}
+
+int main(int argc, char *argv[]) {
+    int receivers = argc > 1 ? atoi(argv[1]) : 8;
+    uint64_t messages = argc > 2 ? strtoull(argv[2], NULL, 10) : 200000;
+    size_t payload = argc > 3 ? (size_t)atoi(argv[3]) : 64;
+    if (payload < sizeof(uint64_t)) payload = sizeof(uint64_t);
+    if (payload > MESSAGE_MAX_PAYLOAD) payload = MESSAGE_MAX_PAYLOAD;
+
+    std::vector<Receiver> rx(receivers);
+    std::vector<struct sockaddr_in> addrs(receivers);
+    for (int i = 0; i < receivers; i++) {
+        rx[i].messenger = new Messenger(100 + i);
+        rx[i].latency_us.resize(messages);
+        rx[i].received.store(0);
+        if (!rx[i].messenger->start(BASE_PORT + 1 + i, on_message, &rx[i])) return 1;
+
+        memset(&addrs[i], 0, sizeof(addrs[i]));
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addrs[i].sin_port = htons(BASE_PORT + 1 + i);
+    }
+
+    Messenger sender(1, 16384);
+    sender.max_queued = 1024;
+    if (!sender.start(BASE_PORT, on_ignore, NULL)) return 1;
+
+    std::vector<uint8_t> buf(payload, 0x5a);
+    uint64_t expected = messages * receivers;
+    uint64_t queued = 0;
+    uint64_t start = now_ns();
+
+    for (uint64_t m = 0; m < messages; m++) {
+        while (queued - total_received.load(std::memory_order_relaxed) > WINDOW) {
+            std::this_thread::yield();
+        }
+        uint64_t t = now_ns();
+        memcpy(buf.data(), &t, sizeof(t));
+
+        size_t done = 0;
+        while (done < (size_t)receivers) {
+            size_t n = sender.send_many(addrs.data() + done, receivers - done, FRAME_TEXT, buf.data(), payload);
+            done += n;
+            if (done < (size_t)receivers) std::this_thread::yield();
+        }
+        queued += receivers;
+    }
+
+    // Wait for stragglers; whatever has not arrived after a quiet second is lost
+    uint64_t last = 0;
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        uint64_t got = total_received.load();
+        if (got >= expected || got == last) break;
+        last = got;
+    }
+    uint64_t got = total_received.load();
+    double seconds = (now_ns() - start) / 1e9;
+
+    std::vector<uint32_t> all;
+    all.reserve(got);
+    for (Receiver &r : rx) {
+        uint64_t n = std::min<uint64_t>(r.received.load(), r.latency_us.size());
+        all.insert(all.end(), r.latency_us.begin(), r.latency_us.begin() + n);
+    }
+    std::sort(all.begin(), all.end());
+
+    MessagingStats st;
+    sender.get_stats(&st);
+    uint64_t drops = 0;
+    for (Receiver &r : rx) {
+        MessagingStats rs;
+        r.messenger->get_stats(&rs);
+        drops += rs.drops;
+    }
+
+    printf("receivers:          %d\n", receivers);
+    printf("payload:            %zu bytes\n", payload);
+    printf("delivered:          %llu of %llu\n", (unsigned long long)got, (unsigned long long)expected);
+    printf("throughput:         %.0f messages/s\n", got / seconds);
+    printf("messages/datagram:  %.1f\n", st.datagrams_sent ? (double)st.messages_sent / st.datagrams_sent : 0.0);
+    printf("datagrams/syscall:  %.1f\n", st.send_calls ? (double)st.datagrams_sent / st.send_calls : 0.0);
+    printf("kernel drops:       %llu\n", (unsigned long long)drops);
+    if (!all.empty()) {
+        printf("latency p50:        %u us\n", all[all.size() / 2]);
+        printf("latency p99:        %u us\n", all[all.size() * 99 / 100]);
+    }
+
+    sender.stop();
+    for (Receiver &r : rx) {
+        r.messenger->stop();
+        delete r.messenger;
+    }
+    return 0;
+}
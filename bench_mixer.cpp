@@ -0,0 +1,113 @@
+// Compile with: g++ -O2 bench_mixer.cpp mixer.cpp -o bench_mixer
+//
+// Conference mixing cost at 48 kHz mono in 10 ms frames. Each tick mixes N
+// remote participants plus the local microphone into one playback frame and
+// N mix-minus frames, which is everything conference.cpp does between the
+// decoders and the encoders. CPU is reported as a share of one core per
+// participant, for the plain C kernels and for the vector ones. The outputs
+// of the two are compared first.
+//
+// Usage: bench_mixer [seconds per size]
+
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mixer.h"
+
+const int RATE = 48000;
+const size_t FRAME = RATE / 100;
+
+static std::vector<std::vector<int16_t>> make_voices(size_t n) {
+    std::vector<std::vector<int16_t>> voices(n, std::vector<int16_t>(FRAME));
+    unsigned seed = 1;
+    for (auto &voice : voices) {
+        for (auto &sample : voice) {
+            seed = seed * 1103515245 + 12345;
+            sample = (int16_t)(seed >> 16);     // loud enough to clip when summed
+        }
+    }
+    return voices;
+}
+
+// Run one tick through both kernel sets and compare; float rounding may
+// differ by one step at most
+static bool kernels_agree(size_t n) {
+    auto voices = make_voices(n + 1);
+    std::vector<MixInput> inputs(n);
+    for (size_t i = 0; i < n; i++) inputs[i] = {voices[i].data(), 0.5f + i * 0.01f};
+    if (n > 1) inputs[1].pcm = NULL;
+
+    std::vector<int16_t> out[2][2];
+    for (int pass = 0; pass < 2; pass++) {
+        mix_force_scalar(pass == 0);
+        Mixer mixer(FRAME);
+        out[pass][0].assign(FRAME, 0);
+        out[pass][1].assign(FRAME * n, 0);
+        std::vector<int16_t *> minus(n);
+        for (size_t i = 0; i < n; i++) minus[i] = &out[pass][1][i * FRAME];
+        mixer.mix(inputs.data(), n, voices[n].data(), 1.0f, out[pass][0].data(), minus.data());
+    }
+    mix_force_scalar(false);
+
+    for (int k = 0; k < 2; k++) {
+        for (size_t i = 0; i < out[0][k].size(); i++) {
+            if (abs(out[0][k][i] - out[1][k][i]) > 1) {
+                fprintf(stderr, "n=%zu: sample %zu differs: %d vs %d\n", n, i, out[0][k][i], out[1][k][i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Nanoseconds per tick
+static double run(size_t n, double seconds) {
+    auto voices = make_voices(n + 1);
+    std::vector<MixInput> inputs(n);
+    for (size_t i = 0; i < n; i++) inputs[i] = {voices[i].data(), 1.0f};
+    std::vector<int16_t> playback(FRAME), outgoing(FRAME * n);
+    std::vector<int16_t *> minus(n);
+    for (size_t i = 0; i < n; i++) minus[i] = &outgoing[i * FRAME];
+    Mixer mixer(FRAME);
+
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::duration<double>(seconds);
+    uint64_t ticks = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        for (int i = 0; i < 64; i++) {
+            mixer.mix(inputs.data(), n, voices[n].data(), 1.0f, playback.data(), minus.data());
+        }
+        ticks += 64;
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return ns / ticks;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    const size_t sizes[] = {2, 4, 8, 16, 32, 64};
+
+    for (size_t n : sizes) {
+        if (!kernels_agree(n)) return 1;
+    }
+
+    const char *best = mix_kernels();
+    printf("48 kHz mono, %zu-sample frames; CPU is the share of one core per participant\n", FRAME);
+    char best_tick[32];
+    snprintf(best_tick, sizeof(best_tick), "%s us/tick", best);
+    printf("%12s %14s %14s %14s %14s %8s\n", "participants", "scalar us/tick", "scalar CPU",
+           best_tick, "CPU", "speedup");
+    for (size_t n : sizes) {
+        mix_force_scalar(true);
+        double scalar = run(n, seconds);
+        mix_force_scalar(false);
+        double vector = run(n, seconds);
+        double frame_ns = 1e9 * FRAME / RATE;
+        printf("%12zu %14.2f %13.4f%% %14.2f %13.4f%% %7.1fx\n", n, scalar / 1000,
+               100 * scalar / frame_ns / n, vector / 1000, 100 * vector / frame_ns / n, scalar / vector);
+    }
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Compile with: g++ -O2 bench_peer_map.cpp peer_map.cpp peers.cpp -o bench_peer_map `pkg-config --cflags --libs epoxy egl` -pthread
+//
+// The puttyNet header's network map, offscreen: EGL on Mesa's surfaceless
+// platform as in bench_galaxy, at the header's 800x200. Each peer count
+// draws frames for --seconds, every one finished with glFinish(), while the
+// snapshot version moves on every PEERS_PUBLISH_MS as heartbeats make it,
+// and --activity peers a second pulse, a few of them in calls.
+//
+// Reports frames per second, the p99 frame time, the share of frames that
+// rebuilt and uploaded the instance buffer, and how long a rebuild took.
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_peer_map [--peers 100,1000,5000,20000] [--size 800x200] [--seconds S] [--activity N]
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <algorithm>
+#include <epoxy/gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "peer_map.h"
+#include "timer_wheel.h"
+
+#define MAX_COUNTS 16
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static int width = 800, height = 200;
+static double run_seconds = 2.0;
+static int activity_per_sec = 50;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool open_display() {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display != NULL) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+    return eglBindAPI(EGL_OPENGL_API);
+}
+
+// A core 3.3 context drawing into a renderbuffer the size of the header
+static EGLContext open_context() {
+    EGLint attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE,
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        return EGL_NO_CONTEXT;
+    }
+
+    GLuint fbo, color;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &color);
+    glBindRenderbuffer(GL_RENDERBUFFER, color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) return EGL_NO_CONTEXT;
+    return context;
+}
+
+static void result(size_t peers, const char *metric, double value) {
+    printf("{\"bench\":\"peer_map\",\"peers\":%zu,\"width\":%d,\"height\":%d,\"metric\":\"%s\",\"value\":%.6g}\n",
+           peers, width, height, metric, value);
+    fflush(stdout);
+}
+
+static void peer_ip(size_t i, char *buf, size_t len) {
+    struct in_addr addr;
+    addr.s_addr = htonl(0x0a000000 | (uint32_t)i);  // 10.x.y.z
+    inet_ntop(AF_INET, &addr, buf, len);
+}
+
+static bool run(size_t count) {
+    EGLContext context = open_context();
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "No OpenGL 3.3 context (EGL error 0x%x)\n", eglGetError());
+        return false;
+    }
+    static bool described = false;
+    if (!described) fprintf(stderr, "%s, %dx%d\n", (const char *)glGetString(GL_RENDERER), width, height);
+    described = true;
+
+    PeerTable table;
+    for (size_t i = 0; i < count; i++) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)i);
+        PeerKey key;
+        peer_key_init(&key, (struct sockaddr *)&addr, 0x1000 + i);
+        bool inserted;
+        Node *node = table.insert(key, &inserted);
+        node->capabilities = (i % 3 == 0) ? CAP_VOICE | CAP_MESSAGE | CAP_FILE : CAP_MESSAGE | CAP_FILE;
+    }
+
+    PeerMap *map = peer_map_new();
+    if (map == NULL) return false;
+    peer_map_clear_calls();
+    char ip[INET_ADDRSTRLEN];
+    for (size_t i = 0; i < std::min<size_t>(count, 3); i++) {
+        peer_ip(i * 7, ip, sizeof(ip));
+        peer_map_set_call(ip, true);
+    }
+
+    uint64_t version = 1;
+    peer_map_draw(map, table, version, width, height);
+    glFinish();
+
+    std::vector<double> frame_ms;
+    PeerMapStats stats;
+    peer_map_get_stats(map, &stats);
+    uint64_t uploads_before = stats.uploads;
+    double build_us = 0;
+    uint32_t state = 12345;
+    double start = now_sec();
+    double end = start + run_seconds;
+    double next_publish = start + PEERS_PUBLISH_MS / 1000.0;
+    double next_activity = start;
+    for (double t = start; t < end || frame_ms.size() < 3;) {
+        if (t >= next_publish) {
+            version++;
+            next_publish += PEERS_PUBLISH_MS / 1000.0;
+        }
+        while (activity_per_sec > 0 && t >= next_activity) {
+            state = state * 1664525 + 1013904223;
+            peer_ip(state % count, ip, sizeof(ip));
+            peer_map_activity(ip);
+            next_activity += 1.0 / activity_per_sec;
+        }
+
+        uint64_t uploads = stats.uploads;
+        peer_map_draw(map, table, version, width, height);
+        peer_map_get_stats(map, &stats);
+        if (stats.uploads != uploads) build_us += stats.last_build_us;
+        glFinish();
+        double done = now_sec();
+        frame_ms.push_back((done - t) * 1000);
+        t = done;
+    }
+    double elapsed = now_sec() - start;
+
+    std::sort(frame_ms.begin(), frame_ms.end());
+    size_t frames = frame_ms.size();
+    size_t uploads = stats.uploads - uploads_before;
+    double fps = frames / elapsed;
+    double p99 = frame_ms[(size_t)(0.99 * (frames - 1))];
+    double upload_share = (double)uploads / frames;
+    double avg_build_us = uploads ? build_us / uploads : 0;
+    result(count, "fps", fps);
+    result(count, "frame_p99_ms", p99);
+    result(count, "upload_share", upload_share);
+    result(count, "build_us", avg_build_us);
+    fprintf(stderr, "%6zu peers  %7.1f fps  p99 %6.2f ms  uploads on %4.1f%% of frames  build %7.1f us  %zu edges\n",
+            count, fps, p99, upload_share * 100, avg_build_us, stats.edges);
+
+    peer_map_free(map);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    return true;
+}
+
+static int parse_counts(const char *arg, size_t *counts) {
+    int n = 0;
+    for (const char *p = arg; *p && n < MAX_COUNTS;) {
+        counts[n++] = strtoul(p, NULL, 10);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t counts[MAX_COUNTS] = {100, 1000, 5000, 20000};
+    int num_counts = 4;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--peers") == 0 && i + 1 < argc) num_counts = parse_counts(argv[++i], counts);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) sscanf(argv[++i], "%dx%d", &width, &height);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--activity") == 0 && i + 1 < argc) activity_per_sec = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--peers 100,1000,...] [--size WxH] [--seconds S] [--activity N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (!open_display()) {
+        fprintf(stderr, "No EGL display (EGL error 0x%x)\n", eglGetError());
+        return 1;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < num_counts; i++) {
+        if (counts[i] > 0) ok = run(counts[i]) && ok;
+    }
+    eglTerminate(display);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,134 @@
+// Compile with: g++ -O2 bench_peers.cpp peers.cpp -o bench_peers -pthread
+//
+// Peer table microbenchmark: lookup and update throughput at 10k peers, and
+// snapshot lookups on reader threads while the writer keeps updating.
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "peers.h"
+#include "timer_wheel.h"
+
+const int NUM_PEERS = 10000;
+const int NUM_OPS = 10000000;
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static struct sockaddr_in peer_addr(int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0a000000 | i);  // 10.x.y.z
+    return addr;
+}
+
+int main(int argc, char *argv[]) {
+    int readers = argc > 1 ? atoi(argv[1]) : 2;
+
+    std::vector<struct sockaddr_in> addrs(NUM_PEERS);
+    std::vector<PeerKey> keys(NUM_PEERS);
+    std::vector<Announcement> announcements(NUM_PEERS);
+    for (int i = 0; i < NUM_PEERS; i++) {
+        addrs[i] = peer_addr(i);
+        memset(&announcements[i], 0, sizeof(Announcement));
+        announcements[i].node_id = 0x1000 + i;
+        announcements[i].ttl = 60;
+        snprintf(announcements[i].name, sizeof(announcements[i].name), "node-%d", i);
+        peer_key_init(&keys[i], (struct sockaddr *)&addrs[i], announcements[i].node_id);
+    }
+
+    // Random access order shared by every phase
+    std::mt19937 rng(42);
+    std::vector<int> order(NUM_OPS);
+    for (int &o : order) o = rng() % NUM_PEERS;
+
+    // Plain table lookups
+    PeerTable table;
+    for (int i = 0; i < NUM_PEERS; i++) {
+        bool inserted;
+        table.insert(keys[i], &inserted);
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t hits = 0;
+    for (int i = 0; i < NUM_OPS; i++) {
+        hits += table.find(keys[order[i]]) != NULL;
+    }
+    double t = seconds_since(start);
+    printf("table lookup:        %8.2f M/s (%zu hits)\n", NUM_OPS / t / 1e6, hits);
+
+    // Heartbeat refreshes through the writer path, publishing as discovery does
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < NUM_PEERS; i++) {
+        peers_update((struct sockaddr *)&addrs[i], &announcements[i], now);
+    }
+    peers_publish(now);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < NUM_OPS; i++) {
+        Announcement &a = announcements[order[i]];
+        a.seq++;
+        peers_update((struct sockaddr *)&addrs[order[i]], &a, now);
+        if ((i & 63) == 63) peers_publish(monotonic_ms());
+    }
+    t = seconds_since(start);
+    printf("writer update:       %8.2f M/s\n", NUM_OPS / t / 1e6);
+
+    // Snapshot lookups on reader threads racing a writer that publishes a
+    // fresh snapshot every 1 ms
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> lookups(0);
+    std::atomic<uint64_t> publishes(0);
+
+    std::thread writer([&]() {
+        uint64_t last = 0;
+        for (int i = 0; !stop.load(std::memory_order_relaxed); i = (i + 1) % NUM_OPS) {
+            Announcement &a = announcements[order[i]];
+            a.seq++;
+            a.ttl = (i & 1023) == 0 ? 0 : 60;  // some churn
+            peers_update((struct sockaddr *)&addrs[order[i]], &a, now);
+            uint64_t ms = monotonic_ms();
+            if (ms != last) {
+                peers_publish(ms + PEERS_PUBLISH_MS);
+                publishes.fetch_add(1, std::memory_order_relaxed);
+                last = ms;
+            }
+        }
+    });
+
+    std::vector<std::thread> threads;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < readers; r++) {
+        threads.emplace_back([&, r]() {
+            uint64_t n = 0;
+            size_t found = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                PeerReader snapshot;
+                for (int i = 0; i < 4096; i++) {
+                    found += snapshot->table.find(keys[order[(n + i + r * 7919) % NUM_OPS]]) != NULL;
+                }
+                n += 4096;
+            }
+            lookups.fetch_add(n);
+            if (found == 0) printf("no hits\n");
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    stop.store(true);
+    for (auto &th : threads) th.join();
+    writer.join();
+    t = seconds_since(start);
+
+    printf("snapshot lookup:     %8.2f M/s across %d readers\n", lookups.load() / t / 1e6, readers);
+    printf("snapshots published: %8.0f /s, %zu peers in the last\n", publishes.load() / t, peers_count());
+    return 0;
+}
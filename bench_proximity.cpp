@@ -0,0 +1,322 @@
+// Compile with: g++ -O2 bench_proximity.cpp proximity.cpp capture.cpp wifi.cpp -o bench_proximity -pthread
+//
+// The RSSI distance estimator, replayed from pcap. A recording is
+// synthesized with ground truth: --devices transmitters at known distances,
+// a tenth of them walking from one distance to another over --duration
+// seconds, each frame's RSSI drawn from the path-loss model plus
+// --noise dB of Gaussian shadowing. On top come --churn probe requests from
+// randomized MACs, each used for a handful of frames, more devices than the
+// table holds. The file is replayed through capture_read_pcap() into a
+// ProximityTable for --seconds, a fresh table per pass, reporting frames
+// per second and the table's fixed memory. Then the estimates at the end of
+// the recording are held against the truth: the median and 90th percentile
+// distance error of the filter, and of the last raw reading alone for
+// comparison, how many of the real devices survived the churn, and whether
+// two replays agree exactly.
+//
+// With --pcap the given recording is replayed instead, and the --top
+// nearest devices are printed.
+//
+// Every result goes to stdout as one JSON object per line.
+//
+// Usage: bench_proximity [--devices N] [--duration S] [--noise DB] [--churn N] [--max-devices N]
+//                        [--seconds S] [--dir PATH] [--pcap FILE] [--top N]
+
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <random>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "proximity.h"
+
+const uint64_t START_NS = 1700000000ull * 1000000000ull;
+const double FRAME_INTERVAL_SEC = 0.1;      // per real device, on average
+
+static double run_seconds = 1.0;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *test, const char *metric, double value) {
+    printf("{\"bench\":\"proximity\",\"test\":\"%s\",\"metric\":\"%s\",\"value\":%.6g}\n", test, metric, value);
+    fflush(stdout);
+}
+
+struct Device {
+    double from_m;          // distance at the start
+    double to_m;            // and at the end; the same for devices that stay put
+    int8_t last_reading;
+};
+
+struct Event {
+    uint64_t time_ns;
+    uint32_t device;        // real devices first, then the churn's MACs
+};
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+// Real devices are 02:00 and their index; the churn's look random, with
+// the locally-administered bit set, as phones' do
+static void device_mac(uint32_t i, uint32_t devices, uint8_t *mac) {
+    uint64_t bits = i < devices ? i : ((uint64_t)i * 0x9e3779b97f4a7c15ull) >> 16;
+    for (size_t b = 0; b < WIFI_MAC_SIZE; b++) mac[b] = (uint8_t)(bits >> (8 * (WIFI_MAC_SIZE - 1 - b)));
+    mac[0] = (uint8_t)((mac[0] & 0xfc) | 0x02);     // unicast, locally administered
+    if (i >= devices) mac[1] |= 1;                  // never 02:00, a real device's
+}
+
+// A probe request under radiotap with flags, channel and signal
+static size_t build_frame(const uint8_t *mac, int8_t signal, uint8_t *buf) {
+    memset(buf, 0, 64);
+    put_le16(buf + 2, 16);
+    put_le32(buf + 4, 0x2a);        // flags, channel, signal
+    put_le16(buf + 10, 2437);
+    put_le16(buf + 12, 0x00a0);
+    buf[14] = (uint8_t)signal;
+    uint8_t *f = buf + 16;
+    f[0] = 0x40;
+    memset(f + 4, 0xff, 6);
+    memcpy(f + 10, mac, WIFI_MAC_SIZE);
+    memset(f + 16, 0xff, 6);
+    f[24] = 0;      // wildcard SSID
+    f[25] = 0;
+    return 16 + 26;
+}
+
+static double distance_at(const Device &d, double t) {
+    return d.from_m + (d.to_m - d.from_m) * t;
+}
+
+static bool synthesize(const char *path, std::vector<Device> *devices, uint32_t count, double duration,
+                       double noise_db, uint32_t churn, const ProximityConfig &config) {
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::normal_distribution<double> shadowing(0, noise_db);
+
+    devices->resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        Device &d = (*devices)[i];
+        d.from_m = 0.5 * pow(60, unit(rng));      // 0.5 to 30 m, log-uniform
+        d.to_m = i % 10 == 0 ? 0.5 * pow(60, unit(rng)) : d.from_m;
+    }
+
+    // Every real device at its own rate; the churn's MACs a few frames each
+    uint64_t span_ns = (uint64_t)(duration * 1e9);
+    std::vector<Event> events;
+    events.reserve((size_t)(count * duration / FRAME_INTERVAL_SEC) + churn * 4);
+    for (uint32_t i = 0; i < count; i++) {
+        double interval = FRAME_INTERVAL_SEC * (0.5 + unit(rng));
+        for (double t = unit(rng) * interval; t < duration; t += interval) {
+            events.push_back({START_NS + (uint64_t)(t * 1e9), i});
+        }
+    }
+    for (uint32_t i = 0; i < churn; i++) {
+        uint64_t t = (uint64_t)(unit(rng) * span_ns);
+        for (int j = 0; j < 4; j++) events.push_back({START_NS + t + j * 20000000ull, count + i});
+    }
+    std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.time_ns < b.time_ns; });
+
+    PcapWriter writer;
+    if (!writer.open(path, WIFI_LINK_RADIOTAP)) return false;
+    uint8_t buf[64];
+    uint8_t mac[WIFI_MAC_SIZE];
+    bool ok = true;
+    for (const Event &e : events) {
+        device_mac(e.device, count, mac);
+        double distance = 20;
+        if (e.device < count) distance = distance_at((*devices)[e.device], (double)(e.time_ns - START_NS) / span_ns);
+        double rssi = config.tx_power_dbm - 10 * config.path_loss_exponent * log10(distance) + shadowing(rng);
+        int8_t reading = (int8_t)std::max(-127.0, std::min(0.0, round(rssi)));
+        if (e.device < count) (*devices)[e.device].last_reading = reading;
+        ok = writer.write(buf, build_frame(mac, reading, buf), e.time_ns) && ok;
+    }
+    fprintf(stderr, "recording: %zu frames, %u devices over %.0f s, %u churn MACs, %.1f dB shadowing\n",
+            events.size(), count, duration, churn, noise_db);
+    return writer.close() && ok;
+}
+
+static void update_frames(const WifiFrame *frames, size_t count, void *user) {
+    ((ProximityTable *)user)->update(frames, count);
+}
+
+static void ignore_frames(const WifiFrame *, size_t, void *) {
+}
+
+// Reading and parsing the file alone, to take out of the replay's cost
+static double parse_ns(const char *path) {
+    uint64_t frames = 0, passes = 0;
+    double start = now_sec();
+    while (now_sec() < start + run_seconds || passes == 0) {
+        CaptureStats capture;
+        if (!capture_read_pcap(path, ignore_frames, NULL, &capture)) return 0;
+        frames += capture.frames;
+        passes++;
+    }
+    return (now_sec() - start) * 1e9 / frames;
+}
+
+// Replay into a fresh table per pass; the last one is kept in table
+static bool run_replay(const char *test, const char *path, const ProximityConfig &config,
+                       std::unique_ptr<ProximityTable> *table, double parse) {
+    uint64_t frames = 0, passes = 0;
+    double start = now_sec();
+    while (now_sec() < start + run_seconds || passes == 0) {
+        table->reset(new ProximityTable(config));
+        CaptureStats capture;
+        if (!capture_read_pcap(path, update_frames, table->get(), &capture)) return false;
+        frames += capture.frames;
+        passes++;
+    }
+    double sec = now_sec() - start;
+    ProximityStats stats;
+    (*table)->get_stats(&stats);
+    result(test, "frames_per_sec", frames / sec);
+    result(test, "ns_per_frame", sec * 1e9 / frames);
+    result(test, "estimator_ns_per_frame", sec * 1e9 / frames - parse);
+    result(test, "devices", stats.devices);
+    result(test, "evictions", stats.evictions);
+    result(test, "table_bytes", stats.table_bytes);
+    fprintf(stderr, "replay %-7s %8.2f M frames/s  %6.1f ns/frame, %5.1f ns of it estimating  %llu devices  "
+            "%llu evictions  %.0f kB table\n", test, frames / sec / 1e6, sec * 1e9 / frames,
+            sec * 1e9 / frames - parse, (unsigned long long)stats.devices,
+            (unsigned long long)stats.evictions, stats.table_bytes / 1024.0);
+    return true;
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    size_t at = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + at, v.end());
+    return v[at];
+}
+
+// The estimates at the end of the recording against where the devices were
+static bool check_accuracy(const ProximityTable &table, const std::vector<Device> &devices,
+                           const ProximityConfig &config) {
+    std::vector<double> filtered, raw;
+    uint32_t tracked = 0;
+    for (uint32_t i = 0; i < devices.size(); i++) {
+        uint8_t mac[WIFI_MAC_SIZE];
+        device_mac(i, (uint32_t)devices.size(), mac);
+        ProximityEstimate e;
+        if (!table.find(mac, &e)) continue;
+        tracked++;
+        double truth = devices[i].to_m;
+        double reading = pow(10, (config.tx_power_dbm - devices[i].last_reading) / (10 * config.path_loss_exponent));
+        filtered.push_back(fabs(e.distance_m - truth) / truth);
+        raw.push_back(fabs(reading - truth) / truth);
+    }
+    double f50 = percentile(filtered, 0.5), f90 = percentile(filtered, 0.9);
+    double r50 = percentile(raw, 0.5), r90 = percentile(raw, 0.9);
+    result("accuracy", "tracked_devices", tracked);
+    result("accuracy", "filtered_error_p50", f50);
+    result("accuracy", "filtered_error_p90", f90);
+    result("accuracy", "raw_error_p50", r50);
+    result("accuracy", "raw_error_p90", r90);
+    fprintf(stderr, "accuracy: %u of %zu devices tracked  distance error p50 %.1f%% p90 %.1f%%, "
+            "one reading alone p50 %.1f%% p90 %.1f%%\n", tracked, devices.size(), f50 * 100, f90 * 100,
+            r50 * 100, r90 * 100);
+    // Churn must not push out devices heard ten times a second
+    return tracked == devices.size() && f50 < r50;
+}
+
+static bool same_estimates(const ProximityTable &a, const ProximityTable &b) {
+    std::vector<ProximityEstimate> x, y;
+    a.all(&x);
+    b.all(&y);
+    if (x.size() != y.size()) return false;
+    for (size_t i = 0; i < x.size(); i++) {
+        if (memcmp(x[i].mac, y[i].mac, WIFI_MAC_SIZE) != 0 || x[i].rssi_dbm != y[i].rssi_dbm ||
+            x[i].frames != y[i].frames) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Someone else's recording: the nearest devices, no truth to check against
+static bool run_file(const char *path, const ProximityConfig &config, size_t top) {
+    std::unique_ptr<ProximityTable> table;
+    if (!run_replay("file", path, config, &table, parse_ns(path))) return false;
+    std::vector<ProximityEstimate> all;
+    table->all(&all);
+    std::sort(all.begin(), all.end(),
+              [](const ProximityEstimate &a, const ProximityEstimate &b) { return a.distance_m < b.distance_m; });
+    for (size_t i = 0; i < all.size() && i < top; i++) {
+        const ProximityEstimate &e = all[i];
+        char mac[18];
+        wifi_format_mac(e.mac, mac);
+        printf("{\"bench\":\"proximity\",\"test\":\"device\",\"mac\":\"%s\",\"frames\":%u,\"rssi_dbm\":%.1f,"
+               "\"distance_m\":%.2f,\"low_m\":%.2f,\"high_m\":%.2f}\n", mac, e.frames, e.rssi_dbm, e.distance_m,
+               e.distance_low_m, e.distance_high_m);
+        fprintf(stderr, "%s  %6u frames  %6.1f dBm  %6.1f m (%.1f-%.1f)\n", mac, e.frames, e.rssi_dbm, e.distance_m,
+                e.distance_low_m, e.distance_high_m);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t devices = 2000;
+    double duration = 60;
+    double noise_db = 4;
+    uint32_t churn = 100000;
+    size_t top = 20;
+    const char *dir = "/tmp";
+    const char *pcap = NULL;
+    ProximityConfig config;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--devices") == 0 && i + 1 < argc) devices = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) duration = atof(argv[++i]);
+        else if (strcmp(argv[i], "--noise") == 0 && i + 1 < argc) noise_db = atof(argv[++i]);
+        else if (strcmp(argv[i], "--churn") == 0 && i + 1 < argc) churn = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-devices") == 0 && i + 1 < argc) config.max_devices = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) run_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (strcmp(argv[i], "--pcap") == 0 && i + 1 < argc) pcap = argv[++i];
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) top = (size_t)atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--devices N] [--duration S] [--noise DB] [--churn N] [--max-devices N] "
+                    "[--seconds S] [--dir PATH] [--pcap FILE] [--top N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (devices < 1) devices = 1;
+
+    if (pcap) return run_file(pcap, config, top) ? 0 : 1;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/bench_proximity.pcap", dir);
+    std::vector<Device> truth;
+    if (!synthesize(path, &truth, devices, duration, noise_db, churn, config)) return 1;
+
+    std::unique_ptr<ProximityTable> first, second;
+    double parse = parse_ns(path);
+    result("parse", "ns_per_frame", parse);
+    bool ok = run_replay("pcap", path, config, &first, parse);
+    ok = ok && run_replay("again", path, config, &second, parse);
+    unlink(path);
+    if (!ok) return 1;
+
+    ok = check_accuracy(*first, truth, config);
+    bool same = same_estimates(*first, *second);
+    result("replay", "deterministic", same);
+    if (!same) fprintf(stderr, "two replays of the same file disagree\n");
+    return ok && same ? 0 : 1;
+}
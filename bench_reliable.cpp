@@ -0,0 +1,201 @@
+// Compile with: g++ -O2 bench_reliable.cpp reliable.cpp messaging.cpp crypto.cpp probes.cpp -o bench_reliable `pkg-config --cflags --libs libcrypto` -pthread
+//
+// Reliable delivery over an impaired loopback link. A small relay sits between
+// the two endpoints and drops, delays and (through jitter) reorders datagrams
+// in both directions. The receiver checks that every message arrives exactly
+// once and in order.
+//
+// Usage: bench_reliable [messages] [loss %] [delay ms] [jitter ms]
+
+#include <atomic>
+#include <chrono>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reliable.h"
+
+const int SENDER_PORT = 24000;
+const int RECEIVER_PORT = 24001;
+const int SHIM_FRONT_PORT = 24002;  // the sender talks to this one
+const int SHIM_BACK_PORT = 24003;   // the receiver sees traffic from this one
+
+const size_t PAYLOAD = 200;
+
+static uint64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static struct sockaddr_in loopback(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+// Loss and delay shim
+
+struct Delayed {
+    uint64_t release_us;
+    uint64_t order;     // keeps datagrams with the same release time in FIFO order
+    int out_fd;
+    struct sockaddr_in to;
+    std::vector<uint8_t> data;
+    bool operator>(const Delayed &o) const {
+        return release_us != o.release_us ? release_us > o.release_us : order > o.order;
+    }
+};
+
+static std::atomic<bool> shim_running(true);
+static std::atomic<uint64_t> shim_dropped(0);
+
+static void run_shim(double loss, uint64_t delay_us, uint64_t jitter_us) {
+    int front = socket(AF_INET, SOCK_DGRAM, 0);
+    int back = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in front_addr = loopback(SHIM_FRONT_PORT);
+    struct sockaddr_in back_addr = loopback(SHIM_BACK_PORT);
+    int size = 8 << 20;
+    setsockopt(front, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(back, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(front, (struct sockaddr *)&front_addr, sizeof(front_addr)) < 0 ||
+        bind(back, (struct sockaddr *)&back_addr, sizeof(back_addr)) < 0) {
+        perror("shim bind");
+        exit(1);
+    }
+
+    struct sockaddr_in sender = loopback(SENDER_PORT);
+    struct sockaddr_in receiver = loopback(RECEIVER_PORT);
+    std::priority_queue<Delayed, std::vector<Delayed>, std::greater<Delayed>> queue;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> coin(0, 1);
+    uint8_t buf[2048];
+    uint64_t order = 0;
+
+    while (shim_running.load()) {
+        uint64_t now = now_us();
+        while (!queue.empty() && queue.top().release_us <= now) {
+            const Delayed &d = queue.top();
+            sendto(d.out_fd, d.data.data(), d.data.size(), 0, (struct sockaddr *)&d.to, sizeof(d.to));
+            queue.pop();
+        }
+
+        int timeout = queue.empty() ? 10 : (int)((queue.top().release_us - now) / 1000);
+        struct pollfd fds[2] = {{front, POLLIN, 0}, {back, POLLIN, 0}};
+        if (poll(fds, 2, timeout) <= 0) continue;
+
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            ssize_t n;
+            while ((n = recv(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+                if (coin(rng) < loss) {
+                    shim_dropped.fetch_add(1);
+                    continue;
+                }
+                Delayed d;
+                d.release_us = now_us() + delay_us + (jitter_us ? rng() % jitter_us : 0);
+                d.order = order++;
+                d.out_fd = i == 0 ? back : front;
+                d.to = i == 0 ? receiver : sender;
+                d.data.assign(buf, buf + n);
+                queue.push(std::move(d));
+            }
+        }
+    }
+    close(front);
+    close(back);
+}
+
+// Receiver
+
+static std::atomic<uint64_t> received(0);
+static std::atomic<uint64_t> out_of_order(0);
+
+static void on_deliver(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *data, size_t, void *) {
+    uint64_t index;
+    memcpy(&index, data, sizeof(index));
+    uint64_t expected = received.load(std::memory_order_relaxed);
+    if (index != expected) out_of_order.fetch_add(1);
+    received.store(expected + 1, std::memory_order_relaxed);
+}
+
+static void on_ignore(const struct sockaddr_in *, uint64_t, uint8_t, const uint8_t *, size_t, void *) {
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t messages = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000;
+    double loss = (argc > 2 ? atof(argv[2]) : 2) / 100;
+    uint64_t delay_us = (argc > 3 ? atoi(argv[3]) : 10) * 1000;
+    uint64_t jitter_us = (argc > 4 ? atoi(argv[4]) : 2) * 1000;
+
+    std::thread shim(run_shim, loss, delay_us, jitter_us);
+
+    Messenger rx_messenger(2);
+    Reliable rx(&rx_messenger, on_deliver, NULL);
+    if (!rx_messenger.start(RECEIVER_PORT, Reliable::on_message, &rx)) return 1;
+
+    Messenger tx_messenger(1);
+    Reliable tx(&tx_messenger, on_ignore, NULL);
+    if (!tx_messenger.start(SENDER_PORT, Reliable::on_message, &tx)) return 1;
+
+    struct sockaddr_in to = loopback(SHIM_FRONT_PORT);
+    uint8_t payload[PAYLOAD];
+    memset(payload, 0x5a, sizeof(payload));
+
+    uint64_t start = now_us();
+    for (uint64_t i = 0; i < messages; i++) {
+        memcpy(payload, &i, sizeof(i));
+        while (!tx.send(&to, FRAME_TEXT, payload, sizeof(payload))) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    // Give up after ten quiet seconds
+    uint64_t last = 0;
+    uint64_t last_change = now_us();
+    while (received.load() < messages) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t got = received.load();
+        if (got != last) {
+            last = got;
+            last_change = now_us();
+        } else if (now_us() - last_change > 10000000) {
+            break;
+        }
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    ReliableStats ts, rs;
+    tx.get_stats(&ts);
+    rx.get_stats(&rs);
+
+    printf("link:           %.1f%% loss, %llu ms delay, %llu ms jitter\n", loss * 100,
+           (unsigned long long)delay_us / 1000, (unsigned long long)jitter_us / 1000);
+    printf("delivered:      %llu of %llu, %llu out of order\n", (unsigned long long)received.load(),
+           (unsigned long long)messages, (unsigned long long)out_of_order.load());
+    printf("goodput:        %.0f messages/s (%.1f Mbit/s)\n", received.load() / seconds,
+           received.load() * PAYLOAD * 8 / seconds / 1e6);
+    printf("shim dropped:   %llu datagrams\n", (unsigned long long)shim_dropped.load());
+    printf("retransmits:    %llu (%.2f%% of sends), %llu timeouts\n", (unsigned long long)ts.retransmits,
+           ts.sent ? 100.0 * ts.retransmits / ts.sent : 0.0, (unsigned long long)ts.timeouts);
+    printf("duplicates:     %llu at the receiver\n", (unsigned long long)rs.duplicates);
+    printf("acks:           %llu\n", (unsigned long long)rs.acks_sent);
+    printf("srtt:           %.2f ms, cwnd %.1f kB, bandwidth %.1f Mbit/s\n", ts.srtt_us / 1000.0, ts.cwnd / 1000,
+           ts.bandwidth * 8 / 1e6);
+
+    tx_messenger.stop();
+    rx_messenger.stop();
+    shim_running.store(false);
+    shim.join();
+    return received.load() == messages && out_of_order.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+// Compile with: g++ -O2 bench_voice.cpp voice.cpp -o bench_voice `pkg-config --cflags --libs gstreamer-1.0 gstreamer-net-1.0 gio-2.0`
+//
+// Call setup latency, measured as the time from asking for a call until the
+// first RTP packet reaches udpsink. Cold is the old way: gst_parse_launch()
+// and NULL to PLAYING per call. Warm is voice.cpp: chains built once and
+// parked in PAUSED. Calls go to ourselves on loopback and need a working
+// audio input.
+//
+// Usage: bench_voice [calls]
+
+#include <atomic>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+#include "voice.h"
+
+const int PORT = 23456;
+
+static std::atomic<gint64> first_packet_us(0);
+
+static GstPadProbeReturn on_packet(GstPad *, GstPadProbeInfo *, gpointer) {
+    gint64 zero = 0;
+    first_packet_us.compare_exchange_strong(zero, g_get_monotonic_time());
+    return GST_PAD_PROBE_OK;
+}
+
+// Spin the default context, which carries the pipelines' bus watches, until done() or a timeout
+template <typename F>
+static bool wait_for(F done) {
+    gint64 deadline = g_get_monotonic_time() + 2 * G_TIME_SPAN_SECOND;
+    while (!done()) {
+        if (g_get_monotonic_time() > deadline) return false;
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(200);
+    }
+    return true;
+}
+
+static double cold_call() {
+    std::string description =
+        "autoaudiosrc ! audioconvert ! opusenc ! rtpopuspay ! "
+        "udpsink name=out host=127.0.0.1 port=" + std::to_string(PORT + 1) + " "
+        "udpsrc port=" + std::to_string(PORT + 1) + " ! "
+        "application/x-rtp,media=audio,encoding-name=OPUS ! "
+        "rtpjitterbuffer ! rtpopusdepay ! opusdec ! audioconvert ! autoaudiosink";
+
+    gint64 start = g_get_monotonic_time();
+    first_packet_us.store(0);
+    GstElement *pipeline = gst_parse_launch(description.c_str(), NULL);
+    if (pipeline == NULL) return -1;
+    GstElement *out = gst_bin_get_by_name(GST_BIN(pipeline), "out");
+    GstPad *pad = gst_element_get_static_pad(out, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_packet, NULL, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(out);
+
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    bool ok = wait_for([] { return first_packet_us.load() != 0; });
+    double ms = (first_packet_us.load() - start) / 1000.0;
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return ok ? ms : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int calls = argc > 1 ? atoi(argv[1]) : 20;
+    gst_init(&argc, &argv);
+
+    double cold_total = 0, cold_max = 0;
+    int cold_calls = 0;
+    for (int i = 0; i < calls; i++) {
+        double ms = cold_call();
+        if (ms < 0) continue;
+        cold_total += ms;
+        if (ms > cold_max) cold_max = ms;
+        cold_calls++;
+    }
+
+    if (!voice_init(PORT)) {
+        fprintf(stderr, "voice_init failed\n");
+        return 1;
+    }
+    for (int i = 0; i < calls; i++) {
+        VoiceStats before;
+        voice_get_stats(&before);
+        voice_start("127.0.0.1", PORT);
+        wait_for([&] {
+            VoiceStats now;
+            voice_get_stats(&now);
+            return now.calls > before.calls;
+        });
+        g_usleep(50000);
+        voice_stop();
+    }
+
+    VoiceStats stats;
+    voice_get_stats(&stats);
+    voice_shutdown();
+
+    printf("cold setup:  avg %.1f ms, max %.1f ms over %d calls (parse, NULL to PLAYING)\n",
+           cold_calls ? cold_total / cold_calls : 0.0, cold_max, cold_calls);
+    printf("warm-up:     %.1f ms once, in voice_init()\n", stats.warmup_ms);
+    printf("warm setup:  avg %.1f ms, max %.1f ms over %llu calls (goal %.0f ms)\n",
+           stats.avg_setup_ms, stats.max_setup_ms, (unsigned long long)stats.calls, VOICE_SETUP_GOAL_MS);
+    return stats.calls == (uint64_t)calls && stats.max_setup_ms < VOICE_SETUP_GOAL_MS ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// Compile with: g++ -O2 bench_voice_latency.cpp voice.cpp -o bench_voice_latency `pkg-config --cflags --libs gstreamer-1.0 gstreamer-net-1.0 gio-2.0`
+//
+// Loopback harness for mouth-to-ear latency, end to end through voice.cpp
+// for each profile. A live 1 kHz tone stands in for the microphone and a
+// clock-synced fakesink for the speaker; the call goes to ourselves over
+// loopback. Each trial switches the tone on and measures from the first
+// loud buffer leaving the source to the first loud buffer being rendered.
+// The sound card's own buffers are not included, so add one device period
+// at each end for the figure a person would hear. The live estimate from
+// VoiceStats is printed next to the measurement.
+//
+// Usage: bench_voice_latency [trials]
+
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gst/gst.h>
+
+#include "voice.h"
+
+const int PORT = 23458;
+
+static const char *SOURCE =
+    "audiotestsrc name=mouth is-live=true wave=sine freq=1000 volume=0 samplesperbuffer=48 ! "
+    "audio/x-raw,format=S16LE,rate=48000,channels=1";
+static const char *SINK = "audio/x-raw,format=S16LE ! fakesink name=ear sync=true signal-handoffs=true";
+
+static std::atomic<gint64> mouth_us(0);
+static std::atomic<gint64> ear_us(0);
+
+static bool loud(GstBuffer *buffer) {
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) return false;
+    const int16_t *samples = (const int16_t *)map.data;
+    bool found = false;
+    for (size_t i = 0; i < map.size / sizeof(int16_t) && !found; i++) found = abs(samples[i]) > 8000;
+    gst_buffer_unmap(buffer, &map);
+    return found;
+}
+
+static GstPadProbeReturn on_mouth(GstPad *, GstPadProbeInfo *info, gpointer) {
+    if (mouth_us.load() == 0 && loud(GST_PAD_PROBE_INFO_BUFFER(info))) {
+        gint64 zero = 0;
+        mouth_us.compare_exchange_strong(zero, g_get_monotonic_time());
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+// fakesink hands off after waiting for the buffer's render time
+static void on_ear(GstElement *, GstBuffer *buffer, GstPad *, gpointer) {
+    if (mouth_us.load() != 0 && ear_us.load() == 0 && loud(buffer)) ear_us.store(g_get_monotonic_time());
+}
+
+// Spin the default context, which carries the bus watches and the jitter
+// buffer control, for ms or until done()
+template <typename F>
+static bool spin(int ms, F done) {
+    gint64 deadline = g_get_monotonic_time() + ms * 1000;
+    while (!done()) {
+        if (g_get_monotonic_time() > deadline) return false;
+        g_main_context_iteration(NULL, FALSE);
+        g_usleep(200);
+    }
+    return true;
+}
+
+static bool measure(const char *name, const VoiceProfile &profile, int trials) {
+    if (!voice_init(PORT, profile, SOURCE, SINK)) {
+        fprintf(stderr, "%s: voice_init failed\n", name);
+        return false;
+    }
+    GstElement *mouth = voice_get_element("mouth");
+    GstElement *ear = voice_get_element("ear");
+    GstPad *pad = gst_element_get_static_pad(mouth, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_mouth, NULL, NULL);
+    gst_object_unref(pad);
+    g_signal_connect(ear, "handoff", G_CALLBACK(on_ear), NULL);
+
+    voice_start("127.0.0.1", PORT);
+    spin(1000, [] { return false; });
+
+    double total = 0, low = 1e9, high = 0;
+    int done = 0;
+    for (int i = 0; i < trials; i++) {
+        mouth_us.store(0);
+        ear_us.store(0);
+        g_object_set(mouth, "volume", 1.0, NULL);
+        bool heard = spin(2000, [] { return ear_us.load() != 0; });
+        g_object_set(mouth, "volume", 0.0, NULL);
+        if (heard) {
+            double ms = (ear_us.load() - mouth_us.load()) / 1000.0;
+            total += ms;
+            low = std::min(low, ms);
+            high = std::max(high, ms);
+            done++;
+        }
+        spin(300, [] { return false; });   // let the silence through
+    }
+
+    VoiceStats stats;
+    voice_get_stats(&stats);
+    voice_stop();
+    gst_object_unref(mouth);
+    gst_object_unref(ear);
+    voice_shutdown();
+
+    if (done == 0) {
+        printf("%-12s no tone came through\n", name);
+        return false;
+    }
+    printf("%-12s %6.1f %4s %9.1f %9.1f %9.1f %10.1f %8.0f %6d/%d\n", name, profile.frame_us / 1000.0,
+           profile.fec ? "yes" : "no", total / done, low, high, stats.mouth_to_ear_ms, stats.jitter_buffer_ms,
+           done, trials);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int trials = argc > 1 ? atoi(argv[1]) : 20;
+    gst_init(&argc, &argv);
+
+    printf("%-12s %6s %4s %9s %9s %9s %10s %8s %8s\n", "profile", "frame", "fec", "avg ms", "min ms",
+           "max ms", "estimate", "buffer", "trials");
+    bool ok = measure("default", VOICE_PROFILE_DEFAULT, trials);
+    ok &= measure("low-latency", VOICE_PROFILE_LOW_LATENCY, trials);
+    ok &= measure("ultra-low", VOICE_PROFILE_ULTRA_LOW, trials);
+    return ok ? 0 : 1;
+}
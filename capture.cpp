@@ -0,0 +1,562 @@
+#include "capture.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <unistd.h>
+
+// Ring frames are variable length in TPACKET_V3; this only has to divide
+// the block size
+const unsigned int RING_FRAME_SIZE = 2048;
+
+static thread_local int current_thread = 0;
+
+int capture_thread() {
+    return current_thread;
+}
+
+// The program below in C: the kernel loads addr2[2..5] as a big-endian
+// word and takes it modulo the group size
+int capture_transmitter_thread(const uint8_t *transmitter, int threads) {
+    uint32_t word = (uint32_t)transmitter[2] << 24 | (uint32_t)transmitter[3] << 16 |
+                    (uint32_t)transmitter[4] << 8 | transmitter[5];
+    return threads > 1 ? (int)(word % (uint32_t)threads) : 0;
+}
+
+Capture::Capture() : kernel_drops(0), kernel_freezes(0) {
+}
+
+Capture::~Capture() {
+    stop();
+}
+
+static uint32_t link_for(int hardware_type) {
+    switch (hardware_type) {
+    case ARPHRD_IEEE80211_RADIOTAP: return WIFI_LINK_RADIOTAP;
+    case ARPHRD_IEEE80211: return WIFI_LINK_80211;
+    default: return 0;
+    }
+}
+
+// Fanout by transmitter: a cBPF program returning the middle four bytes of
+// addr2, which the kernel takes modulo the group size. Loads are relative
+// to the link-layer header (SKF_LL_OFF), wherever the device left the data
+// pointer, and skip a radiotap header by its little-endian length. Frames
+// too short to have addr2 make the loads fail, return 0 and go to the
+// first thread.
+static void transmitter_program(uint32_t link, struct sock_filter *prog, unsigned short *len) {
+    const int32_t addr2 = SKF_LL_OFF + 10 + 2;
+    unsigned short n = 0;
+    if (link == WIFI_LINK_RADIOTAP) {
+        prog[n++] = BPF_STMT(BPF_LD | BPF_B | BPF_ABS, (uint32_t)(SKF_LL_OFF + 3));
+        prog[n++] = BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8);
+        prog[n++] = BPF_STMT(BPF_MISC | BPF_TAX, 0);
+        prog[n++] = BPF_STMT(BPF_LD | BPF_B | BPF_ABS, (uint32_t)(SKF_LL_OFF + 2));
+        prog[n++] = BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0);
+        prog[n++] = BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    } else {
+        prog[n++] = BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 0);
+    }
+    prog[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_IND, (uint32_t)addr2);
+    prog[n++] = BPF_STMT(BPF_RET | BPF_A, 0);
+    *len = n;
+}
+
+bool Capture::open_ring(Ring *ring, const CaptureConfig &config, int ifindex, int fanout_id) {
+    // No protocol until bind, so nothing arrives before the ring is there
+    ring->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (ring->fd < 0) {
+        perror("socket AF_PACKET");
+        return false;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt PACKET_VERSION");
+        return false;
+    }
+    // Not our own injected frames
+    int ignore = 1;
+    setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = (unsigned int)config.block_size;
+    req.tp_block_nr = (unsigned int)config.block_count;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = (unsigned int)(config.block_size / RING_FRAME_SIZE * config.block_count);
+    req.tp_retire_blk_tov = config.block_timeout_ms;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("setsockopt PACKET_RX_RING");
+        return false;
+    }
+
+    ring->block_size = config.block_size;
+    ring->block_count = config.block_count;
+    ring->map_size = config.block_size * config.block_count;
+    // Locked if we may, so a flood never waits on a page fault
+    void *map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE | MAP_LOCKED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    ring->map = (uint8_t *)map;
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind AF_PACKET");
+        return false;
+    }
+
+    if (config.threads > 1) {
+        int mode = config.fanout == CAPTURE_FANOUT_CPU ? PACKET_FANOUT_CPU
+                 : config.fanout == CAPTURE_FANOUT_BALANCE ? PACKET_FANOUT_LB : PACKET_FANOUT_CBPF;
+        int arg = fanout_id | mode << 16;
+        if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+            perror("setsockopt PACKET_FANOUT");
+            return false;
+        }
+        if (mode == PACKET_FANOUT_CBPF) {
+            struct sock_filter code[8];
+            struct sock_fprog prog;
+            transmitter_program(link_type, code, &prog.len);
+            prog.filter = code;
+            if (setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)) < 0) {
+                perror("setsockopt PACKET_FANOUT_DATA");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Capture::start(const CaptureConfig &config, capture_handler on_frames, void *data) {
+    if (config.interface == NULL || config.threads < 1 || config.block_count == 0 ||
+        config.block_size == 0 || config.block_size % RING_FRAME_SIZE) {
+        fprintf(stderr, "capture: bad configuration\n");
+        return false;
+    }
+
+    int ifindex = (int)if_nametoindex(config.interface);
+    if (ifindex == 0) {
+        perror(config.interface);
+        return false;
+    }
+
+    int probe = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        perror("socket AF_PACKET");
+        return false;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, config.interface, IFNAMSIZ - 1);
+    int ok = ioctl(probe, SIOCGIFHWADDR, &ifr);
+    close(probe);
+    if (ok < 0) {
+        perror("ioctl SIOCGIFHWADDR");
+        return false;
+    }
+    link_type = link_for(ifr.ifr_hwaddr.sa_family);
+    if (link_type == 0) {
+        fprintf(stderr, "capture: %s is not in monitor mode (hardware type %d)\n",
+                config.interface, ifr.ifr_hwaddr.sa_family);
+        return false;
+    }
+
+    rings.clear();
+    kernel_drops.store(0);
+    kernel_freezes.store(0);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        perror("eventfd");
+        return false;
+    }
+
+    handler = on_frames;
+    user = data;
+    int fanout_id = getpid() & 0xffff;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < config.threads; i++) {
+        rings.emplace_back(new Ring());
+        Ring *ring = rings.back().get();
+        ring->index = i;
+        if (config.fanout == CAPTURE_FANOUT_CPU && cpus > 0) ring->cpu = (int)(i % cpus);
+        if (!open_ring(ring, config, ifindex, fanout_id)) {
+            stop();
+            return false;
+        }
+    }
+    for (auto &ring : rings) ring->thread = std::thread(&Capture::loop, this, ring.get());
+    return true;
+}
+
+void Capture::stop() {
+    if (stop_fd != -1) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) perror("write");
+    }
+    for (auto &ring : rings) {
+        if (ring->thread.joinable()) ring->thread.join();
+    }
+    // Fold in the kernel's last counters before the sockets go
+    CaptureStats last;
+    get_stats(&last);
+    // The rings stay, counters and all, until the next start
+    for (auto &ring : rings) {
+        if (ring->map) munmap(ring->map, ring->map_size);
+        if (ring->fd != -1) close(ring->fd);
+        ring->map = NULL;
+        ring->fd = -1;
+    }
+    if (stop_fd != -1) close(stop_fd);
+    stop_fd = -1;
+}
+
+// Hand one block's frames over in batches
+void Capture::read_block(Ring *ring, const uint8_t *block) {
+    const struct tpacket_block_desc *desc = (const struct tpacket_block_desc *)block;
+    uint32_t count = desc->hdr.bh1.num_pkts;
+    const uint8_t *p = block + desc->hdr.bh1.offset_to_first_pkt;
+
+    WifiFrame batch[CAPTURE_BATCH];
+    size_t n = 0;
+    uint64_t frames = 0, bytes = 0, malformed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const struct tpacket3_hdr *hdr = (const struct tpacket3_hdr *)p;
+        uint64_t time_ns = (uint64_t)hdr->tp_sec * 1000000000ull + hdr->tp_nsec;
+        if (wifi_parse(p + hdr->tp_mac, hdr->tp_snaplen, link_type, time_ns, &batch[n])) {
+            bytes += hdr->tp_snaplen;
+            if (++n == CAPTURE_BATCH) {
+                handler(batch, n, user);
+                frames += n;
+                n = 0;
+            }
+        } else {
+            malformed++;
+        }
+        p += hdr->tp_next_offset;
+    }
+    if (n) handler(batch, n, user);
+    frames += n;
+
+    ring->frames.fetch_add(frames, std::memory_order_relaxed);
+    ring->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    ring->malformed.fetch_add(malformed, std::memory_order_relaxed);
+    ring->blocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Capture::loop(Ring *ring) {
+    current_thread = ring->index;
+    if (ring->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(ring->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = ring->fd;
+    fds[0].events = POLLIN | POLLERR;
+    fds[1].fd = stop_fd;
+    fds[1].events = POLLIN;
+
+    size_t current = 0;
+    for (;;) {
+        uint8_t *block = ring->map + current * ring->block_size;
+        struct tpacket_block_desc *desc = (struct tpacket_block_desc *)block;
+        // The kernel's writes to the block are visible once we see the status
+        if (__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) {
+            read_block(ring, block);
+            __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            current = (current + 1) % ring->block_count;
+            continue;
+        }
+
+        int ready = poll(fds, 2, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        ring->wakeups.fetch_add(1, std::memory_order_relaxed);
+        if (fds[1].revents & POLLIN) return;
+    }
+}
+
+void Capture::get_stats(CaptureStats *stats) const {
+    memset(stats, 0, sizeof(*stats));
+    for (auto &ring : rings) {
+        stats->frames += ring->frames.load(std::memory_order_relaxed);
+        stats->bytes += ring->bytes.load(std::memory_order_relaxed);
+        stats->malformed += ring->malformed.load(std::memory_order_relaxed);
+        stats->blocks += ring->blocks.load(std::memory_order_relaxed);
+        stats->wakeups += ring->wakeups.load(std::memory_order_relaxed);
+
+        struct tpacket_stats_v3 kernel;
+        socklen_t len = sizeof(kernel);
+        if (ring->fd != -1 && getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &kernel, &len) == 0) {
+            kernel_drops.fetch_add(kernel.tp_drops, std::memory_order_relaxed);
+            kernel_freezes.fetch_add(kernel.tp_freeze_q_cnt, std::memory_order_relaxed);
+        }
+    }
+    stats->drops = kernel_drops.load(std::memory_order_relaxed);
+    stats->freezes = kernel_freezes.load(std::memory_order_relaxed);
+}
+
+// pcap and pcapng
+
+const uint32_t PCAP_MAGIC_USEC = 0xa1b2c3d4;
+const uint32_t PCAP_MAGIC_NSEC = 0xa1b23c4d;
+const size_t PCAP_HEADER_SIZE = 24;
+const size_t PCAP_RECORD_SIZE = 16;
+
+const uint32_t PCAPNG_SECTION = 0x0a0d0d0a;
+const uint32_t PCAPNG_INTERFACE = 1;
+const uint32_t PCAPNG_SIMPLE_PACKET = 3;
+const uint32_t PCAPNG_ENHANCED_PACKET = 6;
+const uint32_t PCAPNG_BYTE_ORDER = 0x1a2b3c4d;
+const uint16_t PCAPNG_OPT_TSRESOL = 9;
+
+static uint32_t read_u32(const uint8_t *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t read_u16(const uint8_t *p, bool swap) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+// Parses into a batch and hands it over when full
+struct Replay {
+    capture_handler handler;
+    void *user;
+    CaptureStats stats;
+    WifiFrame batch[CAPTURE_BATCH];
+    size_t count;
+
+    void frame(const uint8_t *data, size_t len, uint32_t link, uint64_t time_ns) {
+        if (!wifi_parse(data, len, link, time_ns, &batch[count])) {
+            stats.malformed++;
+            return;
+        }
+        stats.bytes += len;
+        if (++count == CAPTURE_BATCH) flush();
+    }
+
+    void flush() {
+        if (count) handler(batch, count, user);
+        stats.frames += count;
+        count = 0;
+    }
+};
+
+static bool read_classic(const uint8_t *p, size_t size, Replay *replay) {
+    uint32_t magic;
+    memcpy(&magic, p, sizeof(magic));
+    bool swap = magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC);
+    uint32_t unit = (read_u32(p, swap) == PCAP_MAGIC_NSEC) ? 1 : 1000;
+    uint32_t link = read_u32(p + 20, swap) & 0xffff;
+
+    size_t off = PCAP_HEADER_SIZE;
+    while (off + PCAP_RECORD_SIZE <= size) {
+        uint64_t sec = read_u32(p + off, swap);
+        uint64_t frac = read_u32(p + off + 4, swap);
+        uint32_t caplen = read_u32(p + off + 8, swap);
+        off += PCAP_RECORD_SIZE;
+        if (caplen > size - off) {
+            fprintf(stderr, "capture: truncated pcap record\n");
+            return false;
+        }
+        replay->frame(p + off, caplen, link, sec * 1000000000ull + frac * unit);
+        off += caplen;
+    }
+    return true;
+}
+
+struct NgInterface {
+    uint32_t link;
+    uint64_t mul;       // timestamp units to ns: * mul / div, or...
+    uint64_t div;
+    int shift;          // ...* 1e9 >> shift for binary resolutions, if nonzero
+};
+
+static uint64_t ng_time(const NgInterface &iface, uint64_t ts) {
+    if (iface.shift) return (uint64_t)(((unsigned __int128)ts * 1000000000u) >> iface.shift);
+    return ts * iface.mul / iface.div;
+}
+
+static NgInterface ng_interface(const uint8_t *body, size_t len, bool swap) {
+    NgInterface iface = { read_u16(body, swap), 1000, 1, 0 };
+    size_t off = 8;
+    while (off + 4 <= len) {
+        uint16_t code = read_u16(body + off, swap);
+        uint16_t opt_len = read_u16(body + off + 2, swap);
+        off += 4;
+        if (code == 0 || opt_len > len - off) break;
+        if (code == PCAPNG_OPT_TSRESOL && opt_len >= 1) {
+            uint8_t resol = body[off];
+            if (resol & 0x80) {
+                iface.shift = resol & 0x7f;
+            } else {
+                iface.mul = 1;
+                iface.div = 1;
+                for (int i = resol; i < 9; i++) iface.mul *= 10;
+                for (int i = 9; i < resol && i < 19; i++) iface.div *= 10;
+            }
+        }
+        off += (opt_len + 3) & ~3u;
+    }
+    return iface;
+}
+
+static bool read_ng(const uint8_t *p, size_t size, Replay *replay) {
+    std::vector<NgInterface> interfaces;
+    bool swap = false;
+    size_t off = 0;
+    while (off + 12 <= size) {
+        uint32_t type;
+        memcpy(&type, p + off, sizeof(type));
+        if (type == PCAPNG_SECTION) {
+            uint32_t order;
+            memcpy(&order, p + off + 8, sizeof(order));
+            if (order != PCAPNG_BYTE_ORDER && order != __builtin_bswap32(PCAPNG_BYTE_ORDER)) break;
+            swap = order != PCAPNG_BYTE_ORDER;
+            interfaces.clear();
+        } else if (swap) {
+            type = __builtin_bswap32(type);
+        }
+
+        uint32_t block_len = read_u32(p + off + 4, swap);
+        if (block_len < 12 || block_len % 4 || block_len > size - off) {
+            fprintf(stderr, "capture: malformed pcapng block\n");
+            return false;
+        }
+        const uint8_t *body = p + off + 8;
+        size_t body_len = block_len - 12;
+
+        if (type == PCAPNG_INTERFACE && body_len >= 8) {
+            interfaces.push_back(ng_interface(body, body_len, swap));
+        } else if (type == PCAPNG_ENHANCED_PACKET && body_len >= 20) {
+            uint32_t id = read_u32(body, swap);
+            uint64_t ts = (uint64_t)read_u32(body + 4, swap) << 32 | read_u32(body + 8, swap);
+            uint32_t caplen = read_u32(body + 12, swap);
+            if (id < interfaces.size() && caplen <= body_len - 20) {
+                replay->frame(body + 20, caplen, interfaces[id].link, ng_time(interfaces[id], ts));
+            } else {
+                replay->stats.malformed++;
+            }
+        } else if (type == PCAPNG_SIMPLE_PACKET && body_len >= 4 && !interfaces.empty()) {
+            uint32_t caplen = read_u32(body, swap);
+            if (caplen > body_len - 4) caplen = (uint32_t)(body_len - 4);
+            replay->frame(body + 4, caplen, interfaces[0].link, 0);
+        }
+        off += block_len;
+    }
+    return true;
+}
+
+bool capture_read_pcap(const char *path, capture_handler handler, void *user, CaptureStats *stats) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)PCAP_HEADER_SIZE) {
+        fprintf(stderr, "capture: %s is not a capture file\n", path);
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const uint8_t *p = (const uint8_t *)map;
+    uint32_t magic;
+    memcpy(&magic, p, sizeof(magic));
+
+    std::unique_ptr<Replay> replay(new Replay());
+    replay->handler = handler;
+    replay->user = user;
+    memset(&replay->stats, 0, sizeof(replay->stats));
+    replay->count = 0;
+
+    bool ok;
+    if (magic == PCAPNG_SECTION) {
+        ok = read_ng(p, size, replay.get());
+    } else if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+               magic == __builtin_bswap32(PCAP_MAGIC_USEC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+        ok = read_classic(p, size, replay.get());
+    } else {
+        fprintf(stderr, "capture: %s is not a capture file\n", path);
+        ok = false;
+    }
+    replay->flush();
+    munmap(map, size);
+
+    if (stats) *stats = replay->stats;
+    return ok;
+}
+
+PcapWriter::~PcapWriter() {
+    close();
+}
+
+bool PcapWriter::open(const char *path, uint32_t link) {
+    close();
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    uint32_t header[6] = { PCAP_MAGIC_NSEC, 2 | 4 << 16, 0, 0, 65535, link };
+    return fwrite(header, sizeof(header), 1, file) == 1;
+}
+
+bool PcapWriter::write(const uint8_t *data, size_t len, uint64_t time_ns) {
+    if (file == NULL) return false;
+    uint32_t record[4] = {
+        (uint32_t)(time_ns / 1000000000ull), (uint32_t)(time_ns % 1000000000ull),
+        (uint32_t)len, (uint32_t)len
+    };
+    return fwrite(record, sizeof(record), 1, file) == 1 && fwrite(data, len, 1, file) == 1;
+}
+
+bool PcapWriter::close() {
+    if (file == NULL) return true;
+    bool ok = fclose(file) == 0;
+    file = NULL;
+    return ok;
+}
@@ -0,0 +1,135 @@
+#ifndef PUTTYNET_CAPTURE_H
+#define PUTTYNET_CAPTURE_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "wifi.h"
+
+// Wi-Fi capture for the proximity feature: every frame a monitor-mode
+// interface sees, parsed in place (wifi.h).
+//
+// Live capture reads an AF_PACKET socket through a TPACKET_V3 ring: the
+// kernel fills blocks of frames in memory shared with us and hands a block
+// over when it is full or block_timeout_ms after its first frame, so a
+// beacon flood costs one wakeup per block rather than a copy and a syscall
+// per frame. Each capture thread has its own socket and ring; with several,
+// the sockets join a fanout group and the kernel splits frames between them
+// (CaptureFanout). The handler sees frames straight out of the ring, in
+// batches, and the block goes back to the kernel once it returns.
+//
+// The same parser runs over pcap and pcapng files (capture_read_pcap()),
+// mapped rather than read, so recordings replay at memory speed.
+
+// Frames per handler call
+const size_t CAPTURE_BATCH = 256;
+
+enum CaptureFanout {
+    CAPTURE_FANOUT_TRANSMITTER,     // by transmitter address: one device, one thread
+    CAPTURE_FANOUT_CPU,             // by the CPU the frame arrived on; threads are pinned to match
+    CAPTURE_FANOUT_BALANCE,         // round robin
+};
+
+struct CaptureConfig {
+    const char *interface = NULL;   // in monitor mode
+    int threads = 1;
+    CaptureFanout fanout = CAPTURE_FANOUT_TRANSMITTER;
+    size_t block_size = 1 << 20;    // a multiple of the page size
+    size_t block_count = 32;        // per thread
+    int block_timeout_ms = 10;      // a block goes out this long after its first frame at the latest
+};
+
+struct CaptureStats {
+    uint64_t frames;                // parsed and handed over
+    uint64_t bytes;
+    uint64_t malformed;             // not parseable as 802.11
+    uint64_t drops;                 // dropped by the kernel: the ring was full
+    uint64_t freezes;               // times the ring filled up
+    uint64_t blocks;
+    uint64_t wakeups;               // polls that returned
+};
+
+// Called with up to CAPTURE_BATCH frames. Live, on the capture threads,
+// several at once with more than one thread; the frames point into the
+// ring and are gone after it returns.
+typedef void (*capture_handler)(const WifiFrame *frames, size_t count, void *user);
+
+// The capture thread a handler runs on, from 0 to threads - 1, in the
+// order the rings joined the fanout group; 0 on any other thread, pcap
+// replay included
+int capture_thread();
+
+// The thread CAPTURE_FANOUT_TRANSMITTER hands this transmitter's frames to
+int capture_transmitter_thread(const uint8_t *transmitter, int threads);
+
+class Capture {
+public:
+    Capture();
+    ~Capture();
+
+    bool start(const CaptureConfig &config, capture_handler handler, void *user);
+    void stop();
+
+    // The link type frames arrive with, once started
+    uint32_t link() const { return link_type; }
+
+    void get_stats(CaptureStats *stats) const;
+
+private:
+    struct Ring {
+        int fd = -1;
+        uint8_t *map = NULL;
+        size_t map_size = 0;
+        size_t block_size = 0;
+        size_t block_count = 0;
+        int index = 0;              // in rings, and so in the fanout group
+        int cpu = -1;               // pinned to, or -1
+        std::thread thread;
+        std::atomic<uint64_t> frames{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> malformed{0};
+        std::atomic<uint64_t> blocks{0};
+        std::atomic<uint64_t> wakeups{0};
+    };
+
+    Capture(const Capture &) = delete;
+    Capture &operator=(const Capture &) = delete;
+
+    bool open_ring(Ring *ring, const CaptureConfig &config, int ifindex, int fanout_id);
+    void loop(Ring *ring);
+    void read_block(Ring *ring, const uint8_t *block);
+
+    std::vector<std::unique_ptr<Ring>> rings;
+    int stop_fd = -1;
+    uint32_t link_type = 0;
+    capture_handler handler = NULL;
+    void *user = NULL;
+
+    // Kernel counters are reset on every read, so they add up here
+    mutable std::atomic<uint64_t> kernel_drops;
+    mutable std::atomic<uint64_t> kernel_freezes;
+};
+
+// Replay a pcap or pcapng file through handler, on this thread. Timestamps
+// come from the file. Returns false if it cannot be read; stats may be NULL.
+bool capture_read_pcap(const char *path, capture_handler handler, void *user, CaptureStats *stats);
+
+// Writes classic pcap files, for recordings and for the benches
+class PcapWriter {
+public:
+    ~PcapWriter();
+
+    bool open(const char *path, uint32_t link);
+    bool write(const uint8_t *data, size_t len, uint64_t time_ns);
+    bool close();
+
+private:
+    FILE *file = NULL;
+};
+
+#endif
@@ -0,0 +1,492 @@
+#include "conference.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/net/gstnetaddressmeta.h>
+
+#include "mixer.h"
+
+static const char *CONFERENCE_SRTP_CAPS =
+    "application/x-srtp,media=audio,clock-rate=48000,encoding-name=OPUS,payload=96";
+
+// GCM authenticates by itself, so the auth settings stay null
+static const char *SRTP_GCM = "rtp-cipher=aes-256-gcm rtp-auth=null rtcp-cipher=aes-256-gcm rtcp-auth=null";
+
+// Everything between the decoders and the encoders is 48 kHz mono S16
+static const char *CONFERENCE_PCM_CAPS =
+    "audio/x-raw,format=S16LE,layout=interleaved,rate=48000,channels=1";
+
+static const size_t FRAME_SAMPLES = 480;                 // 10 ms
+static const size_t MAX_QUEUED = 6 * FRAME_SAMPLES;      // older audio is dropped
+
+// Frame buffers made when the conference starts; the pool only grows past
+// this if the encoders and the speaker hold on to more at once
+static const guint POOL_BUFFERS = 32;
+
+// Decoded audio waiting for the next tick, in a fixed ring: when it is full
+// the oldest samples are overwritten, and nothing allocates
+struct SampleRing {
+    int16_t data[MAX_QUEUED];
+    size_t head = 0;     // oldest sample
+    size_t count = 0;
+
+    void clear() { head = count = 0; }
+
+    void push(const int16_t *samples, size_t n) {
+        if (n > MAX_QUEUED) {
+            samples += n - MAX_QUEUED;
+            n = MAX_QUEUED;
+        }
+        if (count + n > MAX_QUEUED) {
+            size_t drop = count + n - MAX_QUEUED;
+            head = (head + drop) % MAX_QUEUED;
+            count -= drop;
+        }
+        size_t tail = (head + count) % MAX_QUEUED;
+        size_t first = std::min(n, MAX_QUEUED - tail);
+        memcpy(data + tail, samples, first * sizeof(int16_t));
+        memcpy(data, samples + first, (n - first) * sizeof(int16_t));
+        count += n;
+    }
+
+    bool pop(int16_t *frame) {
+        if (count < FRAME_SAMPLES) return false;
+        size_t first = std::min(FRAME_SAMPLES, MAX_QUEUED - head);
+        memcpy(frame, data + head, first * sizeof(int16_t));
+        memcpy(frame + first, data, (FRAME_SAMPLES - first) * sizeof(int16_t));
+        head = (head + FRAME_SAMPLES) % MAX_QUEUED;
+        count -= FRAME_SAMPLES;
+        return true;
+    }
+};
+
+struct Participant {
+    std::string host;
+    GInetAddress *addr = NULL;
+    float gain = 1.0f;
+    GstElement *pipeline = NULL;
+    GstElement *rtp_in = NULL;       // appsrc, fed from the shared udpsrc
+    GstElement *decrypt = NULL;      // srtpdec
+    GstElement *mix_out = NULL;      // appsrc, this participant's mix-minus
+    uint8_t receive_key[SRTP_MASTER_SIZE];  // under room_lock
+    bool keyed = false;
+    SampleRing queue;                // decoded, waiting for the next tick
+    int16_t frame[FRAME_SAMPLES];
+};
+
+// room_lock covers the participant list, every queue, the tick's scratch
+// arrays and the stats. It is taken on the streaming threads, so nothing
+// under it may change a pipeline's state, and tick() must not allocate:
+// the scratch arrays grow in conference_add() and frames come from a pool.
+static std::mutex room_lock;
+static std::vector<std::unique_ptr<Participant>> participants;
+static SampleRing mic_queue;
+static int16_t mic_frame[FRAME_SAMPLES];
+static std::unique_ptr<Mixer> mixer;
+static ConferenceStats stats;
+static double total_mix_us = 0;
+
+// One entry per participant, plus the speaker for buffers and maps
+static std::vector<MixInput> mix_inputs;
+static std::vector<int16_t *> mix_outputs;
+static std::vector<GstBuffer *> mix_buffers;
+static std::vector<GstMapInfo> mix_maps;
+
+static GstElement *room = NULL;      // udpsrc, microphone and speaker
+static GstElement *speaker = NULL;   // appsrc
+static GstBufferPool *frame_pool = NULL;
+
+static void queue_push(SampleRing &queue, const GstMapInfo &map) {
+    queue.push((const int16_t *)map.data, map.size / sizeof(int16_t));
+}
+
+static Participant *find(GInetAddress *addr) {
+    for (auto &p : participants) {
+        if (g_inet_address_equal(p->addr, addr)) return p.get();
+    }
+    return NULL;
+}
+
+// Scratch for a tick with count participants; with room_lock held, outside tick()
+static void reserve_scratch(size_t count) {
+    if (mix_buffers.size() > count) return;
+    mix_inputs.resize(count);
+    mix_outputs.resize(count);
+    mix_buffers.resize(count + 1);
+    mix_maps.resize(count + 1);
+}
+
+// One mix, with room_lock held. The mixer writes straight into pooled
+// buffers that go to the speaker and the encoders; nothing is allocated.
+static void tick(const int16_t *mic) {
+    size_t count = participants.size();
+    GstBuffer **buffers = mix_buffers.data();
+    GstMapInfo *maps = mix_maps.data();
+
+    for (size_t i = 0; i <= count; i++) {
+        if (gst_buffer_pool_acquire_buffer(frame_pool, &buffers[i], NULL) != GST_FLOW_OK) {
+            // Only while the pool is being shut down
+            while (i-- > 0) {
+                gst_buffer_unmap(buffers[i], &maps[i]);
+                gst_buffer_unref(buffers[i]);
+            }
+            return;
+        }
+        gst_buffer_map(buffers[i], &maps[i], GST_MAP_WRITE);
+    }
+    for (size_t i = 0; i < count; i++) {
+        Participant *p = participants[i].get();
+        bool ready = p->queue.pop(p->frame);
+        if (!ready) stats.missing++;
+        mix_inputs[i] = {ready ? p->frame : NULL, p->gain};
+        mix_outputs[i] = (int16_t *)maps[i + 1].data;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    mixer->mix(mix_inputs.data(), count, mic, 1.0f, (int16_t *)maps[0].data, mix_outputs.data());
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    stats.ticks++;
+    total_mix_us += us;
+    stats.avg_mix_us = total_mix_us / stats.ticks;
+    if (us > stats.max_mix_us) stats.max_mix_us = us;
+
+    // push_buffer takes ownership and only queues, so it is fine under the lock
+    for (size_t i = 0; i <= count; i++) gst_buffer_unmap(buffers[i], &maps[i]);
+    gst_app_src_push_buffer(GST_APP_SRC(speaker), buffers[0]);
+    for (size_t i = 0; i < count; i++) {
+        gst_app_src_push_buffer(GST_APP_SRC(participants[i]->mix_out), buffers[i + 1]);
+    }
+}
+
+// The microphone is the conference clock: every 10 ms it delivers is one tick
+static GstFlowReturn on_microphone(GstAppSink *sink, gpointer) {
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (sample == NULL) return GST_FLOW_EOS;
+
+    GstMapInfo map;
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        std::lock_guard<std::mutex> guard(room_lock);
+        queue_push(mic_queue, map);
+        while (mic_queue.pop(mic_frame)) tick(mic_frame);
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// Decoded audio from one participant
+static GstFlowReturn on_decoded(GstAppSink *sink, gpointer data) {
+    Participant *p = (Participant *)data;
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (sample == NULL) return GST_FLOW_EOS;
+
+    GstMapInfo map;
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+        std::lock_guard<std::mutex> guard(room_lock);
+        queue_push(p->queue, map);
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+// srtpdec asks when the participant's first packet arrives and again after
+// clear-keys. Without its key yet the packets are dropped.
+static GstCaps *on_request_key(GstElement *, guint, gpointer data) {
+    Participant *p = (Participant *)data;
+    std::lock_guard<std::mutex> guard(room_lock);
+    if (!p->keyed) {
+        stats.unkeyed++;
+        return NULL;
+    }
+    GstBuffer *key = gst_buffer_new_allocate(NULL, SRTP_MASTER_SIZE, NULL);
+    gst_buffer_fill(key, 0, p->receive_key, SRTP_MASTER_SIZE);
+    GstCaps *caps = gst_caps_new_simple("application/x-srtp", "srtp-key", GST_TYPE_BUFFER, key,
+                                        "srtp-cipher", G_TYPE_STRING, "aes-256-gcm", "srtp-auth", G_TYPE_STRING, "null",
+                                        "srtcp-cipher", G_TYPE_STRING, "aes-256-gcm", "srtcp-auth", G_TYPE_STRING, "null",
+                                        NULL);
+    gst_buffer_unref(key);
+    return caps;
+}
+
+// Everyone sends to the one port; route each packet to its sender's decoder
+static GstFlowReturn on_rtp(GstAppSink *sink, gpointer) {
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (sample == NULL) return GST_FLOW_EOS;
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    GstNetAddressMeta *meta = gst_buffer_get_net_address_meta(buffer);
+    if (meta != NULL && G_IS_INET_SOCKET_ADDRESS(meta->addr)) {
+        GInetAddress *from = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(meta->addr));
+        std::lock_guard<std::mutex> guard(room_lock);
+        Participant *p = find(from);
+        if (p != NULL) gst_app_src_push_buffer(GST_APP_SRC(p->rtp_in), gst_buffer_ref(buffer));
+        else stats.foreign++;
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+static gboolean on_bus_message(GstBus *, GstMessage *message, gpointer) {
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gchar *debug = NULL;
+        gst_message_parse_error(message, &error, &debug);
+        g_warning("Conference pipeline %s: %s", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), error->message);
+        g_error_free(error);
+        g_free(debug);
+    }
+    return TRUE;
+}
+
+static GstElement *build(const std::string &description) {
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error != NULL) {
+        g_warning("Failed to create conference pipeline: %s", error->message);
+        g_error_free(error);
+        if (pipeline) gst_object_unref(pipeline);
+        return NULL;
+    }
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_add_watch(bus, on_bus_message, NULL);
+    gst_object_unref(bus);
+    return pipeline;
+}
+
+static void destroy(GstElement **pipeline) {
+    if (*pipeline == NULL) return;
+    gst_element_set_state(*pipeline, GST_STATE_NULL);
+    GstBus *bus = gst_element_get_bus(*pipeline);
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+    gst_object_unref(*pipeline);
+    *pipeline = NULL;
+}
+
+static void watch_sink(GstElement *pipeline, const char *name, GstFlowReturn (*callback)(GstAppSink *, gpointer),
+                   gpointer data) {
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.new_sample = callback;
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, data, NULL);
+    gst_object_unref(sink);
+}
+
+// Stopping the pipeline first joins its streaming threads, after which
+// nothing else refers to the participant
+static void destroy_participant(std::unique_ptr<Participant> p) {
+    destroy(&p->pipeline);
+    if (p->rtp_in) gst_object_unref(p->rtp_in);
+    if (p->decrypt) gst_object_unref(p->decrypt);
+    if (p->mix_out) gst_object_unref(p->mix_out);
+    if (p->addr) g_object_unref(p->addr);
+}
+
+bool conference_start(int port) {
+    if (room != NULL) return true;
+
+    // Live appsrcs stamp buffers on arrival; the sinks play them as they come
+    room = build(
+        "udpsrc port=" + std::to_string(port) + " caps=\"" + CONFERENCE_SRTP_CAPS + "\" ! "
+        "appsink name=rtp sync=false "
+        "autoaudiosrc ! audioconvert ! audioresample ! " + CONFERENCE_PCM_CAPS + " ! "
+        "appsink name=mic sync=false "
+        "appsrc name=speaker caps=\"" + CONFERENCE_PCM_CAPS + "\" format=time is-live=true do-timestamp=true ! "
+        "audioconvert ! audioresample ! autoaudiosink sync=false");
+    if (room == NULL) return false;
+
+    speaker = gst_bin_get_by_name(GST_BIN(room), "speaker");
+    watch_sink(room, "rtp", on_rtp, NULL);
+    watch_sink(room, "mic", on_microphone, NULL);
+
+    // Every tick's output frames; they come back as the speaker and the
+    // encoders release them
+    frame_pool = gst_buffer_pool_new();
+    GstStructure *config = gst_buffer_pool_get_config(frame_pool);
+    GstCaps *caps = gst_caps_from_string(CONFERENCE_PCM_CAPS);
+    gst_buffer_pool_config_set_params(config, caps, FRAME_SAMPLES * sizeof(int16_t), POOL_BUFFERS, 0);
+    gst_caps_unref(caps);
+    if (!gst_buffer_pool_set_config(frame_pool, config) || !gst_buffer_pool_set_active(frame_pool, TRUE)) {
+        g_warning("Conference buffer pool failed to start");
+        conference_stop();
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(room_lock);
+        mixer.reset(new Mixer(FRAME_SAMPLES));
+        reserve_scratch(0);
+        mic_queue.clear();
+        stats = ConferenceStats();
+        total_mix_us = 0;
+        stats.kernels = mix_kernels();
+        stats.active = true;
+    }
+
+    if (gst_element_set_state(room, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_warning("Conference failed to start on port %d", port);
+        conference_stop();
+        return false;
+    }
+    return true;
+}
+
+bool conference_add(const char *host, int port, const uint8_t *send_key, const uint8_t *receive_key) {
+    if (room == NULL || send_key == NULL) return false;
+    GInetAddress *addr = g_inet_address_new_from_string(host);
+    if (addr == NULL) return false;
+    {
+        std::lock_guard<std::mutex> guard(room_lock);
+        if (find(addr) != NULL) {
+            g_object_unref(addr);
+            return true;
+        }
+    }
+
+    std::unique_ptr<Participant> p(new Participant);
+    p->host = host;
+    p->addr = addr;
+    if (receive_key != NULL) {
+        memcpy(p->receive_key, receive_key, SRTP_MASTER_SIZE);
+        p->keyed = true;
+    }
+    p->pipeline = build(
+        std::string("srtpdec name=decrypt srtpenc name=encrypt ") + SRTP_GCM + " "
+        "appsrc name=rtp caps=\"" + CONFERENCE_SRTP_CAPS + "\" format=time is-live=true do-timestamp=true ! "
+        "decrypt.rtp_sink decrypt.rtp_src ! "
+        "rtpjitterbuffer latency=40 drop-on-latency=true ! rtpopusdepay ! opusdec plc=true use-inband-fec=true ! audioconvert ! audioresample ! " +
+        CONFERENCE_PCM_CAPS + " ! appsink name=pcm sync=false "
+        "appsrc name=mix caps=\"" + CONFERENCE_PCM_CAPS + "\" format=time is-live=true do-timestamp=true ! "
+        "audioconvert ! opusenc frame-size=10 inband-fec=true packet-loss-percentage=10 ! rtpopuspay ! "
+        "encrypt.rtp_sink_0 encrypt.rtp_src_0 ! "
+        "udpsink host=" + host + " port=" + std::to_string(port) + " sync=false async=false");
+    if (p->pipeline == NULL) {
+        destroy_participant(std::move(p));
+        return false;
+    }
+    p->rtp_in = gst_bin_get_by_name(GST_BIN(p->pipeline), "rtp");
+    p->decrypt = gst_bin_get_by_name(GST_BIN(p->pipeline), "decrypt");
+    p->mix_out = gst_bin_get_by_name(GST_BIN(p->pipeline), "mix");
+    watch_sink(p->pipeline, "pcm", on_decoded, p.get());
+    g_signal_connect(p->decrypt, "request-key", G_CALLBACK(on_request_key), p.get());
+
+    GstElement *encrypt = gst_bin_get_by_name(GST_BIN(p->pipeline), "encrypt");
+    GstBuffer *key = gst_buffer_new_allocate(NULL, SRTP_MASTER_SIZE, NULL);
+    gst_buffer_fill(key, 0, send_key, SRTP_MASTER_SIZE);
+    g_object_set(encrypt, "key", key, NULL);
+    gst_buffer_unref(key);
+    gst_object_unref(encrypt);
+
+    if (gst_element_set_state(p->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_warning("Failed to add %s to the conference", host);
+        destroy_participant(std::move(p));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(room_lock);
+    reserve_scratch(participants.size() + 1);
+    participants.push_back(std::move(p));
+    stats.participants = participants.size();
+    return true;
+}
+
+void conference_remove(const char *host) {
+    GInetAddress *addr = g_inet_address_new_from_string(host);
+    if (addr == NULL) return;
+
+    std::unique_ptr<Participant> gone;
+    {
+        std::lock_guard<std::mutex> guard(room_lock);
+        for (auto it = participants.begin(); it != participants.end(); ++it) {
+            if (g_inet_address_equal((*it)->addr, addr)) {
+                gone = std::move(*it);
+                participants.erase(it);
+                break;
+            }
+        }
+        stats.participants = participants.size();
+    }
+    g_object_unref(addr);
+    if (gone) destroy_participant(std::move(gone));
+}
+
+void conference_set_receive_key(const char *host, const uint8_t *key) {
+    GInetAddress *addr = g_inet_address_new_from_string(host);
+    if (addr == NULL) return;
+
+    GstElement *decrypt = NULL;
+    {
+        std::lock_guard<std::mutex> guard(room_lock);
+        Participant *p = find(addr);
+        if (p != NULL) {
+            memcpy(p->receive_key, key, SRTP_MASTER_SIZE);
+            p->keyed = true;
+            decrypt = GST_ELEMENT(gst_object_ref(p->decrypt));
+        }
+    }
+    g_object_unref(addr);
+
+    // clear-keys makes srtpdec ask again, outside room_lock since it asks under it
+    if (decrypt != NULL) {
+        g_signal_emit_by_name(decrypt, "clear-keys");
+        gst_object_unref(decrypt);
+    }
+}
+
+bool conference_set_gain(const char *host, float gain) {
+    GInetAddress *addr = g_inet_address_new_from_string(host);
+    if (addr == NULL) return false;
+
+    std::lock_guard<std::mutex> guard(room_lock);
+    Participant *p = find(addr);
+    g_object_unref(addr);
+    if (p == NULL) return false;
+    p->gain = gain;
+    return true;
+}
+
+bool conference_active() {
+    return room != NULL;
+}
+
+void conference_stop() {
+    // The room goes first so no tick runs while participants are torn down
+    destroy(&room);
+    if (speaker) gst_object_unref(speaker);
+    speaker = NULL;
+
+    std::vector<std::unique_ptr<Participant>> gone;
+    {
+        std::lock_guard<std::mutex> guard(room_lock);
+        gone.swap(participants);
+        stats.participants = 0;
+        stats.active = false;
+    }
+    for (auto &p : gone) destroy_participant(std::move(p));
+
+    // Buffers still out are freed as they come back
+    if (frame_pool) {
+        gst_buffer_pool_set_active(frame_pool, FALSE);
+        gst_object_unref(frame_pool);
+        frame_pool = NULL;
+    }
+}
+
+void conference_get_stats(ConferenceStats *out) {
+    std::lock_guard<std::mutex> guard(room_lock);
+    *out = stats;
+    if (out->kernels == NULL) out->kernels = mix_kernels();
+}
@@ -0,0 +1,60 @@
+#ifndef PUTTYNET_CONFERENCE_H
+#define PUTTYNET_CONFERENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypto.h"
+
+// Group calls hosted on this node. Participants are ordinary voice.cpp
+// callers: they send us their microphone and play whatever we send back.
+// Each incoming Opus stream is decoded on its own chain into a shared
+// Mixer; every 10 ms of microphone input drives one mix, which is played
+// here and sent to every participant as their own mix-minus (the room and
+// our microphone, without themselves).
+//
+// Every leg is SRTP with AES-256-GCM, as a one-to-one call is: we send to
+// each participant under a key of our own for that leg, and decrypt what
+// it sends under the key it handed us (conference_set_receive_key()).
+// There is no plain leg; a participant's packets are dropped until its key
+// is known.
+//
+// The conference takes the voice port and the audio devices, so the voice
+// chains must be shut down while it runs.
+
+struct ConferenceStats {
+    size_t participants;
+    uint64_t ticks;          // mixes, one per 10 ms of microphone audio
+    uint64_t missing;        // participant frames not there in time, mixed as silence
+    uint64_t foreign;        // RTP packets from someone not in the conference
+    uint64_t unkeyed;        // srtpdec key requests before the participant sent its key
+    double avg_mix_us;       // Mixer::mix() per tick
+    double max_mix_us;
+    const char *kernels;     // mixing kernels in use
+    bool active;
+};
+
+// Receive on port and open the microphone and speaker
+bool conference_start(int port);
+
+// Add host, which receives its mix-minus on port under send_key
+// (SRTP_MASTER_SIZE bytes). receive_key is the key host sends under, or
+// NULL until it arrives.
+bool conference_add(const char *host, int port, const uint8_t *send_key, const uint8_t *receive_key);
+
+// The master key host sends under; safe from any thread
+void conference_set_receive_key(const char *host, const uint8_t *key);
+
+void conference_remove(const char *host);
+
+// Linear gain applied to host's voice in every mix it is part of
+bool conference_set_gain(const char *host, float gain);
+
+bool conference_active();
+
+// Hang up on everyone and release the port and devices
+void conference_stop();
+
+void conference_get_stats(ConferenceStats *stats);
+
+#endif
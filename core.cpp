@@ -0,0 +1,578 @@
+#include "core.h"
+
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "conference.h"
+#include "crypto.h"
+#include "mesh.h"
+#include "message_log.h"
+#include "messaging.h"
+#include "metrics.h"
+#include "peers.h"
+#include "probes.h"
+#include "reliable.h"
+
+// The call RTT follows the text channel's once a second
+const guint TICK_INTERVAL_SEC = 1;
+
+void core_config_from_env(CoreConfig *config) {
+    // PUTTYNET_DISCOVERY=gossip switches from broadcast heartbeats to SWIM gossip, =mesh to relayed routing
+    const char *discovery = g_getenv("PUTTYNET_DISCOVERY");
+    if (g_strcmp0(discovery, "gossip") == 0) config->discovery = DISCOVERY_GOSSIP;
+    else if (g_strcmp0(discovery, "mesh") == 0) config->discovery = DISCOVERY_MESH;
+
+    // PUTTYNET_VOICE=ultra-low trades FEC for 2.5 ms frames; =default is the old 20 ms / 200 ms setup
+    const char *mode = g_getenv("PUTTYNET_VOICE");
+    if (g_strcmp0(mode, "ultra-low") == 0) config->voice = VOICE_PROFILE_ULTRA_LOW;
+    else if (g_strcmp0(mode, "default") == 0) config->voice = VOICE_PROFILE_DEFAULT;
+
+    const char *metrics = g_getenv("PUTTYNET_METRICS");
+    if (metrics != NULL) config->metrics_path = metrics;
+
+    const char *trace = g_getenv("PUTTYNET_TRACE");
+    if (trace != NULL) config->trace_path = trace;
+
+    const char *wifi = g_getenv("PUTTYNET_WIFI");
+    if (wifi != NULL) config->wifi_interface = wifi;
+}
+
+bool process_memory(ProcessMemory *out) {
+    memset(out, 0, sizeof(*out));
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t kb;
+        if (sscanf(line, "VmRSS: %zu kB", &kb) == 1) out->rss_kb = kb;
+        else if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) out->peak_rss_kb = kb;
+        else if (sscanf(line, "VmData: %zu kB", &kb) == 1) out->heap_kb = kb;
+    }
+    fclose(f);
+    return out->rss_kb != 0;
+}
+
+Core::Core(const CoreConfig &config) : config(config) {}
+
+Core::~Core() {
+    stop();
+    if (loop != NULL) g_main_loop_unref(loop);
+}
+
+// Runs on the messaging thread
+void Core::on_message(const struct sockaddr_in *from, uint64_t sender, uint8_t type, const uint8_t *data,
+                      size_t len, void *user) {
+    Core *core = (Core *)user;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from->sin_addr, ip, sizeof(ip));
+
+    // The key the peer will send its half of a call under; relayed calls
+    // reach voice from the mesh's loopback relay
+    if (type == FRAME_CALL_KEY) {
+        if (core->voice_ready && len == SRTP_MASTER_SIZE) {
+            voice_set_receive_key(mesh_remote_node(from) ? "127.0.0.1" : ip, data);
+            conference_set_receive_key(ip, data);
+        }
+        return;
+    }
+    if (type != FRAME_TEXT) return;
+
+    // Each peer is one conversation, keyed by its node id
+    if (core->history) core->history->append(sender, sender, type, data, len, g_get_real_time() / 1000);
+    if (core->on_text) core->on_text(ip, sender, (const char *)data, len, core->on_text_user);
+}
+
+// The node id is kept in $XDG_DATA_HOME/puttyNet/node-PORT, so a restarted
+// node is the same peer and its conversations stay its own. One per
+// message port, since two nodes on a host cannot share one anyway.
+uint64_t Core::load_node_id() const {
+    char file[32];
+    snprintf(file, sizeof(file), "node-%d", config.message_port);
+    gchar *dir = g_build_filename(g_get_user_data_dir(), "puttyNet", NULL);
+    gchar *path = g_build_filename(dir, file, NULL);
+
+    uint64_t id = 0;
+    gchar *text = NULL;
+    if (g_file_get_contents(path, &text, NULL, NULL)) id = g_ascii_strtoull(text, NULL, 16);
+    g_free(text);
+    if (id == 0) {
+        std::random_device rd;
+        while (id == 0) id = (uint64_t)rd() << 32 | rd();
+        char hex[24];
+        snprintf(hex, sizeof(hex), "%016llx\n", (unsigned long long)id);
+        if (g_mkdir_with_parents(dir, 0700) < 0 || !g_file_set_contents(path, hex, -1, NULL)) {
+            g_warning("Cannot keep the node id in %s; peers will see a new node next run", path);
+        }
+    }
+    g_free(path);
+    g_free(dir);
+    return id;
+}
+
+// History lives in $XDG_DATA_HOME/puttyNet/history
+void Core::open_history() {
+    gchar *dir = g_build_filename(g_get_user_data_dir(), "puttyNet", "history", NULL);
+    history = new MessageLog();
+    if (g_mkdir_with_parents(dir, 0700) < 0 || !history->open(dir)) {
+        g_warning("Message history unavailable in %s", dir);
+        delete history;
+        history = NULL;
+    }
+    g_free(dir);
+}
+
+// Files arrive in $XDG_DOWNLOAD_DIR/puttyNet
+bool Core::start_files() {
+    const char *downloads = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
+    gchar *dir = g_build_filename(downloads ? downloads : g_get_home_dir(), "puttyNet", NULL);
+    bool ok = g_mkdir_with_parents(dir, 0700) == 0 && transfer_listen(config.file_port, dir, peer_known, NULL);
+    if (!ok) g_warning("File transfer unavailable in %s", dir);
+    g_free(dir);
+    return ok;
+}
+
+// Call quality next to network load, so one can be read against the other
+void Core::collect(MetricsWriter &out, void *user) {
+    Core *core = (Core *)user;
+
+    ProcessMemory memory;
+    if (process_memory(&memory)) {
+        out.gauge("puttynet_process_resident_bytes", "Resident memory", memory.rss_kb * 1024.0);
+        out.gauge("puttynet_process_resident_peak_bytes", "Highest resident memory so far",
+                  memory.peak_rss_kb * 1024.0);
+    }
+    out.gauge("puttynet_startup_seconds", "Time Core::start() took", core->started_ms / 1000);
+
+    // Hot-path probes, as quantiles of each histogram
+    static const struct {
+        const char *quantile;
+        double ProbeStats::*value;
+    } quantiles[] = {{"0.5", &ProbeStats::p50_ns}, {"0.9", &ProbeStats::p90_ns}, {"0.99", &ProbeStats::p99_ns},
+                     {"0.999", &ProbeStats::p999_ns}};
+    char labels[96];
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ProbeStats probe;
+        probe_get((Probe)i, &probe);
+        for (const auto &q : quantiles) {
+            snprintf(labels, sizeof(labels), "probe=\"%s\",quantile=\"%s\"", probe_name((Probe)i), q.quantile);
+            out.gauge("puttynet_probe_seconds", "Hot-path latency quantiles", probe.*q.value / 1e9, labels);
+        }
+    }
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ProbeStats probe;
+        probe_get((Probe)i, &probe);
+        snprintf(labels, sizeof(labels), "probe=\"%s\"", probe_name((Probe)i));
+        out.counter("puttynet_probe_count_total", "Hot-path probe samples", probe.count, labels);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        snprintf(labels, sizeof(labels), "counter=\"%s\"", counter_name((Counter)i));
+        out.counter("puttynet_probe_events_total", "Hot-path event counters", counter_get((Counter)i), labels);
+    }
+
+    if (core->voice_ready) {
+        VoiceStats voice;
+        voice_get_stats(&voice);
+        out.gauge("puttynet_voice_in_call", "1 during a one-to-one call", voice.in_call);
+        out.counter("puttynet_voice_packets_received_total", "RTP packets received from the peer",
+                    voice.packets_received);
+        out.gauge("puttynet_voice_packets_lost", "RTP packets expected but not received, per RTCP",
+                  voice.packets_lost);
+        out.counter("puttynet_voice_concealed_total", "Packets lost and concealed by the decoder", voice.concealed);
+        out.counter("puttynet_voice_late_total", "Packets that arrived after their playout time", voice.late);
+        out.counter("puttynet_voice_foreign_total", "Packets dropped for not coming from the peer", voice.foreign);
+        out.gauge("puttynet_voice_peer_loss_ratio", "Loss of our stream in the peer's last receiver report",
+                  voice.peer_loss_percent / 100);
+        out.gauge("puttynet_voice_jitter_seconds", "Interarrival jitter of the peer's stream", voice.jitter_ms / 1000);
+        out.gauge("puttynet_voice_jitter_buffer_seconds", "Jitter buffer latency", voice.jitter_buffer_ms / 1000);
+        out.gauge("puttynet_voice_rtt_seconds", "Round trip from RTCP receiver reports", voice.rtcp_rtt_ms / 1000);
+        out.gauge("puttynet_voice_send_bits_per_second", "Bitrate of the stream we send", voice.send_kbps * 1000);
+        out.gauge("puttynet_voice_receive_bits_per_second", "Bitrate of the stream we receive",
+                  voice.receive_kbps * 1000);
+        out.gauge("puttynet_voice_mouth_to_ear_seconds", "Estimated mouth-to-ear latency",
+                  voice.mouth_to_ear_ms / 1000);
+    }
+
+    if (core->config.discovery == DISCOVERY_MESH) {
+        MeshStats mesh;
+        mesh_get_stats(&mesh);
+        MessagingStats messages;
+        core->messenger->get_stats(&messages);
+        out.gauge("puttynet_mesh_routes", "Nodes reachable through the mesh, neighbours included", mesh.routes);
+        out.counter("puttynet_mesh_relayed_total", "Datagrams forwarded for other nodes", messages.relayed);
+        out.counter("puttynet_mesh_no_route_total", "Relayed datagrams dropped for want of a route",
+                    mesh.no_route + mesh.expired);
+    }
+
+    if (proximity_running()) {
+        ProximityStats proximity;
+        proximity_get_stats(&proximity);
+        out.gauge("puttynet_proximity_devices", "Wi-Fi transmitters with a distance estimate", proximity.devices);
+        out.counter("puttynet_proximity_frames_total", "Frames whose signal went into an estimate", proximity.frames);
+        out.counter("puttynet_proximity_evictions_total", "Transmitters forgotten to make room for new ones",
+                    proximity.evictions);
+    }
+
+    DiscoveryStats discovery;
+    discovery_get_stats(&discovery);
+    out.gauge("puttynet_peers", "Peers in the peer table", peers_count());
+    out.counter("puttynet_discovery_packets_total", "Discovery datagrams received", discovery.packets);
+    out.counter("puttynet_discovery_bytes_total", "Discovery payload bytes received", discovery.bytes);
+    out.counter("puttynet_discovery_drops_total", "Discovery datagrams dropped by the kernel", discovery.drops);
+
+    if (core->reliable) {
+        ReliableStats text;
+        core->reliable->get_stats(&text);
+        out.counter("puttynet_messages_sent_total", "Text messages sent, first transmissions", text.sent);
+        out.counter("puttynet_messages_retransmits_total", "Text messages resent", text.retransmits);
+        out.counter("puttynet_messages_delivered_total", "Text messages delivered in order", text.delivered);
+        out.gauge("puttynet_messages_srtt_seconds", "Smoothed RTT of the last acked peer", text.srtt_us / 1e6);
+    }
+
+    TransferStats files;
+    transfer_get_stats(&files);
+    out.counter("puttynet_transfer_sent_bytes_total", "File chunk bytes sent, resends included", files.bytes_sent);
+    out.counter("puttynet_transfer_received_bytes_total", "File chunk bytes received", files.bytes_received);
+    out.counter("puttynet_transfer_resent_chunks_total", "File chunks sent again after a bad hash",
+                files.chunks_resent);
+    out.counter("puttynet_transfer_resumed_chunks_total", "File chunks kept from an earlier attempt",
+                files.chunks_resumed);
+    out.counter("puttynet_transfer_completed_total", "File transfers finished, both directions",
+                files.sends_completed + files.receives_completed);
+    out.counter("puttynet_transfer_failed_total", "File transfers that broke off or were refused", files.failed);
+    out.gauge("puttynet_transfers_active", "File transfers in flight", files.active);
+}
+
+// Metrics are served on $XDG_RUNTIME_DIR/puttyNet/metrics.sock unless the
+// config names a path
+void Core::start_metrics() {
+    if (config.metrics_path == "-") return;
+
+    gchar *dir = g_build_filename(g_get_user_runtime_dir(), "puttyNet", NULL);
+    std::string path = config.metrics_path;
+    if (path.empty()) {
+        gchar *socket_path = g_build_filename(dir, "metrics.sock", NULL);
+        path = socket_path;
+        g_free(socket_path);
+    }
+    metrics_register(collect, this);
+    if ((config.metrics_path.empty() && g_mkdir_with_parents(dir, 0700) < 0) || !metrics_start(path.c_str())) {
+        g_warning("Metrics unavailable on %s", path.c_str());
+    }
+    g_free(dir);
+}
+
+// The text channel's RTT stands in for the voice path's
+gboolean Core::on_tick(gpointer user) {
+    Core *core = (Core *)user;
+    struct sockaddr_in to;
+    if (!core->call_peer.empty() && core->message_address(core->call_peer, &to)) {
+        voice_set_rtt(core->reliable->srtt(&to) / 1000.0);
+    }
+    return TRUE;
+}
+
+bool Core::start() {
+    if (running) return true;
+    gint64 start = g_get_monotonic_time();
+    if (!config.trace_path.empty()) trace_enable(true);
+
+    Announcement self;
+    memset(&self, 0, sizeof(self));
+
+    // The same id every run. Peers only take announcements newer than the
+    // last they saw from it, so the sequence starts from the clock: a
+    // heartbeat every few seconds never catches up with it.
+    self.node_id = load_node_id();
+    self.seq = (uint32_t)(g_get_real_time() / G_USEC_PER_SEC);
+    self_id = self.node_id;
+    g_strlcpy(self.name, config.name.empty() ? g_get_host_name() : config.name.c_str(), sizeof(self.name));
+
+    // Messages and calls are encrypted under keys agreed with each peer
+    // from the public key in its announcements; plaintext is not an option
+    if (!crypto_init()) {
+        g_warning("No key pair; not starting in the clear");
+        return false;
+    }
+    self.capabilities |= CAP_SECURE;
+    memcpy(self.public_key, crypto_public_key(), sizeof(self.public_key));
+
+    // Voice chains are built now and kept warm, so a call starts in milliseconds
+    if (config.audio) {
+        gst_init(NULL, NULL);
+        voice_ready = voice_init(config.voice_port, config.voice);
+        if (voice_ready) self.capabilities |= CAP_VOICE;
+        else g_warning("Voice chat unavailable");
+    }
+
+    // Messaging shares the node id so peers can match messages to announcements
+    // Text goes through the reliable layer: in order, resent on loss
+    if (config.history) open_history();
+    messenger = new Messenger(self.node_id);
+    messenger->set_keys(peer_public_key, NULL);
+    if (config.discovery == DISCOVERY_MESH) {
+        // Relaying works without the voice relay; only calls to far peers need it
+        if (!mesh_start(config.message_port, config.voice_port)) g_warning("Calls through the mesh unavailable");
+        messenger->set_relay(mesh_route, mesh_relay, NULL);
+    }
+    reliable = new Reliable(messenger, on_message, this);
+    reliable->set_admit(peer_known, NULL);
+    if (messenger->start(config.message_port, Reliable::on_message, reliable)) {
+        self.capabilities |= CAP_MESSAGE;
+    }
+    if (config.files && start_files()) self.capabilities |= CAP_FILE;
+
+    // Capturing needs CAP_NET_RAW and an interface in monitor mode; without
+    // them peers simply have no distance
+    if (!config.wifi_interface.empty() && !proximity_start(config.wifi_interface.c_str(), ProximityConfig())) {
+        g_warning("Peer distances unavailable on %s", config.wifi_interface.c_str());
+    }
+
+    running = true;
+    if (!discovery_start(config.discovery_port, &self, config.discovery)) {
+        g_warning("Discovery unavailable on port %d", config.discovery_port);
+        stop();
+        return false;
+    }
+
+    tick_timer = g_timeout_add_seconds(TICK_INTERVAL_SEC, on_tick, this);
+    start_metrics();
+    started_ms = (g_get_monotonic_time() - start) / 1000.0;
+    return true;
+}
+
+void Core::stop() {
+    if (!running) return;
+    running = false;
+
+    // Metrics first: collect() reads everything below
+    metrics_stop();
+    if (tick_timer) g_source_remove(tick_timer);
+    tick_timer = 0;
+
+    conference_stop();
+    if (voice_ready) voice_shutdown();
+    voice_ready = false;
+    call_peer.clear();
+
+    // Sends are cancelled; the peers keep what they have for a later resume
+    transfer_stop();
+    proximity_stop();
+
+    discovery_stop();
+    messenger->stop();     // before the Reliable its tick points at goes
+    mesh_stop();
+    delete reliable;
+    delete messenger;
+    reliable = NULL;
+    messenger = NULL;
+    if (history) history->close();
+    delete history;
+    history = NULL;
+
+    if (!config.trace_path.empty()) {
+        trace_enable(false);
+        if (!trace_write_chrome(config.trace_path.c_str())) g_warning("Failed to write %s", config.trace_path.c_str());
+    }
+}
+
+void Core::run() {
+    if (loop == NULL) loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+}
+
+void Core::quit() {
+    if (loop != NULL) g_main_loop_quit(loop);
+}
+
+void Core::set_text_handler(text_handler handler, void *user) {
+    on_text = handler;
+    on_text_user = user;
+}
+
+bool Core::message_address(const std::string &ip, struct sockaddr_in *to) const {
+    memset(to, 0, sizeof(*to));
+    to->sin_family = AF_INET;
+    to->sin_port = htons(config.message_port);
+    return reliable != NULL && inet_pton(AF_INET, ip.c_str(), &to->sin_addr) == 1;
+}
+
+// The key announced from addr's host; the messenger asks on its own thread
+bool Core::peer_public_key(const struct sockaddr_in *addr, uint8_t *public_key, void *) {
+    PeerKey key;
+    peer_key_init(&key, (const struct sockaddr *)addr, 0);
+    PeerReader reader;
+    const Node *node = reader->table.find_addr(key.addr);
+    if (node == NULL || !(node->capabilities & CAP_SECURE)) return false;
+    memcpy(public_key, node->public_key, sizeof(node->public_key));
+    return true;
+}
+
+// Node id of the peer announcing from addr, or 0
+static uint64_t peer_node_id(const struct sockaddr_in *addr) {
+    PeerKey key;
+    peer_key_init(&key, (const struct sockaddr *)addr, 0);
+    PeerReader reader;
+    const Node *node = reader->table.find_addr(key.addr);
+    return node ? node->key.node_id : 0;
+}
+
+size_t Core::history_count(const std::string &ip) {
+    struct sockaddr_in addr;
+    if (!message_address(ip, &addr) || history == NULL) return 0;
+    uint64_t peer = peer_node_id(&addr);
+    return peer ? history->count(peer) : 0;
+}
+
+size_t Core::read_history(const std::string &ip, size_t first, size_t n, std::vector<HistoryMessage> *out) {
+    out->clear();
+    struct sockaddr_in addr;
+    if (!message_address(ip, &addr) || history == NULL) return 0;
+    uint64_t peer = peer_node_id(&addr);
+    if (peer == 0) return 0;
+
+    std::vector<const LogRecord *> records(n);
+    records.resize(history->read(peer, first, records.data(), n));
+    for (const LogRecord *r : records) {
+        if (r->type != FRAME_TEXT) continue;
+        out->emplace_back();
+        HistoryMessage &m = out->back();
+        m.outgoing = r->sender == self_id;
+        m.time_ms = r->time_ms;
+        m.text.assign((const char *)(r + 1), r->length);
+    }
+    return out->size();
+}
+
+// Reliable keeps sequence state only for hosts in the discovery table
+bool Core::peer_known(const struct sockaddr_in *addr, void *) {
+    return peer_node_id(addr) != 0;
+}
+
+bool Core::send_text(const std::string &ip, const std::string &text) {
+    struct sockaddr_in to;
+    if (!message_address(ip, &to)) return false;
+    if (!reliable->send(&to, FRAME_TEXT, text.data(), text.size())) return false;
+
+    uint64_t peer = peer_node_id(&to);
+    if (history && peer) {
+        history->append(peer, self_id, FRAME_TEXT, text.data(), text.size(), g_get_real_time() / 1000);
+    }
+    return true;
+}
+
+// A fresh SRTP key for a call or a conference leg, handed over the sealed
+// text channel. A peer already in a call with us takes it as our new key.
+bool Core::send_call_key(const std::string &ip, uint8_t *send_key) {
+    struct sockaddr_in to;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    if (!message_address(ip, &to) || !peer_public_key(&to, public_key, NULL)) {
+        g_warning("No key for %s; not calling in the clear", ip.c_str());
+        return false;
+    }
+    if (!crypto_random(send_key, SRTP_MASTER_SIZE) ||
+        !reliable->send(&to, FRAME_CALL_KEY, send_key, SRTP_MASTER_SIZE)) {
+        g_warning("Failed to send a call key to %s", ip.c_str());
+        return false;
+    }
+    return true;
+}
+
+// One SRTP leg of the conference; host's own key is used once it has sent
+// one, from the call we had or when it calls back
+bool Core::add_to_conference(const std::string &ip) {
+    uint8_t send_key[SRTP_MASTER_SIZE];
+    uint8_t receive_key[SRTP_MASTER_SIZE];
+    if (!send_call_key(ip, send_key)) return false;
+    bool keyed = voice_get_receive_key(ip.c_str(), receive_key);
+    return conference_add(ip.c_str(), config.voice_port, send_key, keyed ? receive_key : NULL);
+}
+
+// Calling a second node during a call turns it into a conference hosted
+// here. The others stay one-to-one calls to us, each under keys of its own.
+bool Core::start_conference(const std::string &first, const std::string &second) {
+    voice_shutdown();   // the conference needs the voice port and the audio devices
+    if (!conference_start(config.voice_port)) {
+        voice_init(config.voice_port, config.voice);
+        return false;
+    }
+    if (!add_to_conference(first)) g_warning("Failed to keep %s in the conference", first.c_str());
+    if (!add_to_conference(second)) g_warning("Failed to add %s to the conference", second.c_str());
+    call_peer.clear();
+    return true;
+}
+
+bool Core::call(const std::string &ip) {
+    if (!voice_ready) return false;
+
+    // A peer behind relays is called through the mesh's loopback relay,
+    // which carries one call; conferences need everyone in reach
+    struct sockaddr_in to;
+    if (!message_address(ip, &to)) return false;
+    uint64_t remote = mesh_remote_node(&to);
+    if (remote && (conference_active() || (!call_peer.empty() && call_peer != ip))) {
+        g_warning("%s is only reachable through relays; not adding it to a conference", ip.c_str());
+        return false;
+    }
+
+    if (conference_active()) {
+        if (!add_to_conference(ip)) {
+            g_warning("Failed to add %s to the conference", ip.c_str());
+            return false;
+        }
+        return true;
+    }
+    if (!call_peer.empty() && call_peer != ip) {
+        if (!start_conference(call_peer, ip)) {
+            g_warning("Failed to start a conference with %s and %s", call_peer.c_str(), ip.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // A fresh SRTP key for every call
+    uint8_t send_key[SRTP_MASTER_SIZE];
+    if (!send_call_key(ip, send_key)) return false;
+    mesh_set_call(remote);
+    if (!(remote ? voice_start("127.0.0.1", MESH_VOICE_PORT, send_key)
+                 : voice_start(ip.c_str(), config.voice_port, send_key))) {
+        g_warning("Failed to start voice chat with %s", ip.c_str());
+        return false;
+    }
+    call_peer = ip;
+    return true;
+}
+
+void Core::hang_up() {
+    if (conference_active()) {
+        conference_stop();
+        voice_init(config.voice_port, config.voice);
+    } else if (voice_ready) {
+        voice_stop();
+    }
+    mesh_set_call(0);
+    call_peer.clear();
+}
+
+uint64_t Core::send_file(const std::string &ip, const std::string &path, transfer_done done, void *user) {
+    if (!running) return 0;
+    uint64_t id = transfer_send(ip.c_str(), config.file_port, path.c_str(), TRANSFER_STREAMS, done, user);
+    if (id == 0) g_warning("Cannot send %s", path.c_str());
+    return id;
+}
+
+bool Core::peer_distance(const std::string &ip, ProximityEstimate *out) const {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    return inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) == 1 && proximity_peer(&addr, out);
+}
+
+CallState Core::call_state() const {
+    if (conference_active()) return CALL_CONFERENCE;
+    return call_peer.empty() ? CALL_IDLE : CALL_ONE_TO_ONE;
+}
@@ -0,0 +1,159 @@
+#ifndef PUTTYNET_CORE_H
+#define PUTTYNET_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <glib.h>
+
+#include "discovery.h"
+#include "proximity.h"
+#include "transfer.h"
+#include "voice.h"
+
+class Messenger;
+class Reliable;
+class MessageLog;
+class MetricsWriter;
+
+// libputtynet: a whole node without a display. Discovery, reliable text
+// with its history, voice calls and conferences, file transfer and the
+// metrics endpoint, behind one object. puttyNet is a GTK client of it and
+// puttynetd runs it headless.
+//
+// The modules underneath keep their state in globals, so there is one Core
+// per process. Its timers and the GStreamer bus watches run on the default
+// GLib main context: run() drives it on its own, and gtk_main() drives it
+// just as well in the GTK client. The sockets have threads of their own.
+
+const int MESSAGE_PORT = 12345;
+const int VOICE_PORT = 12346;
+const int DISCOVERY_PORT = 12347;
+const int FILE_PORT = 12348;
+
+struct CoreConfig {
+    int message_port = MESSAGE_PORT;
+    int voice_port = VOICE_PORT;
+    int discovery_port = DISCOVERY_PORT;
+    int file_port = FILE_PORT;
+    DiscoveryMode discovery = DISCOVERY_BROADCAST;
+    VoiceProfile voice = VOICE_PROFILE_LOW_LATENCY;
+    bool audio = true;               // false: no GStreamer, no calls; for servers without sound devices
+    bool history = true;             // keep text in $XDG_DATA_HOME/puttyNet/history
+    bool files = true;               // accept files into the downloads directory, under puttyNet
+    std::string name;                // announced name, the host name if empty
+    std::string metrics_path;        // $XDG_RUNTIME_DIR/puttyNet/metrics.sock if empty, none if "-"
+    std::string trace_path;          // trace spans on, written here as Chrome trace JSON by stop()
+    std::string wifi_interface;      // monitor-mode interface to estimate peer distances from, none if empty
+};
+
+// PUTTYNET_DISCOVERY=gossip|mesh, PUTTYNET_VOICE=ultra-low|default,
+// PUTTYNET_METRICS=path, PUTTYNET_TRACE=path and PUTTYNET_WIFI=interface
+// over the defaults
+void core_config_from_env(CoreConfig *config);
+
+// Memory of this process from /proc/self/status, in kB
+struct ProcessMemory {
+    size_t rss_kb;           // resident now
+    size_t peak_rss_kb;      // high water mark
+    size_t heap_kb;          // data segment, which is where malloc grows
+};
+bool process_memory(ProcessMemory *out);
+
+// One message of a conversation, copied out of the history
+struct HistoryMessage {
+    bool outgoing;           // sent from here
+    uint64_t time_ms;        // wall clock
+    std::string text;
+};
+
+enum CallState {
+    CALL_IDLE,
+    CALL_ONE_TO_ONE,
+    CALL_CONFERENCE,
+};
+
+class Core {
+public:
+    // Runs on the messaging thread, in order per peer. Install before start().
+    typedef void (*text_handler)(const char *ip, uint64_t sender, const char *text, size_t len, void *user);
+
+    explicit Core(const CoreConfig &config);
+    ~Core();
+
+    Core(const Core &) = delete;
+    Core &operator=(const Core &) = delete;
+
+    // Brings the node onto the network. Audio that fails to start only
+    // leaves the node without calls.
+    bool start();
+    void stop();
+
+    // The main loop, until quit(); for clients without one of their own
+    void run();
+    void quit();
+
+    void set_text_handler(text_handler handler, void *user);
+    bool send_text(const std::string &ip, const std::string &text);
+
+    // The stored conversation with the peer at ip, oldest first; empty
+    // without history or while ip is not a discovered peer. Call from the
+    // thread that runs the main loop, where the history is compacted.
+    size_t history_count(const std::string &ip);
+    size_t read_history(const std::string &ip, size_t first, size_t n, std::vector<HistoryMessage> *out);
+
+    // Call ip. During a one-to-one call this turns into a conference hosted
+    // here; during a conference ip joins it.
+    bool call(const std::string &ip);
+    void hang_up();
+    CallState call_state() const;
+
+    // Send a file to ip in the background; done runs on the transfer's
+    // thread. Returns the id for transfer_progress(), or 0.
+    uint64_t send_file(const std::string &ip, const std::string &path, transfer_done done = NULL,
+                       void *user = NULL);
+
+    // How far away ip is, from the signal of its frames on the monitor
+    // interface; false without one, or if ip has not been heard
+    bool peer_distance(const std::string &ip, ProximityEstimate *out) const;
+
+    // The same across restarts; conversations are keyed by it
+    uint64_t node_id() const { return self_id; }
+    MessageLog *message_history() { return history; }
+    double startup_ms() const { return started_ms; }
+
+private:
+    static void on_message(const struct sockaddr_in *from, uint64_t sender, uint8_t type,
+                           const uint8_t *data, size_t len, void *user);
+    static gboolean on_tick(gpointer user);
+    static bool peer_public_key(const struct sockaddr_in *addr, uint8_t *public_key, void *user);
+    static bool peer_known(const struct sockaddr_in *addr, void *user);
+    static void collect(MetricsWriter &out, void *user);
+
+    uint64_t load_node_id() const;
+    void open_history();
+    bool start_files();
+    void start_metrics();
+    bool send_call_key(const std::string &ip, uint8_t *send_key);
+    bool add_to_conference(const std::string &ip);
+    bool start_conference(const std::string &first, const std::string &second);
+    bool message_address(const std::string &ip, struct sockaddr_in *to) const;
+
+    CoreConfig config;
+    uint64_t self_id = 0;
+    Messenger *messenger = NULL;
+    Reliable *reliable = NULL;
+    MessageLog *history = NULL;
+    GMainLoop *loop = NULL;
+    guint tick_timer = 0;
+    bool voice_ready = false;
+    bool running = false;
+    double started_ms = 0;
+
+    text_handler on_text = NULL;
+    void *on_text_user = NULL;
+    std::string call_peer;   // the one-to-one call, empty when idle or in a conference
+};
+
+#endif
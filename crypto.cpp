@@ -0,0 +1,209 @@
+#include "crypto.h"
+
+#include <atomic>
+#include <string.h>
+#include <stdio.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// HKDF info; a new wire format gets a new label so old keys never fit it
+static const char KEY_LABEL[] = "puttyNet session keys v1";
+
+static EVP_PKEY *self_key = NULL;
+static uint8_t self_public[CRYPTO_PUBLIC_KEY_SIZE];
+static CryptoCipher forced = CIPHER_NONE;
+static std::atomic<uint64_t> next_packet(1);
+
+static CryptoCipher best_cipher() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")) return CIPHER_AES_256_GCM;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_AES) return CIPHER_AES_256_GCM;
+#endif
+    return CIPHER_CHACHA20_POLY1305;
+}
+
+static CryptoCipher preferred = best_cipher();
+
+bool crypto_init() {
+    if (self_key != NULL) return true;
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    bool ok = ctx != NULL && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_keygen(ctx, &self_key) > 0;
+    EVP_PKEY_CTX_free(ctx);
+
+    size_t len = sizeof(self_public);
+    if (ok) ok = EVP_PKEY_get_raw_public_key(self_key, self_public, &len) > 0 && len == sizeof(self_public);
+    if (!ok) {
+        fprintf(stderr, "X25519 key generation failed\n");
+        EVP_PKEY_free(self_key);
+        self_key = NULL;
+    }
+    return ok;
+}
+
+const uint8_t *crypto_public_key() {
+    return self_key != NULL ? self_public : NULL;
+}
+
+CryptoCipher crypto_cipher() {
+    return forced != CIPHER_NONE ? forced : preferred;
+}
+
+const char *crypto_cipher_name(CryptoCipher cipher) {
+    switch (cipher) {
+    case CIPHER_AES_256_GCM: return "aes-256-gcm";
+    case CIPHER_CHACHA20_POLY1305: return "chacha20-poly1305";
+    default: return "none";
+    }
+}
+
+void crypto_force_cipher(CryptoCipher cipher) {
+    forced = cipher;
+}
+
+static bool x25519(const uint8_t *peer_public, uint8_t *shared, size_t len) {
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_public, CRYPTO_PUBLIC_KEY_SIZE);
+    EVP_PKEY_CTX *ctx = peer ? EVP_PKEY_CTX_new(self_key, NULL) : NULL;
+    size_t out = len;
+    // libcrypto refuses small-order points, whose secret would be all zeros
+    bool ok = ctx != NULL && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+              EVP_PKEY_derive(ctx, shared, &out) > 0 && out == len;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return ok;
+}
+
+static bool hkdf(const uint8_t *secret, size_t secret_len, const uint8_t *salt, size_t salt_len,
+                 uint8_t *out, size_t out_len) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    size_t len = out_len;
+    bool ok = ctx != NULL && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, (int)salt_len) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, (int)secret_len) > 0 &&
+              EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char *)KEY_LABEL, sizeof(KEY_LABEL) - 1) > 0 &&
+              EVP_PKEY_derive(ctx, out, &len) > 0 && len == out_len;
+    EVP_PKEY_CTX_free(ctx);
+    return ok;
+}
+
+// Output blocks, in order; "low" is whichever end has the smaller public key
+struct KeyBlock {
+    uint8_t key[CRYPTO_KEY_SIZE];
+    uint8_t salt[CRYPTO_SALT_SIZE];
+};
+struct KeyMaterial {
+    KeyBlock low_to_high;
+    KeyBlock high_to_low;
+};
+
+bool crypto_derive(const uint8_t *peer_public, SessionKeys *keys) {
+    if (self_key == NULL) return false;
+    int order = memcmp(self_public, peer_public, CRYPTO_PUBLIC_KEY_SIZE);
+
+    uint8_t shared[32];
+    if (!x25519(peer_public, shared, sizeof(shared))) return false;
+
+    // Both public keys as the salt, in the same order at both ends
+    bool low = order <= 0;
+    uint8_t salt[2 * CRYPTO_PUBLIC_KEY_SIZE];
+    memcpy(salt, low ? self_public : peer_public, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(salt + CRYPTO_PUBLIC_KEY_SIZE, low ? peer_public : self_public, CRYPTO_PUBLIC_KEY_SIZE);
+
+    KeyMaterial m;
+    bool ok = hkdf(shared, sizeof(shared), salt, sizeof(salt), (uint8_t *)&m, sizeof(m));
+    OPENSSL_cleanse(shared, sizeof(shared));
+    if (!ok) return false;
+
+    const KeyBlock &send = low ? m.low_to_high : m.high_to_low;
+    const KeyBlock &receive = order == 0 ? send : low ? m.high_to_low : m.low_to_high;
+    memcpy(keys->send_key, send.key, sizeof(keys->send_key));
+    memcpy(keys->send_salt, send.salt, sizeof(keys->send_salt));
+    memcpy(keys->receive_key, receive.key, sizeof(keys->receive_key));
+    memcpy(keys->receive_salt, receive.salt, sizeof(keys->receive_salt));
+    OPENSSL_cleanse(&m, sizeof(m));
+    return true;
+}
+
+bool crypto_random(uint8_t *out, size_t len) {
+    return RAND_bytes(out, (int)len) == 1;
+}
+
+uint64_t crypto_reserve_packets(size_t count) {
+    return next_packet.fetch_add(count, std::memory_order_relaxed);
+}
+
+Aead::~Aead() {
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+// The key schedule runs once here; each packet only sets its nonce
+bool Aead::init(CryptoCipher cipher, const uint8_t *key, const uint8_t *nonce_salt) {
+    const EVP_CIPHER *evp = cipher == CIPHER_AES_256_GCM ? EVP_aes_256_gcm()
+                          : cipher == CIPHER_CHACHA20_POLY1305 ? EVP_chacha20_poly1305() : NULL;
+    if (evp == NULL) return false;
+    if (ctx == NULL) ctx = EVP_CIPHER_CTX_new();
+    else EVP_CIPHER_CTX_reset(ctx);
+
+    kind = CIPHER_NONE;
+    if (ctx == NULL || EVP_CipherInit_ex(ctx, evp, NULL, NULL, NULL, 1) <= 0 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, CRYPTO_NONCE_SIZE, NULL) <= 0 ||
+        EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, -1) <= 0) {
+        return false;
+    }
+    memcpy(salt, nonce_salt, sizeof(salt));
+    kind = cipher;
+    return true;
+}
+
+// Salt, then the packet number big-endian; a key never sees a nonce twice
+// as long as packet numbers do not repeat
+void Aead::nonce(uint64_t packet, uint8_t *out) const {
+    memcpy(out, salt, CRYPTO_SALT_SIZE);
+    for (int i = CRYPTO_NONCE_SIZE - 1; i >= (int)CRYPTO_SALT_SIZE; i--, packet >>= 8) out[i] = (uint8_t)packet;
+}
+
+bool Aead::seal(uint64_t packet, const uint8_t *aad, size_t aad_len, uint8_t *data, size_t len, uint8_t *tag) {
+    uint8_t iv[CRYPTO_NONCE_SIZE];
+    nonce(packet, iv);
+    int out;
+    return kind != CIPHER_NONE && EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1) > 0 &&
+           EVP_CipherUpdate(ctx, NULL, &out, aad, (int)aad_len) > 0 &&
+           EVP_CipherUpdate(ctx, data, &out, data, (int)len) > 0 &&
+           EVP_CipherFinal_ex(ctx, data + out, &out) > 0 &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CRYPTO_TAG_SIZE, tag) > 0;
+}
+
+bool Aead::open(uint64_t packet, const uint8_t *aad, size_t aad_len, uint8_t *data, size_t len, const uint8_t *tag) {
+    uint8_t iv[CRYPTO_NONCE_SIZE];
+    nonce(packet, iv);
+    int out;
+    return kind != CIPHER_NONE && EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 0) > 0 &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CRYPTO_TAG_SIZE, (void *)tag) > 0 &&
+           EVP_CipherUpdate(ctx, NULL, &out, aad, (int)aad_len) > 0 &&
+           EVP_CipherUpdate(ctx, data, &out, data, (int)len) > 0 &&
+           EVP_CipherFinal_ex(ctx, data + out, &out) > 0;
+}
+
+bool ReplayWindow::check(uint64_t packet) const {
+    if (packet > highest) return true;
+    uint64_t age = highest - packet;
+    return age < 64 && !(seen & (1ull << age));
+}
+
+void ReplayWindow::accept(uint64_t packet) {
+    if (packet > highest) {
+        uint64_t shift = packet - highest;
+        seen = shift < 64 ? seen << shift | 1 : 1;
+        highest = packet;
+    } else {
+        seen |= 1ull << (highest - packet);
+    }
+}
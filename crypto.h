@@ -0,0 +1,120 @@
+#ifndef PUTTYNET_CRYPTO_H
+#define PUTTYNET_CRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-peer keys from the announcements. Every process makes a fresh X25519
+// key pair at start and announces the public half (announce.h); two nodes
+// that have heard each other share a secret without a round trip. HKDF-SHA256
+// stretches it into a key and nonce salt for each direction of messaging.
+//
+// Messages are sealed with an AEAD through libcrypto, which picks the
+// AES-NI/VAES and CLMUL code on x86 and the ARMv8 crypto extensions on
+// arm64. Without AES instructions ChaCha20-Poly1305 is faster, so the
+// sender picks by CPU and names the cipher in the datagram; every node
+// opens both.
+//
+// Each datagram needs its own tag, since any of them may be lost, so the
+// cipher cannot be batched across datagrams. Sealing then costs a few
+// hundred nanoseconds of libcrypto dispatch per datagram, plus the cipher
+// run over every byte at both ends. For small messages that is tens of
+// percent of messaging's CPU time, not a rounding error; bench_crypto
+// measures it, next to the floor the cipher alone sets. Datagrams already
+// leave full and a session is looked up once per run of a flush, so what
+// remains is that floor: about 1.4 GB/s of AES-GCM against roughly 70
+// bytes and 400 ns of plaintext path per small message.
+//
+// Announcements are not signed: a node on the same segment can announce a
+// key in someone else's name. The keys keep out everyone who merely
+// listens, which is what shared Wi-Fi needs.
+//
+// Calls are SRTP with AES-256-GCM. Each end picks a fresh master key for
+// every call and sends it to the other over sealed messaging, so no SRTP
+// key ever outlives the sequence numbers it was used with.
+
+const size_t CRYPTO_PUBLIC_KEY_SIZE = 32;
+const size_t CRYPTO_KEY_SIZE = 32;
+const size_t CRYPTO_SALT_SIZE = 4;      // nonce prefix; the packet number fills the other 8 bytes
+const size_t CRYPTO_NONCE_SIZE = 12;
+const size_t CRYPTO_TAG_SIZE = 16;
+const size_t SRTP_MASTER_SIZE = 44;     // AES-256-GCM: 32 byte key, 12 byte salt
+
+enum CryptoCipher {
+    CIPHER_NONE = 0,
+    CIPHER_AES_256_GCM = 1,
+    CIPHER_CHACHA20_POLY1305 = 2,
+};
+
+// Make this process's key pair; once, before anything is announced
+bool crypto_init();
+const uint8_t *crypto_public_key();
+
+// What this CPU seals fastest, unless crypto_force_cipher() chose
+CryptoCipher crypto_cipher();
+const char *crypto_cipher_name(CryptoCipher cipher);
+
+// For benchmarks: CIPHER_NONE goes back to choosing by CPU
+void crypto_force_cipher(CryptoCipher cipher);
+
+// Everything one peer pair needs, from our side
+struct SessionKeys {
+    uint8_t send_key[CRYPTO_KEY_SIZE];
+    uint8_t send_salt[CRYPTO_SALT_SIZE];
+    uint8_t receive_key[CRYPTO_KEY_SIZE];
+    uint8_t receive_salt[CRYPTO_SALT_SIZE];
+};
+
+// X25519 with the peer's announced key, then HKDF. Both ends derive the
+// same material with send and receive swapped. Our own key is allowed, for
+// endpoints talking to each other within one process: both directions then
+// share a key, which process-wide packet numbers keep safe. Fails for a key
+// that makes a degenerate secret.
+bool crypto_derive(const uint8_t *peer_public, SessionKeys *keys);
+
+// Fresh key material from the system's CSPRNG
+bool crypto_random(uint8_t *out, size_t len);
+
+// Reserve count packet numbers and return the first. They are unique
+// across the process, so no key is ever used twice with the same nonce,
+// however sessions come and go.
+uint64_t crypto_reserve_packets(size_t count);
+
+// One direction of a session: a cipher context keyed once, so sealing a
+// datagram only sets the nonce. Not thread safe.
+class Aead {
+public:
+    Aead() = default;
+    ~Aead();
+
+    bool init(CryptoCipher cipher, const uint8_t *key, const uint8_t *salt);
+    CryptoCipher cipher() const { return kind; }
+
+    // Encrypt data in place and write the tag; aad is authenticated as is
+    bool seal(uint64_t packet, const uint8_t *aad, size_t aad_len, uint8_t *data, size_t len, uint8_t *tag);
+
+    // Decrypt data in place; false, with data garbage, unless the tag matches
+    bool open(uint64_t packet, const uint8_t *aad, size_t aad_len, uint8_t *data, size_t len, const uint8_t *tag);
+
+private:
+    Aead(const Aead &) = delete;
+    Aead &operator=(const Aead &) = delete;
+
+    void nonce(uint64_t packet, uint8_t *out) const;
+
+    struct evp_cipher_ctx_st *ctx = NULL;
+    CryptoCipher kind = CIPHER_NONE;
+    uint8_t salt[CRYPTO_SALT_SIZE] = {0};
+};
+
+// Packet numbers a receiver has accepted: the highest and a bitmap of the
+// 64 below it, as in IPsec. Older packets are refused.
+struct ReplayWindow {
+    uint64_t highest = 0;
+    uint64_t seen = 0;      // bit i: highest - i was accepted
+
+    bool check(uint64_t packet) const;
+    void accept(uint64_t packet);
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include "discovery.h"
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Networking headers
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <unistd.h>
+
+#include "gossip.h"
+#include "mesh.h"
+#include "peers.h"
+#include "probes.h"
+#include "timer_wheel.h"
+
+// Kernel receive buffer, large enough to absorb a burst of announcements
+const int DISCOVERY_RCVBUF = 1 << 20;
+
+static int discovery_socket = -1;
+static int discovery_socket6 = -1;     // gossip mode only, may stay -1 without IPv6
+static int epoll_fd = -1;
+static int stop_fd = -1;
+static int discovery_port = 0;
+static Announcement self_announcement;
+static std::thread discovery_thread;
+
+// Gossip mode state, touched only by the discovery thread and by discovery_stop() after the join
+static Gossip *gossip = NULL;
+static std::vector<unsigned> multicast_ifaces;   // interfaces that joined the IPv6 group
+static uint32_t member_seq = 0;                  // peers_update() only takes newer sequence numbers
+
+// Mesh mode state, likewise
+static Mesh *mesh = NULL;
+
+static std::atomic<uint64_t> stat_packets(0);
+static std::atomic<uint64_t> stat_bytes(0);
+static std::atomic<uint64_t> stat_drops(0);
+static std::atomic<uint64_t> stat_truncated(0);
+static std::atomic<uint64_t> stat_malformed(0);
+static std::atomic<uint64_t> stat_expired(0);
+
+// Receive buffers for one recvmmsg batch, owned by the discovery thread
+struct DiscoveryBatch {
+    struct mmsghdr msgs[DISCOVERY_BATCH];
+    struct iovec iovs[DISCOVERY_BATCH];
+    struct sockaddr_storage addrs[DISCOVERY_BATCH];
+    char bufs[DISCOVERY_BATCH][DISCOVERY_MTU];
+    char ctrl[DISCOVERY_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+};
+
+static void close_discovery_fds() {
+    if (discovery_socket != -1) close(discovery_socket);
+    if (discovery_socket6 != -1) close(discovery_socket6);
+    if (epoll_fd != -1) close(epoll_fd);
+    if (stop_fd != -1) close(stop_fd);
+    discovery_socket = discovery_socket6 = epoll_fd = stop_fd = -1;
+    multicast_ifaces.clear();
+}
+
+// Bigger receive queue plus a drop counter on every datagram; both are best effort
+static void tune_receive_queue(int fd) {
+    int rcvbuf = DISCOVERY_RCVBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+    }
+    int ovfl = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &ovfl, sizeof(ovfl)) < 0) {
+        perror("setsockopt SO_RXQ_OVFL");
+    }
+}
+
+// Gossip mode: the IPv4 group on the default interface, and a second socket
+// in the IPv6 link-local group on every interface that takes it. A host
+// without IPv6 carries on with IPv4 alone.
+static bool join_multicast_groups(int port) {
+    struct ip_mreqn mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    inet_pton(AF_INET, DISCOVERY_GROUP_V4, &mreq.imr_multiaddr);
+    mreq.imr_address.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(discovery_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("setsockopt IP_ADD_MEMBERSHIP");
+        return false;
+    }
+    int ttl = DISCOVERY_MULTICAST_TTL;
+    if (setsockopt(discovery_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        perror("setsockopt IP_MULTICAST_TTL");
+    }
+
+    discovery_socket6 = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (discovery_socket6 < 0) {
+        perror("socket AF_INET6");
+        return true;
+    }
+    int v6only = 1;
+    setsockopt(discovery_socket6, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    tune_receive_queue(discovery_socket6);
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(discovery_socket6, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind AF_INET6");
+        close(discovery_socket6);
+        discovery_socket6 = -1;
+        return true;
+    }
+
+    struct ipv6_mreq mreq6;
+    inet_pton(AF_INET6, DISCOVERY_GROUP_V6, &mreq6.ipv6mr_multiaddr);
+    struct if_nameindex *ifs = if_nameindex();
+    for (struct if_nameindex *i = ifs; i != NULL && i->if_index != 0; i++) {
+        // Interfaces without multicast, loopback among them, just refuse
+        mreq6.ipv6mr_interface = i->if_index;
+        if (setsockopt(discovery_socket6, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq6, sizeof(mreq6)) == 0) {
+            multicast_ifaces.push_back(i->if_index);
+        }
+    }
+    if (ifs != NULL) if_freenameindex(ifs);
+    return true;
+}
+
+static bool broadcast_announcement(const Announcement *a) {
+    uint8_t buf[ANNOUNCE_MAX_SIZE];
+    size_t len = announce_encode(a, buf, sizeof(buf));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    addr.sin_port = htons(discovery_port);
+
+    if (sendto(discovery_socket, buf, len, 0, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("sendto");
+        return false;
+    }
+    return true;
+}
+
+// Gossip send hook; to is NULL for the multicast groups. Unicast errors are
+// ignored like any other datagram loss, the protocol already copes with it.
+static void gossip_send(const struct sockaddr *to, const uint8_t *data, size_t len, void *) {
+    struct sockaddr_in6 addr6;
+    if (to == NULL) {
+        struct sockaddr_in group;
+        memset(&group, 0, sizeof(group));
+        group.sin_family = AF_INET;
+        group.sin_port = htons(discovery_port);
+        inet_pton(AF_INET, DISCOVERY_GROUP_V4, &group.sin_addr);
+        if (sendto(discovery_socket, data, len, 0, (struct sockaddr *)&group, sizeof(group)) < 0) {
+            perror("sendto multicast");
+        }
+
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(discovery_port);
+        inet_pton(AF_INET6, DISCOVERY_GROUP_V6, &addr6.sin6_addr);
+    } else if (to->sa_family == AF_INET) {
+        sendto(discovery_socket, data, len, 0, to, sizeof(struct sockaddr_in));
+        return;
+    } else {
+        memcpy(&addr6, to, sizeof(addr6));
+        if (!IN6_IS_ADDR_LINKLOCAL(&addr6.sin6_addr) || addr6.sin6_scope_id != 0) {
+            if (discovery_socket6 != -1) sendto(discovery_socket6, data, len, 0, to, sizeof(addr6));
+            return;
+        }
+        // A link-local address relayed by another member has lost its scope:
+        // try it on every interface, as for the group
+    }
+
+    if (discovery_socket6 == -1) return;
+    for (unsigned index : multicast_ifaces) {
+        addr6.sin6_scope_id = index;
+        sendto(discovery_socket6, data, len, 0, (struct sockaddr *)&addr6, sizeof(addr6));
+    }
+}
+
+// Mesh send hook: one interface's advert to its subnet
+static void mesh_send(uint32_t broadcast, const uint8_t *data, size_t len, void *) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = broadcast;
+    addr.sin_port = htons(discovery_port);
+    if (sendto(discovery_socket, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("sendto mesh");
+    }
+}
+
+// Gossip or the mesh decides when members come and go; the peer table just follows it
+static void member_changed(const struct sockaddr *addr, const Announcement *a, bool alive, void *) {
+    Announcement copy = *a;
+    copy.seq = ++member_seq;
+    copy.ttl = alive ? DISCOVERY_TTL_SEC : 0;
+    peers_update(addr, &copy, monotonic_ms());
+}
+
+// Stands in for heartbeats: every member gossip still counts as live gets a
+// fresh ttl, so only members gossip has given up on can expire
+static void refresh_gossip_members() {
+    for (auto &entry : gossip->all()) {
+        const GossipMember &m = entry.second;
+        if (m.state == MEMBER_ALIVE || m.state == MEMBER_SUSPECT) {
+            member_changed((const struct sockaddr *)&m.addr, &m.info, true, NULL);
+        }
+    }
+}
+
+static bool handle_discovery_packet(const struct sockaddr *from, const char *data, size_t len, uint64_t now) {
+    // Gossip shares the port with announcements; its packets start 'P' 'G'
+    if (gossip != NULL && len >= 2 && data[0] == 'P' && data[1] == 'G') {
+        return gossip->handle(from, (const uint8_t *)data, len, now);
+    }
+    // Mesh adverts likewise start 'P' 'V'
+    if (mesh != NULL && len >= 2 && data[0] == 'P' && data[1] == 'V') {
+        return mesh->handle(from, (const uint8_t *)data, len, now);
+    }
+
+    Announcement a;
+    if (!announce_decode((const uint8_t *)data, len, &a)) return false;
+
+    // Our own broadcasts loop back to us
+    if (a.node_id == self_announcement.node_id) return true;
+
+    peers_update(from, &a, now);
+    return true;
+}
+
+// Read everything queued on the socket, DISCOVERY_BATCH datagrams per syscall
+static void drain_socket(int fd, DiscoveryBatch *batch) {
+    for (;;) {
+        for (int i = 0; i < DISCOVERY_BATCH; i++) {
+            struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+            batch->iovs[i].iov_base = batch->bufs[i];
+            batch->iovs[i].iov_len = DISCOVERY_MTU;
+            hdr->msg_name = &batch->addrs[i];
+            hdr->msg_namelen = sizeof(batch->addrs[i]);
+            hdr->msg_iov = &batch->iovs[i];
+            hdr->msg_iovlen = 1;
+            hdr->msg_control = batch->ctrl[i];
+            hdr->msg_controllen = sizeof(batch->ctrl[i]);
+            hdr->msg_flags = 0;
+        }
+
+        int n = recvmmsg(fd, batch->msgs, DISCOVERY_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+            return;
+        }
+
+        uint64_t now = monotonic_ms();
+        uint64_t bytes = 0;
+        uint64_t truncated = 0;
+        uint64_t malformed = 0;
+        uint32_t drops = 0;
+        bool saw_drops = false;
+        for (int i = 0; i < n; i++) {
+            struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+
+            // SO_RXQ_OVFL reports the socket's running drop counter with each datagram
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                    saw_drops = true;
+                }
+            }
+
+            if (hdr->msg_flags & MSG_TRUNC) {
+                truncated++;
+                continue;
+            }
+
+            size_t len = batch->msgs[i].msg_len;
+            bytes += len;
+            ProbeScope probe(PROBE_DISCOVERY_PACKET);
+            if (!handle_discovery_packet((const struct sockaddr *)&batch->addrs[i], batch->bufs[i], len, now)) {
+                malformed++;
+            }
+        }
+
+        stat_packets.fetch_add(n - truncated, std::memory_order_relaxed);
+        stat_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (truncated) stat_truncated.fetch_add(truncated, std::memory_order_relaxed);
+        if (malformed) stat_malformed.fetch_add(malformed, std::memory_order_relaxed);
+        if (saw_drops) stat_drops.store(drops, std::memory_order_relaxed);
+
+        // A short batch means the queue is empty
+        if (n < DISCOVERY_BATCH) return;
+    }
+}
+
+static void discovery_loop() {
+    DiscoveryBatch *batch = new DiscoveryBatch;
+    struct epoll_event events[3];
+
+    // Jitter keeps nodes that booted together from heartbeating in lockstep
+    std::mt19937 rng(std::random_device{}());
+    std::uniform_int_distribution<int> jitter(-DISCOVERY_INTERVAL_MS / 4, DISCOVERY_INTERVAL_MS / 4);
+
+    uint64_t now = monotonic_ms();
+    uint64_t next_heartbeat = now;
+    uint64_t next_expiry = now;
+    uint64_t next_gossip = gossip != NULL ? now : UINT64_MAX;
+    uint64_t next_mesh = mesh != NULL ? now : UINT64_MAX;
+
+    for (;;) {
+        // Sleep until the next heartbeat, expiry check, gossip or mesh timer, whichever is first
+        now = monotonic_ms();
+        uint64_t deadline = next_heartbeat < next_expiry ? next_heartbeat : next_expiry;
+        if (next_gossip < deadline) deadline = next_gossip;
+        if (next_mesh < deadline) deadline = next_mesh;
+        int timeout = deadline > now ? (int)(deadline - now) : 0;
+
+        int n = epoll_wait(epoll_fd, events, 3, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        counter_add(COUNTER_DISCOVERY_WAKEUPS);
+
+        bool stop = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == stop_fd) stop = true;
+            else drain_socket(events[i].data.fd, batch);
+        }
+        if (stop) break;
+
+        now = monotonic_ms();
+        if (gossip != NULL && now >= next_gossip) next_gossip = gossip->tick(now);
+        if (mesh != NULL && now >= next_mesh) next_mesh = mesh->tick(now);
+        {
+            ProbeScope probe(PROBE_DISCOVERY_PUBLISH);
+            peers_publish(now);
+        }
+        if (now >= next_heartbeat) {
+            if (gossip != NULL) {
+                refresh_gossip_members();
+            } else if (mesh != NULL) {
+                mesh->refresh();
+            } else {
+                self_announcement.seq++;
+                broadcast_announcement(&self_announcement);
+            }
+            next_heartbeat = now + DISCOVERY_INTERVAL_MS + jitter(rng);
+        }
+        if (now >= next_expiry) {
+            size_t expired = peers_expire(now);
+            if (expired) stat_expired.fetch_add(expired, std::memory_order_relaxed);
+            peers_publish(now);
+            next_expiry = now + 1000;
+        }
+    }
+
+    delete batch;
+}
+
+bool discovery_start(int port, const Announcement *self, DiscoveryMode mode) {
+    discovery_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (discovery_socket < 0) {
+        perror("socket");
+        return false;
+    }
+
+    // Set socket to allow broadcast
+    int broadcast = 1;
+    if (setsockopt(discovery_socket, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
+        perror("setsockopt");
+        close_discovery_fds();
+        return false;
+    }
+
+    tune_receive_queue(discovery_socket);
+
+    // Bind to discovery port
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(discovery_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close_discovery_fds();
+        return false;
+    }
+
+    discovery_port = port;
+    if (mode == DISCOVERY_GOSSIP && !join_multicast_groups(port)) {
+        close_discovery_fds();
+        return false;
+    }
+
+    // eventfd used by discovery_stop() to wake the receive thread
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (stop_fd < 0 || epoll_fd < 0) {
+        perror("epoll");
+        close_discovery_fds();
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = discovery_socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, discovery_socket, &ev);
+    if (discovery_socket6 != -1) {
+        ev.data.fd = discovery_socket6;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, discovery_socket6, &ev);
+    }
+    ev.data.fd = stop_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev);
+
+    self_announcement = *self;
+    self_announcement.ttl = DISCOVERY_TTL_SEC;
+    if (mode == DISCOVERY_GOSSIP) {
+        GossipConfig config;
+        gossip = new Gossip(&self_announcement, config, gossip_send, member_changed, NULL, monotonic_ms());
+    } else if (mode == DISCOVERY_MESH) {
+        mesh = new Mesh(&self_announcement, mesh_send, member_changed, NULL, monotonic_ms());
+    }
+    discovery_thread = std::thread(discovery_loop);
+    return true;
+}
+
+void discovery_stop() {
+    if (discovery_thread.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) perror("write");
+        discovery_thread.join();
+
+        if (gossip != NULL) {
+            gossip->leave();
+            delete gossip;
+            gossip = NULL;
+        } else if (mesh != NULL) {
+            mesh->leave();
+            delete mesh;
+            mesh = NULL;
+        } else {
+            // A ttl of 0 tells peers to drop us now instead of waiting for expiry
+            self_announcement.seq++;
+            self_announcement.ttl = 0;
+            broadcast_announcement(&self_announcement);
+        }
+    }
+    close_discovery_fds();
+}
+
+void discovery_get_stats(DiscoveryStats *stats) {
+    stats->packets = stat_packets.load(std::memory_order_relaxed);
+    stats->bytes = stat_bytes.load(std::memory_order_relaxed);
+    stats->drops = stat_drops.load(std::memory_order_relaxed);
+    stats->truncated = stat_truncated.load(std::memory_order_relaxed);
+    stats->malformed = stat_malformed.load(std::memory_order_relaxed);
+    stats->expired = stat_expired.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef PUTTYNET_DISCOVERY_H
+#define PUTTYNET_DISCOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "announce.h"
+
+// Receive-side counters for the discovery socket
+struct DiscoveryStats {
+    uint64_t packets;        // datagrams received
+    uint64_t bytes;          // payload bytes received
+    uint64_t drops;          // datagrams dropped by the kernel because the queue was full
+    uint64_t truncated;      // datagrams larger than DISCOVERY_MTU
+    uint64_t malformed;      // datagrams that are not announcements
+    uint64_t expired;        // peers dropped because their ttl ran out
+};
+
+// Largest announcement we accept and the number of datagrams drained per recvmmsg call
+const int DISCOVERY_MTU = 1500;
+const int DISCOVERY_BATCH = 64;
+
+// Heartbeats go out every DISCOVERY_INTERVAL_MS +/- 25% and promise a ttl of
+// three intervals, so a peer survives two lost heartbeats
+const int DISCOVERY_INTERVAL_MS = 5000;
+const uint16_t DISCOVERY_TTL_SEC = 3 * DISCOVERY_INTERVAL_MS / 1000;
+
+// Broadcast mode: every node heartbeats to the whole segment, so each node
+// handles every other node's announcements. Gossip mode: SWIM membership
+// (gossip.h) over unicast, with a multicast beacon for joining; per-node
+// traffic grows with log(nodes), and the groups can be routed across subnets.
+// Mesh mode: distance-vector adverts on every interface's subnet (mesh.h)
+// stand in for heartbeats, and peers several hops away join the table
+// under their home addresses, reached through the nodes in between.
+enum DiscoveryMode {
+    DISCOVERY_BROADCAST,
+    DISCOVERY_GOSSIP,
+    DISCOVERY_MESH,
+};
+
+// Gossip mode multicast groups: organisation-local IPv4, link-local IPv6
+const char *const DISCOVERY_GROUP_V4 = "239.255.80.78";
+const char *const DISCOVERY_GROUP_V6 = "ff02::504e";
+const int DISCOVERY_MULTICAST_TTL = 8;
+
+// Open the discovery socket on port and start the discovery thread, which
+// announces self, records peers in the peer table and expires stale ones
+bool discovery_start(int port, const Announcement *self, DiscoveryMode mode = DISCOVERY_BROADCAST);
+
+// Say goodbye, wake the discovery thread, join it and close the sockets
+void discovery_stop();
+
+// Counters only ever grow; each reader takes its own rates from two samples
+void discovery_get_stats(DiscoveryStats *stats);
+
+#endif
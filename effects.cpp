@@ -0,0 +1,310 @@
+#include "effects.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+
+#include "mixer.h"
+
+static const char *EFFECTS_PCM_CAPS =
+    "audio/x-raw,format=S16LE,layout=interleaved,rate=48000,channels=1";
+
+const int RATE = 48000;
+const size_t BLOCK_SAMPLES = RATE / 400;         // 2.5 ms
+const gint64 SINK_LATENCY_US = 2500;             // one ring buffer segment
+const gint64 SINK_BUFFER_US = 7500;              // whole ring buffer
+const gint64 DECODE_TIMEOUT_US = 5 * G_TIME_SPAN_SECOND;
+const size_t IDLE_BLOCKS = EFFECTS_IDLE_MS * RATE / 1000 / BLOCK_SAMPLES;
+
+// Written once by effects_init(), then only read
+static std::unordered_map<std::string, std::vector<int16_t>> cache;
+
+struct Voice {
+    const std::vector<int16_t> *pcm;
+    size_t position;
+    float gain;
+    gint64 triggered_us;     // 0 once its first block is out
+};
+
+// voices_lock covers the voices, the stats and stopping; the sleeping
+// mixer waits on voices_ready with it
+static std::mutex voices_lock;
+static std::condition_variable voices_ready;
+static std::vector<Voice> voices;
+static EffectsStats stats;
+static bool stopping = false;
+
+static GstElement *playback = NULL;
+static std::vector<float> mix;
+static uint64_t samples_out = 0;     // streaming thread only
+static size_t silent_blocks = 0;     // streaming thread only
+
+// Decode one file to the cache format by running it through its own
+// pipeline to EOS
+static bool decode(const std::string &path, std::vector<int16_t> *pcm) {
+    GstElement *pipeline = gst_parse_launch(
+        (std::string("filesrc name=file ! decodebin ! audioconvert ! audioresample ! ") +
+         EFFECTS_PCM_CAPS + " ! appsink name=pcm sync=false").c_str(), NULL);
+    if (pipeline == NULL) return false;
+
+    GstElement *file = gst_bin_get_by_name(GST_BIN(pipeline), "file");
+    g_object_set(file, "location", path.c_str(), NULL);
+    gst_object_unref(file);
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(pipeline), "pcm");
+    GstBus *bus = gst_element_get_bus(pipeline);
+
+    bool ok = gst_element_set_state(pipeline, GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE;
+    gint64 deadline = g_get_monotonic_time() + DECODE_TIMEOUT_US;
+    while (ok && !gst_app_sink_is_eos(GST_APP_SINK(sink))) {
+        GstSample *sample = gst_app_sink_try_pull_sample(GST_APP_SINK(sink), 100 * GST_MSECOND);
+        if (sample != NULL) {
+            GstBuffer *buffer = gst_sample_get_buffer(sample);
+            GstMapInfo map;
+            if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+                const int16_t *samples = (const int16_t *)map.data;
+                pcm->insert(pcm->end(), samples, samples + map.size / sizeof(int16_t));
+                gst_buffer_unmap(buffer, &map);
+            }
+            gst_sample_unref(sample);
+        }
+
+        GstMessage *error = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+        if (error != NULL) {
+            GError *err = NULL;
+            gst_message_parse_error(error, &err, NULL);
+            g_warning("Failed to decode %s: %s", path.c_str(), err->message);
+            g_error_free(err);
+            gst_message_unref(error);
+            ok = false;
+        } else if (g_get_monotonic_time() > deadline) {
+            g_warning("Decoding %s timed out", path.c_str());
+            ok = false;
+        }
+    }
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(bus);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+    return ok && !pcm->empty();
+}
+
+// Running time of the playback chain in samples, never behind what was
+// already sent
+static uint64_t running_samples() {
+    GstClock *clock = gst_element_get_clock(playback);
+    if (clock == NULL) return samples_out;
+    GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(playback);
+    gst_object_unref(clock);
+    uint64_t samples = gst_util_uint64_scale(now, RATE, GST_SECOND);
+    return samples > samples_out ? samples : samples_out;
+}
+
+// The next block, on the appsrc streaming thread. Runs every 2.5 ms while
+// anything plays and for EFFECTS_IDLE_MS after; then the thread sleeps here
+// until a trigger, and the block that answers it starts at the current
+// running time.
+static void on_need_data(GstAppSrc *src, guint, gpointer) {
+    std::fill(mix.begin(), mix.end(), 0.0f);
+    bool woken = false;
+    {
+        std::unique_lock<std::mutex> guard(voices_lock);
+        if (voices.empty() && silent_blocks >= IDLE_BLOCKS) {
+            voices_ready.wait(guard, [] { return !voices.empty() || stopping; });
+            if (stopping) return;
+            woken = true;
+            stats.wakeups++;
+        }
+        gint64 now = voices.empty() ? 0 : g_get_monotonic_time();
+        for (size_t i = 0; i < voices.size();) {
+            Voice &voice = voices[i];
+            size_t n = std::min(BLOCK_SAMPLES, voice.pcm->size() - voice.position);
+            mix_accumulate(mix.data(), voice.pcm->data() + voice.position, voice.gain, n);
+            voice.position += n;
+
+            if (voice.triggered_us) {
+                stats.last_trigger_ms = (now - voice.triggered_us) / 1000.0;
+                if (stats.last_trigger_ms > stats.max_trigger_ms) stats.max_trigger_ms = stats.last_trigger_ms;
+                voice.triggered_us = 0;
+            }
+            if (voice.position == voice.pcm->size()) {
+                voices[i] = voices.back();
+                voices.pop_back();
+            } else {
+                i++;
+            }
+        }
+        silent_blocks = voices.empty() ? silent_blocks + 1 : 0;
+        stats.blocks++;
+    }
+
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, BLOCK_SAMPLES * sizeof(int16_t), NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    mix_store((int16_t *)map.data, mix.data(), BLOCK_SAMPLES);
+    gst_buffer_unmap(buffer, &map);
+
+    if (woken) {
+        samples_out = running_samples();
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+    }
+    GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(samples_out, GST_SECOND, RATE);
+    GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(BLOCK_SAMPLES, GST_SECOND, RATE);
+    samples_out += BLOCK_SAMPLES;
+    gst_app_src_push_buffer(src, buffer);
+}
+
+// autoaudiosink picks its device sink at runtime; shrink its ring buffer
+// as it appears
+static void on_element_added(GstBin *, GstBin *, GstElement *element, gpointer) {
+    if (!GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK)) return;
+    if (g_object_class_find_property(G_OBJECT_GET_CLASS(element), "buffer-time") == NULL) return;
+    g_object_set(element, "buffer-time", SINK_BUFFER_US, "latency-time", SINK_LATENCY_US, NULL);
+}
+
+static gboolean on_bus_message(GstBus *, GstMessage *message, gpointer) {
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gchar *debug = NULL;
+        gst_message_parse_error(message, &error, &debug);
+        g_warning("Sound effects %s: %s", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), error->message);
+        g_error_free(error);
+        g_free(debug);
+    }
+    return TRUE;
+}
+
+bool effects_init(const char *dir, const char *const *names, size_t count, const char *sink) {
+    if (playback != NULL) return true;
+    gint64 start = g_get_monotonic_time();
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        gchar *path = g_build_filename(dir, names[i], NULL);
+        std::vector<int16_t> pcm;
+        if (decode(path, &pcm)) {
+            bytes += pcm.size() * sizeof(int16_t);
+            cache[names[i]].swap(pcm);
+        }
+        g_free(path);
+    }
+
+    // max-bytes of one block: the mixer runs just ahead of the sink, so a
+    // trigger waits for at most the block in hand. Live, with a block of
+    // latency, so the sink plays by timestamp and a sleeping mixer is a gap
+    // rather than a stall.
+    GError *error = NULL;
+    playback = gst_parse_launch(
+        (std::string("appsrc name=effects format=time is-live=true caps=\"") + EFFECTS_PCM_CAPS + "\" "
+         "min-latency=" + std::to_string(SINK_LATENCY_US * 1000) + " "
+         "max-bytes=" + std::to_string(BLOCK_SAMPLES * sizeof(int16_t)) + " ! "
+         "audioconvert ! audioresample ! " + sink).c_str(), &error);
+    if (error != NULL) {
+        g_warning("Failed to create sound effects pipeline: %s", error->message);
+        g_error_free(error);
+        if (playback) gst_object_unref(playback);
+        playback = NULL;
+        return false;
+    }
+
+    GstBus *bus = gst_element_get_bus(playback);
+    gst_bus_add_watch(bus, on_bus_message, NULL);
+    gst_object_unref(bus);
+    g_signal_connect(playback, "deep-element-added", G_CALLBACK(on_element_added), NULL);
+
+    mix.assign(BLOCK_SAMPLES, 0.0f);
+    samples_out = 0;
+    silent_blocks = IDLE_BLOCKS;     // asleep until the first trigger
+    GstAppSrcCallbacks callbacks = {};
+    callbacks.need_data = on_need_data;
+    GstElement *src = gst_bin_get_by_name(GST_BIN(playback), "effects");
+    gst_app_src_set_callbacks(GST_APP_SRC(src), &callbacks, NULL, NULL);
+    gst_object_unref(src);
+
+    {
+        std::lock_guard<std::mutex> guard(voices_lock);
+        stats = EffectsStats();
+        stats.effects = cache.size();
+        stats.cached_bytes = bytes;
+        stats.decode_ms = (g_get_monotonic_time() - start) / 1000.0;
+        stopping = false;
+    }
+
+    // Playing from here on; the mixer sleeps until the first trigger
+    if (gst_element_set_state(playback, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_warning("Sound effects pipeline failed to start");
+        effects_shutdown();
+        return false;
+    }
+    return true;
+}
+
+bool effects_play(const char *name, float gain) {
+    auto it = cache.find(name);
+    if (playback == NULL || it == cache.end()) return false;
+
+    {
+        std::lock_guard<std::mutex> guard(voices_lock);
+        Voice voice = {&it->second, 0, gain, g_get_monotonic_time()};
+        if (voices.size() >= EFFECTS_MAX_VOICES) {
+            // Voices are unordered; the one furthest in has played the longest
+            size_t oldest = 0;
+            for (size_t i = 1; i < voices.size(); i++) {
+                if (voices[i].position > voices[oldest].position) oldest = i;
+            }
+            voices[oldest] = voice;
+            stats.stolen++;
+        } else {
+            voices.push_back(voice);
+        }
+        stats.played++;
+    }
+    voices_ready.notify_one();
+    return true;
+}
+
+void effects_shutdown() {
+    // Wake a sleeping mixer first, or stopping the chain would wait on it
+    {
+        std::lock_guard<std::mutex> guard(voices_lock);
+        stopping = true;
+    }
+    voices_ready.notify_one();
+
+    if (playback != NULL) {
+        gst_element_set_state(playback, GST_STATE_NULL);
+        GstBus *bus = gst_element_get_bus(playback);
+        gst_bus_remove_watch(bus);
+        gst_object_unref(bus);
+        gst_object_unref(playback);
+        playback = NULL;
+    }
+
+    std::lock_guard<std::mutex> guard(voices_lock);
+    voices.clear();
+    cache.clear();
+}
+
+void effects_get_stats(EffectsStats *out) {
+    double output_ms = 0;
+    if (playback != NULL) {
+        GstQuery *query = gst_query_new_latency();
+        GstClockTime min = 0;
+        if (gst_element_query(playback, query)) gst_query_parse_latency(query, NULL, &min, NULL);
+        if (GST_CLOCK_TIME_IS_VALID(min)) output_ms = min / 1e6;
+        gst_query_unref(query);
+    }
+
+    std::lock_guard<std::mutex> guard(voices_lock);
+    *out = stats;
+    out->output_ms = output_ms;
+}
+
+GstElement *effects_get_element(const char *name) {
+    return playback ? gst_bin_get_by_name(GST_BIN(playback), name) : NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef PUTTYNET_EFFECTS_H
+#define PUTTYNET_EFFECTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <gst/gst.h>
+
+// Sound effects, decoded once by effects_init() into 48 kHz mono PCM and
+// played through one appsrc. Triggering an effect only adds it to the list
+// being mixed, so effects overlap and a trigger costs no file I/O. Output
+// goes out in 2.5 ms blocks to an audio sink with a 7.5 ms ring buffer.
+//
+// The chain stays PLAYING; a trigger never changes its state. Once nothing
+// has played for EFFECTS_IDLE_MS the mixer stops making blocks and its
+// streaming thread sleeps until the next trigger, which it answers with a
+// block timestamped at the current running time. The source is live, so
+// the gap costs nothing and the sink plays the block a block plus its own
+// latency later. The sink's device keeps running while the mixer sleeps:
+// an idle app takes no mixer wakeups, but ALSA or PulseAudio still wakes
+// per period to play silence. Pausing would stop that too, at the cost of a
+// state change and a preroll on every trigger; bench_effects measures both
+// the trigger latency and the blocks mixed while idle.
+
+// Effects playing at once; a new one replaces the oldest beyond this
+const size_t EFFECTS_MAX_VOICES = 16;
+
+// Silence mixed after the last effect before the mixer sleeps, enough for
+// the ring buffer to drain
+const guint EFFECTS_IDLE_MS = 50;
+
+struct EffectsStats {
+    size_t effects;          // decoded and cached
+    size_t cached_bytes;
+    double decode_ms;        // effects_init(), all files
+    uint64_t played;
+    uint64_t stolen;         // cut short to make room for a newer effect
+    uint64_t blocks;         // mixed and pushed, silence included
+    uint64_t wakeups;        // times the sleeping mixer was woken by a trigger
+    double last_trigger_ms;  // effects_play() until its first block left the mixer
+    double max_trigger_ms;
+    double output_ms;        // sink side latency after the mixer, from a latency query
+};
+
+// Decode every file in names from dir. Files that fail are skipped with a
+// warning; false only if the playback chain cannot be built.
+bool effects_init(const char *dir, const char *const *names, size_t count,
+                  const char *sink = "autoaudiosink");
+
+// Start the effect loaded from name; false if it was not loaded
+bool effects_play(const char *name, float gain = 1.0f);
+
+void effects_shutdown();
+
+void effects_get_stats(EffectsStats *stats);
+
+// A named element from the playback chain, with a reference; for test harnesses
+GstElement *effects_get_element(const char *name);
+
+#endif
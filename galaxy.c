@@ -1,86 +1,86 @@
-// Compile with: gcc galaxy.c -o galaxy `pkg-config --cflags --libs gtk+-3.0 epoxy` -lm
+// Compile with: gcc -O2 galaxy.c galaxy_render.c galaxy_stars.c galaxy_sim.c -o galaxy `pkg-config --cflags --libs gtk+-3.0 epoxy` -pthread -lm
+//
+// Usage: galaxy [stars]
 
 #include <gtk/gtk.h>
 #include <epoxy/gl.h>
 #include <math.h>
 #include <stdlib.h>
 #include <time.h>
-#include <GL/glu.h>
 
+#include "galaxy_render.h"
+#include "galaxy_sim.h"
 
 #define NUM_STARS 1000
-
-typedef struct {
-    float x, y, z;
-    float r, g, b;
-} Star;
-
-static Star stars[NUM_STARS];
-static float rotation = 0.0f;
-
-// Initialize stars in a spiral galaxy formation
-void init_galaxy() {
-    srand(time(NULL));
-    for (int i = 0; i < NUM_STARS; i++) {
-        float angle = ((float) rand() / RAND_MAX) * 6.28f * 3; // up to 3 full spirals
-        float radius = ((float) rand() / RAND_MAX) * 2.0f;
-        float arm_offset = ((float) rand() / RAND_MAX - 0.5f) * 0.2f;
-
-        float spiral_x = cos(angle) * radius + arm_offset;
-        float spiral_y = sin(angle) * radius + arm_offset;
-        float z = ((float) rand() / RAND_MAX - 0.5f) * 0.2f;
-
-        stars[i].x = spiral_x;
-        stars[i].y = spiral_y;
-        stars[i].z = z;
-
-        // Color: mostly white with slight tints
-        stars[i].r = 0.8f + ((float) rand() / RAND_MAX) * 0.2f;
-        stars[i].g = 0.8f + ((float) rand() / RAND_MAX) * 0.2f;
-        stars[i].b = 0.8f + ((float) rand() / RAND_MAX) * 0.2f;
+#define MAX_STEP_SECONDS (1.0f / 20)   // a stalled frame slows the orbits rather than jumping them
+
+static size_t num_stars = NUM_STARS;
+static GalaxyRenderer renderer;
+static bool renderer_ready = false;
+static GalaxySim *sim = NULL;
+static float step_seconds = 1.0f / 60;   // this frame's, from the frame clock
+static gint64 last_frame_us = 0;
+
+// Colors go to the GPU once, when the area gets its context; positions
+// come from the simulation every frame
+static void realize(GtkGLArea *area, gpointer user_data) {
+    gtk_gl_area_make_current(area);
+    if (gtk_gl_area_get_error(area)) {
+        g_warning("Failed to initialize OpenGL");
+        return;
     }
-}
-
-static gboolean render(GtkGLArea *area, GdkGLContext *context, gpointer user_data) {
-    int width = gtk_widget_get_allocated_width(GTK_WIDGET(area));
-    int height = gtk_widget_get_allocated_height(GTK_WIDGET(area));
-    glViewport(0, 0, width, height);
-
-    glClearColor(0, 0, 0, 1);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    glEnable(GL_DEPTH_TEST);
-    glPointSize(2.0f);
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho(-2, 2, -2, 2, 1.0, 10.0);  // flat orthographic view for now
+    Star *stars = malloc(num_stars * sizeof(Star));
+    if (stars == NULL) return;
+    galaxy_generate(stars, num_stars, (uint32_t)time(NULL));
+    renderer_ready = galaxy_renderer_init(&renderer, stars, num_stars);
+    if (!renderer_ready) g_warning("Failed to set up the star renderer");
+    sim = galaxy_sim_new(stars, num_stars, 0);
+    if (sim == NULL) g_warning("Failed to start the orbit simulation");
+    free(stars);
+}
 
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
-    glTranslatef(0, 0, -3.0f);  // move camera back
+static void unrealize(GtkGLArea *area, gpointer user_data) {
+    gtk_gl_area_make_current(area);
+    if (renderer_ready) galaxy_renderer_free(&renderer);
+    renderer_ready = false;
+    galaxy_sim_free(sim);
+    sim = NULL;
+}
 
-    glBegin(GL_POINTS);
-    for (int i = 0; i < NUM_STARS; i++) {
-        glColor3f(stars[i].r, stars[i].g, stars[i].b);
-        glVertex3f(stars[i].x, stars[i].y, stars[i].z);
+static gboolean render(GtkGLArea *area, GdkGLContext *context, gpointer user_data) {
+    if (!renderer_ready) return FALSE;
+    int scale = gtk_widget_get_scale_factor(GTK_WIDGET(area));
+    int width = gtk_widget_get_allocated_width(GTK_WIDGET(area)) * scale;
+    int height = gtk_widget_get_allocated_height(GTK_WIDGET(area)) * scale;
+
+    // Upload the step finished since the last frame, and compute the next
+    // one on the workers while this frame draws
+    if (sim != NULL) {
+        galaxy_sim_wait(sim);
+        galaxy_renderer_update_positions(&renderer, galaxy_sim_x(sim), galaxy_sim_y(sim), galaxy_sim_z(sim));
+        galaxy_sim_step(sim, step_seconds);
     }
-    glEnd();
-
+    galaxy_renderer_draw(&renderer, width, height, 0);
     return TRUE;
 }
 
+// Once a frame of the window's frame clock, so steps follow the display's
+// refresh rate and stop while the window is hidden; nothing moves without
+// the simulation, so ticks stop with it
+static gboolean tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data) {
+    if (gtk_widget_get_realized(widget) && sim == NULL) return G_SOURCE_REMOVE;
 
-static gboolean tick(gpointer data) {
-    GtkGLArea *area = GTK_GL_AREA(data);
-    rotation += 0.2f;
-    gtk_gl_area_queue_render(area);
+    gint64 now = gdk_frame_clock_get_frame_time(clock);
+    if (last_frame_us) step_seconds = fminf((now - last_frame_us) / 1e6f, MAX_STEP_SECONDS);
+    last_frame_us = now;
+    gtk_gl_area_queue_render(GTK_GL_AREA(widget));
     return G_SOURCE_CONTINUE;
 }
 
 int main(int argc, char *argv[]) {
     gtk_init(&argc, &argv);
-    init_galaxy();
+    if (argc > 1) num_stars = strtoul(argv[1], NULL, 10);
 
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "3D Galaxy Viewer");
@@ -90,19 +90,16 @@ int main(int argc, char *argv[]) {
     GtkWidget *gl_area = gtk_gl_area_new();
     gtk_container_add(GTK_CONTAINER(window), gl_area);
 
+    gtk_gl_area_set_required_version(GTK_GL_AREA(gl_area), 3, 3);
+    g_signal_connect(gl_area, "realize", G_CALLBACK(realize), NULL);
+    g_signal_connect(gl_area, "unrealize", G_CALLBACK(unrealize), NULL);
     g_signal_connect(gl_area, "render", G_CALLBACK(render), NULL);
-    gtk_gl_area_set_has_depth_buffer(GTK_GL_AREA(gl_area), TRUE);
 
+    gtk_widget_add_tick_callback(gl_area, tick, NULL, NULL);
     gtk_widget_show_all(window);
 
-    // Animation timer (~60 FPS)
-    g_timeout_add(16, tick, gl_area);
-
     gtk_main();
     return 0;
 }
 
-//galaxy.h / galaxy.c for star logic, gl_render.c for rendering, main.c for GTK app setup
 //Add mouse/touch controls to rotate it manually
-//Switch to shaders (GLSL) for glow effects
-//Make stars orbit (animated position updates)
@@ -0,0 +1,290 @@
+#include "galaxy_render.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// transform is the projection times the rotation, built once a frame on
+// the CPU, so a vertex costs one matrix multiply. x, y and z are separate
+// attributes so they can come from the Star VBO or from three arrays.
+static const char *vertex_shader_source =
+    "#version 330 core\n"
+    "layout (location = 0) in float x;\n"
+    "layout (location = 1) in vec4 color;\n"
+    "layout (location = 2) in float y;\n"
+    "layout (location = 3) in float z;\n"
+    "uniform mat4 transform;\n"
+    "uniform float point_size;\n"
+    "out vec4 star_color;\n"
+    "void main() {\n"
+    "    gl_Position = transform * vec4(x, y, z, 1.0);\n"
+    "    gl_PointSize = point_size;\n"
+    "    star_color = color;\n"
+    "}\n";
+
+// A bright core with a soft falloff; blending is additive, so overlapping
+// glows brighten the arms without any sorting
+static const char *fragment_shader_source =
+    "#version 330 core\n"
+    "in vec4 star_color;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    vec2 d = gl_PointCoord * 2.0 - 1.0;\n"
+    "    float r2 = dot(d, d);\n"
+    "    if (r2 > 1.0) discard;\n"
+    "    float glow = (1.0 - r2) * (1.0 - r2) * star_color.a + exp(-16.0 * r2);\n"
+    "    frag_color = vec4(star_color.rgb * glow, 1.0);\n"
+    "}\n";
+
+// The layer as a quad from gl_VertexID, so it needs no buffer
+static const char *layer_vertex_shader_source =
+    "#version 330 core\n"
+    "uniform mat4 transform;\n"
+    "uniform float extent;\n"
+    "out vec2 uv;\n"
+    "void main() {\n"
+    "    uv = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+    "    gl_Position = transform * vec4((uv * 2.0 - 1.0) * extent, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *layer_fragment_shader_source =
+    "#version 330 core\n"
+    "in vec2 uv;\n"
+    "uniform sampler2D layer;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    frag_color = texture(layer, uv);\n"
+    "}\n";
+
+// Sprites shrink as the field gets denser: past a star a pixel or so the
+// glows only saturate, and every extra pixel is fill rate
+static const float MIN_POINT_SIZE = 1.5f;
+static const float MAX_POINT_SIZE = 4.0f;
+static const float VIEW_EXTENT = 2.0f;   // the old glOrtho(-2, 2, -2, 2, ...)
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader compilation failed: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint link_program(const char *vertex_source, const char *fragment_source) {
+    GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (!vertex || !fragment) {
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[512];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader link failed: %s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+bool galaxy_renderer_init(GalaxyRenderer *renderer, const Star *stars, size_t count) {
+    memset(renderer, 0, sizeof(*renderer));
+    renderer->program = link_program(vertex_shader_source, fragment_shader_source);
+    renderer->layer_program = link_program(layer_vertex_shader_source, layer_fragment_shader_source);
+    if (!renderer->program || !renderer->layer_program) return false;
+    renderer->transform_loc = glGetUniformLocation(renderer->program, "transform");
+    renderer->point_size_loc = glGetUniformLocation(renderer->program, "point_size");
+    renderer->layer_transform_loc = glGetUniformLocation(renderer->layer_program, "transform");
+    renderer->layer_extent_loc = glGetUniformLocation(renderer->layer_program, "extent");
+    renderer->count = (GLsizei)count;
+    renderer->cached = true;
+
+    // A little past the furthest star, so no sprite is cut at the layer's edge
+    for (size_t i = 0; i < count; i++) {
+        renderer->extent = fmaxf(renderer->extent, fmaxf(fabsf(stars[i].x), fabsf(stars[i].y)));
+    }
+    renderer->extent = renderer->extent * 1.02f + 0.01f;
+
+    // Uploaded once; only positions ever stream, into their own buffer
+    glGenVertexArrays(1, &renderer->vao);
+    glBindVertexArray(renderer->vao);
+    glGenBuffers(1, &renderer->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->vbo);
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof(Star), stars, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, sizeof(Star), (void *)offsetof(Star, x));
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(Star), (void *)offsetof(Star, y));
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Star), (void *)offsetof(Star, z));
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Star), (void *)offsetof(Star, r));
+    for (GLuint i = 0; i < 4; i++) glEnableVertexAttribArray(i);
+
+    glGenVertexArrays(1, &renderer->layer_vao);
+    glBindVertexArray(0);
+    glGenFramebuffers(1, &renderer->layer_fbo);
+    glGenTextures(1, &renderer->layer_texture);
+    return glGetError() == GL_NO_ERROR;
+}
+
+void galaxy_renderer_invalidate(GalaxyRenderer *renderer) {
+    renderer->layer_valid = false;
+}
+
+void galaxy_renderer_update_positions(GalaxyRenderer *renderer, const float *x, const float *y, const float *z) {
+    size_t bytes = (size_t)renderer->count * sizeof(float);
+    glBindVertexArray(renderer->vao);
+    if (!renderer->positions_vbo) {
+        glGenBuffers(1, &renderer->positions_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, renderer->positions_vbo);
+        glVertexAttribPointer(0, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void *)0);
+        glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void *)bytes);
+        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(float), (void *)(2 * bytes));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->positions_vbo);
+
+    // Orphan last frame's storage rather than wait for the GPU to be done with it
+    glBufferData(GL_ARRAY_BUFFER, 3 * bytes, NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, x);
+    glBufferSubData(GL_ARRAY_BUFFER, bytes, bytes, y);
+    glBufferSubData(GL_ARRAY_BUFFER, 2 * bytes, bytes, z);
+    glBindVertexArray(0);
+
+    // The disc no longer turns rigidly, so the layer is no use
+    renderer->cached = false;
+}
+
+static void draw_stars(GalaxyRenderer *renderer, const float transform[16]) {
+    glUseProgram(renderer->program);
+    glUniformMatrix4fv(renderer->transform_loc, 1, GL_FALSE, transform);
+    glUniform1f(renderer->point_size_loc, renderer->point_size);
+
+    glEnable(GL_PROGRAM_POINT_SIZE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glBindVertexArray(renderer->vao);
+    glDrawArrays(GL_POINTS, 0, renderer->count);
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+}
+
+// Draw the stars unrotated into a square texture spanning the disc, at the
+// screen's pixel density so the quad maps it about one to one
+static bool draw_layer(GalaxyRenderer *renderer) {
+    float pixels_per_unit = fmaxf(renderer->scale_x * renderer->width, renderer->scale_y * renderer->height) / 2;
+    GLint max_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    int size = (int)ceilf(2 * renderer->extent * pixels_per_unit);
+    if (size < 1) size = 1;
+    if (size > max_size) size = max_size;
+
+    GLint previous_fbo;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous_fbo);
+
+    glBindTexture(GL_TEXTURE_2D, renderer->layer_texture);
+    if (size != renderer->layer_size) {
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        renderer->layer_size = size;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, renderer->layer_fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, renderer->layer_texture, 0);
+    bool ok = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (ok) {
+        glViewport(0, 0, size, size);
+        glClearColor(0, 0, 0, 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+        float inverse = 1 / renderer->extent;
+        float transform[16] = {
+            inverse, 0, 0, 0,
+            0, inverse, 0, 0,
+            0, 0, -1, 0,
+            0, 0, 0, 1,
+        };
+        draw_stars(renderer, transform);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_fbo);
+    glViewport(0, 0, renderer->width, renderer->height);
+    renderer->layer_valid = ok;
+    return ok;
+}
+
+// Orthographic with the shorter side spanning the old view, and the sprite
+// size for this many stars on this many pixels
+static void set_viewport(GalaxyRenderer *renderer, int width, int height) {
+    float aspect = height > 0 ? (float)width / height : 1.0f;
+    renderer->scale_x = 1 / (aspect >= 1 ? VIEW_EXTENT * aspect : VIEW_EXTENT);
+    renderer->scale_y = 1 / (aspect >= 1 ? VIEW_EXTENT : VIEW_EXTENT / aspect);
+    renderer->width = width;
+    renderer->height = height;
+    renderer->layer_valid = false;
+
+    float size = renderer->count > 0 ? 2 * sqrtf((float)width * height / renderer->count) : MAX_POINT_SIZE;
+    renderer->point_size = fminf(fmaxf(size, MIN_POINT_SIZE), MAX_POINT_SIZE);
+}
+
+void galaxy_renderer_draw(GalaxyRenderer *renderer, int width, int height, float rotation) {
+    glViewport(0, 0, width, height);
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (width != renderer->width || height != renderer->height) set_viewport(renderer, width, height);
+    glDisable(GL_DEPTH_TEST);
+
+    // Column-major projection * rotation about z; z passes through
+    float angle = rotation * (float)M_PI / 180.0f;
+    float c = cosf(angle), s = sinf(angle);
+    float transform[16] = {
+        c * renderer->scale_x, s * renderer->scale_y, 0, 0,
+        -s * renderer->scale_x, c * renderer->scale_y, 0, 0,
+        0, 0, -1, 0,
+        0, 0, 0, 1,
+    };
+
+    if (!renderer->cached || (!renderer->layer_valid && !draw_layer(renderer))) {
+        draw_stars(renderer, transform);
+        return;
+    }
+
+    glUseProgram(renderer->layer_program);
+    glUniformMatrix4fv(renderer->layer_transform_loc, 1, GL_FALSE, transform);
+    glUniform1f(renderer->layer_extent_loc, renderer->extent);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, renderer->layer_texture);
+    glBindVertexArray(renderer->layer_vao);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+}
+
+void galaxy_renderer_free(GalaxyRenderer *renderer) {
+    if (renderer->vbo) glDeleteBuffers(1, &renderer->vbo);
+    if (renderer->positions_vbo) glDeleteBuffers(1, &renderer->positions_vbo);
+    if (renderer->vao) glDeleteVertexArrays(1, &renderer->vao);
+    if (renderer->program) glDeleteProgram(renderer->program);
+    if (renderer->layer_texture) glDeleteTextures(1, &renderer->layer_texture);
+    if (renderer->layer_fbo) glDeleteFramebuffers(1, &renderer->layer_fbo);
+    if (renderer->layer_vao) glDeleteVertexArrays(1, &renderer->layer_vao);
+    if (renderer->layer_program) glDeleteProgram(renderer->layer_program);
+    memset(renderer, 0, sizeof(*renderer));
+}
@@ -0,0 +1,61 @@
+#ifndef GALAXY_RENDER_H
+#define GALAXY_RENDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <epoxy/gl.h>
+
+#include "galaxy_stars.h"
+
+// Core-profile star renderer, shared by galaxy and bench_galaxy. The stars
+// go into a VBO once and are drawn as point sprites in one glDrawArrays,
+// with the rotation and the projection in one matrix uniform.
+//
+// The disc only ever turns as a whole and a sprite looks the same at any
+// angle, so by default the stars are drawn once into a texture, unrotated,
+// and a frame is a single rotated quad over it: the cost of a frame no
+// longer depends on the number of stars. The texture is redrawn when the
+// viewport changes or after galaxy_renderer_invalidate(). Needs OpenGL 3.3.
+
+typedef struct {
+    GLuint program;
+    GLuint vao;
+    GLuint vbo;
+    GLuint positions_vbo;    // x, y and z arrays once positions stream
+    GLint transform_loc;
+    GLint point_size_loc;
+    GLsizei count;
+    int width, height;       // projection and sprite size follow these
+    float scale_x, scale_y;
+    float point_size;
+    float extent;            // furthest any star is from the axis, in x or y
+
+    bool cached;             // draw through the layer; on after init
+    bool layer_valid;
+    GLuint layer_program;
+    GLuint layer_vao;
+    GLuint layer_fbo;
+    GLuint layer_texture;
+    GLint layer_transform_loc;
+    GLint layer_extent_loc;
+    int layer_size;
+} GalaxyRenderer;
+
+// Compile the shaders and upload the stars; the context must be current.
+// stars may be freed afterwards.
+bool galaxy_renderer_init(GalaxyRenderer *renderer, const Star *stars, size_t count);
+
+// Draw into the current framebuffer, rotated by rotation degrees
+void galaxy_renderer_draw(GalaxyRenderer *renderer, int width, int height, float rotation);
+
+// The stars changed in the VBO; redraw the layer before the next frame
+void galaxy_renderer_invalidate(GalaxyRenderer *renderer);
+
+// Replace every star's position with count floats from each of x, y and z;
+// colors stay as they were. From then on every frame draws every star.
+void galaxy_renderer_update_positions(GalaxyRenderer *renderer, const float *x, const float *y, const float *z);
+
+void galaxy_renderer_free(GalaxyRenderer *renderer);
+
+#endif
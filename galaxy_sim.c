@@ -0,0 +1,421 @@
+#include "galaxy_sim.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Potential 1/2 V0^2 ln(r^2 + Rc^2): circular speed rises over the core
+// radius Rc and is flat at V0 beyond it. With the view 4 units across, an
+// orbit at the rim takes about 20 seconds.
+static const float V0_SQUARED = 0.63f * 0.63f;
+static const float CORE_SQUARED = 0.3f * 0.3f;
+
+// Stars per unit of work: big enough that taking one is noise next to
+// computing it, small enough to balance ten thousand stars over a few cores
+#define BLOCK_STARS 2048
+
+typedef struct {
+    const float *x, *y, *z;
+    float *vx, *vy, *vz;
+    float *nx, *ny, *nz;
+    float dt;
+} StepArrays;
+
+// Scalar kernel, also used for the tail of every vector loop
+
+static void advance_scalar(const StepArrays *s, size_t begin, size_t end) {
+    float k = -V0_SQUARED * s->dt;
+    for (size_t i = begin; i < end; i++) {
+        float x = s->x[i], y = s->y[i], z = s->z[i];
+        float f = k / (x * x + y * y + z * z + CORE_SQUARED);
+        float vx = s->vx[i] + f * x;
+        float vy = s->vy[i] + f * y;
+        float vz = s->vz[i] + f * z;
+        s->vx[i] = vx;
+        s->vy[i] = vy;
+        s->vz[i] = vz;
+        s->nx[i] = x + vx * s->dt;
+        s->ny[i] = y + vy * s->dt;
+        s->nz[i] = z + vz * s->dt;
+    }
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this is the floor there
+
+static void advance_sse2(const StepArrays *s, size_t begin, size_t end) {
+    __m128 k = _mm_set1_ps(-V0_SQUARED * s->dt);
+    __m128 core = _mm_set1_ps(CORE_SQUARED);
+    __m128 dt = _mm_set1_ps(s->dt);
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(s->x + i), y = _mm_loadu_ps(s->y + i), z = _mm_loadu_ps(s->z + i);
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_add_ps(_mm_mul_ps(z, z), core));
+        __m128 f = _mm_div_ps(k, r2);
+        __m128 vx = _mm_add_ps(_mm_loadu_ps(s->vx + i), _mm_mul_ps(f, x));
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(s->vy + i), _mm_mul_ps(f, y));
+        __m128 vz = _mm_add_ps(_mm_loadu_ps(s->vz + i), _mm_mul_ps(f, z));
+        _mm_storeu_ps(s->vx + i, vx);
+        _mm_storeu_ps(s->vy + i, vy);
+        _mm_storeu_ps(s->vz + i, vz);
+        _mm_storeu_ps(s->nx + i, _mm_add_ps(x, _mm_mul_ps(vx, dt)));
+        _mm_storeu_ps(s->ny + i, _mm_add_ps(y, _mm_mul_ps(vy, dt)));
+        _mm_storeu_ps(s->nz + i, _mm_add_ps(z, _mm_mul_ps(vz, dt)));
+    }
+    advance_scalar(s, i, end);
+}
+
+__attribute__((target("avx2,fma")))
+static void advance_avx2(const StepArrays *s, size_t begin, size_t end) {
+    __m256 k = _mm256_set1_ps(-V0_SQUARED * s->dt);
+    __m256 core = _mm256_set1_ps(CORE_SQUARED);
+    __m256 dt = _mm256_set1_ps(s->dt);
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 x = _mm256_loadu_ps(s->x + i), y = _mm256_loadu_ps(s->y + i), z = _mm256_loadu_ps(s->z + i);
+        __m256 r2 = _mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, _mm256_fmadd_ps(z, z, core)));
+        __m256 f = _mm256_div_ps(k, r2);
+        __m256 vx = _mm256_fmadd_ps(f, x, _mm256_loadu_ps(s->vx + i));
+        __m256 vy = _mm256_fmadd_ps(f, y, _mm256_loadu_ps(s->vy + i));
+        __m256 vz = _mm256_fmadd_ps(f, z, _mm256_loadu_ps(s->vz + i));
+        _mm256_storeu_ps(s->vx + i, vx);
+        _mm256_storeu_ps(s->vy + i, vy);
+        _mm256_storeu_ps(s->vz + i, vz);
+        _mm256_storeu_ps(s->nx + i, _mm256_fmadd_ps(vx, dt, x));
+        _mm256_storeu_ps(s->ny + i, _mm256_fmadd_ps(vy, dt, y));
+        _mm256_storeu_ps(s->nz + i, _mm256_fmadd_ps(vz, dt, z));
+    }
+    advance_scalar(s, i, end);
+}
+
+#elif defined(__aarch64__)
+
+static void advance_neon(const StepArrays *s, size_t begin, size_t end) {
+    float32x4_t k = vdupq_n_f32(-V0_SQUARED * s->dt);
+    float32x4_t core = vdupq_n_f32(CORE_SQUARED);
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        float32x4_t x = vld1q_f32(s->x + i), y = vld1q_f32(s->y + i), z = vld1q_f32(s->z + i);
+        float32x4_t r2 = vfmaq_f32(vfmaq_f32(vfmaq_f32(core, z, z), y, y), x, x);
+        float32x4_t f = vdivq_f32(k, r2);
+        float32x4_t vx = vfmaq_f32(vld1q_f32(s->vx + i), f, x);
+        float32x4_t vy = vfmaq_f32(vld1q_f32(s->vy + i), f, y);
+        float32x4_t vz = vfmaq_f32(vld1q_f32(s->vz + i), f, z);
+        vst1q_f32(s->vx + i, vx);
+        vst1q_f32(s->vy + i, vy);
+        vst1q_f32(s->vz + i, vz);
+        vst1q_f32(s->nx + i, vfmaq_n_f32(x, vx, s->dt));
+        vst1q_f32(s->ny + i, vfmaq_n_f32(y, vy, s->dt));
+        vst1q_f32(s->nz + i, vfmaq_n_f32(z, vz, s->dt));
+    }
+    advance_scalar(s, i, end);
+}
+
+#endif
+
+typedef struct {
+    const char *name;
+    void (*advance)(const StepArrays *, size_t, size_t);
+} SimKernels;
+
+static const SimKernels scalar_kernels = {"scalar", advance_scalar};
+
+static SimKernels best_kernels(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return (SimKernels){"avx2", advance_avx2};
+    }
+    return (SimKernels){"sse2", advance_sse2};
+#elif defined(__aarch64__)
+    return (SimKernels){"neon", advance_neon};
+#else
+    return scalar_kernels;
+#endif
+}
+
+static SimKernels kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernels(void) {
+    kernels = best_kernels();
+}
+
+const char *galaxy_sim_kernels(void) {
+    pthread_once(&kernels_once, pick_kernels);
+    return kernels.name;
+}
+
+void galaxy_sim_force_scalar(bool scalar) {
+    pthread_once(&kernels_once, pick_kernels);
+    kernels = scalar ? scalar_kernels : best_kernels();
+}
+
+// Work stealing. Each worker owns a range of blocks, begin and end packed
+// into one atomic word. The owner takes blocks off the front; a thief cuts
+// the back half off with one compare-and-swap and makes it its own range,
+// where it can be stolen from in turn.
+
+typedef struct {
+    _Atomic uint64_t range;
+    char pad[64 - sizeof(uint64_t)];     // one cache line per worker
+} WorkRange;
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin << 32 | end;
+}
+
+struct GalaxySim {
+    size_t count;
+    float *x[2], *y[2], *z[2];
+    float *vx, *vy, *vz;
+    int front;                   // positions[front] are the current ones
+
+    int threads;
+    pthread_t *workers;
+    WorkRange *ranges;
+    _Atomic uint64_t steals;
+
+    pthread_mutex_t lock;        // covers everything below
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;         // one per step
+    int busy;                    // workers still on this step
+    bool in_flight;
+    bool quit;
+    StepArrays step;
+};
+
+static bool take_block(WorkRange *own, uint32_t *block) {
+    uint64_t range = atomic_load_explicit(&own->range, memory_order_relaxed);
+    for (;;) {
+        uint32_t begin = range >> 32, end = (uint32_t)range;
+        if (begin >= end) return false;
+        if (atomic_compare_exchange_weak_explicit(&own->range, &range, pack_range(begin + 1, end),
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            *block = begin;
+            return true;
+        }
+    }
+}
+
+static bool steal(GalaxySim *sim, int self) {
+    for (int n = 1; n < sim->threads; n++) {
+        WorkRange *victim = &sim->ranges[(self + n) % sim->threads];
+        uint64_t range = atomic_load_explicit(&victim->range, memory_order_relaxed);
+        for (;;) {
+            uint32_t begin = range >> 32, end = (uint32_t)range;
+            if (begin >= end) break;
+            uint32_t middle = begin + (end - begin) / 2;
+            if (atomic_compare_exchange_weak_explicit(&victim->range, &range, pack_range(begin, middle),
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                atomic_store_explicit(&sim->ranges[self].range, pack_range(middle, end), memory_order_relaxed);
+                atomic_fetch_add_explicit(&sim->steals, 1, memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void run_blocks(GalaxySim *sim, int self, const StepArrays *step) {
+    uint32_t block;
+    do {
+        while (take_block(&sim->ranges[self], &block)) {
+            size_t begin = (size_t)block * BLOCK_STARS;
+            size_t end = begin + BLOCK_STARS < sim->count ? begin + BLOCK_STARS : sim->count;
+            kernels.advance(step, begin, end);
+        }
+    } while (steal(sim, self));
+}
+
+typedef struct {
+    GalaxySim *sim;
+    int index;
+} WorkerArgs;
+
+static void *worker_main(void *arg) {
+    WorkerArgs args = *(WorkerArgs *)arg;
+    free(arg);
+    GalaxySim *sim = args.sim;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&sim->lock);
+    for (;;) {
+        while (!sim->quit && sim->generation == seen) pthread_cond_wait(&sim->start, &sim->lock);
+        if (sim->quit) break;
+        seen = sim->generation;
+        StepArrays step = sim->step;
+        pthread_mutex_unlock(&sim->lock);
+
+        run_blocks(sim, args.index, &step);
+
+        pthread_mutex_lock(&sim->lock);
+        if (--sim->busy == 0) pthread_cond_signal(&sim->done);
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return NULL;
+}
+
+static float *alloc_floats(size_t count) {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, (count ? count : 1) * sizeof(float)) != 0) return NULL;
+    return p;
+}
+
+GalaxySim *galaxy_sim_new(const Star *stars, size_t count, int threads) {
+    pthread_once(&kernels_once, pick_kernels);
+    if (count > (size_t)UINT32_MAX * BLOCK_STARS) return NULL;
+    GalaxySim *sim = calloc(1, sizeof(GalaxySim));
+    if (sim == NULL) return NULL;
+    sim->count = count;
+
+    float **arrays[] = {&sim->x[0], &sim->y[0], &sim->z[0], &sim->x[1], &sim->y[1], &sim->z[1],
+                        &sim->vx, &sim->vy, &sim->vz};
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        *arrays[i] = alloc_floats(count);
+        if (*arrays[i] == NULL) {
+            galaxy_sim_free(sim);
+            return NULL;
+        }
+    }
+
+    // Counter-clockwise at the circular speed for each star's radius
+    for (size_t i = 0; i < count; i++) {
+        float x = stars[i].x, y = stars[i].y;
+        float r2 = x * x + y * y;
+        float speed = sqrtf(V0_SQUARED / (r2 + CORE_SQUARED));   // v_c / r
+        sim->x[0][i] = x;
+        sim->y[0][i] = y;
+        sim->z[0][i] = stars[i].z;
+        sim->vx[i] = -y * speed;
+        sim->vy[i] = x * speed;
+        sim->vz[i] = 0;
+    }
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    sim->threads = threads;
+    sim->ranges = aligned_alloc(64, threads * sizeof(WorkRange));
+    sim->workers = calloc(threads, sizeof(pthread_t));
+    pthread_mutex_init(&sim->lock, NULL);
+    pthread_cond_init(&sim->start, NULL);
+    pthread_cond_init(&sim->done, NULL);
+    if (sim->ranges == NULL || sim->workers == NULL) {
+        sim->threads = 0;
+        galaxy_sim_free(sim);
+        return NULL;
+    }
+    for (int i = 0; i < threads; i++) {
+        atomic_init(&sim->ranges[i].range, 0);
+        WorkerArgs *args = malloc(sizeof(WorkerArgs));
+        args->sim = sim;
+        args->index = i;
+        if (pthread_create(&sim->workers[i], NULL, worker_main, args) != 0) {
+            free(args);
+            sim->threads = i;
+            galaxy_sim_free(sim);
+            return NULL;
+        }
+    }
+    return sim;
+}
+
+void galaxy_sim_free(GalaxySim *sim) {
+    if (sim == NULL) return;
+    if (sim->workers != NULL) {
+        pthread_mutex_lock(&sim->lock);
+        sim->quit = true;
+        pthread_cond_broadcast(&sim->start);
+        pthread_mutex_unlock(&sim->lock);
+        for (int i = 0; i < sim->threads; i++) pthread_join(sim->workers[i], NULL);
+        pthread_mutex_destroy(&sim->lock);
+        pthread_cond_destroy(&sim->start);
+        pthread_cond_destroy(&sim->done);
+    }
+    free(sim->workers);
+    free(sim->ranges);
+    for (int b = 0; b < 2; b++) {
+        free(sim->x[b]);
+        free(sim->y[b]);
+        free(sim->z[b]);
+    }
+    free(sim->vx);
+    free(sim->vy);
+    free(sim->vz);
+    free(sim);
+}
+
+void galaxy_sim_step(GalaxySim *sim, float dt) {
+    galaxy_sim_wait(sim);
+
+    int back = sim->front ^ 1;
+    uint32_t blocks = (uint32_t)((sim->count + BLOCK_STARS - 1) / BLOCK_STARS);
+    for (int i = 0; i < sim->threads; i++) {
+        uint32_t begin = (uint64_t)blocks * i / sim->threads;
+        uint32_t end = (uint64_t)blocks * (i + 1) / sim->threads;
+        atomic_store_explicit(&sim->ranges[i].range, pack_range(begin, end), memory_order_relaxed);
+    }
+
+    pthread_mutex_lock(&sim->lock);
+    sim->step = (StepArrays){sim->x[sim->front], sim->y[sim->front], sim->z[sim->front],
+                             sim->vx, sim->vy, sim->vz,
+                             sim->x[back], sim->y[back], sim->z[back], dt};
+    sim->busy = sim->threads;
+    sim->in_flight = true;
+    sim->generation++;
+    pthread_cond_broadcast(&sim->start);
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void galaxy_sim_wait(GalaxySim *sim) {
+    pthread_mutex_lock(&sim->lock);
+    if (sim->in_flight) {
+        while (sim->busy > 0) pthread_cond_wait(&sim->done, &sim->lock);
+        sim->in_flight = false;
+        sim->front ^= 1;
+    }
+    pthread_mutex_unlock(&sim->lock);
+}
+
+size_t galaxy_sim_count(const GalaxySim *sim) {
+    return sim->count;
+}
+
+const float *galaxy_sim_x(const GalaxySim *sim) {
+    return sim->x[sim->front];
+}
+
+const float *galaxy_sim_y(const GalaxySim *sim) {
+    return sim->y[sim->front];
+}
+
+const float *galaxy_sim_z(const GalaxySim *sim) {
+    return sim->z[sim->front];
+}
+
+// Lz = x vy - y vx. The kick is along x and the drift along v, so neither
+// half of a step changes it beyond rounding.
+double galaxy_sim_angular_momentum(const GalaxySim *sim) {
+    const float *x = galaxy_sim_x(sim), *y = galaxy_sim_y(sim);
+    double total = 0;
+    for (size_t i = 0; i < sim->count; i++) total += (double)x[i] * sim->vy[i] - (double)y[i] * sim->vx[i];
+    return total;
+}
+
+int galaxy_sim_threads(const GalaxySim *sim) {
+    return sim->threads;
+}
+
+uint64_t galaxy_sim_steals(const GalaxySim *sim) {
+    return atomic_load_explicit(&sim->steals, memory_order_relaxed);
+}
@@ -0,0 +1,60 @@
+#ifndef GALAXY_SIM_H
+#define GALAXY_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "galaxy_stars.h"
+
+// Stars orbiting the galaxy's centre. There is no star-star gravity: every
+// star falls in the same smooth potential, one with a flat rotation curve,
+// so the inner disc turns faster than the outer and the arms wind up as
+// they do in a real spiral. Angular momentum is conserved exactly by the
+// integrator (semi-implicit Euler), which the benchmark checks.
+//
+// Positions and velocities are kept as separate float arrays, so a step is
+// straight vector loads and stores (AVX2 or SSE2 on x86-64, NEON on ARM64,
+// picked once at startup). Steps run on a pool of worker threads that each
+// start on an equal share of the stars and steal half of a busier
+// worker's remaining share once theirs runs out.
+//
+// Positions are double-buffered. galaxy_sim_step() starts computing the
+// next positions into the back buffer and returns at once; the front
+// buffer stays as it is for the renderer to upload until galaxy_sim_wait()
+// makes the finished step the front.
+
+typedef struct GalaxySim GalaxySim;
+
+// Stars at rest on circular orbits, from stars' positions. threads 0 means
+// one per core.
+GalaxySim *galaxy_sim_new(const Star *stars, size_t count, int threads);
+void galaxy_sim_free(GalaxySim *sim);
+
+// Start a step of dt seconds; one at a time
+void galaxy_sim_step(GalaxySim *sim, float dt);
+
+// Wait for the step in flight, if any, and make its positions current
+void galaxy_sim_wait(GalaxySim *sim);
+
+// Current positions, count floats each; they stay put until the next wait
+size_t galaxy_sim_count(const GalaxySim *sim);
+const float *galaxy_sim_x(const GalaxySim *sim);
+const float *galaxy_sim_y(const GalaxySim *sim);
+const float *galaxy_sim_z(const GalaxySim *sim);
+
+// Total angular momentum about the axis, between steps; constant up to
+// float rounding
+double galaxy_sim_angular_momentum(const GalaxySim *sim);
+
+// Worker threads, and the ranges taken from another worker since creation
+int galaxy_sim_threads(const GalaxySim *sim);
+uint64_t galaxy_sim_steals(const GalaxySim *sim);
+
+// Name of the kernels in use
+const char *galaxy_sim_kernels(void);
+
+// Benchmarks only: switch to the plain C kernels and back
+void galaxy_sim_force_scalar(bool scalar);
+
+#endif
@@ -0,0 +1,32 @@
+#include "galaxy_stars.h"
+
+#include <math.h>
+
+// xorshift32: rand() is too slow for a million stars and not reentrant
+static inline float next_unit(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+void galaxy_generate(Star *stars, size_t count, uint32_t seed) {
+    uint32_t state = seed ? seed : 1;
+    for (size_t i = 0; i < count; i++) {
+        float angle = next_unit(&state) * 6.28f * 3; // up to 3 full spirals
+        float radius = next_unit(&state) * 2.0f;
+        float arm_offset = (next_unit(&state) - 0.5f) * 0.2f;
+
+        stars[i].x = cosf(angle) * radius + arm_offset;
+        stars[i].y = sinf(angle) * radius + arm_offset;
+        stars[i].z = (next_unit(&state) - 0.5f) * 0.2f;
+
+        // Color: mostly white with slight tints
+        stars[i].r = (uint8_t)(255 * (0.8f + next_unit(&state) * 0.2f));
+        stars[i].g = (uint8_t)(255 * (0.8f + next_unit(&state) * 0.2f));
+        stars[i].b = (uint8_t)(255 * (0.8f + next_unit(&state) * 0.2f));
+        stars[i].a = (uint8_t)(255 * (0.3f + next_unit(&state) * 0.7f));
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef GALAXY_STARS_H
+#define GALAXY_STARS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The stars themselves, with no GL: galaxy_sim moves them and
+// galaxy_render draws them.
+
+// 16 bytes a star, interleaved as the renderer's VBO holds it
+typedef struct {
+    float x, y, z;
+    uint8_t r, g, b, a;      // a: brightness of the glow
+} Star;
+
+// Spiral galaxy of count stars, the same for the same seed
+void galaxy_generate(Star *stars, size_t count, uint32_t seed);
+
+#endif
@@ -0,0 +1,552 @@
+#include "gossip.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+// Dead and departed members are remembered this many periods so stale
+// gossip about them cannot bring them back
+const uint64_t TOMBSTONE_PERIODS = 60;
+
+// Relayed probes use the top half of the sequence space so they never match our own
+const uint32_t RELAY_SEQ_BIT = 0x80000000u;
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v >> 16);
+    put_u16(p + 2, v);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)get_u16(p) << 16 | get_u16(p + 2);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+// Serial number arithmetic so incarnations can wrap
+static bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static bool is_live(uint8_t state) {
+    return state == MEMBER_ALIVE || state == MEMBER_SUSPECT;
+}
+
+// 16-byte address (IPv4 v4-mapped) and port, the layout used on the wire
+static void addr_pack(const struct sockaddr_storage *addr, uint8_t *out, uint16_t *port) {
+    memset(out, 0, 16);
+    *port = 0;
+    if (addr == NULL) return;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        out[10] = out[11] = 0xff;
+        memcpy(out + 12, &in->sin_addr, 4);
+        *port = ntohs(in->sin_port);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        memcpy(out, &in6->sin6_addr, 16);
+        *port = ntohs(in6->sin6_port);
+    }
+}
+
+static void addr_unpack(const uint8_t *in, uint16_t port, struct sockaddr_storage *addr) {
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    memset(addr, 0, sizeof(*addr));
+    if (memcmp(in, v4_prefix, 12) == 0) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, in + 12, 4);
+        sin->sin_port = htons(port);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, in, 16);
+        sin6->sin6_port = htons(port);
+    }
+}
+
+static bool addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    uint8_t pa[16], pb[16];
+    uint16_t porta, portb;
+    addr_pack(a, pa, &porta);
+    addr_pack(b, pb, &portb);
+    return porta == portb && memcmp(pa, pb, 16) == 0;
+}
+
+Gossip::Gossip(const Announcement *me, const GossipConfig &cfg,
+               gossip_send_fn send, gossip_member_fn member, void *data, uint64_t now_ms)
+    : self(*me), config(cfg), send_fn(send), member_fn(member), user(data), rng(me->node_id) {
+    probe_period_end = now_ms + config.period_ms;
+    last_beacon = now_ms;
+    next_sweep = now_ms;
+    next_push_pull = now_ms + config.push_pull_ms;
+    sync_deadline = now_ms + config.beacon_ms;
+}
+
+uint32_t Gossip::retransmit_limit() const {
+    return config.retransmit_mult * (uint32_t)ceil(log10((double)live_count + 2));
+}
+
+uint64_t Gossip::suspicion_ms() const {
+    double scale = log10((double)live_count + 1);
+    if (scale < 1) scale = 1;
+    return (uint64_t)(config.suspicion_mult * scale * config.period_ms);
+}
+
+void Gossip::enqueue(uint64_t node_id) {
+    GossipMember &m = table[node_id];
+    if (m.queued == 0) return;
+    m.queued = 0;
+    if (pending.empty()) pending.resize(1);
+    pending[0].push_back(node_id);
+}
+
+void Gossip::set_state(GossipMember *m, uint8_t state, uint64_t now_ms) {
+    bool was_live = is_live(m->state);
+    m->state = state;
+    m->changed_ms = now_ms;
+
+    if (was_live && !is_live(state)) {
+        live_count--;
+        member_fn((const struct sockaddr *)&m->addr, &m->info, false, user);
+    }
+    enqueue(m->info.node_id);
+}
+
+// Someone thinks we are suspect or dead: outbid them. Our record leads every
+// packet we send, so whoever hears from us next spreads the new incarnation.
+void Gossip::refute(uint32_t incarnation) {
+    if (self_state != MEMBER_ALIVE) return;
+    self.seq = incarnation + 1;
+    counters.refuted++;
+}
+
+// SWIM precedence: a higher incarnation wins; at the same incarnation
+// suspect beats alive and dead or left beat both
+void Gossip::apply(const Update &u, bool spread, uint64_t now_ms) {
+    if (u.info.node_id == self.node_id) {
+        if (u.state != MEMBER_ALIVE && !seq_before(u.info.seq, self.seq)) refute(u.info.seq);
+        return;
+    }
+
+    auto it = table.find(u.info.node_id);
+    if (it == table.end()) {
+        GossipMember &m = table[u.info.node_id];
+        m.addr = u.addr;
+        m.info = u.info;
+        m.state = u.state;
+        m.changed_ms = now_ms;
+        m.queued = -1;
+        if (!is_live(u.state)) return;  // only a tombstone
+
+        live_count++;
+        probe_order.push_back(u.info.node_id);
+        std::swap(probe_order.back(), probe_order[probe_pos + rng() % (probe_order.size() - probe_pos)]);
+        member_fn((const struct sockaddr *)&m.addr, &m.info, true, user);
+        if (spread) enqueue(u.info.node_id);
+        return;
+    }
+
+    GossipMember *m = &it->second;
+    bool accept;
+    if (u.state == MEMBER_ALIVE) {
+        accept = seq_before(m->info.seq, u.info.seq);
+    } else if (u.state == MEMBER_SUSPECT) {
+        // Suspicion never revives a dead member; only its own alive record does
+        if (m->state == MEMBER_ALIVE) accept = !seq_before(u.info.seq, m->info.seq);
+        else accept = m->state == MEMBER_SUSPECT && seq_before(m->info.seq, u.info.seq);
+    } else {
+        accept = is_live(m->state) ? !seq_before(u.info.seq, m->info.seq)
+                                   : seq_before(m->info.seq, u.info.seq);
+    }
+    if (!accept) return;
+
+    bool was_live = is_live(m->state);
+    if (u.state == MEMBER_ALIVE) {
+        // Moved, renamed or came back: drop the old entry before announcing the new one
+        if (was_live && !addr_equal(&m->addr, &u.addr)) {
+            member_fn((const struct sockaddr *)&m->addr, &m->info, false, user);
+        }
+        m->addr = u.addr;
+        m->info = u.info;
+        if (!was_live) {
+            live_count++;
+            probe_order.push_back(u.info.node_id);
+        }
+        m->state = MEMBER_ALIVE;
+        m->changed_ms = now_ms;
+        member_fn((const struct sockaddr *)&m->addr, &m->info, true, user);
+        if (spread) enqueue(u.info.node_id);
+        return;
+    }
+
+    m->info.seq = u.info.seq;
+    set_state(m, u.state, now_ms);
+}
+
+size_t Gossip::encode_update(uint8_t *p, size_t room, uint8_t state, const Announcement *info,
+                             const struct sockaddr_storage *addr) {
+    size_t name_len = strnlen(info->name, ANNOUNCE_MAX_NAME);
+    size_t key_len = (info->capabilities & CAP_SECURE) ? ANNOUNCE_KEY_SIZE : 0;
+    size_t total = GOSSIP_UPDATE_HEADER_SIZE + name_len + key_len;
+    if (room < total) return 0;
+
+    uint16_t port;
+    p[0] = state;
+    p[1] = (uint8_t)name_len;
+    addr_pack(addr, p + 20, &port);
+    put_u16(p + 2, port);
+    put_u32(p + 4, info->seq);
+    put_u64(p + 8, info->node_id);
+    put_u32(p + 16, info->capabilities);
+    memcpy(p + GOSSIP_UPDATE_HEADER_SIZE, info->name, name_len);
+    memcpy(p + GOSSIP_UPDATE_HEADER_SIZE + name_len, info->public_key, key_len);
+    return total;
+}
+
+// Header and our own record, which leads every packet
+size_t Gossip::begin_packet(uint8_t *buf, uint8_t type, uint32_t seq, uint64_t target) {
+    buf[0] = 'P';
+    buf[1] = 'G';
+    buf[2] = GOSSIP_VERSION;
+    buf[3] = type;
+    put_u64(buf + 4, self.node_id);
+    put_u32(buf + 12, seq);
+    put_u64(buf + 16, target);
+    buf[25] = synced ? GOSSIP_FLAG_SYNCED : 0;
+    buf[26] = buf[27] = 0;
+    return GOSSIP_HEADER_SIZE + encode_update(buf + GOSSIP_HEADER_SIZE, GOSSIP_MTU - GOSSIP_HEADER_SIZE,
+                                              self_state, &self, NULL);
+}
+
+void Gossip::finish_packet(const struct sockaddr *to, uint8_t *buf, size_t len, unsigned count) {
+    buf[24] = (uint8_t)count;
+    counters.packets_sent++;
+    counters.bytes_sent += len;
+    send_fn(to, buf, len, user);
+}
+
+// Our own record, then as many pending updates as fit, least-sent first
+void Gossip::send_packet(const struct sockaddr *to, uint8_t type, uint32_t seq, uint64_t target) {
+    uint8_t buf[GOSSIP_MTU];
+    size_t len = begin_packet(buf, type, seq, target);
+    unsigned count = 1;
+
+    uint32_t limit = retransmit_limit();
+    if (pending.size() < limit) pending.resize(limit);
+    std::vector<uint64_t> sent;
+    bool room = true;
+    for (uint32_t t = 0; t < pending.size() && room; t++) {
+        // Newest first within a bucket, so fresh news is not stuck behind a backlog
+        std::vector<uint64_t> &bucket = pending[t];
+        while (!bucket.empty()) {
+            uint64_t id = bucket.back();
+            auto it = table.find(id);
+            if (it == table.end() || it->second.queued != (int32_t)t ||
+                std::find(sent.begin(), sent.end(), id) != sent.end()) {
+                bucket.pop_back();
+                continue;
+            }
+
+            size_t n = count < 255 ? encode_update(buf + len, sizeof(buf) - len, it->second.state,
+                                                   &it->second.info, &it->second.addr) : 0;
+            if (n == 0) {
+                room = false;
+                break;
+            }
+            len += n;
+            count++;
+            sent.push_back(id);
+            bucket.pop_back();
+        }
+    }
+
+    // Move what went out up one bucket only now, so nothing goes twice in one packet
+    for (uint64_t id : sent) {
+        GossipMember &m = table[id];
+        m.queued++;
+        if ((uint32_t)m.queued < limit) pending[m.queued].push_back(id);
+        else m.queued = -1;
+    }
+
+    finish_packet(to, buf, len, count);
+}
+
+// The whole live member list, over as many packets as it takes, so a joiner
+// starts with the full picture instead of waiting for gossip to reach it
+void Gossip::send_sync(const struct sockaddr *to) {
+    uint8_t buf[GOSSIP_MTU];
+    size_t len = begin_packet(buf, GOSSIP_SYNC, 0, 0);
+    unsigned count = 1;
+
+    for (auto &entry : table) {
+        if (!is_live(entry.second.state)) continue;
+        size_t n = count < 255 ? encode_update(buf + len, sizeof(buf) - len, entry.second.state,
+                                               &entry.second.info, &entry.second.addr) : 0;
+        if (n == 0) {
+            finish_packet(to, buf, len, count);
+            len = begin_packet(buf, GOSSIP_SYNC, 0, 0);
+            count = 1;
+            n = encode_update(buf + len, sizeof(buf) - len, entry.second.state,
+                              &entry.second.info, &entry.second.addr);
+        }
+        len += n;
+        count++;
+    }
+    finish_packet(to, buf, len, count);
+}
+
+bool Gossip::handle(const struct sockaddr *from, const uint8_t *data, size_t len, uint64_t now_ms) {
+    if (len < GOSSIP_HEADER_SIZE || data[0] != 'P' || data[1] != 'G' || data[2] != GOSSIP_VERSION) {
+        counters.malformed++;
+        return false;
+    }
+    uint8_t type = data[3];
+    uint64_t sender = get_u64(data + 4);
+    uint32_t seq = get_u32(data + 12);
+    uint64_t target = get_u64(data + 16);
+    unsigned count = data[24];
+    uint8_t flags = data[25];
+
+    // Our own multicast looped back
+    if (sender == self.node_id) return true;
+
+    counters.packets_received++;
+    counters.bytes_received += len;
+
+    struct sockaddr_storage source;
+    memset(&source, 0, sizeof(source));
+    memcpy(&source, from, from->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+    // Everyone who could hear a beacon heard it from the multicast group
+    // itself; gossiping the beacon's sender as well would only crowd out news
+    bool quiet = type == GOSSIP_JOIN;
+
+    size_t pos = GOSSIP_HEADER_SIZE;
+    for (unsigned i = 0; i < count; i++) {
+        if (len - pos < GOSSIP_UPDATE_HEADER_SIZE) break;
+        const uint8_t *p = data + pos;
+        size_t name_len = p[1];
+        size_t key_len = (get_u32(p + 16) & CAP_SECURE) ? ANNOUNCE_KEY_SIZE : 0;
+        if (name_len > ANNOUNCE_MAX_NAME || len - pos < GOSSIP_UPDATE_HEADER_SIZE + name_len + key_len) break;
+
+        Update u;
+        memset(&u.info, 0, sizeof(u.info));
+        u.state = p[0];
+        u.info.version = ANNOUNCE_VERSION;
+        u.info.seq = get_u32(p + 4);
+        u.info.node_id = get_u64(p + 8);
+        u.info.capabilities = get_u32(p + 16);
+        memcpy(u.info.name, p + GOSSIP_UPDATE_HEADER_SIZE, name_len);
+        u.info.name[name_len] = '\0';
+        memcpy(u.info.public_key, p + GOSSIP_UPDATE_HEADER_SIZE + name_len, key_len);
+
+        static const uint8_t unspecified[16] = {0};
+        if (memcmp(p + 20, unspecified, 16) == 0) u.addr = source;
+        else addr_unpack(p + 20, get_u16(p + 2), &u.addr);
+
+        pos += GOSSIP_UPDATE_HEADER_SIZE + name_len + key_len;
+        if (u.state > MEMBER_LEFT) continue;
+        apply(u, !quiet, now_ms);
+    }
+
+    if (type == GOSSIP_SYNC && (flags & GOSSIP_FLAG_SYNCED)) synced = true;
+    if (!synced && now_ms >= next_pull) {
+        next_pull = now_ms + config.period_ms;
+        send_packet(from, GOSSIP_PULL, 0, 0);
+    }
+
+    switch (type) {
+    case GOSSIP_PING:
+        send_packet(from, GOSSIP_ACK, seq, self.node_id);
+        break;
+
+    case GOSSIP_ACK:
+        if (seq == probe_seq && target == probe_target) {
+            probe_acked = true;
+        } else {
+            auto it = relays.find(seq);
+            if (it != relays.end() && it->second.target == target) {
+                send_packet((const struct sockaddr *)&it->second.requester, GOSSIP_ACK,
+                            it->second.requester_seq, target);
+                relays.erase(it);
+            }
+        }
+        break;
+
+    case GOSSIP_PING_REQ: {
+        auto it = table.find(target);
+        if (it == table.end() || !is_live(it->second.state)) break;
+        uint32_t relay_seq = RELAY_SEQ_BIT | (++relay_counter & ~RELAY_SEQ_BIT);
+        relays[relay_seq] = Relay{source, seq, target, now_ms + config.period_ms};
+        send_packet((const struct sockaddr *)&it->second.addr, GOSSIP_PING, relay_seq, target);
+        break;
+    }
+
+    case GOSSIP_PULL:
+        send_sync(from);
+        break;
+
+    case GOSSIP_JOIN: {
+        // Only a few members answer, so a beacon costs the joiner O(1) replies,
+        // and never one that is still waiting for its own list
+        if (!synced) break;
+        double p = (double)config.sync_replies / (live_count ? live_count : 1);
+        if (p >= 1 || std::uniform_real_distribution<double>(0, 1)(rng) < p) {
+            send_sync(from);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+    return true;
+}
+
+GossipMember *Gossip::random_member(uint64_t exclude) {
+    if (probe_order.empty()) return NULL;
+    for (int tries = 0; tries < 8; tries++) {
+        auto it = table.find(probe_order[rng() % probe_order.size()]);
+        if (it != table.end() && it->first != exclude && is_live(it->second.state)) return &it->second;
+    }
+    return NULL;
+}
+
+void Gossip::start_probe(uint64_t now_ms) {
+    probe_period_end = now_ms + config.period_ms;
+    if (live_count == 0) return;
+
+    for (int pass = 0; pass < 2; pass++) {
+        while (probe_pos < probe_order.size()) {
+            auto it = table.find(probe_order[probe_pos++]);
+            if (it == table.end() || !is_live(it->second.state)) continue;
+
+            probe_target = it->first;
+            probe_seq = (probe_seq + 1) & ~RELAY_SEQ_BIT;
+            probe_acked = false;
+            probe_indirect = false;
+            probe_ack_deadline = now_ms + config.ack_timeout_ms;
+            counters.probes++;
+            send_packet((const struct sockaddr *)&it->second.addr, GOSSIP_PING, probe_seq, probe_target);
+            return;
+        }
+
+        // End of a round: reshuffle the live members and start over
+        probe_order.clear();
+        for (auto &entry : table) {
+            if (is_live(entry.second.state)) probe_order.push_back(entry.first);
+        }
+        std::shuffle(probe_order.begin(), probe_order.end(), rng);
+        probe_pos = 0;
+    }
+}
+
+uint64_t Gossip::tick(uint64_t now_ms) {
+    if (now_ms >= next_sweep) {
+        for (auto it = relays.begin(); it != relays.end();) {
+            if (it->second.expires_ms <= now_ms) it = relays.erase(it);
+            else ++it;
+        }
+
+        uint64_t suspicion = suspicion_ms();
+        uint64_t tombstone = TOMBSTONE_PERIODS * config.period_ms;
+        for (auto it = table.begin(); it != table.end();) {
+            GossipMember &m = it->second;
+            if (m.state == MEMBER_SUSPECT && now_ms - m.changed_ms >= suspicion) {
+                set_state(&m, MEMBER_DEAD, now_ms);
+                counters.failed++;
+            } else if (!is_live(m.state) && now_ms - m.changed_ms >= tombstone) {
+                it = table.erase(it);
+                continue;
+            }
+            ++it;
+        }
+        next_sweep = now_ms + config.period_ms;
+    }
+
+    if (probe_target) {
+        if (!probe_acked && !probe_indirect && now_ms >= probe_ack_deadline) {
+            // Rule out a bad path between us and the target before suspecting it
+            for (uint32_t i = 0; i < config.indirect_probes; i++) {
+                GossipMember *via = random_member(probe_target);
+                if (via == NULL) break;
+                counters.indirect_probes++;
+                send_packet((const struct sockaddr *)&via->addr, GOSSIP_PING_REQ, probe_seq, probe_target);
+            }
+            probe_indirect = true;
+        }
+        if (now_ms >= probe_period_end) {
+            auto it = table.find(probe_target);
+            if (!probe_acked && it != table.end() && it->second.state == MEMBER_ALIVE) {
+                set_state(&it->second, MEMBER_SUSPECT, now_ms);
+                counters.suspected++;
+            }
+            probe_target = 0;
+        }
+    }
+    if (probe_target == 0 && now_ms >= probe_period_end) start_probe(now_ms);
+
+    // Nobody with a full list answered yet: try another member
+    if (!synced && now_ms >= sync_deadline) synced = true;
+    if (!synced && live_count && now_ms >= next_pull) {
+        GossipMember *m = random_member(0);
+        if (m) send_packet((const struct sockaddr *)&m->addr, GOSSIP_PULL, 0, 0);
+        next_pull = now_ms + config.period_ms;
+    }
+
+    // Anti-entropy: swap full lists with one member now and then, which repairs
+    // whatever a lost SYNC or exhausted piggybacking left out
+    if (now_ms >= next_push_pull) {
+        GossipMember *m = synced ? random_member(0) : NULL;
+        if (m) {
+            send_sync((const struct sockaddr *)&m->addr);
+            send_packet((const struct sockaddr *)&m->addr, GOSSIP_PULL, 0, 0);
+        }
+        next_push_pull = now_ms + config.push_pull_ms;
+    }
+
+    // The interval stretches with the cluster so the group-wide beacon rate stays flat
+    uint64_t next_beacon = last_beacon + (uint64_t)(config.beacon_ms * (live_count / 8 + 1) * beacon_jitter);
+    if (now_ms >= next_beacon) {
+        send_packet(NULL, GOSSIP_JOIN, 0, 0);
+        last_beacon = now_ms;
+        beacon_jitter = std::uniform_real_distribution<double>(0.75, 1.25)(rng);
+        next_beacon = last_beacon + (uint64_t)(config.beacon_ms * (live_count / 8 + 1) * beacon_jitter);
+    }
+
+    uint64_t next = probe_period_end < next_beacon ? probe_period_end : next_beacon;
+    if (probe_target && !probe_acked && !probe_indirect && probe_ack_deadline < next) next = probe_ack_deadline;
+    if (next_sweep < next) next = next_sweep;
+    if (next_push_pull < next) next = next_push_pull;
+    return next;
+}
+
+void Gossip::leave() {
+    self_state = MEMBER_LEFT;
+    self.seq++;
+
+    send_packet(NULL, GOSSIP_SYNC, 0, 0);
+    for (uint32_t i = 0; i < config.indirect_probes; i++) {
+        GossipMember *m = random_member(0);
+        if (m == NULL) break;
+        send_packet((const struct sockaddr *)&m->addr, GOSSIP_SYNC, 0, 0);
+    }
+}
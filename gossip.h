@@ -0,0 +1,201 @@
+#ifndef PUTTYNET_GOSSIP_H
+#define PUTTYNET_GOSSIP_H
+
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "announce.h"
+
+// SWIM membership: every period each node probes one member, asks a few
+// others to probe it indirectly if the ack is late, and only then suspects
+// it. Membership changes ride along on the probes and acks, each sent a
+// logarithmic number of times, so per-node traffic stays nearly flat as the
+// cluster grows. Multicast is only used for the join beacon.
+//
+// Packet wire format, all fields big-endian:
+//
+//   0  magic 'P' 'G'     2 bytes
+//   2  version           1 byte
+//   3  type              1 byte
+//   4  sender node id    8 bytes
+//  12  probe sequence    4 bytes
+//  16  target node id    8 bytes, PING_REQ: node to probe, ACK: node that answered
+//  24  update count      1 byte
+//  25  flags             1 byte
+//  26  reserved          2 bytes
+//  28  updates...
+//
+// and each update is
+//
+//   0  state             1 byte
+//   1  name length       1 byte
+//   2  port              2 bytes
+//   4  incarnation       4 bytes
+//   8  node id           8 bytes
+//  16  capabilities      4 bytes
+//  20  address           16 bytes, IPv6 or v4-mapped; all zero means the packet's source
+//  36  name              name length bytes
+//      public key        32 bytes, only with CAP_SECURE
+//
+// The first update of every packet is the sender's own record.
+
+const uint8_t GOSSIP_VERSION = 2;
+const size_t GOSSIP_HEADER_SIZE = 28;
+const size_t GOSSIP_UPDATE_HEADER_SIZE = 36;
+const size_t GOSSIP_MTU = 1400;
+
+// Packet types
+const uint8_t GOSSIP_PING = 1;
+const uint8_t GOSSIP_ACK = 2;
+const uint8_t GOSSIP_PING_REQ = 3;
+const uint8_t GOSSIP_JOIN = 4;     // multicast beacon
+const uint8_t GOSSIP_SYNC = 5;     // the sender's member list, in one or more packets
+const uint8_t GOSSIP_PULL = 6;     // ask one member for a SYNC
+
+// Header flags
+const uint8_t GOSSIP_FLAG_SYNCED = 0x01;   // the sender holds the member list
+
+// Member states
+const uint8_t MEMBER_ALIVE = 0;
+const uint8_t MEMBER_SUSPECT = 1;
+const uint8_t MEMBER_DEAD = 2;
+const uint8_t MEMBER_LEFT = 3;
+
+struct GossipConfig {
+    uint32_t period_ms = 1000;        // one probe per period
+    uint32_t ack_timeout_ms = 400;    // then probe indirectly
+    uint32_t indirect_probes = 3;
+    uint32_t suspicion_mult = 4;      // suspect for mult * log10(members) periods before dead
+    uint32_t retransmit_mult = 4;     // every update rides on mult * log10(members + 1) packets
+    uint32_t beacon_ms = 10000;       // while alone; stretched as the cluster grows
+    uint32_t sync_replies = 3;        // members expected to answer a beacon
+    uint32_t push_pull_ms = 30000;    // full state exchange with one random member
+};
+
+struct GossipStats {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t packets_received;
+    uint64_t bytes_received;
+    uint64_t malformed;
+    uint64_t probes;
+    uint64_t indirect_probes;
+    uint64_t suspected;
+    uint64_t failed;           // members declared dead by this node
+    uint64_t refuted;          // times we were suspected and answered
+};
+
+struct GossipMember {
+    struct sockaddr_storage addr;
+    Announcement info;         // seq is the incarnation
+    uint8_t state;
+    uint64_t changed_ms;       // when the state last changed
+    int32_t queued;            // times the current state was piggybacked, -1 once done
+};
+
+// to is NULL for the multicast group
+typedef void (*gossip_send_fn)(const struct sockaddr *to, const uint8_t *data, size_t len, void *user);
+
+// A member appeared (alive) or went away; addr is where it is reached
+typedef void (*gossip_member_fn)(const struct sockaddr *addr, const Announcement *a, bool alive, void *user);
+
+// One node's membership state. Not thread safe: drive it from the thread
+// that owns its sockets.
+class Gossip {
+public:
+    Gossip(const Announcement *self, const GossipConfig &config,
+           gossip_send_fn send, gossip_member_fn member, void *user, uint64_t now_ms);
+
+    // Returns false for anything that is not a well-formed gossip packet
+    bool handle(const struct sockaddr *from, const uint8_t *data, size_t len, uint64_t now_ms);
+
+    // Run timers; returns the time tick() next needs to run
+    uint64_t tick(uint64_t now_ms);
+
+    // Tell the group we are going, by multicast and to a few members
+    void leave();
+
+    // Alive and suspected members
+    size_t members() const { return live_count; }
+
+    const std::unordered_map<uint64_t, GossipMember> &all() const { return table; }
+
+    void get_stats(GossipStats *stats) const { *stats = counters; }
+
+private:
+    struct Update {
+        uint8_t state;
+        Announcement info;
+        struct sockaddr_storage addr;
+    };
+
+    struct Relay {
+        struct sockaddr_storage requester;
+        uint32_t requester_seq;
+        uint64_t target;
+        uint64_t expires_ms;
+    };
+
+    void apply(const Update &u, bool spread, uint64_t now_ms);
+    void set_state(GossipMember *m, uint8_t state, uint64_t now_ms);
+    void refute(uint32_t incarnation);
+    void enqueue(uint64_t node_id);
+
+    size_t begin_packet(uint8_t *buf, uint8_t type, uint32_t seq, uint64_t target);
+    void finish_packet(const struct sockaddr *to, uint8_t *buf, size_t len, unsigned count);
+    void send_packet(const struct sockaddr *to, uint8_t type, uint32_t seq, uint64_t target);
+    void send_sync(const struct sockaddr *to);
+    size_t encode_update(uint8_t *p, size_t room, uint8_t state, const Announcement *info,
+                         const struct sockaddr_storage *addr);
+
+    void start_probe(uint64_t now_ms);
+    GossipMember *random_member(uint64_t exclude);
+    uint32_t retransmit_limit() const;
+    uint64_t suspicion_ms() const;
+
+    Announcement self;
+    uint8_t self_state = MEMBER_ALIVE;
+    GossipConfig config;
+    gossip_send_fn send_fn;
+    gossip_member_fn member_fn;
+    void *user;
+    std::mt19937_64 rng;
+
+    std::unordered_map<uint64_t, GossipMember> table;
+    size_t live_count = 0;
+    // Updates still being piggybacked, bucketed by how often they were sent.
+    // An id whose member's queued count differs from its bucket is stale.
+    std::vector<std::vector<uint64_t>> pending;
+    std::unordered_map<uint32_t, Relay> relays;
+    uint32_t relay_counter = 0;
+
+    // Probing walks a shuffled list of members so each is probed within a bounded time
+    std::vector<uint64_t> probe_order;
+    size_t probe_pos = 0;
+    uint64_t probe_target = 0;
+    uint32_t probe_seq = 0;
+    bool probe_acked = false;
+    bool probe_indirect = false;
+    uint64_t probe_ack_deadline = 0;
+    uint64_t probe_period_end = 0;
+
+    // A joiner pulls the member list from the first member it hears from.
+    // Only a list from a synced member counts, and only synced members answer
+    // beacons; a node nobody answers by sync_deadline founds the cluster.
+    bool synced = false;
+    uint64_t sync_deadline = 0;
+    uint64_t next_pull = 0;
+    uint64_t next_push_pull = 0;
+
+    uint64_t last_beacon = 0;
+    double beacon_jitter = 0;
+    uint64_t next_sweep = 0;
+
+    GossipStats counters = {};
+};
+
+#endif
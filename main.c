@@ -6,11 +6,28 @@
 #include <gst/gst.h>
 #include <epoxy/gl.h>
 
-static guint wave_timeout_id = 0;  // Timeout for the wave animation
-static double wave_radius = 0;     // Current radius of the wave
-
-// Current icon scaling factor
+// The icon zooms on hover and sends out a ring. Both animate from the
+// canvas's frame clock, only while they are moving, and only the area
+// they cover is redrawn; an idle window does no work at all.
+#define ICON_ZOOM 1.1            // icon_scale while hovered
+#define ICON_ZOOM_PER_SEC 1.0    // how fast icon_scale moves toward it
+#define WAVE_SPEED 200.0         // ring growth, pixels a second
+#define WAVE_MAX_RADIUS 200.0
+#define FOOTER_HEIGHT 40
+
+static GdkPixbuf *icon = NULL;
+static guint animation_id = 0;     // tick callback, 0 while nothing moves
+static gint64 last_frame_us = 0;
+static double wave_radius = 0;     // current radius of the ring, 0 for none
+
+// Current icon scaling factor, and the one it is heading for
 static double icon_scale = 1.0;
+static double icon_target = 1.0;
+
+// The icon at full zoom and the footer, drawn once; frames only copy them
+static cairo_surface_t *icon_surface = NULL;
+static cairo_surface_t *footer_surface = NULL;
+static int footer_width = 0;
 
 // GStreamer pipeline for sound playback
 GstElement *pipeline = NULL;
@@ -40,82 +57,174 @@ void stop_hover_sound() {
     }
 }
 
-// Function to draw footer (same as before)
-void draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data) {
-    int width = gtk_widget_get_allocated_width(widget);
-    int height = gtk_widget_get_allocated_height(widget);
+// Surface for widget's window, in its device scale, w by h logical pixels
+static cairo_surface_t *create_surface(GtkWidget *widget, int w, int h) {
+    return gdk_window_create_similar_image_surface(gtk_widget_get_window(widget), CAIRO_FORMAT_ARGB32, w, h,
+                                                   gtk_widget_get_scale_factor(widget));
+}
+
+static void render_footer(GtkWidget *widget, int width) {
+    if (footer_surface) cairo_surface_destroy(footer_surface);
+    footer_surface = create_surface(widget, width, FOOTER_HEIGHT);
+    footer_width = width;
 
+    cairo_t *cr = cairo_create(footer_surface);
     // Draw the footer background (transparent grey)
-    cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.7);  // Semi-transparent grey
-    cairo_rectangle(cr, 0, height - 40, width, 40); // Footer size
-    cairo_fill(cr);
+    cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.7);
+    cairo_paint(cr);
 
     // Draw the footer text
     cairo_set_source_rgb(cr, 1, 1, 1);  // White text
     cairo_select_font_face(cr, "Arial", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
     cairo_set_font_size(cr, 14);
-    cairo_move_to(cr, 20, height - 15);  // Position of the text
+    cairo_move_to(cr, 20, FOOTER_HEIGHT - 15);  // Position of the text
     cairo_show_text(cr, "More nodes will show as they come online");
+    cairo_destroy(cr);
 }
 
-// Function to draw the icon
-void draw_icon(GtkWidget *widget, cairo_t *cr, gpointer data) {
+// Function to draw footer, rendered again only when the width changes
+gboolean draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data) {
     int width = gtk_widget_get_allocated_width(widget);
     int height = gtk_widget_get_allocated_height(widget);
 
-    // Load the icon image (png)
-    GtkImage *icon = GTK_IMAGE(data);
-    GdkPixbuf *pixbuf = gtk_image_get_pixbuf(icon);
+    GdkRectangle clip;
+    GdkRectangle footer = {0, height - FOOTER_HEIGHT, width, FOOTER_HEIGHT};
+    if (!gdk_cairo_get_clip_rectangle(cr, &clip) || !gdk_rectangle_intersect(&clip, &footer, NULL)) return FALSE;
 
-    if (pixbuf != NULL) {
-        int img_width = gdk_pixbuf_get_width(pixbuf);
-        int img_height = gdk_pixbuf_get_height(pixbuf);
+    if (footer_surface == NULL || footer_width != width) render_footer(widget, width);
+    cairo_set_source_surface(cr, footer_surface, 0, height - FOOTER_HEIGHT);
+    cairo_paint(cr);
+    return FALSE;
+}
 
-        // Apply scaling to the icon
-        int scaled_width = (int)(img_width * icon_scale);
-        int scaled_height = (int)(img_height * icon_scale);
+// Where the icon is at scale, centred in the canvas
+static GdkRectangle icon_rect(GtkWidget *widget, double scale) {
+    int w = (int)ceil(gdk_pixbuf_get_width(icon) * scale);
+    int h = (int)ceil(gdk_pixbuf_get_height(icon) * scale);
+    GdkRectangle rect = {(gtk_widget_get_allocated_width(widget) - w) / 2,
+                         (gtk_widget_get_allocated_height(widget) - h) / 2, w, h};
+    return rect;
+}
 
-        // Calculate the center position for the image
-        int x = (width - scaled_width) / 2;
-        int y = (height - scaled_height) / 2;
+// The box the ring covers, with room for its stroke
+static GdkRectangle wave_rect(GtkWidget *widget) {
+    int r = (int)ceil(wave_radius) + 2;
+    GdkRectangle rect = {gtk_widget_get_allocated_width(widget) / 2 - r,
+                         gtk_widget_get_allocated_height(widget) / 2 - r, 2 * r, 2 * r};
+    return rect;
+}
 
-        // Draw the image with scaling
-        gdk_cairo_set_source_pixbuf(cr, pixbuf, x, y);
-        cairo_paint(cr);
-    }
+// The icon at its largest, scaled down when painted below that
+static void render_icon(GtkWidget *widget) {
+    GdkRectangle rect = icon_rect(widget, ICON_ZOOM);
+    icon_surface = create_surface(widget, rect.width, rect.height);
+    cairo_t *cr = cairo_create(icon_surface);
+    cairo_scale(cr, ICON_ZOOM, ICON_ZOOM);
+    gdk_cairo_set_source_pixbuf(cr, icon, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
 }
 
-// Function to animate the wave
-gboolean animate_wave(GtkWidget *widget) {
-    wave_radius += 10;  // Increase the wave radius
-    if (wave_radius > 200) {  // Reset after reaching a maximum size
-        wave_radius = 0;
+// Function to draw the icon, and the ring while there is one
+gboolean draw_icon(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    if (icon == NULL) return FALSE;
+
+    if (wave_radius > 0) {
+        cairo_save(cr);
+        cairo_set_source_rgba(cr, 0.4, 0.7, 1.0, 1.0 - wave_radius / WAVE_MAX_RADIUS);
+        cairo_set_line_width(cr, 2);
+        cairo_arc(cr, gtk_widget_get_allocated_width(widget) / 2.0, gtk_widget_get_allocated_height(widget) / 2.0,
+                  wave_radius, 0, 2 * M_PI);
+        cairo_stroke(cr);
+        cairo_restore(cr);
     }
 
-    gtk_widget_queue_draw(widget);  // Redraw the widget
+    GdkRectangle clip;
+    GdkRectangle rect = icon_rect(widget, icon_scale);
+    if (!gdk_cairo_get_clip_rectangle(cr, &clip) || !gdk_rectangle_intersect(&clip, &rect, NULL)) return FALSE;
+
+    if (icon_surface == NULL) render_icon(widget);
+    cairo_save(cr);
+    cairo_translate(cr, rect.x, rect.y);
+    cairo_scale(cr, icon_scale / ICON_ZOOM, icon_scale / ICON_ZOOM);
+    cairo_set_source_surface(cr, icon_surface, 0, 0);
+    cairo_paint(cr);
+    cairo_restore(cr);
+    return FALSE;
+}
 
-    return TRUE;  // Continue calling this function at intervals
+static void damage(GtkWidget *widget, GdkRectangle rect) {
+    gtk_widget_queue_draw_area(widget, rect.x, rect.y, rect.width, rect.height);
 }
 
-// Function to handle hover effect on the icon
-gboolean on_hover(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    // Play sound using GStreamer
-    play_hover_sound();
+// One frame of the zoom and the ring: damage where they were and where
+// they are now, and stop once both are at rest
+static gboolean animate(GtkWidget *widget, GdkFrameClock *clock, gpointer data) {
+    gint64 now = gdk_frame_clock_get_frame_time(clock);
+    double dt = last_frame_us ? (now - last_frame_us) / 1e6 : 0;
+    last_frame_us = now;
+
+    damage(widget, icon_rect(widget, icon_scale));
+    if (wave_radius > 0) damage(widget, wave_rect(widget));
+
+    double step = ICON_ZOOM_PER_SEC * dt;
+    if (fabs(icon_target - icon_scale) <= step) icon_scale = icon_target;
+    else icon_scale += icon_scale < icon_target ? step : -step;
+
+    if (wave_radius > 0) {
+        wave_radius += WAVE_SPEED * dt;
+        if (wave_radius > WAVE_MAX_RADIUS) wave_radius = 0;  // Done until the next hover
+    }
+
+    damage(widget, icon_rect(widget, icon_scale));
+    if (wave_radius > 0) damage(widget, wave_rect(widget));
 
-    // Apply zoom effect by scaling the icon
-    icon_scale = 1.1;  // Zoom in the icon
+    if (icon_scale == icon_target && wave_radius == 0) {
+        animation_id = 0;
+        last_frame_us = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
 
-    gtk_widget_queue_draw(widget);  // Redraw the widget with updated scale
-    return FALSE;  // Continue with normal behavior
+static void start_animation(GtkWidget *widget) {
+    if (animation_id == 0) animation_id = gtk_widget_add_tick_callback(widget, animate, NULL, NULL);
+}
+
+// Function to handle hover effect on the icon: the pointer moving onto it
+// or off it, within the canvas
+gboolean on_motion(GtkWidget *widget, GdkEventMotion *event, gpointer data) {
+    if (icon == NULL) return FALSE;
+    GdkRectangle rect = icon_rect(widget, 1.0);
+    gboolean over = event->x >= rect.x && event->x < rect.x + rect.width &&
+                event->y >= rect.y && event->y < rect.y + rect.height;
+    double target = over ? ICON_ZOOM : 1.0;
+    if (target == icon_target) return FALSE;
+
+    icon_target = target;
+    if (over) {
+        play_hover_sound();
+        wave_radius = 1;  // Start a ring
+    }
+    start_animation(widget);
+    return FALSE;
 }
 
-// Function to handle when the mouse leaves the icon (reset zoom)
-gboolean on_leave(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    // Reset zoom effect
-    icon_scale = 1.0;  // Restore the icon to its original size
+// Function to handle when the mouse leaves the canvas (reset zoom)
+gboolean on_leave(GtkWidget *widget, GdkEventCrossing *event, gpointer data) {
+    if (icon_target != 1.0) {
+        icon_target = 1.0;
+        start_animation(widget);
+    }
+    return FALSE;
+}
 
-    gtk_widget_queue_draw(widget);  // Redraw the widget with original scale
-    return FALSE;  // Continue with normal behavior
+// Cached surfaces follow the window's scale factor
+static void on_scale_changed(GtkWidget *widget, GParamSpec *pspec, gpointer data) {
+    if (icon_surface) cairo_surface_destroy(icon_surface);
+    if (footer_surface) cairo_surface_destroy(footer_surface);
+    icon_surface = footer_surface = NULL;
+    gtk_widget_queue_draw(widget);
 }
 
 int main(int argc, char *argv[]) {
@@ -137,34 +246,35 @@ int main(int argc, char *argv[]) {
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_container_add(GTK_CONTAINER(window), vbox);
 
-    // Load the icon and create an image widget
-    GtkWidget *icon_widget = gtk_image_new_from_file("icon.png");  // Replace with your actual image path
-    gtk_widget_set_size_request(icon_widget, 100, 100);  // Set the size of the icon (adjust as needed)
-    
-    // Create a drawing area for the content (background, footer, etc.)
+    // Load the icon
+    icon = gdk_pixbuf_new_from_file("icon.png", NULL);  // Replace with your actual image path
+    if (icon == NULL) g_warning("Failed to load icon.png");
+
+    // Create a drawing area for the content (background, icon, footer)
     GtkWidget *canvas = gtk_drawing_area_new();
     gtk_widget_set_size_request(canvas, 400, 400);
+    gtk_widget_add_events(canvas, GDK_POINTER_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK);
 
     // Connect signals for drawing the icon and footer
-    g_signal_connect(canvas, "draw", G_CALLBACK(draw_icon), icon_widget);
+    g_signal_connect(canvas, "draw", G_CALLBACK(draw_icon), NULL);
     g_signal_connect(canvas, "draw", G_CALLBACK(draw_footer), NULL);
+    g_signal_connect(canvas, "notify::scale-factor", G_CALLBACK(on_scale_changed), NULL);
 
-    // Add canvas and icon to the vbox
-    gtk_box_pack_start(GTK_BOX(vbox), canvas, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), icon_widget, FALSE, FALSE, 0);
+    // Mouse hover effect for the icon
+    g_signal_connect(canvas, "motion-notify-event", G_CALLBACK(on_motion), NULL);
+    g_signal_connect(canvas, "leave-notify-event", G_CALLBACK(on_leave), NULL);
 
-    // Start wave animation
-    wave_timeout_id = g_timeout_add(2000, (GSourceFunc)animate_wave, canvas);
-
-    // Mouse hover effect for icon
-    g_signal_connect(icon_widget, "enter-notify-event", G_CALLBACK(on_hover), NULL);
-    g_signal_connect(icon_widget, "leave-notify-event", G_CALLBACK(on_leave), NULL);
+    gtk_box_pack_start(GTK_BOX(vbox), canvas, TRUE, TRUE, 0);
 
     // Show all widgets
     gtk_widget_show_all(window);
 
     gtk_main();
 
+    if (icon_surface) cairo_surface_destroy(icon_surface);
+    if (footer_surface) cairo_surface_destroy(footer_surface);
+    if (icon) g_object_unref(icon);
+
     // Clean up GStreamer resources
     if (pipeline) {
         gst_element_set_state(pipeline, GST_STATE_NULL);
@@ -0,0 +1,594 @@
+#include "mesh.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Networking headers
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <unistd.h>
+
+// Routes are swept for expiry this often
+const uint64_t MESH_SWEEP_MS = 250;
+
+const int VOICE_SOCKBUF = 1 << 20;
+
+// RTCP offsets of the voice ports, as VOICE_RTCP_OFFSET in voice.h, which
+// needs GStreamer; relays and the daemon without audio do not
+const int RTCP_OFFSET = 100;
+static const int VOICE_OFFSETS[3] = {0, RTCP_OFFSET, RTCP_OFFSET + 1};
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | p[i];
+    return v;
+}
+
+static std::atomic<uint64_t> stat_adverts_sent(0);
+static std::atomic<uint64_t> stat_adverts_received(0);
+static std::atomic<uint64_t> stat_malformed(0);
+static std::atomic<uint64_t> stat_no_route(0);
+static std::atomic<uint64_t> stat_expired(0);
+static std::atomic<uint64_t> stat_voice_sent(0);
+static std::atomic<uint64_t> stat_voice_delivered(0);
+
+// What the data plane needs of the routing table
+struct MeshHop {
+    uint64_t node_id;
+    uint32_t via;
+    uint8_t hops;
+};
+
+struct MeshTable {
+    uint64_t self_id;
+    uint32_t self_home;
+    std::unordered_map<uint64_t, MeshHop> by_node;     // every reachable node
+    std::unordered_map<uint32_t, MeshHop> remote;      // home address -> nodes behind relays
+};
+
+// The published table. Readers keep their own reference and only come
+// back for a new one when the version moves, so a lookup costs one
+// atomic load; the lock is only taken right after a publish.
+static std::mutex table_lock;
+static std::shared_ptr<const MeshTable> table_current;
+static std::atomic<uint64_t> table_version(0);
+
+static void publish_table(std::shared_ptr<const MeshTable> table) {
+    std::lock_guard<std::mutex> guard(table_lock);
+    table_current = std::move(table);
+    table_version.fetch_add(1, std::memory_order_release);
+}
+
+static const MeshTable *current_table() {
+    static thread_local std::shared_ptr<const MeshTable> cached;
+    static thread_local uint64_t cached_version = 0;
+    uint64_t version = table_version.load(std::memory_order_acquire);
+    if (version != cached_version) {
+        std::lock_guard<std::mutex> guard(table_lock);
+        cached = table_current;
+        cached_version = table_version.load(std::memory_order_relaxed);
+    }
+    return cached.get();
+}
+
+// Where the peer table keeps a node: neighbours under the address we hear
+// them from, everyone else under their home address
+static void member_addr(const MeshRoute &r, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = r.hops == 1 ? r.via : r.home;
+}
+
+static bool same_info(const Announcement &a, const Announcement &b) {
+    return a.capabilities == b.capabilities && strcmp(a.name, b.name) == 0 &&
+           memcmp(a.public_key, b.public_key, sizeof(a.public_key)) == 0;
+}
+
+Mesh::Mesh(const Announcement *self, mesh_send_fn send, mesh_member_fn member, void *user, uint64_t now_ms)
+    : self(*self), send_fn(send), member_fn(member), user(user), rng(std::random_device{}()) {
+    scan_interfaces();
+    next_advert = now_ms;
+    next_sweep = now_ms + MESH_SWEEP_MS;
+    publish();
+}
+
+// IPv4 interfaces that can broadcast. The first one's address is our home
+// for as long as we run.
+void Mesh::scan_interfaces() {
+    struct ifaddrs *ifs;
+    if (getifaddrs(&ifs) < 0) {
+        perror("getifaddrs");
+        return;
+    }
+    interfaces.clear();
+    for (struct ifaddrs *i = ifs; i != NULL; i = i->ifa_next) {
+        if (i->ifa_addr == NULL || i->ifa_addr->sa_family != AF_INET || i->ifa_netmask == NULL) continue;
+        if (!(i->ifa_flags & IFF_UP) || (i->ifa_flags & IFF_LOOPBACK) || !(i->ifa_flags & IFF_BROADCAST)) continue;
+        Interface iface;
+        iface.addr = ((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr;
+        iface.mask = ((struct sockaddr_in *)i->ifa_netmask)->sin_addr.s_addr;
+        iface.broadcast = iface.addr | ~iface.mask;
+        interfaces.push_back(iface);
+    }
+    freeifaddrs(ifs);
+
+    if (self_home == 0 && !interfaces.empty()) {
+        self_home = interfaces[0].addr;
+        dirty = true;
+    }
+}
+
+bool Mesh::handle(const struct sockaddr *from, const uint8_t *data, size_t len, uint64_t now_ms) {
+    if (from->sa_family != AF_INET || len < MESH_ADVERT_HEADER_SIZE || data[0] != 'P' || data[1] != 'V' ||
+        data[2] != MESH_VERSION) {
+        stat_malformed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Our own adverts loop back to us
+    uint64_t sender = get_u64(data + 4);
+    if (sender == self.node_id) return true;
+    stat_adverts_received.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t via = ((const struct sockaddr_in *)from)->sin_addr.s_addr;
+    size_t off = MESH_ADVERT_HEADER_SIZE;
+    for (int i = 0; i < data[3]; i++) {
+        if (off + MESH_ENTRY_HEADER_SIZE > len || off + MESH_ENTRY_HEADER_SIZE + data[off + 1] > len) {
+            stat_malformed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        uint8_t hops = data[off];
+        size_t info_len = data[off + 1];
+        uint32_t home;
+        memcpy(&home, data + off + 2, sizeof(home));
+        Announcement info;
+        if (!announce_decode(data + off + MESH_ENTRY_HEADER_SIZE, info_len, &info)) {
+            stat_malformed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        off += MESH_ENTRY_HEADER_SIZE + info_len;
+
+        // Only the sender can be at distance 0, and nobody routes us to ourselves
+        if (info.node_id == self.node_id || (hops == 0 && info.node_id != sender)) continue;
+        learn(info, home, via, hops >= MESH_INFINITY - 1 ? MESH_INFINITY : hops + 1, now_ms);
+    }
+    return true;
+}
+
+// Bellman-Ford, one entry at a time: a shorter route wins, and the current
+// next hop is believed whatever it says, lost included
+void Mesh::learn(const Announcement &info, uint32_t home, uint32_t via, uint8_t hops, uint64_t now_ms) {
+    auto it = routes.find(info.node_id);
+    if (it == routes.end()) {
+        if (hops >= MESH_INFINITY) return;
+        MeshRoute before;
+        memset(&before, 0, sizeof(before));
+        before.info = info;
+        before.hops = MESH_INFINITY;
+        MeshRoute &r = routes[info.node_id];
+        r.info = info;
+        r.home = home;
+        r.via = via;
+        r.hops = hops;
+        r.expires_ms = now_ms + MESH_ROUTE_TTL_MS;
+        changed(before, r, now_ms);
+        return;
+    }
+
+    MeshRoute &r = it->second;
+    if (r.via != via && hops >= r.hops) return;
+    if (r.via == via && hops >= MESH_INFINITY && r.hops >= MESH_INFINITY) return;
+
+    MeshRoute before = r;
+    r.via = via;
+    r.hops = hops;
+    if (hops < MESH_INFINITY) {
+        r.info = info;
+        r.home = home;
+    }
+    r.expires_ms = now_ms + MESH_ROUTE_TTL_MS;   // once lost: advertised as such until then
+    if (before.hops != r.hops || before.via != r.via || before.home != r.home || !same_info(before.info, r.info)) {
+        changed(before, r, now_ms);
+    }
+}
+
+// Tell the peer table, mark the data plane stale and advertise soon
+void Mesh::changed(const MeshRoute &before, const MeshRoute &after, uint64_t now_ms) {
+    bool was = before.hops < MESH_INFINITY;
+    bool is = after.hops < MESH_INFINITY;
+    struct sockaddr_in old_addr, new_addr;
+    member_addr(before, &old_addr);
+    member_addr(after, &new_addr);
+    bool moved = old_addr.sin_addr.s_addr != new_addr.sin_addr.s_addr;
+
+    if (was && (!is || moved)) member_fn((const struct sockaddr *)&old_addr, &before.info, false, user);
+    if (is && (!was || moved || !same_info(before.info, after.info))) {
+        member_fn((const struct sockaddr *)&new_addr, &after.info, true, user);
+    }
+
+    dirty = true;
+    if (before.hops != after.hops && next_advert > now_ms + MESH_TRIGGER_MS) next_advert = now_ms + MESH_TRIGGER_MS;
+}
+
+uint64_t Mesh::tick(uint64_t now_ms) {
+    if (now_ms >= next_sweep) {
+        for (auto it = routes.begin(); it != routes.end();) {
+            MeshRoute &r = it->second;
+            if (now_ms < r.expires_ms) {
+                ++it;
+            } else if (r.hops < MESH_INFINITY) {
+                MeshRoute before = r;
+                r.hops = MESH_INFINITY;
+                r.expires_ms = now_ms + MESH_ROUTE_TTL_MS;
+                changed(before, r, now_ms);
+                ++it;
+            } else {
+                it = routes.erase(it);
+            }
+        }
+        next_sweep = now_ms + MESH_SWEEP_MS;
+    }
+
+    if (now_ms >= next_advert) {
+        scan_interfaces();
+        advertise(false);
+        // Jitter keeps neighbours from advertising in lockstep
+        std::uniform_int_distribution<int> jitter(-(int)MESH_INTERVAL_MS / 4, (int)MESH_INTERVAL_MS / 4);
+        next_advert = now_ms + MESH_INTERVAL_MS + jitter(rng);
+    }
+
+    if (dirty) publish();
+    return next_advert < next_sweep ? next_advert : next_sweep;
+}
+
+void Mesh::leave() {
+    advertise(true);
+}
+
+void Mesh::refresh() {
+    for (auto &entry : routes) {
+        const MeshRoute &r = entry.second;
+        if (r.hops >= MESH_INFINITY) continue;
+        struct sockaddr_in addr;
+        member_addr(r, &addr);
+        member_fn((const struct sockaddr *)&addr, &r.info, true, user);
+    }
+}
+
+// One advert per interface, in as many datagrams as the table needs. A
+// route learned on an interface stays out of that interface's advert.
+void Mesh::advertise(bool leaving) {
+    if (self_home == 0) return;
+
+    uint8_t buf[MESH_ADVERT_MTU];
+    for (const Interface &iface : interfaces) {
+        size_t len = 0;
+        auto add = [&](const Announcement &info, uint32_t home, uint8_t hops) {
+            uint8_t entry[MESH_ENTRY_HEADER_SIZE + ANNOUNCE_MAX_SIZE];
+            size_t info_len = announce_encode(&info, entry + MESH_ENTRY_HEADER_SIZE, ANNOUNCE_MAX_SIZE);
+            if (info_len == 0) return;
+            entry[0] = hops;
+            entry[1] = (uint8_t)info_len;
+            memcpy(entry + 2, &home, sizeof(home));
+            size_t entry_len = MESH_ENTRY_HEADER_SIZE + info_len;
+
+            if (len != 0 && (len + entry_len > sizeof(buf) || buf[3] == 255)) {
+                send_fn(iface.broadcast, buf, len, user);
+                stat_adverts_sent.fetch_add(1, std::memory_order_relaxed);
+                len = 0;
+            }
+            if (len == 0) {
+                buf[0] = 'P';
+                buf[1] = 'V';
+                buf[2] = MESH_VERSION;
+                buf[3] = 0;
+                put_u64(buf + 4, self.node_id);
+                len = MESH_ADVERT_HEADER_SIZE;
+            }
+            memcpy(buf + len, entry, entry_len);
+            len += entry_len;
+            buf[3]++;
+        };
+
+        add(self, self_home, leaving ? MESH_INFINITY : 0);
+        for (auto &entry : routes) {
+            const MeshRoute &r = entry.second;
+            if ((r.via & iface.mask) == (iface.addr & iface.mask)) continue;
+            add(r.info, r.home, leaving ? MESH_INFINITY : r.hops);
+        }
+        send_fn(iface.broadcast, buf, len, user);
+        stat_adverts_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Mesh::publish() {
+    std::shared_ptr<MeshTable> table = std::make_shared<MeshTable>();
+    table->self_id = self.node_id;
+    table->self_home = self_home;
+    for (auto &entry : routes) {
+        const MeshRoute &r = entry.second;
+        if (r.hops >= MESH_INFINITY) continue;
+        MeshHop hop = {entry.first, r.via, r.hops};
+        table->by_node.emplace(entry.first, hop);
+        if (r.hops > 1) table->remote.emplace(r.home, hop);
+    }
+    publish_table(std::move(table));
+    dirty = false;
+}
+
+// Data plane state: set by mesh_start() before the Messenger starts
+static int message_port = 0;
+static int voice_port = 0;
+static std::atomic<uint64_t> call_node(0);
+
+static int voice_in[3] = {-1, -1, -1};   // RTP, RTCP and reports from our voice chains
+static int voice_out = -1;               // wrapped packets to the next hop, unwrapped ones to voice
+static int voice_epoll = -1;
+static int voice_stop_fd = -1;
+static std::thread voice_thread;
+
+static void write_header(uint8_t *p, uint8_t service, uint64_t destination, const MeshTable *table) {
+    p[0] = 'P';
+    p[1] = 'R';
+    p[2] = MESH_VERSION;
+    p[3] = MESH_INFINITY;
+    p[4] = service;
+    p[5] = 0;
+    put_u16(p + 6, (uint16_t)message_port);
+    put_u64(p + 8, destination);
+    put_u64(p + 16, table->self_id);
+    memcpy(p + 24, &table->self_home, sizeof(table->self_home));
+    memset(p + 28, 0, 4);
+}
+
+static void next_hop_addr(const MeshHop &hop, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = hop.via;
+    addr->sin_port = htons(message_port);
+}
+
+bool mesh_route(const struct sockaddr_in *to, MessageHop *hop, void *) {
+    const MeshTable *table = current_table();
+    if (table == NULL) return false;
+    auto it = table->remote.find(to->sin_addr.s_addr);
+    if (it == table->remote.end()) return false;
+
+    write_header(hop->header, MESH_SERVICE_MESSAGE, it->second.node_id, table);
+    next_hop_addr(it->second, &hop->via);
+    hop->relayed = true;
+    return true;
+}
+
+// Call packets from the far end go to our voice chains, which only take
+// them from loopback while the call is relayed
+static void deliver_voice(uint8_t service, uint64_t source, const uint8_t *data, size_t len) {
+    if (service < MESH_SERVICE_RTP || service > MESH_SERVICE_REPORTS || source != call_node.load() ||
+        voice_out == -1) {
+        return;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(voice_port + VOICE_OFFSETS[service - MESH_SERVICE_RTP]);
+    if (sendto(voice_out, data, len, 0, (struct sockaddr *)&addr, sizeof(addr)) >= 0) {
+        stat_voice_delivered.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+MessageRelayAction mesh_relay(uint8_t *data, size_t len, struct sockaddr_in *addr, void *) {
+    const MeshTable *table = current_table();
+    if (table == NULL || len < MESH_HEADER_SIZE || data[2] != MESH_VERSION) {
+        stat_malformed.fetch_add(1, std::memory_order_relaxed);
+        return RELAY_DROP;
+    }
+
+    uint64_t destination = get_u64(data + 8);
+    if (destination == table->self_id) {
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        memcpy(&addr->sin_addr.s_addr, data + 24, sizeof(addr->sin_addr.s_addr));
+        addr->sin_port = htons(get_u16(data + 6));
+        if (data[4] == MESH_SERVICE_MESSAGE) return RELAY_DELIVER;
+        deliver_voice(data[4], get_u64(data + 16), data + MESH_HEADER_SIZE, len - MESH_HEADER_SIZE);
+        return RELAY_DROP;
+    }
+
+    // Someone else's: one hop less, on to the next
+    if (data[3] <= 1) {
+        stat_expired.fetch_add(1, std::memory_order_relaxed);
+        return RELAY_DROP;
+    }
+    auto it = table->by_node.find(destination);
+    if (it == table->by_node.end()) {
+        stat_no_route.fetch_add(1, std::memory_order_relaxed);
+        return RELAY_DROP;
+    }
+    data[3]--;
+    next_hop_addr(it->second, addr);
+    return RELAY_FORWARD;
+}
+
+// Wrap what our voice chains send for the call's node. Packets are read
+// behind room for the header, so it is written in front of them in place.
+static void voice_relay_loop() {
+    struct Batch {
+        struct mmsghdr msgs[MESSAGE_BATCH];
+        struct iovec iovs[MESSAGE_BATCH];
+        uint8_t bufs[MESSAGE_BATCH][MESH_HEADER_SIZE + MESSAGE_MTU];
+    };
+    Batch *batch = new Batch;
+    struct epoll_event events[4];
+
+    for (;;) {
+        int n = epoll_wait(voice_epoll, events, 4, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        bool stop = false;
+        for (int e = 0; e < n; e++) {
+            int index = events[e].data.u32;
+            if (index < 0 || index > 2) {
+                stop = true;
+                continue;
+            }
+
+            for (;;) {
+                for (int i = 0; i < MESSAGE_BATCH; i++) {
+                    batch->iovs[i].iov_base = batch->bufs[i] + MESH_HEADER_SIZE;
+                    batch->iovs[i].iov_len = MESSAGE_MTU;
+                    memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+                    batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+                    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                int got = recvmmsg(voice_in[index], batch->msgs, MESSAGE_BATCH, MSG_DONTWAIT, NULL);
+                if (got < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+                    break;
+                }
+
+                const MeshTable *table = current_table();
+                uint64_t node = call_node.load();
+                const MeshHop *hop = NULL;
+                if (table != NULL && node != 0) {
+                    auto it = table->by_node.find(node);
+                    if (it != table->by_node.end()) hop = &it->second;
+                }
+                if (hop == NULL) {
+                    stat_no_route.fetch_add(got, std::memory_order_relaxed);
+                } else {
+                    struct sockaddr_in via;
+                    next_hop_addr(*hop, &via);
+                    for (int i = 0; i < got; i++) {
+                        write_header(batch->bufs[i], MESH_SERVICE_RTP + index, node, table);
+                        batch->iovs[i].iov_base = batch->bufs[i];
+                        batch->iovs[i].iov_len = MESH_HEADER_SIZE + batch->msgs[i].msg_len;
+                        batch->msgs[i].msg_hdr.msg_name = &via;
+                        batch->msgs[i].msg_hdr.msg_namelen = sizeof(via);
+                    }
+                    // Loss is the voice chains' to conceal; a short send is not retried
+                    int sent = sendmmsg(voice_out, batch->msgs, got, 0);
+                    if (sent > 0) stat_voice_sent.fetch_add(sent, std::memory_order_relaxed);
+                }
+                if (got < MESSAGE_BATCH) break;
+            }
+        }
+        if (stop) break;
+    }
+
+    delete batch;
+}
+
+static void close_voice_fds() {
+    for (int &fd : voice_in) {
+        if (fd != -1) close(fd);
+        fd = -1;
+    }
+    if (voice_out != -1) close(voice_out);
+    if (voice_epoll != -1) close(voice_epoll);
+    if (voice_stop_fd != -1) close(voice_stop_fd);
+    voice_out = voice_epoll = voice_stop_fd = -1;
+}
+
+bool mesh_start(int message, int voice) {
+    message_port = message;
+    voice_port = voice;
+
+    voice_out = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    voice_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    voice_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (voice_out < 0 || voice_stop_fd < 0 || voice_epoll < 0) {
+        perror("mesh voice relay");
+        close_voice_fds();
+        return false;
+    }
+
+    // Room for a burst while the relay thread waits for the CPU
+    int size = VOICE_SOCKBUF;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    for (int i = 0; i < 3; i++) {
+        voice_in[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(MESH_VOICE_PORT + VOICE_OFFSETS[i]);
+        if (voice_in[i] >= 0 && setsockopt(voice_in[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+            perror("setsockopt SO_RCVBUF");
+        }
+        if (voice_in[i] < 0 || bind(voice_in[i], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("bind mesh voice relay");
+            close_voice_fds();
+            return false;
+        }
+        ev.data.u32 = i;
+        epoll_ctl(voice_epoll, EPOLL_CTL_ADD, voice_in[i], &ev);
+    }
+    ev.data.u32 = 3;
+    epoll_ctl(voice_epoll, EPOLL_CTL_ADD, voice_stop_fd, &ev);
+
+    voice_thread = std::thread(voice_relay_loop);
+    return true;
+}
+
+void mesh_stop() {
+    if (voice_thread.joinable()) {
+        uint64_t one = 1;
+        if (write(voice_stop_fd, &one, sizeof(one)) < 0) perror("write");
+        voice_thread.join();
+    }
+    close_voice_fds();
+    call_node.store(0);
+}
+
+uint64_t mesh_remote_node(const struct sockaddr_in *addr) {
+    const MeshTable *table = current_table();
+    if (table == NULL) return 0;
+    auto it = table->remote.find(addr->sin_addr.s_addr);
+    return it != table->remote.end() ? it->second.node_id : 0;
+}
+
+void mesh_set_call(uint64_t node_id) {
+    call_node.store(node_id);
+}
+
+void mesh_get_stats(MeshStats *stats) {
+    const MeshTable *table = current_table();
+    stats->adverts_sent = stat_adverts_sent.load(std::memory_order_relaxed);
+    stats->adverts_received = stat_adverts_received.load(std::memory_order_relaxed);
+    stats->malformed = stat_malformed.load(std::memory_order_relaxed);
+    stats->routes = table != NULL ? table->by_node.size() : 0;
+    stats->no_route = stat_no_route.load(std::memory_order_relaxed);
+    stats->expired = stat_expired.load(std::memory_order_relaxed);
+    stats->voice_sent = stat_voice_sent.load(std::memory_order_relaxed);
+    stats->voice_delivered = stat_voice_delivered.load(std::memory_order_relaxed);
+}
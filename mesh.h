@@ -0,0 +1,192 @@
+#ifndef PUTTYNET_MESH_H
+#define PUTTYNET_MESH_H
+
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "announce.h"
+#include "messaging.h"
+
+// Mesh mode: peers beyond the broadcast domain, reached through the nodes
+// in between.
+//
+// Routing is distance vector, as in RIP. Every MESH_INTERVAL_MS each node
+// broadcasts an advert on every IPv4 interface with itself at distance 0 and
+// every node it can reach with its hop count. A neighbour's entries at d
+// become routes at d + 1 through it, kept if they are shorter than what is
+// known or come from the current next hop. Routes not heard again within
+// MESH_ROUTE_TTL_MS are lost; lost routes are advertised at MESH_INFINITY
+// for another TTL so the loss spreads, then forgotten. Split horizon keeps
+// a route out of the advert on the interface it was learned on, and a
+// change triggers an advert right away. Remote nodes go into the peer table
+// under the home address they advertise, so everything above sees them as
+// peers like any other.
+//
+// Advert wire format, all fields big-endian, on the discovery port:
+//
+//   0  magic 'P' 'V'     2 bytes
+//   2  version           1 byte
+//   3  entry count       1 byte
+//   4  sender node id    8 bytes
+//  12  entries...
+//
+// and each entry is
+//
+//   0  hops              1 byte, MESH_INFINITY for a lost route
+//   1  length            1 byte, of the announcement
+//   2  home address      4 bytes
+//   6  announcement      (announce.h)
+//
+// Data for a remote peer gets a relay header in front and goes to the next
+// hop's messaging port. Relays handle it in the Messenger's receive batch:
+// they decrement the hop count in place and send it on from the receive
+// buffer with the batch's other forwards, one sendmmsg, no copy and no
+// allocation. The destination strips the header and takes the datagram as
+// if it came from the source's home address. Messages are sealed end to
+// end (crypto.h), so relays can neither read them nor pass off a forged
+// source as genuine.
+//
+// Relay header, big-endian:
+//
+//   0  magic 'P' 'R'     2 bytes
+//   2  version           1 byte
+//   3  hops left         1 byte, dropped at 0
+//   4  service           1 byte
+//   5  reserved          1 byte
+//   6  source port       2 bytes
+//   8  destination id    8 bytes
+//  16  source id         8 bytes
+//  24  source address    4 bytes, the source's home address
+//  28  reserved          4 bytes
+//  32  datagram
+//
+// Calls go the same way: the voice chains send to MESH_VOICE_PORT on
+// loopback, the relay wraps each RTP and RTCP packet for the call's node,
+// and the far end hands them to its voice ports from loopback.
+
+const uint8_t MESH_VERSION = 1;
+const size_t MESH_ADVERT_HEADER_SIZE = 12;
+const size_t MESH_ENTRY_HEADER_SIZE = 6;
+const size_t MESH_ADVERT_MTU = 1400;
+const size_t MESH_HEADER_SIZE = 32;
+static_assert(MESH_HEADER_SIZE == MESSAGE_RELAY_HEADER_SIZE, "the Messenger strips relay headers itself");
+
+const uint8_t MESH_INFINITY = 16;
+const uint64_t MESH_INTERVAL_MS = 1000;
+const uint64_t MESH_ROUTE_TTL_MS = 4 * MESH_INTERVAL_MS;
+const uint64_t MESH_TRIGGER_MS = 50;      // a change goes out this soon, batched with any others
+
+// Relayed services
+const uint8_t MESH_SERVICE_MESSAGE = 0;
+const uint8_t MESH_SERVICE_RTP = 1;        // to the voice port
+const uint8_t MESH_SERVICE_RTCP = 2;       // to the voice port + VOICE_RTCP_OFFSET
+const uint8_t MESH_SERVICE_REPORTS = 3;    // to the voice port + VOICE_RTCP_OFFSET + 1
+
+// Loopback port the voice chains call instead of a relayed peer; RTCP goes
+// to the usual offsets above it
+const int MESH_VOICE_PORT = 12350;
+
+// One node's route, discovery thread only
+struct MeshRoute {
+    Announcement info;
+    uint32_t home;            // where the node says it lives, network order
+    uint32_t via;             // next hop, network order; the node itself when hops is 1
+    uint8_t hops;             // MESH_INFINITY once lost
+    uint64_t expires_ms;      // lost then, or forgotten if already lost
+};
+
+struct MeshStats {
+    uint64_t adverts_sent;
+    uint64_t adverts_received;
+    uint64_t malformed;
+    uint64_t routes;          // reachable nodes
+    uint64_t no_route;        // relayed datagrams for nodes we cannot reach
+    uint64_t expired;         // relayed datagrams that ran out of hops
+    uint64_t voice_sent;      // call packets wrapped for the far end
+    uint64_t voice_delivered; // call packets from the far end handed to voice
+};
+
+// broadcast is an interface's broadcast address, network order
+typedef void (*mesh_send_fn)(uint32_t broadcast, const uint8_t *data, size_t len, void *user);
+
+// A node became reachable (alive) or was lost; addr is where it is reached
+typedef void (*mesh_member_fn)(const struct sockaddr *addr, const Announcement *a, bool alive, void *user);
+
+// The routing table. Like Gossip it has no sockets of its own; drive it
+// from the discovery thread.
+class Mesh {
+public:
+    Mesh(const Announcement *self, mesh_send_fn send, mesh_member_fn member, void *user, uint64_t now_ms);
+
+    // Returns false for anything that is not a well-formed advert
+    bool handle(const struct sockaddr *from, const uint8_t *data, size_t len, uint64_t now_ms);
+
+    // Advertise and expire; returns the time tick() next needs to run
+    uint64_t tick(uint64_t now_ms);
+
+    // Advertise every route, ourselves included, as lost
+    void leave();
+
+    // Report every reachable node to the member hook again, so the peer
+    // table keeps them while the routes hold
+    void refresh();
+
+    const std::unordered_map<uint64_t, MeshRoute> &all() const { return routes; }
+
+    // The address we are known by beyond our neighbours, network order
+    uint32_t home() const { return self_home; }
+
+private:
+    struct Interface {
+        uint32_t addr;
+        uint32_t mask;
+        uint32_t broadcast;
+    };
+
+    void scan_interfaces();
+    void learn(const Announcement &info, uint32_t home, uint32_t via, uint8_t hops, uint64_t now_ms);
+    void changed(const MeshRoute &before, const MeshRoute &after, uint64_t now_ms);
+    void advertise(bool leaving);
+    void publish();
+
+    Announcement self;
+    uint32_t self_home = 0;
+    mesh_send_fn send_fn;
+    mesh_member_fn member_fn;
+    void *user;
+    std::mt19937 rng;
+
+    std::unordered_map<uint64_t, MeshRoute> routes;
+    std::vector<Interface> interfaces;
+    uint64_t next_advert = 0;
+    uint64_t next_sweep = 0;
+    bool dirty = false;       // the data plane's table is behind
+};
+
+// The data plane, any thread. Mesh publishes a snapshot of its routes on
+// every change; readers pick it up with one atomic load per datagram and
+// never wait for the discovery thread.
+
+// Messenger hooks, installed with Messenger::set_relay()
+bool mesh_route(const struct sockaddr_in *to, MessageHop *hop, void *user);
+MessageRelayAction mesh_relay(uint8_t *data, size_t len, struct sockaddr_in *addr, void *user);
+
+// Open the voice relay on loopback; message_port is where the next hop's
+// Messenger listens, voice_port where our voice chains do
+bool mesh_start(int message_port, int voice_port);
+void mesh_stop();
+
+// The node id of the peer at addr if it is reached through relays, else 0
+uint64_t mesh_remote_node(const struct sockaddr_in *addr);
+
+// Relay calls to and from node, or to no one with 0
+void mesh_set_call(uint64_t node_id);
+
+void mesh_get_stats(MeshStats *stats);
+
+#endif
@@ -0,0 +1,698 @@
+#include "message_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "timer_wheel.h"
+
+const size_t RECORD_ALIGN = 8;
+
+static size_t record_size(size_t payload) {
+    return (sizeof(LogRecord) + payload + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+static uint64_t position(uint64_t segment, uint32_t offset) {
+    return segment << 32 | offset;
+}
+
+// CRC-32C, with the SSE 4.2 instruction where the CPU has it. The table
+// version is slicing-by-one; it only runs on old or non-x86 machines.
+
+static uint32_t crc_table[256];
+
+static void crc_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = (uint32_t)c;
+    for (; len; p++, len--) crc = __builtin_ia32_crc32qi(crc, *p);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t len) {
+    static const bool hw = [] {
+        crc_init_table();
+#if defined(__x86_64__)
+        return (bool)__builtin_cpu_supports("sse4.2");
+#else
+        return false;
+#endif
+    }();
+#if defined(__x86_64__)
+    if (hw) return crc32c_hw(crc, p, len);
+#endif
+    return crc32c_table(crc, p, len);
+}
+
+// The checksum skips length and crc themselves; length is checked against the segment instead
+static uint32_t record_crc(const LogRecord *r, const void *payload) {
+    const size_t skip = offsetof(LogRecord, conversation);
+    uint32_t crc = crc32c_update(~0u, (const uint8_t *)r + skip, sizeof(LogRecord) - skip);
+    return ~crc32c_update(crc, (const uint8_t *)payload, r->length);
+}
+
+static bool entry_less(const LogIndexEntry &a, const LogIndexEntry &b) {
+    return a.conversation != b.conversation ? a.conversation < b.conversation : a.offset < b.offset;
+}
+
+static std::string segment_path(const std::string &dir, uint64_t number, const char *suffix) {
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx%s", (unsigned long long)number, suffix);
+    return dir + name;
+}
+
+static bool write_all(int fd, const void *data, size_t len, off_t offset) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void sync_dir(const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+}
+
+MessageLog::MessageLog(const MessageLogConfig &cfg) : config(cfg) {
+}
+
+MessageLog::~MessageLog() {
+    close();
+}
+
+void MessageLog::release(Segment *segment) {
+    if (segment->base) munmap(segment->base, segment->mapped);
+    if (segment->index_map) munmap(segment->index_map, segment->index_mapped);
+    if (segment->fd != -1) ::close(segment->fd);
+    delete segment;
+}
+
+// Walk a segment's records from the start; returns where the valid ones end.
+// A torn or zeroed tail after a crash simply ends the walk.
+size_t MessageLog::scan(Segment *segment, std::vector<LogIndexEntry> *entries,
+                        std::vector<LogIndexEntry> *forgets) {
+    size_t offset = 0;
+    while (segment->mapped - offset >= sizeof(LogRecord)) {
+        const LogRecord *r = (const LogRecord *)(segment->base + offset);
+        if (r->length > segment->mapped - offset - sizeof(LogRecord)) break;
+        if (r->crc != record_crc(r, r + 1)) break;
+
+        LogIndexEntry e = {r->conversation, (uint32_t)offset, 0};
+        if (r->type == LOG_FORGET) forgets->push_back(e);
+        else entries->push_back(e);
+        offset += record_size(r->length);
+    }
+    return offset < segment->mapped ? offset : segment->mapped;
+}
+
+bool MessageLog::map_index(Segment *segment) {
+    std::string path = segment_path(dir, segment->number, ".idx");
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(LogIndexHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const LogIndexHeader *h = (const LogIndexHeader *)map;
+    size_t want = sizeof(LogIndexHeader) + ((size_t)h->entries + h->forgets) * sizeof(LogIndexEntry);
+    if (h->magic != LOG_INDEX_MAGIC || h->version != LOG_INDEX_VERSION ||
+        h->segment_bytes != segment->used || want != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    segment->index_map = map;
+    segment->index_mapped = st.st_size;
+    segment->entries = (const LogIndexEntry *)(h + 1);
+    segment->entry_count = h->entries;
+    segment->forgets = segment->entries + h->entries;
+    segment->forget_count = h->forgets;
+    return true;
+}
+
+// Write NNNN.idx next to the segment by way of a temporary file, then map it
+bool MessageLog::write_index(Segment *segment, std::vector<LogIndexEntry> &entries,
+                             const std::vector<LogIndexEntry> &forgets) {
+    std::sort(entries.begin(), entries.end(), entry_less);
+
+    LogIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = LOG_INDEX_MAGIC;
+    h.version = LOG_INDEX_VERSION;
+    h.entries = (uint32_t)entries.size();
+    h.forgets = (uint32_t)forgets.size();
+    h.segment_bytes = segment->used;
+
+    std::string path = segment_path(dir, segment->number, ".idx");
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open index");
+        return false;
+    }
+    size_t entry_bytes = entries.size() * sizeof(LogIndexEntry);
+    bool ok = write_all(fd, &h, sizeof(h), 0) &&
+              write_all(fd, entries.data(), entry_bytes, sizeof(h)) &&
+              write_all(fd, forgets.data(), forgets.size() * sizeof(LogIndexEntry), sizeof(h) + entry_bytes) &&
+              fdatasync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror("write index");
+        unlink(tmp.c_str());
+        return false;
+    }
+    return map_index(segment);
+}
+
+// Map an existing segment. Sealed ones come with an index, or get one
+// rebuilt; the active one is scanned into active_offsets.
+bool MessageLog::open_segment(uint64_t number, bool active) {
+    std::string path = segment_path(dir, number, ".log");
+    int fd = ::open(path.c_str(), (active ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path.c_str());
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+
+    Segment *segment = new Segment();
+    segment->number = number;
+    segment->fd = fd;
+    segment->mapped = active ? std::max((size_t)st.st_size, config.segment_bytes) : (size_t)st.st_size;
+    if (active && (size_t)st.st_size < segment->mapped) {
+        posix_fallocate(fd, 0, segment->mapped);
+    }
+    if (segment->mapped > 0) {
+        void *map = mmap(NULL, segment->mapped, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            release(segment);
+            return false;
+        }
+        segment->base = (uint8_t *)map;
+    }
+
+    if (!active) {
+        segment->used = st.st_size;
+        if (!map_index(segment)) {
+            std::vector<LogIndexEntry> entries, forgets;
+            segment->used = scan(segment, &entries, &forgets);
+            if (!write_index(segment, entries, forgets)) {
+                release(segment);
+                return false;
+            }
+        }
+        for (size_t i = 0; i < segment->forget_count; i++) {
+            note_forget(segment->forgets[i].conversation, position(number, segment->forgets[i].offset));
+        }
+    } else {
+        std::vector<LogIndexEntry> entries, forgets;
+        segment->used = scan(segment, &entries, &forgets);
+        for (const LogIndexEntry &e : entries) active_offsets[e.conversation].push_back(e.offset);
+        for (const LogIndexEntry &e : forgets) note_forget(e.conversation, position(number, e.offset));
+        active_forgets = forgets;
+    }
+    segments.push_back(segment);
+    return true;
+}
+
+bool MessageLog::create_active() {
+    uint64_t number = segments.empty() ? 0 : segments.back()->number + 1;
+    std::string path = segment_path(dir, number, ".log");
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+    // Preallocated, so a commit's fdatasync never has to update the file size
+    int err = posix_fallocate(fd, 0, config.segment_bytes);
+    if (err != 0 && ftruncate(fd, config.segment_bytes) < 0) {
+        perror("ftruncate");
+        ::close(fd);
+        return false;
+    }
+    ::close(fd);
+    sync_dir(dir);
+    return open_segment(number, true);
+}
+
+// Turn the active segment into a sealed one and start the next
+bool MessageLog::seal_active() {
+    Segment *segment = segments.back();
+
+    std::vector<LogIndexEntry> entries;
+    for (auto &conversation : active_offsets) {
+        for (uint32_t offset : conversation.second) entries.push_back({conversation.first, offset, 0});
+    }
+    if (ftruncate(segment->fd, segment->used) < 0 || fdatasync(segment->fd) < 0) {
+        perror("seal segment");
+        return false;
+    }
+
+    // Readers may hold pointers into the mapping, so it stays as it is;
+    // nobody reads past used, which is now the end of the file. The lock
+    // covers the index write, a few milliseconds once per segment.
+    std::lock_guard<std::mutex> guard(index_lock);
+    if (!write_index(segment, entries, active_forgets)) return false;
+    active_offsets.clear();
+    active_forgets.clear();
+    return create_active();
+}
+
+void MessageLog::note_forget(uint64_t conversation, uint64_t pos) {
+    uint64_t &latest = forgotten[conversation];
+    if (pos > latest) latest = pos;
+}
+
+bool MessageLog::open(const char *path) {
+    if (opened) return false;
+    dir = path;
+
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        perror(path);
+        return false;
+    }
+    std::vector<uint64_t> numbers;
+    while (struct dirent *entry = readdir(d)) {
+        char *end;
+        uint64_t number = strtoull(entry->d_name, &end, 16);
+        if (end == entry->d_name + 16 && strcmp(end, ".log") == 0) numbers.push_back(number);
+    }
+    closedir(d);
+    std::sort(numbers.begin(), numbers.end());
+
+    // The newest segment is the active one unless it was sealed before a crash
+    bool ok = true;
+    for (size_t i = 0; i < numbers.size() && ok; i++) {
+        bool last = i + 1 == numbers.size();
+        bool sealed = access(segment_path(dir, numbers[i], ".idx").c_str(), F_OK) == 0;
+        ok = open_segment(numbers[i], last && !sealed);
+    }
+    if (ok && (segments.empty() || segments.back()->entries != NULL)) ok = create_active();
+    if (!ok) {
+        for (Segment *segment : segments) release(segment);
+        segments.clear();
+        active_offsets.clear();
+        active_forgets.clear();
+        forgotten.clear();
+        return false;
+    }
+
+    stats = MessageLogStats();
+    pending.reserve(config.max_pending);
+    running = true;
+    failed = false;
+    opened = true;
+    commit_thread = std::thread(&MessageLog::commit_loop, this);
+    return true;
+}
+
+void MessageLog::close() {
+    if (!opened) return;
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        running = false;
+    }
+    queue_cv.notify_all();
+    commit_thread.join();
+
+    for (Segment *segment : segments) release(segment);
+    segments.clear();
+    active_offsets.clear();
+    active_forgets.clear();
+    forgotten.clear();
+    opened = false;
+}
+
+bool MessageLog::append(uint64_t conversation, uint64_t sender, uint32_t type,
+                        const void *data, size_t len, uint64_t time_ms) {
+    size_t size = record_size(len);
+    if (size > config.segment_bytes) return false;
+
+    // Everything but the copy happens outside the lock
+    LogRecord r;
+    memset(&r, 0, sizeof(r));
+    r.length = (uint32_t)len;
+    r.conversation = conversation;
+    r.sender = sender;
+    r.time_ms = time_ms;
+    r.type = type;
+    r.crc = record_crc(&r, data);
+    static const uint8_t padding[RECORD_ALIGN] = {0};
+
+    std::lock_guard<std::mutex> guard(queue_lock);
+    if (!running || failed || pending.size() + size > config.max_pending) return false;
+
+    size_t at = pending.size();
+    pending.insert(pending.end(), (const uint8_t *)&r, (const uint8_t *)(&r + 1));
+    pending.insert(pending.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+    pending.insert(pending.end(), padding, padding + (size - sizeof(r) - len));
+
+    appended_seq++;
+    if (at == 0) {
+        pending_since_ms = monotonic_ms();
+        queue_cv.notify_one();
+    } else if (pending.size() >= config.commit_bytes) {
+        queue_cv.notify_one();
+    }
+    return true;
+}
+
+bool MessageLog::forget(uint64_t conversation, uint64_t time_ms) {
+    return append(conversation, 0, LOG_FORGET, NULL, 0, time_ms);
+}
+
+bool MessageLog::flush() {
+    std::unique_lock<std::mutex> guard(queue_lock);
+    uint64_t want = appended_seq;
+    if (durable_seq >= want) return true;
+    if (failed) return false;
+    flush_requested = true;
+    queue_cv.notify_one();
+    durable_cv.wait(guard, [&] { return durable_seq >= want || failed || !running; });
+    return durable_seq >= want;
+}
+
+// Group commit: whatever piled up during the window goes out in one write
+// and one fdatasync, however many threads appended it. A failed commit puts
+// what it could not write back in front of pending and stops the log, so
+// nothing is ever reported durable that is not.
+void MessageLog::commit_loop() {
+    std::vector<uint8_t> batch;
+    batch.reserve(config.max_pending);
+    std::unique_lock<std::mutex> guard(queue_lock);
+    for (;;) {
+        queue_cv.wait(guard, [&] { return (!pending.empty() && !failed) || !running; });
+        if (pending.empty() || failed) break;
+
+        auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(
+            (int64_t)(pending_since_ms + config.commit_ms) - (int64_t)monotonic_ms());
+        queue_cv.wait_until(guard, due, [&] {
+            return pending.size() >= config.commit_bytes || flush_requested || !running;
+        });
+
+        batch.swap(pending);
+        pending.clear();
+        flush_requested = false;
+        uint64_t seq = appended_seq;
+        guard.unlock();
+
+        bool ok = commit(batch);
+
+        guard.lock();
+        if (ok) {
+            durable_seq = seq;
+        } else {
+            batch.insert(batch.end(), pending.begin(), pending.end());
+            pending.swap(batch);
+            batch.clear();
+            failed = true;
+        }
+        durable_cv.notify_all();
+    }
+    durable_cv.notify_all();
+}
+
+// False if the disk refused part of batch, which is left holding that part
+bool MessageLog::commit(std::vector<uint8_t> &batch) {
+    size_t pos = 0;
+    while (pos < batch.size()) {
+        Segment *segment = segments.back();
+
+        // As many whole records as fit in the active segment
+        size_t end = pos;
+        size_t room = segment->mapped - segment->used;
+        while (end < batch.size()) {
+            size_t size = record_size(((const LogRecord *)(batch.data() + end))->length);
+            if (end - pos + size > room) break;
+            end += size;
+        }
+
+        if (end > pos) {
+            if (!write_all(segment->fd, batch.data() + pos, end - pos, segment->used) ||
+                fdatasync(segment->fd) < 0) {
+                perror("message log commit");
+                batch.erase(batch.begin(), batch.begin() + pos);
+                return false;
+            }
+
+            std::lock_guard<std::mutex> guard(index_lock);
+            size_t base = segment->used;
+            for (size_t at = pos; at < end;) {
+                const LogRecord *r = (const LogRecord *)(batch.data() + at);
+                uint32_t offset = (uint32_t)(base + at - pos);
+                if (r->type == LOG_FORGET) {
+                    active_forgets.push_back({r->conversation, offset, 0});
+                    note_forget(r->conversation, position(segment->number, offset));
+                } else {
+                    active_offsets[r->conversation].push_back(offset);
+                    stats.records++;
+                }
+                at += record_size(r->length);
+            }
+            segment->used += end - pos;
+            stats.bytes += end - pos;
+            stats.commits++;
+            pos = end;
+        }
+
+        if (pos < batch.size() && !seal_active()) {
+            batch.erase(batch.begin(), batch.begin() + pos);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The conversation's messages segment by segment, minus what was forgotten.
+// Sealed segments are binary searched in their index, never scanned.
+void MessageLog::collect(uint64_t conversation, std::vector<Range> *ranges) {
+    auto f = forgotten.find(conversation);
+    uint64_t cut = f != forgotten.end() ? f->second : 0;
+
+    for (const Segment *segment : segments) {
+        if (cut >> 32 > segment->number) continue;
+        uint32_t from = cut >> 32 == segment->number ? (uint32_t)cut : 0;
+
+        Range range = {segment, NULL, NULL, 0};
+        if (segment->entries != NULL) {
+            const LogIndexEntry *end = segment->entries + segment->entry_count;
+            LogIndexEntry lo_key = {conversation, from, 0};
+            LogIndexEntry hi_key = {conversation, 0xffffffffu, 0};
+            const LogIndexEntry *lo = std::lower_bound(segment->entries, end, lo_key, entry_less);
+            const LogIndexEntry *hi = std::upper_bound(lo, end, hi_key, entry_less);
+            range.entries = lo;
+            range.count = hi - lo;
+        } else {
+            auto it = active_offsets.find(conversation);
+            if (it == active_offsets.end()) continue;
+            const std::vector<uint32_t> &offsets = it->second;
+            const uint32_t *lo = std::lower_bound(offsets.data(), offsets.data() + offsets.size(), from);
+            range.offsets = lo;
+            range.count = offsets.data() + offsets.size() - lo;
+        }
+        if (range.count) ranges->push_back(range);
+    }
+}
+
+size_t MessageLog::count(uint64_t conversation) {
+    std::lock_guard<std::mutex> guard(index_lock);
+    std::vector<Range> ranges;
+    collect(conversation, &ranges);
+    size_t total = 0;
+    for (const Range &r : ranges) total += r.count;
+    return total;
+}
+
+size_t MessageLog::read(uint64_t conversation, size_t first, const LogRecord **out, size_t n) {
+    std::lock_guard<std::mutex> guard(index_lock);
+    std::vector<Range> ranges;
+    collect(conversation, &ranges);
+
+    size_t filled = 0;
+    for (const Range &r : ranges) {
+        if (first >= r.count) {
+            first -= r.count;
+            continue;
+        }
+        for (size_t i = first; i < r.count && filled < n; i++) {
+            uint32_t offset = r.entries ? r.entries[i].offset : r.offsets[i];
+            out[filled++] = (const LogRecord *)(r.segment->base + offset);
+        }
+        first = 0;
+        if (filled == n) break;
+    }
+    return filled;
+}
+
+// Copy a sealed segment's surviving records, in order, into a new file that
+// replaces it. Offsets change, so its index is rebuilt with it.
+bool MessageLog::compact_segment(Segment *segment, uint64_t now_ms) {
+    uint64_t horizon = config.retention_ms && now_ms > config.retention_ms ? now_ms - config.retention_ms : 0;
+    std::unordered_map<uint64_t, uint64_t> cuts;
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        cuts = forgotten;
+    }
+
+    auto dead = [&](const LogRecord *r, uint32_t offset) {
+        if (r->type == LOG_FORGET) return false;   // tiny, and still needed if an older segment fails to compact
+        auto c = cuts.find(r->conversation);
+        if (c != cuts.end() && position(segment->number, offset) < c->second) return true;
+        return r->time_ms < horizon;
+    };
+
+    // Worth it only if something goes
+    size_t live_bytes = 0;
+    for (size_t offset = 0; offset < segment->used;) {
+        const LogRecord *r = (const LogRecord *)(segment->base + offset);
+        size_t size = record_size(r->length);
+        if (!dead(r, (uint32_t)offset)) live_bytes += size;
+        offset += size;
+    }
+    if (live_bytes == segment->used) return true;
+
+    std::string path = segment_path(dir, segment->number, ".log");
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("open compacted segment");
+        return false;
+    }
+
+    // Runs of live records go out as single writes
+    bool ok = true;
+    size_t out = 0;
+    size_t run_start = 0, run_len = 0;
+    for (size_t offset = 0; offset < segment->used && ok;) {
+        const LogRecord *r = (const LogRecord *)(segment->base + offset);
+        size_t size = record_size(r->length);
+        if (dead(r, (uint32_t)offset)) {
+            if (run_len) ok = write_all(fd, segment->base + run_start, run_len, out);
+            out += run_len;
+            run_len = 0;
+        } else {
+            if (run_len == 0) run_start = offset;
+            run_len += size;
+        }
+        offset += size;
+    }
+    if (ok && run_len) ok = write_all(fd, segment->base + run_start, run_len, out);
+    out += run_len;
+    if (!ok || fdatasync(fd) < 0) {
+        perror("write compacted segment");
+        ::close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    Segment *fresh = new Segment();
+    fresh->number = segment->number;
+    fresh->fd = fd;
+    fresh->mapped = out;
+    fresh->used = out;
+    if (out > 0) {
+        void *map = mmap(NULL, out, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            unlink(tmp.c_str());
+            release(fresh);
+            return false;
+        }
+        fresh->base = (uint8_t *)map;
+    }
+
+    std::vector<LogIndexEntry> entries, forgets;
+    scan(fresh, &entries, &forgets);
+    // A crash between these renames leaves an index that no longer matches
+    // the segment's size; open() then rebuilds it
+    if (rename(tmp.c_str(), path.c_str()) < 0 || !write_index(fresh, entries, forgets)) {
+        perror("replace compacted segment");
+        unlink(tmp.c_str());
+        release(fresh);
+        return false;
+    }
+    sync_dir(dir);
+
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        *std::find(segments.begin(), segments.end(), segment) = fresh;
+        stats.compacted += segment->used - out;
+
+        // Forgets in this segment moved along with everything else
+        for (auto it = forgotten.begin(); it != forgotten.end();) {
+            if (it->second >> 32 == segment->number) it = forgotten.erase(it);
+            else ++it;
+        }
+        for (size_t i = 0; i < fresh->forget_count; i++) {
+            note_forget(fresh->forgets[i].conversation, position(fresh->number, fresh->forgets[i].offset));
+        }
+    }
+    release(segment);
+    return true;
+}
+
+bool MessageLog::compact(uint64_t now_ms) {
+    // The commit thread only ever appends segments, so the sealed ones we
+    // pick here stay put while we work on them
+    std::vector<Segment *> sealed;
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        sealed.assign(segments.begin(), segments.end() - 1);
+    }
+    bool ok = true;
+    for (Segment *segment : sealed) ok = compact_segment(segment, now_ms) && ok;
+    return ok;
+}
+
+void MessageLog::get_stats(MessageLogStats *out) {
+    std::lock_guard<std::mutex> guard(index_lock);
+    *out = stats;
+    out->segments = segments.size();
+}
@@ -0,0 +1,184 @@
+#ifndef PUTTYNET_MESSAGE_LOG_H
+#define PUTTYNET_MESSAGE_LOG_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// Message history: an append-only log split into segment files in one
+// directory, read in place through mmap.
+//
+// NNNNNNNNNNNNNNNN.log holds records back to back, each padded to 8 bytes.
+// The newest segment is preallocated and written by the commit thread; once
+// full it is sealed: truncated to its records and given a NNNNNNNNNNNNNNNN.idx
+// with its records sorted by conversation, so opening the log only maps
+// files and reads the newest segment, however long the history.
+//
+// Files use host byte order; they are a local cache, not a wire format.
+
+// Record header, followed by the payload
+struct LogRecord {
+    uint32_t length;         // payload bytes
+    uint32_t crc;            // CRC-32C of the rest of the header and the payload
+    uint64_t conversation;   // the peer's node id
+    uint64_t sender;         // node id of the author
+    uint64_t time_ms;        // wall clock
+    uint32_t type;           // FRAME_TEXT and so on, or LOG_FORGET
+    uint32_t reserved;
+};
+
+// Marks everything earlier in the conversation as deleted
+const uint32_t LOG_FORGET = 0xffffffffu;
+
+// .idx layout: this header, the message entries sorted by conversation and
+// offset, then the forget records in file order
+struct LogIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t forgets;
+    uint64_t segment_bytes;  // size of the .log it describes; a mismatch means rebuild
+    uint64_t reserved;
+};
+
+struct LogIndexEntry {
+    uint64_t conversation;
+    uint32_t offset;
+    uint32_t reserved;
+};
+
+const uint32_t LOG_INDEX_MAGIC = 0x58494e50;   // "PNIX"
+const uint32_t LOG_INDEX_VERSION = 1;
+
+struct MessageLogConfig {
+    size_t segment_bytes = 64 << 20;
+    uint32_t commit_ms = 5;           // group commit window after the first append
+    size_t commit_bytes = 1 << 20;    // commit early once this much is waiting
+    size_t max_pending = 16 << 20;    // append() refuses more until the disk catches up
+    uint64_t retention_ms = 0;        // compact() drops older messages; 0 keeps everything
+};
+
+struct MessageLogStats {
+    uint64_t records;        // appended since open
+    uint64_t bytes;          // record bytes written since open
+    uint64_t commits;        // group commits, one fdatasync each per segment touched
+    uint64_t segments;
+    uint64_t compacted;      // bytes reclaimed by compact()
+};
+
+class MessageLog {
+public:
+    explicit MessageLog(const MessageLogConfig &config = MessageLogConfig());
+    ~MessageLog();
+
+    // Open or create the log in dir, which must exist, and start the commit thread
+    bool open(const char *dir);
+
+    // Commit what is queued and release everything
+    void close();
+
+    // Queue a message for the next group commit; any thread. Returns false if
+    // the log is closed or has failed, max_pending bytes are already waiting,
+    // or the message could never fit in a segment.
+    bool append(uint64_t conversation, uint64_t sender, uint32_t type,
+                const void *data, size_t len, uint64_t time_ms);
+
+    // Drop a conversation's history: gone from reads once committed, and from
+    // disk at the next compact()
+    bool forget(uint64_t conversation, uint64_t time_ms);
+
+    // Wait until everything appended so far is on disk. False once a commit
+    // has failed: what it held stays queued, unwritten, and the log refuses
+    // appends until it is reopened.
+    bool flush();
+
+    // Committed messages in a conversation
+    size_t count(uint64_t conversation);
+
+    // Pointers to messages [first, first + n) of a conversation, oldest first,
+    // straight into the mapped segments. They stay valid until compact() or
+    // close(). Returns how many were filled in.
+    size_t read(uint64_t conversation, size_t first, const LogRecord **out, size_t n);
+
+    // Rewrite sealed segments without forgotten and expired messages. Run it
+    // from the thread that reads, since it invalidates read() pointers.
+    bool compact(uint64_t now_ms);
+
+    void get_stats(MessageLogStats *stats);
+
+private:
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+
+    struct Segment {
+        uint64_t number;
+        int fd;
+        uint8_t *base;                  // the .log, mapped read only
+        size_t mapped;
+        size_t used;                    // bytes of whole records
+        // Sealed segments only: the mapped .idx
+        void *index_map;
+        size_t index_mapped;
+        const LogIndexEntry *entries;
+        size_t entry_count;
+        const LogIndexEntry *forgets;
+        size_t forget_count;
+    };
+
+    // Messages of one conversation within one segment
+    struct Range {
+        const Segment *segment;
+        const LogIndexEntry *entries;   // sealed segments
+        const uint32_t *offsets;        // the active segment
+        size_t count;
+    };
+
+    bool open_segment(uint64_t number, bool active);
+    bool map_index(Segment *segment);
+    bool write_index(Segment *segment, std::vector<LogIndexEntry> &entries,
+                     const std::vector<LogIndexEntry> &forgets);
+    size_t scan(Segment *segment, std::vector<LogIndexEntry> *entries, std::vector<LogIndexEntry> *forgets);
+    bool create_active();
+    bool seal_active();
+    void note_forget(uint64_t conversation, uint64_t position);
+    void collect(uint64_t conversation, std::vector<Range> *ranges);
+    bool compact_segment(Segment *segment, uint64_t now_ms);
+
+    void commit_loop();
+    bool commit(std::vector<uint8_t> &batch);
+    void release(Segment *segment);
+
+    MessageLogConfig config;
+    std::string dir;
+    bool opened = false;
+
+    // Appends are framed straight into pending; the commit thread swaps it out
+    std::mutex queue_lock;
+    std::condition_variable queue_cv;
+    std::condition_variable durable_cv;
+    std::vector<uint8_t> pending;
+    uint64_t pending_since_ms = 0;
+    uint64_t appended_seq = 0;
+    uint64_t durable_seq = 0;
+    bool flush_requested = false;
+    bool running = false;
+    bool failed = false;
+    std::thread commit_thread;
+
+    // Segments and indexes; written by the commit thread and compact(), read by anyone
+    std::mutex index_lock;
+    std::vector<Segment *> segments;    // oldest first, the last one active
+    std::unordered_map<uint64_t, std::vector<uint32_t>> active_offsets;
+    std::vector<LogIndexEntry> active_forgets;
+    // Latest forget per conversation, as segment number << 32 | offset
+    std::unordered_map<uint64_t, uint64_t> forgotten;
+
+    MessageLogStats stats = {};
+};
+
+#endif
@@ -0,0 +1,638 @@
+#include "messaging.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Networking headers
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "probes.h"
+
+// Socket buffers sized for a few thousand queued datagrams
+const int MESSAGE_SOCKBUF = 4 << 20;
+
+static uint64_t peer_id(const struct sockaddr_in *addr) {
+    return (uint64_t)ntohl(addr->sin_addr.s_addr) << 16 | ntohs(addr->sin_port);
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8) p[i] = (uint8_t)v;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = v << 8 | p[i];
+    return v;
+}
+
+Messenger::Messenger(uint64_t node_id, size_t pool_size)
+    : node_id(node_id), wake_pending(false), stopping(false), pool(pool_size),
+      stat_messages_sent(0), stat_datagrams_sent(0), stat_send_calls(0),
+      stat_messages_received(0), stat_datagrams_received(0), stat_queue_full(0),
+      stat_drops(0), stat_malformed(0), stat_unkeyed(0), stat_rejected(0), stat_relayed(0) {
+    free_buffers.reserve(pool_size);
+    for (size_t i = 0; i < pool_size; i++) free_buffers.push_back(&pool[i]);
+    ready.reserve(pool_size);
+    outgoing.reserve(pool_size);
+    refused.reserve(pool_size);
+}
+
+Messenger::~Messenger() {
+    stop();
+}
+
+bool Messenger::start(int port, message_handler on_message, void *data) {
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return false;
+    }
+
+    int size = MESSAGE_SOCKBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) perror("setsockopt SO_RCVBUF");
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) perror("setsockopt SO_SNDBUF");
+    int ovfl = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &ovfl, sizeof(ovfl)) < 0) perror("setsockopt SO_RXQ_OVFL");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(sock);
+        sock = -1;
+        return false;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (wake_fd < 0 || epoll_fd < 0) {
+        perror("epoll");
+        stop();
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.fd = wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    handler = on_message;
+    user = data;
+    stopping.store(false);
+    thread = std::thread(&Messenger::loop, this);
+    return true;
+}
+
+void Messenger::stop() {
+    if (thread.joinable()) {
+        stopping.store(true);
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) perror("write");
+        thread.join();
+    }
+    if (sock != -1) close(sock);
+    if (epoll_fd != -1) close(epoll_fd);
+    if (wake_fd != -1) close(wake_fd);
+    sock = epoll_fd = wake_fd = -1;
+}
+
+// Copy one frame into the peer's open datagram, starting a new one if needed
+bool Messenger::append_locked(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len) {
+    PeerQueue &peer = peers[peer_id(to)];
+    size_t need = MESSAGE_FRAME_HEADER_SIZE + len;
+
+    if (peer.open && (peer.open->len + need > MESSAGE_MTU - MESSAGE_TAG_SIZE || peer.open->frames == 255)) {
+        ready.push_back(peer.open);
+        peer.open = NULL;
+    }
+
+    if (peer.open == NULL) {
+        if (peer.queued >= max_queued || free_buffers.empty()) {
+            stat_queue_full.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        MessageBuffer *buf = free_buffers.back();
+        free_buffers.pop_back();
+        buf->to = *to;
+        buf->peer = &peer;
+        buf->len = MESSAGE_HEADER_SIZE;
+        buf->frames = 0;
+        buf->hop.relayed = false;
+        buf->data[0] = 'P';
+        buf->data[1] = 'M';
+        buf->data[2] = MESSAGE_VERSION;
+        put_u64(buf->data + 4, node_id);
+        memset(buf->data + 12, 0, MESSAGE_HEADER_SIZE - 12);
+        peer.open = buf;
+        peer.queued++;
+        open_peers.push_back(&peer);
+    }
+
+    MessageBuffer *buf = peer.open;
+    uint8_t *frame = buf->data + buf->len;
+    frame[0] = type;
+    frame[1] = 0;
+    put_u16(frame + 2, (uint16_t)len);
+    memcpy(frame + MESSAGE_FRAME_HEADER_SIZE, data, len);
+    buf->len += need;
+    buf->frames++;
+    return true;
+}
+
+void Messenger::set_keys(message_key_lookup lookup, void *data) {
+    key_lookup = lookup;
+    key_user = data;
+}
+
+void Messenger::set_relay(message_route route_fn, message_relay relay_fn, void *data) {
+    route = route_fn;
+    relay = relay_fn;
+    relay_user = data;
+}
+
+// The peer's session, keyed afresh when its announced key changes. NULL
+// while the peer has no key.
+MessageSession *Messenger::session(const struct sockaddr_in *addr, uint64_t now_ms, bool retry) {
+    auto it = sessions.find(peer_id(addr));
+    if (it == sessions.end()) {
+        if (sessions.size() >= MESSAGE_MAX_SESSIONS) {
+            for (auto s = sessions.begin(); s != sessions.end();) {
+                s = s->second->keyed ? std::next(s) : sessions.erase(s);
+            }
+            if (sessions.size() >= MESSAGE_MAX_SESSIONS) return NULL;
+        }
+        MessageSession *fresh = new MessageSession();
+        fresh->id = peer_id(addr);
+        fresh->keyed = false;
+        fresh->checked_ms = 0;
+        fresh->next_packet = 0;
+        fresh->packet_end = 0;
+        it = sessions.emplace(peer_id(addr), std::unique_ptr<MessageSession>(fresh)).first;
+    }
+
+    MessageSession *s = it->second.get();
+    uint64_t wait = retry ? MESSAGE_KEY_RETRY_MS : MESSAGE_KEY_CHECK_MS;
+    if (s->checked_ms == 0 || now_ms >= s->checked_ms + wait) {
+        s->checked_ms = now_ms;
+        uint8_t key[CRYPTO_PUBLIC_KEY_SIZE];
+        if (!key_lookup(addr, key, key_user)) {
+            s->keyed = false;
+        } else if (!s->keyed || memcmp(key, s->public_key, sizeof(key)) != 0) {
+            s->keyed = crypto_derive(key, &s->keys) &&
+                       s->send.init(crypto_cipher(), s->keys.send_key, s->keys.send_salt) &&
+                       s->receive[0].init(CIPHER_AES_256_GCM, s->keys.receive_key, s->keys.receive_salt) &&
+                       s->receive[1].init(CIPHER_CHACHA20_POLY1305, s->keys.receive_key, s->keys.receive_salt);
+            memcpy(s->public_key, key, sizeof(key));
+            s->window = ReplayWindow();
+        }
+    }
+    return s->keyed ? s : NULL;
+}
+
+// Forget peers that have left discovery. Only queues with nothing waiting
+// and no open datagram go, since buffers point at their queue; the key
+// lookups run outside the queue lock.
+void Messenger::prune_peers(uint64_t now_ms) {
+    pruned_ms = now_ms;
+    idle_peers.clear();
+    {
+        ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+        for (const auto &entry : peers) {
+            if (entry.second.queued == 0 && entry.second.open == NULL) idle_peers.push_back(entry.first);
+        }
+    }
+
+    size_t gone = 0;
+    for (uint64_t id : idle_peers) {
+        if (key_lookup != NULL) {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl((uint32_t)(id >> 16));
+            addr.sin_port = htons((uint16_t)id);
+            uint8_t key[CRYPTO_PUBLIC_KEY_SIZE];
+            if (key_lookup(&addr, key, key_user)) continue;
+            sessions.erase(id);
+        }
+        idle_peers[gone++] = id;
+    }
+    idle_peers.resize(gone);
+    if (idle_peers.empty()) return;
+
+    ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+    for (uint64_t id : idle_peers) {
+        auto it = peers.find(id);
+        if (it != peers.end() && it->second.queued == 0 && it->second.open == NULL) peers.erase(it);
+    }
+}
+
+// Numbers stay unique under every key because each block comes from the
+// process-wide counter, however sessions come and go or get keyed again
+static uint64_t next_packet(MessageSession *s) {
+    if (s->next_packet == s->packet_end) {
+        s->next_packet = crypto_reserve_packets(MESSAGE_PACKET_BLOCK);
+        s->packet_end = s->next_packet + MESSAGE_PACKET_BLOCK;
+    }
+    return s->next_packet++;
+}
+
+// Fill in the frame counts and, with keys installed, seal every datagram of
+// the flush in place, so the cipher runs over the batch back to back. A
+// flush holds runs of datagrams for one peer, so the session is looked up
+// and checked once per run, not once per datagram. Datagrams for peers
+// without a key go back to the pool unsent.
+void Messenger::seal_outgoing() {
+    if (key_lookup == NULL) {
+        for (MessageBuffer *buf : outgoing) buf->data[3] = buf->frames;
+        return;
+    }
+
+    uint64_t now_ms = probe_now_ns() / 1000000;
+    MessageSession *s = NULL;
+    size_t kept = 0;
+    for (size_t i = 0; i < outgoing.size(); i++) {
+        MessageBuffer *buf = outgoing[i];
+        if (s == NULL || s->id != peer_id(&buf->to)) s = session(&buf->to, now_ms, false);
+        if (s != NULL) {
+            buf->data[3] = buf->frames;
+            buf->data[12] = (uint8_t)s->send.cipher();
+            uint64_t packet = next_packet(s);
+            put_u64(buf->data + 16, packet);
+            if (s->send.seal(packet, buf->data, MESSAGE_HEADER_SIZE, buf->data + MESSAGE_HEADER_SIZE,
+                             buf->len - MESSAGE_HEADER_SIZE, buf->data + buf->len)) {
+                buf->len += MESSAGE_TAG_SIZE;
+                outgoing[kept++] = buf;
+                continue;
+            }
+        }
+        refused.push_back(buf);
+    }
+    outgoing.resize(kept);
+    if (refused.empty()) return;
+
+    stat_unkeyed.fetch_add(refused.size(), std::memory_order_relaxed);
+    ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+    for (MessageBuffer *buf : refused) {
+        buf->peer->queued--;
+        free_buffers.push_back(buf);
+    }
+    refused.clear();
+}
+
+// Datagrams for peers out of reach go to the next hop behind a relay header.
+// The header is its own iovec, so the datagram is not moved to make room.
+void Messenger::route_outgoing() {
+    for (MessageBuffer *buf : outgoing) buf->hop.relayed = route(&buf->to, &buf->hop, relay_user);
+}
+
+void Messenger::kick() {
+    if (!wake_pending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) perror("write");
+    }
+}
+
+bool Messenger::send(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len) {
+    if (len > MESSAGE_MAX_PAYLOAD) return false;
+
+    {
+        ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+        if (!append_locked(to, type, data, len)) return false;
+    }
+    stat_messages_sent.fetch_add(1, std::memory_order_relaxed);
+    kick();
+    return true;
+}
+
+size_t Messenger::send_many(const struct sockaddr_in *to, size_t count, uint8_t type, const void *data, size_t len) {
+    if (len > MESSAGE_MAX_PAYLOAD) return 0;
+
+    size_t queued = 0;
+    {
+        ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+        for (size_t i = 0; i < count; i++) {
+            if (append_locked(&to[i], type, data, len)) queued++;
+        }
+    }
+    stat_messages_sent.fetch_add(queued, std::memory_order_relaxed);
+    if (queued) kick();
+    return queued;
+}
+
+// Close every open datagram, take the ready list, seal it and push it out
+// with sendmmsg
+void Messenger::flush() {
+    struct mmsghdr msgs[MESSAGE_BATCH];
+    struct iovec iovs[2 * MESSAGE_BATCH];
+
+    for (;;) {
+        if (outgoing_pos == outgoing.size()) {
+            {
+                ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+                outgoing.clear();
+                outgoing_pos = 0;
+
+                for (PeerQueue *peer : open_peers) {
+                    if (peer->open) {
+                        ready.push_back(peer->open);
+                        peer->open = NULL;
+                    }
+                }
+                open_peers.clear();
+                outgoing.swap(ready);
+            }
+            if (outgoing.empty()) break;
+
+            // Once per datagram: a send the kernel puts off resumes sealed and routed
+            seal_outgoing();
+            if (outgoing.empty()) continue;
+            if (route) route_outgoing();
+        }
+
+        int n = 0;
+        for (size_t i = outgoing_pos; i < outgoing.size() && n < MESSAGE_BATCH; i++, n++) {
+            MessageBuffer *buf = outgoing[i];
+            struct iovec *iov = &iovs[2 * n];
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = iov;
+            if (buf->hop.relayed) {
+                iov[0].iov_base = buf->hop.header;
+                iov[0].iov_len = MESSAGE_RELAY_HEADER_SIZE;
+                iov[1].iov_base = buf->data;
+                iov[1].iov_len = buf->len;
+                msgs[n].msg_hdr.msg_iovlen = 2;
+                msgs[n].msg_hdr.msg_name = &buf->hop.via;
+            } else {
+                iov[0].iov_base = buf->data;
+                iov[0].iov_len = buf->len;
+                msgs[n].msg_hdr.msg_iovlen = 1;
+                msgs[n].msg_hdr.msg_name = &buf->to;
+            }
+            msgs[n].msg_hdr.msg_namelen = sizeof(buf->to);
+        }
+
+        int sent = sendmmsg(sock, msgs, n, 0);
+        stat_send_calls.fetch_add(1, std::memory_order_relaxed);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("sendmmsg");
+            sent = 1;  // skip the datagram the kernel refused
+        }
+        stat_datagrams_sent.fetch_add(sent, std::memory_order_relaxed);
+
+        // The kernel has copied them; back to the pool
+        ProbedLock<std::mutex> lock(queue_mutex, PROBE_MESSENGER_LOCK, COUNTER_MESSENGER_LOCK);
+        for (int i = 0; i < sent; i++) {
+            MessageBuffer *buf = outgoing[outgoing_pos++];
+            buf->peer->queued--;
+            free_buffers.push_back(buf);
+        }
+    }
+
+    // Send buffer full: finish when the socket becomes writable again
+    bool blocked = outgoing_pos < outgoing.size();
+    if (blocked != want_writable) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (blocked ? (uint32_t)EPOLLOUT : 0);
+        ev.data.fd = sock;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev);
+        want_writable = blocked;
+    }
+}
+
+// Check a received datagram against the keys and decrypt it in place,
+// leaving len at the end of its frames. Counts whatever it refuses. last
+// carries the session across one receive batch, which mostly holds runs
+// from the same peer.
+bool Messenger::open_datagram(const struct sockaddr_in *from, uint8_t *p, size_t *len, uint64_t now_ms,
+                              MessageSession **last) {
+    uint8_t cipher = p[12];
+    if (key_lookup == NULL) {
+        if (cipher == CIPHER_NONE) return true;
+        stat_unkeyed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (cipher != CIPHER_AES_256_GCM && cipher != CIPHER_CHACHA20_POLY1305) {
+        stat_unkeyed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (*len < MESSAGE_HEADER_SIZE + MESSAGE_TAG_SIZE) {
+        stat_malformed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    MessageSession *s = *last;
+    if (s == NULL || s->id != peer_id(from)) s = *last = session(from, now_ms, false);
+    if (s == NULL) {
+        stat_unkeyed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t packet = get_u64(p + 16);
+    size_t body = *len - MESSAGE_HEADER_SIZE - MESSAGE_TAG_SIZE;
+    if (!s->window.check(packet) ||
+        !s->receive[cipher - 1].open(packet, p, MESSAGE_HEADER_SIZE, p + MESSAGE_HEADER_SIZE, body,
+                                     p + MESSAGE_HEADER_SIZE + body)) {
+        stat_rejected.fetch_add(1, std::memory_order_relaxed);
+        session(from, now_ms, true);   // the peer may have a new key by now
+        *last = NULL;
+        return false;
+    }
+    s->window.accept(packet);
+    *len -= MESSAGE_TAG_SIZE;
+    return true;
+}
+
+// Relayed datagrams for other nodes leave from the receive buffers they
+// arrived in, with one sendmmsg per batch. What the kernel will not take
+// right now is dropped, as a router would.
+static void forward_batch(int sock, struct mmsghdr *msgs, int count, std::atomic<uint64_t> &relayed) {
+    int done = 0;
+    while (done < count) {
+        int sent = sendmmsg(sock, msgs + done, count - done, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("sendmmsg relay");
+            break;
+        }
+        done += sent;
+    }
+    if (done) relayed.fetch_add(done, std::memory_order_relaxed);
+}
+
+void Messenger::drain_socket() {
+    struct mmsghdr msgs[MESSAGE_BATCH];
+    struct iovec iovs[MESSAGE_BATCH];
+    struct sockaddr_in addrs[MESSAGE_BATCH];
+    char ctrl[MESSAGE_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+    struct mmsghdr forwards[MESSAGE_BATCH];
+    struct iovec forward_iovs[MESSAGE_BATCH];
+    struct sockaddr_in next_hops[MESSAGE_BATCH];
+    static thread_local uint8_t bufs[MESSAGE_BATCH][MESSAGE_RELAY_HEADER_SIZE + MESSAGE_MTU];
+
+    for (;;) {
+        for (int i = 0; i < MESSAGE_BATCH; i++) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+
+        int n = recvmmsg(sock, msgs, MESSAGE_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+            return;
+        }
+
+        uint64_t now_ms = key_lookup ? probe_now_ns() / 1000000 : 0;
+        MessageSession *last = NULL;
+        uint64_t frames = 0;
+        uint64_t malformed = 0;
+        int forwarding = 0;
+        for (int i = 0; i < n; i++) {
+            struct msghdr *hdr = &msgs[i].msg_hdr;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                    uint32_t drops;
+                    memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                    stat_drops.store(drops, std::memory_order_relaxed);
+                }
+            }
+
+            uint8_t *p = bufs[i];
+            size_t len = msgs[i].msg_len;
+            if (relay != NULL && len >= MESSAGE_RELAY_HEADER_SIZE && !(hdr->msg_flags & MSG_TRUNC) &&
+                p[0] == 'P' && p[1] == 'R') {
+                struct sockaddr_in *addr = &next_hops[forwarding];
+                MessageRelayAction action = relay(p, len, addr, relay_user);
+                if (action == RELAY_FORWARD) {
+                    forward_iovs[forwarding].iov_base = p;
+                    forward_iovs[forwarding].iov_len = len;
+                    memset(&forwards[forwarding], 0, sizeof(forwards[forwarding]));
+                    forwards[forwarding].msg_hdr.msg_name = addr;
+                    forwards[forwarding].msg_hdr.msg_namelen = sizeof(*addr);
+                    forwards[forwarding].msg_hdr.msg_iov = &forward_iovs[forwarding];
+                    forwards[forwarding].msg_hdr.msg_iovlen = 1;
+                    forwarding++;
+                    continue;
+                }
+                if (action != RELAY_DELIVER) continue;
+                addrs[i] = *addr;
+                p += MESSAGE_RELAY_HEADER_SIZE;
+                len -= MESSAGE_RELAY_HEADER_SIZE;
+            }
+            if ((hdr->msg_flags & MSG_TRUNC) || len < MESSAGE_HEADER_SIZE || len > MESSAGE_MTU ||
+                p[0] != 'P' || p[1] != 'M' || p[2] != MESSAGE_VERSION) {
+                malformed++;
+                continue;
+            }
+            if (!open_datagram(&addrs[i], p, &len, now_ms, &last)) continue;
+
+            uint64_t sender = get_u64(p + 4);
+            size_t off = MESSAGE_HEADER_SIZE;
+            for (int f = 0; f < p[3]; f++) {
+                if (off + MESSAGE_FRAME_HEADER_SIZE > len) break;
+                size_t frame_len = get_u16(p + off + 2);
+                if (off + MESSAGE_FRAME_HEADER_SIZE + frame_len > len) break;
+                handler(&addrs[i], sender, p[off], p + off + MESSAGE_FRAME_HEADER_SIZE, frame_len, user);
+                off += MESSAGE_FRAME_HEADER_SIZE + frame_len;
+                frames++;
+            }
+        }
+
+        // Before the next recvmmsg reuses the buffers
+        if (forwarding) forward_batch(sock, forwards, forwarding, stat_relayed);
+
+        stat_datagrams_received.fetch_add(n, std::memory_order_relaxed);
+        stat_messages_received.fetch_add(frames, std::memory_order_relaxed);
+        if (malformed) stat_malformed.fetch_add(malformed, std::memory_order_relaxed);
+
+        if (n < MESSAGE_BATCH) return;
+    }
+}
+
+void Messenger::set_tick(message_tick fn, void *data) {
+    tick = fn;
+    tick_user = data;
+}
+
+void Messenger::loop() {
+    struct epoll_event events[2];
+    int timeout = -1;
+
+    while (!stopping.load()) {
+        int n = epoll_wait(epoll_fd, events, 2, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        bool do_flush = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read");
+                // Clear before flushing so a send racing with us wakes us again
+                wake_pending.store(false);
+                do_flush = true;
+            } else {
+                if (events[i].events & EPOLLIN) drain_socket();
+                if (events[i].events & EPOLLOUT) do_flush = true;
+            }
+        }
+
+        // The tick queues acks and retransmissions, which go out in the same flush
+        if (tick) {
+            timeout = tick(tick_user);
+            do_flush = true;
+        }
+        if (do_flush) flush();
+
+        uint64_t now_ms = probe_now_ns() / 1000000;
+        if (now_ms >= pruned_ms + MESSAGE_PRUNE_MS) prune_peers(now_ms);
+    }
+}
+
+void Messenger::get_stats(MessagingStats *stats) const {
+    stats->messages_sent = stat_messages_sent.load(std::memory_order_relaxed);
+    stats->datagrams_sent = stat_datagrams_sent.load(std::memory_order_relaxed);
+    stats->send_calls = stat_send_calls.load(std::memory_order_relaxed);
+    stats->messages_received = stat_messages_received.load(std::memory_order_relaxed);
+    stats->datagrams_received = stat_datagrams_received.load(std::memory_order_relaxed);
+    stats->queue_full = stat_queue_full.load(std::memory_order_relaxed);
+    stats->drops = stat_drops.load(std::memory_order_relaxed);
+    stats->malformed = stat_malformed.load(std::memory_order_relaxed);
+    stats->unkeyed = stat_unkeyed.load(std::memory_order_relaxed);
+    stats->rejected = stat_rejected.load(std::memory_order_relaxed);
+    stats->relayed = stat_relayed.load(std::memory_order_relaxed);
+}
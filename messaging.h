@@ -0,0 +1,265 @@
+#ifndef PUTTYNET_MESSAGING_H
+#define PUTTYNET_MESSAGING_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "crypto.h"
+
+// Message datagram wire format, all fields big-endian. Several messages for
+// the same peer are packed into one datagram:
+//
+//   0  magic 'P' 'M'     2 bytes
+//   2  version           1 byte
+//   3  frame count       1 byte
+//   4  sender node id    8 bytes
+//  12  cipher            1 byte, CryptoCipher; 0 is plaintext
+//  13  reserved          3 bytes
+//  16  packet number     8 bytes, 0 in plaintext
+//  24  frames...
+//      tag               16 bytes, unless plaintext
+//
+// and each frame is
+//
+//   0  type              1 byte
+//   1  flags             1 byte
+//   2  payload length    2 bytes
+//   4  payload
+//
+// With keys installed (set_keys()) the frames are encrypted and the header
+// is authenticated with them, under the session keys crypto.h derives from
+// the peer's announced public key. A whole flush is sealed in one pass
+// before it goes to sendmmsg, and each recvmmsg batch is opened in place
+// as it is parsed. Datagrams to or from a peer without a key are dropped,
+// plaintext included; Reliable resends text once the key is known.
+//
+// In mesh mode datagrams for peers out of reach travel behind a relay
+// header, and the thread forwards other nodes' datagrams in its receive
+// batch (set_relay()).
+
+const uint8_t MESSAGE_VERSION = 2;
+const size_t MESSAGE_HEADER_SIZE = 24;
+const size_t MESSAGE_FRAME_HEADER_SIZE = 4;
+const size_t MESSAGE_TAG_SIZE = CRYPTO_TAG_SIZE;
+
+// Datagrams stay under a typical path MTU so they are never fragmented
+const size_t MESSAGE_MTU = 1400;
+const size_t MESSAGE_MAX_PAYLOAD = MESSAGE_MTU - MESSAGE_HEADER_SIZE - MESSAGE_TAG_SIZE - MESSAGE_FRAME_HEADER_SIZE;
+
+// A session's public key is looked up again this often, and sooner after
+// a datagram fails to open, in case the peer restarted with a new one
+const uint64_t MESSAGE_KEY_CHECK_MS = 5000;
+const uint64_t MESSAGE_KEY_RETRY_MS = 250;
+
+// A session takes packet numbers from the process-wide counter this many
+// at a time and uses them in order, so the numbers one peer sees are
+// consecutive however many peers we send to
+const uint64_t MESSAGE_PACKET_BLOCK = 1 << 20;
+
+// Sessions kept per endpoint; past this, peers without a key are forgotten
+const size_t MESSAGE_MAX_SESSIONS = 4096;
+
+// Idle peer queues are swept this often. A peer whose key lookup fails has
+// left discovery, and its queue and session go; without keys installed
+// every idle queue goes, since an empty one costs nothing to recreate.
+const uint64_t MESSAGE_PRUNE_MS = MESSAGE_KEY_CHECK_MS;
+
+// Frame types
+const uint8_t FRAME_TEXT = 1;
+const uint8_t FRAME_DATA = 2;   // reliable.h: sequenced payload
+const uint8_t FRAME_ACK = 3;    // reliable.h: cumulative ack plus SACK bitmap
+const uint8_t FRAME_CALL_KEY = 4;   // core.cpp, through Reliable: the SRTP key the sender calls under
+
+// Datagrams per sendmmsg/recvmmsg call
+const int MESSAGE_BATCH = 64;
+
+// Relay header in front of a datagram that crosses the mesh (mesh.h)
+const size_t MESSAGE_RELAY_HEADER_SIZE = 32;
+
+// Called on the messaging thread for every frame received
+typedef void (*message_handler)(const struct sockaddr_in *from, uint64_t sender,
+                                uint8_t type, const uint8_t *data, size_t len, void *user);
+
+// Called on the messaging thread after every wakeup and when the previous
+// timeout runs out. Returns milliseconds until it next wants to run, or -1 to
+// wait for traffic.
+typedef int (*message_tick)(void *user);
+
+// Called on the messaging thread: the public key announced by the peer at
+// addr, or false if it has none
+typedef bool (*message_key_lookup)(const struct sockaddr_in *addr, uint8_t *public_key, void *user);
+
+// Where a datagram for a peer out of reach goes first, and the relay
+// header it goes with
+struct MessageHop {
+    struct sockaddr_in via;
+    uint8_t header[MESSAGE_RELAY_HEADER_SIZE];
+    bool relayed;               // false: straight to the peer
+};
+
+// Called on the messaging thread, once per datagram: false sends it
+// straight to the peer
+typedef bool (*message_route)(const struct sockaddr_in *to, MessageHop *hop, void *user);
+
+enum MessageRelayAction {
+    RELAY_DROP,                 // refused, or taken care of by the hook
+    RELAY_FORWARD,              // header rewritten, send it to addr
+    RELAY_DELIVER,              // ours: what follows the header came from addr
+};
+
+// Called on the messaging thread for every relayed datagram ('P' 'R'); it
+// may rewrite the header in place
+typedef MessageRelayAction (*message_relay)(uint8_t *data, size_t len, struct sockaddr_in *addr, void *user);
+
+struct MessagingStats {
+    uint64_t messages_sent;
+    uint64_t datagrams_sent;
+    uint64_t send_calls;        // sendmmsg syscalls
+    uint64_t messages_received;
+    uint64_t datagrams_received;
+    uint64_t queue_full;        // messages refused because a peer's queue was full
+    uint64_t drops;             // datagrams dropped by the kernel on receive
+    uint64_t malformed;
+    uint64_t unkeyed;           // datagrams dropped for want of the peer's key, either way
+    uint64_t rejected;          // datagrams that failed authentication or were replayed
+    uint64_t relayed;           // datagrams forwarded for other nodes
+};
+
+// One datagram being filled or waiting to go out
+struct MessageBuffer {
+    struct sockaddr_in to;
+    struct PeerQueue *peer;
+    uint16_t len;
+    uint8_t frames;
+    MessageHop hop;
+    uint8_t data[MESSAGE_MTU];
+};
+
+// Keys for one peer, messaging thread only
+struct MessageSession {
+    uint64_t id;                // the peer's address and port
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    bool keyed;
+    SessionKeys keys;
+    Aead send;
+    Aead receive[2];            // by cipher, set up once the peer uses it
+    ReplayWindow window;
+    uint64_t checked_ms;
+    uint64_t next_packet;       // in the block reserved last
+    uint64_t packet_end;
+};
+
+// Datagrams queued for one destination; at most one is open for appending
+struct PeerQueue {
+    MessageBuffer *open;
+    size_t queued;
+};
+
+// Messaging endpoint: one UDP socket, a fixed pool of datagram buffers and a
+// thread that drains the socket and flushes queued datagrams. send() may be
+// called from any thread; it copies into the peer's open datagram and only
+// wakes the thread if it is not already due to flush, so steady traffic
+// costs no syscall or allocation per message.
+class Messenger {
+public:
+    // pool_size datagram buffers are allocated up front
+    Messenger(uint64_t node_id, size_t pool_size = 4096);
+    ~Messenger();
+
+    bool start(int port, message_handler handler, void *user);
+    void stop();
+
+    // Queue one message for to. Returns false if it is too large or the
+    // peer already has max_queued datagrams waiting.
+    bool send(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len);
+
+    // Queue the same message for several peers
+    size_t send_many(const struct sockaddr_in *to, size_t count, uint8_t type, const void *data, size_t len);
+
+    // Install before start(); the tick may call send()
+    void set_tick(message_tick tick, void *tick_user);
+
+    // Encrypt everything, with keys from lookup; install before start()
+    void set_keys(message_key_lookup lookup, void *lookup_user);
+
+    // Relay through the mesh, and for it; install before start()
+    void set_relay(message_route route, message_relay relay, void *relay_user);
+
+    // Wake the messaging thread so the tick runs soon
+    void kick();
+
+    void get_stats(MessagingStats *stats) const;
+
+    // Per-peer cap on queued datagrams
+    size_t max_queued = 256;
+
+private:
+    Messenger(const Messenger &) = delete;
+    Messenger &operator=(const Messenger &) = delete;
+
+    bool append_locked(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len);
+    void loop();
+    void drain_socket();
+    void flush();
+    void seal_outgoing();
+    void route_outgoing();
+    bool open_datagram(const struct sockaddr_in *from, uint8_t *p, size_t *len, uint64_t now_ms,
+                       MessageSession **last);
+    MessageSession *session(const struct sockaddr_in *addr, uint64_t now_ms, bool retry);
+    void prune_peers(uint64_t now_ms);
+
+    uint64_t node_id;
+    int sock = -1;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    message_handler handler = NULL;
+    void *user = NULL;
+    message_tick tick = NULL;
+    void *tick_user = NULL;
+    message_key_lookup key_lookup = NULL;
+    void *key_user = NULL;
+    message_route route = NULL;
+    message_relay relay = NULL;
+    void *relay_user = NULL;
+    std::thread thread;
+    std::atomic<bool> wake_pending;
+    std::atomic<bool> stopping;
+
+    // Guarded by queue_mutex
+    std::mutex queue_mutex;
+    std::vector<MessageBuffer> pool;
+    std::vector<MessageBuffer *> free_buffers;
+    std::unordered_map<uint64_t, PeerQueue> peers;  // ip:port -> queue
+    std::vector<PeerQueue *> open_peers;
+    std::vector<MessageBuffer *> ready;
+
+    // Messaging thread only: datagrams handed to the kernel next
+    std::vector<MessageBuffer *> outgoing;
+    size_t outgoing_pos = 0;
+    bool want_writable = false;
+    std::vector<MessageBuffer *> refused;
+    std::unordered_map<uint64_t, std::unique_ptr<MessageSession>> sessions;  // ip:port -> keys
+    std::vector<uint64_t> idle_peers;
+    uint64_t pruned_ms = 0;
+
+    std::atomic<uint64_t> stat_messages_sent;
+    std::atomic<uint64_t> stat_datagrams_sent;
+    std::atomic<uint64_t> stat_send_calls;
+    std::atomic<uint64_t> stat_messages_received;
+    std::atomic<uint64_t> stat_datagrams_received;
+    std::atomic<uint64_t> stat_queue_full;
+    std::atomic<uint64_t> stat_drops;
+    std::atomic<uint64_t> stat_malformed;
+    std::atomic<uint64_t> stat_unkeyed;
+    std::atomic<uint64_t> stat_rejected;
+    std::atomic<uint64_t> stat_relayed;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Time a scraper gets to send its request before the answer goes out
+// anyway, and to take the answer before it is dropped
+const int REQUEST_TIMEOUT_MS = 200;
+const int RESPONSE_TIMEOUT_SEC = 1;
+
+static int listen_fd = -1;
+static int stop_fd = -1;
+static std::string socket_path;
+static std::thread metrics_thread;
+
+static std::mutex collectors_lock;
+static std::vector<std::pair<metrics_collector, void *>> collectors;
+
+void MetricsWriter::sample(const char *name, const char *help, const char *type, double value,
+                           const char *labels) {
+    if (family != name) {
+        family = name;
+        out += "# HELP ";
+        out += name;
+        out += ' ';
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += ' ';
+        out += type;
+        out += '\n';
+    }
+    char number[32];
+    if (isnan(value)) snprintf(number, sizeof(number), "NaN");
+    else snprintf(number, sizeof(number), "%.17g", value);
+
+    out += name;
+    if (labels != NULL) {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+void MetricsWriter::gauge(const char *name, const char *help, double value, const char *labels) {
+    sample(name, help, "gauge", value, labels);
+}
+
+void MetricsWriter::counter(const char *name, const char *help, double value, const char *labels) {
+    sample(name, help, "counter", value, labels);
+}
+
+// MSG_NOSIGNAL: a scraper hanging up early must give EPIPE, not kill the
+// process, and the GUI does not ignore SIGPIPE
+static bool write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// Read the request until its blank line, a timeout or EOF. Its content does
+// not matter: every path gets the metrics.
+static void read_request(int fd) {
+    char buffer[1024];
+    std::string request;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) <= 0) return;
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) return;
+        request.append(buffer, n);
+    }
+}
+
+static void serve(int fd) {
+    read_request(fd);
+
+    MetricsWriter writer;
+    {
+        std::lock_guard<std::mutex> guard(collectors_lock);
+        for (auto &collector : collectors) collector.first(writer, collector.second);
+    }
+
+    std::string response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(writer.text().size()) + "\r\n"
+        "\r\n";
+    if (write_all(fd, response)) write_all(fd, writer.text());
+}
+
+// One scrape at a time is plenty for a local endpoint
+static void metrics_loop() {
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        if (fds[1].revents) return;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        struct timeval timeout = {RESPONSE_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(fd);
+        close(fd);
+    }
+}
+
+static void close_fds() {
+    if (listen_fd != -1) close(listen_fd);
+    if (stop_fd != -1) close(stop_fd);
+    listen_fd = stop_fd = -1;
+}
+
+bool metrics_start(const char *path) {
+    if (listen_fd != -1) return true;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics: socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listen_fd < 0 || stop_fd < 0) {
+        perror("metrics socket");
+        close_fds();
+        return false;
+    }
+
+    // Only this user may read the metrics
+    struct stat existing;
+    if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) unlink(path);
+    mode_t mask = umask(077);
+    int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0 || listen(listen_fd, 8) < 0) {
+        perror("metrics bind");
+        close_fds();
+        return false;
+    }
+
+    socket_path = path;
+    metrics_thread = std::thread(metrics_loop);
+    return true;
+}
+
+void metrics_register(metrics_collector collector, void *user) {
+    std::lock_guard<std::mutex> guard(collectors_lock);
+    collectors.emplace_back(collector, user);
+}
+
+void metrics_stop() {
+    if (metrics_thread.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) perror("metrics stop");
+        metrics_thread.join();
+    }
+    close_fds();
+    if (!socket_path.empty()) unlink(socket_path.c_str());
+    socket_path.clear();
+
+    std::lock_guard<std::mutex> guard(collectors_lock);
+    collectors.clear();
+}
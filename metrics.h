@@ -0,0 +1,40 @@
+#ifndef PUTTYNET_METRICS_H
+#define PUTTYNET_METRICS_H
+
+#include <string>
+
+// Live metrics in the Prometheus text format, served over HTTP on a Unix
+// socket:
+//
+//     curl --unix-socket $XDG_RUNTIME_DIR/puttyNet/metrics.sock http://localhost/metrics
+//
+// Nothing is sampled in the background. Each scrape calls the registered
+// collectors on the metrics thread, and those only copy out numbers their
+// modules already keep.
+
+class MetricsWriter {
+public:
+    // labels is the inside of the braces, e.g. peer="10.0.0.2", or NULL
+    void gauge(const char *name, const char *help, double value, const char *labels = NULL);
+    void counter(const char *name, const char *help, double value, const char *labels = NULL);
+
+    const std::string &text() const { return out; }
+
+private:
+    void sample(const char *name, const char *help, const char *type, double value, const char *labels);
+
+    std::string out;
+    std::string family;     // HELP and TYPE go out once per family
+};
+
+typedef void (*metrics_collector)(MetricsWriter &out, void *user);
+
+// Listen on path, replacing a stale socket left there
+bool metrics_start(const char *path);
+
+// Collectors may be added before or after metrics_start()
+void metrics_register(metrics_collector collector, void *user);
+
+void metrics_stop();
+
+#endif
@@ -0,0 +1,225 @@
+#include "mixer.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Scalar kernels, also used for the tail of every vector loop
+
+static inline int16_t clip(float v) {
+    int32_t i = (int32_t)(v < 0 ? v - 0.5f : v + 0.5f);
+    if (i > INT16_MAX) return INT16_MAX;
+    if (i < INT16_MIN) return INT16_MIN;
+    return (int16_t)i;
+}
+
+static void accumulate_scalar(float *acc, const int16_t *in, float gain, size_t n) {
+    for (size_t i = 0; i < n; i++) acc[i] += in[i] * gain;
+}
+
+static void store_scalar(int16_t *out, const float *acc, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = clip(acc[i]);
+}
+
+static void minus_scalar(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = clip(acc[i] - in[i] * gain);
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so this is the floor there. Sign extension of
+// 16-bit samples without SSE4.1: unpack each sample into the top half of a
+// 32-bit lane and shift it back down arithmetically. packs_epi32 clips.
+
+static inline void widen_sse2(__m128i v, __m128 *lo, __m128 *hi) {
+    *lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+    *hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+}
+
+static void accumulate_sse2(float *acc, const int16_t *in, float gain, size_t n) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 lo, hi;
+        widen_sse2(_mm_loadu_si128((const __m128i *)(in + i)), &lo, &hi);
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(lo, g)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(hi, g)));
+    }
+    accumulate_scalar(acc + i, in + i, gain, n - i);
+}
+
+static void store_sse2(int16_t *out, const float *acc, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_cvtps_epi32(_mm_loadu_ps(acc + i));
+        __m128i hi = _mm_cvtps_epi32(_mm_loadu_ps(acc + i + 4));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+    store_scalar(out + i, acc + i, n - i);
+}
+
+static void minus_sse2(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 lo, hi;
+        widen_sse2(_mm_loadu_si128((const __m128i *)(in + i)), &lo, &hi);
+        __m128i a = _mm_cvtps_epi32(_mm_sub_ps(_mm_loadu_ps(acc + i), _mm_mul_ps(lo, g)));
+        __m128i b = _mm_cvtps_epi32(_mm_sub_ps(_mm_loadu_ps(acc + i + 4), _mm_mul_ps(hi, g)));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+    }
+    minus_scalar(out + i, acc + i, in + i, gain, n - i);
+}
+
+// AVX2 does 16 samples per step. packs works within 128-bit lanes, so the
+// result is put back in order with a cross-lane permute.
+
+__attribute__((target("avx2,fma")))
+static void accumulate_avx2(float *acc, const int16_t *in, float gain, size_t n) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        __m256i w = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i + 8)));
+        _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(_mm256_cvtepi32_ps(v), g, _mm256_loadu_ps(acc + i)));
+        _mm256_storeu_ps(acc + i + 8, _mm256_fmadd_ps(_mm256_cvtepi32_ps(w), g, _mm256_loadu_ps(acc + i + 8)));
+    }
+    accumulate_scalar(acc + i, in + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+static void store_avx2(int16_t *out, const float *acc, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_cvtps_epi32(_mm256_loadu_ps(acc + i));
+        __m256i hi = _mm256_cvtps_epi32(_mm256_loadu_ps(acc + i + 8));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    store_scalar(out + i, acc + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void minus_avx2(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i))));
+        __m256 w = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i + 8))));
+        __m256i lo = _mm256_cvtps_epi32(_mm256_fnmadd_ps(v, g, _mm256_loadu_ps(acc + i)));
+        __m256i hi = _mm256_cvtps_epi32(_mm256_fnmadd_ps(w, g, _mm256_loadu_ps(acc + i + 8)));
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    minus_scalar(out + i, acc + i, in + i, gain, n - i);
+}
+
+#elif defined(__aarch64__)
+
+// vqmovn_s32 narrows with saturation, which is the clip
+
+static void accumulate_neon(float *acc, const int16_t *in, float gain, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(in + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        vst1q_f32(acc + i, vfmaq_n_f32(vld1q_f32(acc + i), lo, gain));
+        vst1q_f32(acc + i + 4, vfmaq_n_f32(vld1q_f32(acc + i + 4), hi, gain));
+    }
+    accumulate_scalar(acc + i, in + i, gain, n - i);
+}
+
+static void store_neon(int16_t *out, const float *acc, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t lo = vcvtnq_s32_f32(vld1q_f32(acc + i));
+        int32x4_t hi = vcvtnq_s32_f32(vld1q_f32(acc + i + 4));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+    store_scalar(out + i, acc + i, n - i);
+}
+
+static void minus_neon(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(in + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        int32x4_t a = vcvtnq_s32_f32(vfmsq_n_f32(vld1q_f32(acc + i), lo, gain));
+        int32x4_t b = vcvtnq_s32_f32(vfmsq_n_f32(vld1q_f32(acc + i + 4), hi, gain));
+        vst1q_s16(out + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+    minus_scalar(out + i, acc + i, in + i, gain, n - i);
+}
+
+#endif
+
+struct MixKernels {
+    const char *name;
+    void (*accumulate)(float *, const int16_t *, float, size_t);
+    void (*store)(int16_t *, const float *, size_t);
+    void (*minus)(int16_t *, const float *, const int16_t *, float, size_t);
+};
+
+static const MixKernels scalar_kernels = {"scalar", accumulate_scalar, store_scalar, minus_scalar};
+
+static MixKernels best_kernels() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return {"avx2", accumulate_avx2, store_avx2, minus_avx2};
+    }
+    return {"sse2", accumulate_sse2, store_sse2, minus_sse2};
+#elif defined(__aarch64__)
+    return {"neon", accumulate_neon, store_neon, minus_neon};
+#else
+    return scalar_kernels;
+#endif
+}
+
+static MixKernels kernels = best_kernels();
+
+void mix_accumulate(float *acc, const int16_t *in, float gain, size_t n) {
+    kernels.accumulate(acc, in, gain, n);
+}
+
+void mix_store(int16_t *out, const float *acc, size_t n) {
+    kernels.store(out, acc, n);
+}
+
+void mix_minus(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n) {
+    kernels.minus(out, acc, in, gain, n);
+}
+
+const char *mix_kernels() {
+    return kernels.name;
+}
+
+void mix_force_scalar(bool scalar) {
+    kernels = scalar ? scalar_kernels : best_kernels();
+}
+
+Mixer::Mixer(size_t frame_samples) : samples(frame_samples), remote(frame_samples), all(frame_samples) {
+}
+
+void Mixer::mix(const MixInput *inputs, size_t count, const int16_t *local, float local_gain,
+                int16_t *playback, int16_t *const *minus) {
+    memset(remote.data(), 0, samples * sizeof(float));
+    for (size_t i = 0; i < count; i++) {
+        if (inputs[i].pcm) mix_accumulate(remote.data(), inputs[i].pcm, inputs[i].gain, samples);
+    }
+    if (playback) mix_store(playback, remote.data(), samples);
+
+    // Everyone sends back the whole room plus us, minus what they said
+    memcpy(all.data(), remote.data(), samples * sizeof(float));
+    if (local) mix_accumulate(all.data(), local, local_gain, samples);
+    for (size_t i = 0; i < count; i++) {
+        if (minus[i] == NULL) continue;
+        if (inputs[i].pcm) mix_minus(minus[i], all.data(), inputs[i].pcm, inputs[i].gain, samples);
+        else mix_store(minus[i], all.data(), samples);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef PUTTYNET_MIXER_H
+#define PUTTYNET_MIXER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Conference mixing on 16-bit PCM. Sums are kept in float so any number of
+// speakers can be added and subtracted without overflow; only the final
+// conversion back to 16 bits clips. The kernels are vectorized (AVX2 or
+// SSE2 on x86-64, NEON on ARM64) and picked once at startup.
+
+// acc[i] += in[i] * gain
+void mix_accumulate(float *acc, const int16_t *in, float gain, size_t n);
+
+// out[i] = clip(acc[i])
+void mix_store(int16_t *out, const float *acc, size_t n);
+
+// out[i] = clip(acc[i] - in[i] * gain), one participant's mix-minus
+void mix_minus(int16_t *out, const float *acc, const int16_t *in, float gain, size_t n);
+
+// Name of the kernels in use
+const char *mix_kernels();
+
+// Benchmarks only: switch to the plain C kernels and back
+void mix_force_scalar(bool scalar);
+
+// One remote participant's audio for this tick
+struct MixInput {
+    const int16_t *pcm;      // frame_samples samples, or NULL for silence
+    float gain;
+};
+
+// Mixes one tick of a conference. Every remote participant hears everyone
+// but themselves plus the local microphone; the local speaker hears all
+// remote participants.
+class Mixer {
+public:
+    explicit Mixer(size_t frame_samples);
+
+    // minus[i] receives participant i's outgoing mix; local may be NULL
+    void mix(const MixInput *inputs, size_t count, const int16_t *local, float local_gain,
+             int16_t *playback, int16_t *const *minus);
+
+    size_t frame_samples() const { return samples; }
+
+private:
+    size_t samples;
+    std::vector<float> remote;   // sum of remote participants
+    std::vector<float> all;      // plus the local microphone
+};
+
+#endif
@@ -0,0 +1,243 @@
+#include "node_list.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+#include "peers.h"
+#include "probes.h"
+
+// List item for one peer; the labels bind to its "name" and "distance"
+// properties
+
+#define PEER_TYPE_ITEM (peer_item_get_type())
+G_DECLARE_FINAL_TYPE(PeerItem, peer_item, PEER, ITEM, GObject)
+
+struct _PeerItem {
+    GObject parent_instance;
+    PeerKey key;
+    char ip[INET6_ADDRSTRLEN];
+    char *name;
+    char *distance;     // "" when unknown
+    guint generation;
+};
+
+G_DEFINE_TYPE(PeerItem, peer_item, G_TYPE_OBJECT)
+
+enum {
+    PROP_0,
+    PROP_NAME,
+    PROP_DISTANCE,
+    N_PROPS
+};
+
+static GParamSpec *item_props[N_PROPS];
+
+static void peer_item_set_property(GObject *object, guint id, const GValue *value, GParamSpec *pspec) {
+    PeerItem *item = PEER_ITEM(object);
+    if (id == PROP_NAME) {
+        g_free(item->name);
+        item->name = g_value_dup_string(value);
+    } else if (id == PROP_DISTANCE) {
+        g_free(item->distance);
+        item->distance = g_value_dup_string(value);
+    } else {
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, id, pspec);
+    }
+}
+
+static void peer_item_get_property(GObject *object, guint id, GValue *value, GParamSpec *pspec) {
+    PeerItem *item = PEER_ITEM(object);
+    if (id == PROP_NAME) {
+        g_value_set_string(value, item->name);
+    } else if (id == PROP_DISTANCE) {
+        g_value_set_string(value, item->distance);
+    } else {
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, id, pspec);
+    }
+}
+
+static void peer_item_finalize(GObject *object) {
+    g_free(PEER_ITEM(object)->name);
+    g_free(PEER_ITEM(object)->distance);
+    G_OBJECT_CLASS(peer_item_parent_class)->finalize(object);
+}
+
+static void peer_item_class_init(PeerItemClass *klass) {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+    object_class->set_property = peer_item_set_property;
+    object_class->get_property = peer_item_get_property;
+    object_class->finalize = peer_item_finalize;
+
+    item_props[PROP_NAME] = g_param_spec_string("name", "Name", "Announced node name", "",
+        (GParamFlags)(G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+    item_props[PROP_DISTANCE] = g_param_spec_string("distance", "Distance", "Estimated distance to the peer", "",
+        (GParamFlags)(G_PARAM_READWRITE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_properties(object_class, N_PROPS, item_props);
+}
+
+static void peer_item_init(PeerItem *item) {
+    item->name = g_strdup("");
+    item->distance = g_strdup("");
+}
+
+// Model state, UI thread only
+
+struct PeerKeyHash {
+    size_t operator()(const PeerKey &key) const { return peer_key_hash(key); }
+};
+
+struct PeerKeyEqual {
+    bool operator()(const PeerKey &a, const PeerKey &b) const { return peer_key_equal(a, b); }
+};
+
+static GListStore *node_store = NULL;
+static std::unordered_map<PeerKey, PeerItem *, PeerKeyHash, PeerKeyEqual> node_items;
+static guint generation = 0;
+static node_call_handler message_handler = NULL;
+static node_call_handler call_handler = NULL;
+static node_call_handler send_file_handler = NULL;
+static node_distance_fn distance_source = NULL;
+static std::atomic<bool> sync_pending(false);
+
+// Bring the store in line with the current snapshot
+static gboolean sync_node_store(gpointer) {
+    ProbeScope probe(PROBE_NODE_LIST_SYNC);
+    sync_pending.store(false);
+
+    PeerReader snapshot;
+    const std::vector<Node> &nodes = snapshot->table.all();
+    generation++;
+
+    size_t kept = 0;
+    size_t inserted = 0;
+    for (const Node &node : nodes) {
+        auto it = node_items.find(node.key);
+        if (it == node_items.end()) {
+            PeerItem *item = PEER_ITEM(g_object_new(PEER_TYPE_ITEM, "name", node.name, NULL));
+            item->key = node.key;
+            item->generation = generation;
+            peer_format_addr(&node.key, item->ip, sizeof(item->ip));
+            g_list_store_append(node_store, item);
+            node_items[node.key] = item;
+            g_object_unref(item);  // the store holds the reference
+            inserted++;
+            continue;
+        }
+
+        PeerItem *item = it->second;
+        item->generation = generation;
+        kept++;
+        if (strcmp(item->name, node.name) != 0) {
+            g_free(item->name);
+            item->name = g_strdup(node.name);
+            g_object_notify_by_pspec(G_OBJECT(item), item_props[PROP_NAME]);
+        }
+    }
+
+    // Anything not seen this round left the snapshot; walk the store once
+    if (kept + inserted < node_items.size()) {
+        for (guint i = g_list_model_get_n_items(G_LIST_MODEL(node_store)); i-- > 0;) {
+            PeerItem *item = PEER_ITEM(g_list_model_get_item(G_LIST_MODEL(node_store), i));
+            if (item->generation != generation) {
+                node_items.erase(item->key);
+                g_list_store_remove(node_store, i);
+            }
+            g_object_unref(item);
+        }
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+// Runs on the discovery thread; coalesces bursts into one idle callback
+static void on_peers_changed() {
+    if (!sync_pending.exchange(true)) {
+        g_idle_add(sync_node_store, NULL);
+    }
+}
+
+static void on_message_clicked(GtkButton *, gpointer data) {
+    message_handler(PEER_ITEM(data)->ip);
+}
+
+static void on_call_clicked(GtkButton *, gpointer data) {
+    call_handler(PEER_ITEM(data)->ip);
+}
+
+static void on_send_file_clicked(GtkButton *, gpointer data) {
+    send_file_handler(PEER_ITEM(data)->ip);
+}
+
+static GtkWidget *create_node_row(gpointer object, gpointer) {
+    PeerItem *item = PEER_ITEM(object);
+
+    GtkWidget *row = gtk_list_box_row_new();
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_container_add(GTK_CONTAINER(row), hbox);
+
+    GtkWidget *label = gtk_label_new(NULL);
+    g_object_bind_property(item, "name", label, "label", G_BINDING_SYNC_CREATE);
+    gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, TRUE, 0);
+
+    label = gtk_label_new(NULL);
+    gtk_widget_set_sensitive(label, FALSE);    // dimmed, secondary to the name
+    g_object_bind_property(item, "distance", label, "label", G_BINDING_SYNC_CREATE);
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+
+    GtkWidget *button = gtk_button_new_with_label("Message");
+    g_signal_connect_object(button, "clicked", G_CALLBACK(on_message_clicked), item, (GConnectFlags)0);
+    gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
+
+    button = gtk_button_new_with_label("Call");
+    g_signal_connect_object(button, "clicked", G_CALLBACK(on_call_clicked), item, (GConnectFlags)0);
+    gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
+
+    button = gtk_button_new_with_label("Send file");
+    g_signal_connect_object(button, "clicked", G_CALLBACK(on_send_file_clicked), item, (GConnectFlags)0);
+    gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
+
+    gtk_widget_show_all(row);
+    return row;
+}
+
+// Distances change with every frame the peer sends, so these are polled
+static gboolean refresh_distances(gpointer) {
+    char text[32];
+    for (auto &entry : node_items) {
+        PeerItem *item = entry.second;
+        double metres;
+        if (!distance_source(item->ip, &metres)) text[0] = '\0';
+        else if (metres < 10) snprintf(text, sizeof(text), "%.1f m", metres);
+        else snprintf(text, sizeof(text), "%.0f m", metres);
+        if (strcmp(item->distance, text) != 0) {
+            g_free(item->distance);
+            item->distance = g_strdup(text);
+            g_object_notify_by_pspec(G_OBJECT(item), item_props[PROP_DISTANCE]);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+void node_list_show_distances(node_distance_fn distance) {
+    if (distance_source == NULL) g_timeout_add_seconds(1, refresh_distances, NULL);
+    distance_source = distance;
+}
+
+GtkWidget *node_list_new(node_call_handler on_message, node_call_handler on_call, node_call_handler on_send_file) {
+    message_handler = on_message;
+    call_handler = on_call;
+    send_file_handler = on_send_file;
+    node_store = g_list_store_new(PEER_TYPE_ITEM);
+
+    GtkWidget *list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(list), GTK_SELECTION_SINGLE);
+    gtk_list_box_bind_model(GTK_LIST_BOX(list), G_LIST_MODEL(node_store), create_node_row, NULL, NULL);
+
+    peers_set_changed_hook(on_peers_changed);
+    on_peers_changed();  // pick up anything discovered before the list existed
+    return list;
+}
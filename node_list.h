@@ -0,0 +1,22 @@
+#ifndef PUTTYNET_NODE_LIST_H
+#define PUTTYNET_NODE_LIST_H
+
+#include <gtk/gtk.h>
+
+// Called with the peer's address when its Message, Call or Send file button
+// is clicked
+typedef void (*node_call_handler)(const char *ip);
+
+// List box bound to a GListStore of online peers. Rows are only created,
+// renamed or removed for peers that changed, whenever discovery publishes a
+// membership change; nothing polls but the distances below.
+GtkWidget *node_list_new(node_call_handler on_message, node_call_handler on_call, node_call_handler on_send_file);
+
+// How far away the peer at ip is, in metres; false if unknown
+typedef bool (*node_distance_fn)(const char *ip, double *metres);
+
+// Show each peer's distance next to its name, asked of distance once a
+// second. Only labels whose text changed are touched.
+void node_list_show_distances(node_distance_fn distance);
+
+#endif
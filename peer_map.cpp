@@ -0,0 +1,423 @@
+#include "peer_map.h"
+
+#include <algorithm>
+#include <epoxy/gl.h>
+#include <math.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "probes.h"
+#include "timer_wheel.h"
+
+// How long an edge stays up after a pulse; the pulse itself fades in the
+// shader over a second or two
+static const uint64_t EDGE_MS = 8000;
+
+// 16 bytes an instance. Position is polar so the shaders can turn the disc;
+// active_at is on the map's clock, negative for never.
+struct MapInstance {
+    float radius;
+    float angle;
+    float active_at;
+    uint8_t r, g, b;
+    uint8_t in_call;
+};
+
+// Shared by both programs: where a star is at time, with inner stars
+// turning faster, on a disc squashed to fill the wide header
+#define MAP_PLACE_GLSL \
+    "uniform float time;\n" \
+    "uniform vec2 disc;\n" \
+    "vec2 place(float radius, float angle) {\n" \
+    "    float a = angle + time * 0.08 / (radius + 0.25);\n" \
+    "    return vec2(cos(a), sin(a)) * radius * disc;\n" \
+    "}\n" \
+    "float pulse(float active_at, float in_call) {\n" \
+    "    if (in_call > 0.5) return 0.7 + 0.3 * sin(time * 4.0);\n" \
+    "    return active_at < 0.0 ? 0.0 : exp(-(time - active_at) / 1.5);\n" \
+    "}\n"
+
+// A quad per instance from gl_VertexID, so the instance buffer is all there is
+static const char *star_vertex_shader_source =
+    "#version 330 core\n"
+    "layout (location = 0) in vec2 polar;\n"
+    "layout (location = 1) in float active_at;\n"
+    "layout (location = 2) in vec4 color;\n"
+    MAP_PLACE_GLSL
+    "uniform vec2 pixel;\n"
+    "uniform float star_size;\n"
+    "out vec2 corner;\n"
+    "out vec3 star_color;\n"
+    "out float glow;\n"
+    "void main() {\n"
+    "    corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;\n"
+    "    float p = pulse(active_at, color.a);\n"
+    "    float size = star_size * (1.0 + 1.5 * p);\n"
+    "    gl_Position = vec4(place(polar.x, polar.y) + corner * size * pixel, 0.0, 1.0);\n"
+    "    star_color = color.rgb;\n"
+    "    glow = 0.4 + 0.6 * p;\n"
+    "}\n";
+
+static const char *star_fragment_shader_source =
+    "#version 330 core\n"
+    "in vec2 corner;\n"
+    "in vec3 star_color;\n"
+    "in float glow;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    float r2 = dot(corner, corner);\n"
+    "    if (r2 > 1.0) discard;\n"
+    "    float light = (1.0 - r2) * (1.0 - r2) * glow + exp(-16.0 * r2);\n"
+    "    frag_color = vec4(star_color * light, 1.0);\n"
+    "}\n";
+
+// An edge per instance: vertex 0 at the centre, vertex 1 at the peer
+static const char *edge_vertex_shader_source =
+    "#version 330 core\n"
+    "layout (location = 0) in vec2 polar;\n"
+    "layout (location = 1) in float active_at;\n"
+    "layout (location = 2) in vec4 color;\n"
+    MAP_PLACE_GLSL
+    "out vec4 edge_color;\n"
+    "void main() {\n"
+    "    vec2 end = place(polar.x, polar.y);\n"
+    "    gl_Position = vec4(gl_VertexID == 0 ? vec2(0.0) : end, 0.0, 1.0);\n"
+    "    edge_color = vec4(color.rgb * (0.15 + 0.45 * pulse(active_at, color.a)), 1.0);\n"
+    "}\n";
+
+static const char *edge_fragment_shader_source =
+    "#version 330 core\n"
+    "in vec4 edge_color;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    frag_color = edge_color;\n"
+    "}\n";
+
+// Peer activity, keyed by address alone, since calls and messages go to
+// an address rather than a node id
+
+struct AddrKey {
+    uint8_t addr[16];
+    bool operator==(const AddrKey &other) const { return memcmp(addr, other.addr, 16) == 0; }
+};
+
+struct AddrKeyHash {
+    size_t operator()(const AddrKey &key) const {
+        uint64_t lo, hi;
+        memcpy(&lo, key.addr, 8);
+        memcpy(&hi, key.addr + 8, 8);
+        return (size_t)((lo ^ (hi * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull >> 16);
+    }
+};
+
+struct Activity {
+    uint64_t at_ms;          // last pulse, 0 for none
+    bool in_call;
+};
+
+typedef std::unordered_map<AddrKey, Activity, AddrKeyHash> ActivityMap;
+
+static std::mutex activity_mutex;
+static ActivityMap activity;         // covered by activity_mutex
+static uint64_t activity_generation = 0;
+
+static bool parse_addr(const char *ip, AddrKey *key) {
+    memset(key, 0, sizeof(*key));
+    if (inet_pton(AF_INET, ip, key->addr + 12) == 1) {
+        key->addr[10] = 0xff;
+        key->addr[11] = 0xff;
+        return true;
+    }
+    return inet_pton(AF_INET6, ip, key->addr) == 1;
+}
+
+void peer_map_activity(const char *ip) {
+    AddrKey key;
+    if (!parse_addr(ip, &key)) return;
+    std::lock_guard<std::mutex> lock(activity_mutex);
+    activity[key].at_ms = monotonic_ms();
+    activity_generation++;
+}
+
+void peer_map_set_call(const char *ip, bool in_call) {
+    AddrKey key;
+    if (!parse_addr(ip, &key)) return;
+    std::lock_guard<std::mutex> lock(activity_mutex);
+    Activity &a = activity[key];
+    a.in_call = in_call;
+    if (in_call) a.at_ms = monotonic_ms();
+    activity_generation++;
+}
+
+void peer_map_clear_calls() {
+    std::lock_guard<std::mutex> lock(activity_mutex);
+    for (auto &entry : activity) entry.second.in_call = false;
+    activity_generation++;
+}
+
+// The map
+
+struct MapProgram {
+    GLuint program = 0;
+    GLint time_loc = -1;
+    GLint disc_loc = -1;
+};
+
+struct PeerMap {
+    MapProgram stars;
+    MapProgram edges;
+    GLint pixel_loc = -1;
+    GLint star_size_loc = -1;
+    GLuint star_vao = 0;
+    GLuint edge_vao = 0;
+    GLuint vbo = 0;
+    size_t vbo_capacity = 0;     // instances
+
+    float time = 0;              // seconds the map has been animating
+    uint64_t last_draw_ms = 0;
+    uint64_t version = 0;        // of the snapshot last built from
+    uint64_t generation = 0;     // of the activity last built from
+    uint64_t edges_expire_ms = 0;
+    bool built = false;
+
+    ActivityMap activity;        // copy, so the lock is never held while building
+    std::vector<MapInstance> instances;
+    size_t num_nodes = 0;
+    size_t num_edges = 0;
+    uint64_t uploads = 0;
+    double last_build_us = 0;
+};
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader compilation failed: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static bool link_program(MapProgram *out, const char *vertex_source, const char *fragment_source) {
+    GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (!vertex || !fragment) {
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+        return false;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[512];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader link failed: %s\n", log);
+        glDeleteProgram(program);
+        return false;
+    }
+    out->program = program;
+    out->time_loc = glGetUniformLocation(program, "time");
+    out->disc_loc = glGetUniformLocation(program, "disc");
+    return true;
+}
+
+// Instance attributes from offset, one step per instance
+static void point_instances(GLuint vao, GLuint vbo, size_t first) {
+    size_t base = first * sizeof(MapInstance);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(MapInstance), (void *)(base + offsetof(MapInstance, radius)));
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, sizeof(MapInstance), (void *)(base + offsetof(MapInstance, active_at)));
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(MapInstance), (void *)(base + offsetof(MapInstance, r)));
+    for (GLuint i = 0; i < 3; i++) {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+    glBindVertexArray(0);
+}
+
+PeerMap *peer_map_new() {
+    PeerMap *map = new PeerMap;
+    if (!link_program(&map->stars, star_vertex_shader_source, star_fragment_shader_source) ||
+        !link_program(&map->edges, edge_vertex_shader_source, edge_fragment_shader_source)) {
+        peer_map_free(map);
+        return NULL;
+    }
+    map->pixel_loc = glGetUniformLocation(map->stars.program, "pixel");
+    map->star_size_loc = glGetUniformLocation(map->stars.program, "star_size");
+    glGenVertexArrays(1, &map->star_vao);
+    glGenVertexArrays(1, &map->edge_vao);
+    glGenBuffers(1, &map->vbo);
+    return map;
+}
+
+void peer_map_free(PeerMap *map) {
+    if (map == NULL) return;
+    if (map->vbo) glDeleteBuffers(1, &map->vbo);
+    if (map->star_vao) glDeleteVertexArrays(1, &map->star_vao);
+    if (map->edge_vao) glDeleteVertexArrays(1, &map->edge_vao);
+    if (map->stars.program) glDeleteProgram(map->stars.program);
+    if (map->edges.program) glDeleteProgram(map->edges.program);
+    delete map;
+}
+
+// A fixed place for key: uniform over the disc, twisted into a loose spiral
+static void place_peer(const PeerKey &key, MapInstance *out) {
+    uint32_t h = peer_key_hash(key);
+    float u = (h & 0xffff) / 65536.0f;
+    float v = (h >> 16) / 65536.0f;
+    out->radius = 0.12f + 0.88f * sqrtf(u);
+    out->angle = 6.2831853f * v + 2.5f * out->radius;
+}
+
+// Cooler for nodes that can take calls, greener for files only, white else
+static void color_peer(uint32_t capabilities, MapInstance *out) {
+    if (capabilities & CAP_VOICE) {
+        out->r = 150, out->g = 190, out->b = 255;
+    } else if (capabilities & CAP_FILE) {
+        out->r = 150, out->g = 255, out->b = 190;
+    } else {
+        out->r = 230, out->g = 230, out->b = 230;
+    }
+}
+
+// Nodes, then a copy of every node with an edge; one pass over the snapshot
+static void build(PeerMap *map, const PeerTable &peers, uint64_t now_ms) {
+    uint64_t start = probe_now_ns();
+    const std::vector<Node> &nodes = peers.all();
+    map->instances.resize(1 + nodes.size());
+    std::vector<MapInstance> &out = map->instances;
+
+    // This node
+    out[0] = MapInstance{0, 0, -1, 255, 210, 120, 0};
+
+    map->edges_expire_ms = UINT64_MAX;
+    size_t edges = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        MapInstance &instance = out[1 + i];
+        place_peer(nodes[i].key, &instance);
+        color_peer(nodes[i].capabilities, &instance);
+        instance.active_at = -1;
+        instance.in_call = 0;
+        if (map->activity.empty()) continue;
+
+        AddrKey key;
+        memcpy(key.addr, nodes[i].key.addr, 16);
+        auto it = map->activity.find(key);
+        if (it == map->activity.end()) continue;
+        const Activity &a = it->second;
+        if (a.at_ms) instance.active_at = map->time - (now_ms - a.at_ms) / 1000.0f;
+        instance.in_call = a.in_call ? 255 : 0;
+        if (a.in_call || a.at_ms + EDGE_MS > now_ms) {
+            out.push_back(instance);
+            edges++;
+            if (!a.in_call && a.at_ms + EDGE_MS < map->edges_expire_ms) map->edges_expire_ms = a.at_ms + EDGE_MS;
+        }
+    }
+    map->num_nodes = 1 + nodes.size();
+    map->num_edges = edges;
+    map->last_build_us = (probe_now_ns() - start) / 1000.0;
+}
+
+// The frame's one upload: orphan the buffer, or grow it, and write it whole
+static void upload(PeerMap *map) {
+    size_t count = map->instances.size();
+    glBindBuffer(GL_ARRAY_BUFFER, map->vbo);
+    if (count > map->vbo_capacity) map->vbo_capacity = count + count / 2;
+    glBufferData(GL_ARRAY_BUFFER, map->vbo_capacity * sizeof(MapInstance), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(MapInstance), map->instances.data());
+    point_instances(map->star_vao, map->vbo, 0);
+    point_instances(map->edge_vao, map->vbo, map->num_nodes);
+    map->uploads++;
+}
+
+void peer_map_draw(PeerMap *map, const PeerTable &peers, uint64_t version, int width, int height) {
+    // The clock only runs between frames of an animation, so after a rest
+    // the disc carries on from where it stopped
+    uint64_t now_ms = monotonic_ms();
+    if (peer_map_animating(map)) map->time += std::min<uint64_t>(now_ms - map->last_draw_ms, 100) / 1000.0f;
+    map->last_draw_ms = now_ms;
+
+    bool activity_changed;
+    {
+        std::lock_guard<std::mutex> lock(activity_mutex);
+        activity_changed = activity_generation != map->generation;
+        if (activity_changed) {
+            // Pulses long faded are dropped here, so the table stays small
+            for (auto it = activity.begin(); it != activity.end();) {
+                if (!it->second.in_call && it->second.at_ms + EDGE_MS < now_ms) it = activity.erase(it);
+                else ++it;
+            }
+            map->activity = activity;
+            map->generation = activity_generation;
+        }
+    }
+    if (!map->built || activity_changed || version != map->version || now_ms >= map->edges_expire_ms) {
+        build(map, peers, now_ms);
+        upload(map);
+        map->version = version;
+        map->built = true;
+    }
+
+    glViewport(0, 0, width, height);
+    glClearColor(0, 0, 0, 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+
+    // Sprites shrink as the header fills up, as galaxy's do
+    float time = map->time;
+    float disc[2] = {0.95f, 0.85f};
+    float star_size = sqrtf((float)width * height / map->num_nodes) / 2;
+    star_size = fminf(fmaxf(star_size, 2.0f), 8.0f);
+
+    if (map->num_edges > 0) {
+        glUseProgram(map->edges.program);
+        glUniform1f(map->edges.time_loc, time);
+        glUniform2fv(map->edges.disc_loc, 1, disc);
+        glBindVertexArray(map->edge_vao);
+        glDrawArraysInstanced(GL_LINES, 0, 2, (GLsizei)map->num_edges);
+    }
+
+    glUseProgram(map->stars.program);
+    glUniform1f(map->stars.time_loc, time);
+    glUniform2fv(map->stars.disc_loc, 1, disc);
+    glUniform2f(map->pixel_loc, 2.0f / width, 2.0f / height);
+    glUniform1f(map->star_size_loc, star_size);
+    glBindVertexArray(map->star_vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)map->num_nodes);
+
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+}
+
+bool peer_map_animating(const PeerMap *map) {
+    return map->num_edges > 0;
+}
+
+void peer_map_get_stats(const PeerMap *map, PeerMapStats *stats) {
+    stats->nodes = map->num_nodes;
+    stats->edges = map->num_edges;
+    stats->uploads = map->uploads;
+    stats->last_build_us = map->last_build_us;
+}
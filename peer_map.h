@@ -0,0 +1,56 @@
+#ifndef PUTTYNET_PEER_MAP_H
+#define PUTTYNET_PEER_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "peers.h"
+
+// The live peer set as a star map, for the GL header. Every peer is one
+// instance of a glowing sprite, placed by a hash of its key so it keeps its
+// place across restarts, on a disc that turns faster near the middle, as
+// galaxy's does. This node sits at the centre. A peer pulses when a message
+// or a file goes either way, and gets an edge to the centre while it is in
+// a call or for a few seconds after the pulse.
+//
+// Everything a frame needs is in one instance buffer, nodes then edges.
+// The animation runs in the shaders on a time uniform, so the buffer is
+// only rewritten, with one upload, in frames where the snapshot or the
+// activity changed. The disc only turns while something is active: with
+// no calls and no recent traffic the map is a still picture and needs no
+// frames at all.
+
+struct PeerMap;
+
+// Compile the shaders; the GL 3.3 context must be current
+PeerMap *peer_map_new();
+void peer_map_free(PeerMap *map);
+
+// Draw peers into the current framebuffer. version is the snapshot's, so
+// an unchanged snapshot is not walked again.
+void peer_map_draw(PeerMap *map, const PeerTable &peers, uint64_t version, int width, int height);
+
+// Whether the last draw was mid-animation, so the next frame should come
+// as soon as the display can take it
+bool peer_map_animating(const PeerMap *map);
+
+// Instances written by the last draw that uploaded, and how long building
+// them took, for the footer and the benchmark
+struct PeerMapStats {
+    size_t nodes;
+    size_t edges;
+    uint64_t uploads;
+    double last_build_us;
+};
+void peer_map_get_stats(const PeerMap *map, PeerMapStats *stats);
+
+// The functions below are safe from any thread
+
+// Pulse ip's star: a message or a file to or from it
+void peer_map_activity(const char *ip);
+
+// Mark ip as in a call, or not; calls keep their edge until cleared
+void peer_map_set_call(const char *ip, bool in_call);
+void peer_map_clear_calls();
+
+#endif
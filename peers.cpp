@@ -0,0 +1,349 @@
+#include "peers.h"
+
+#include <atomic>
+#include <utility>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "timer_wheel.h"
+
+// Expiry resolution and wheel size; ttls beyond one lap just take extra laps
+const uint64_t EXPIRY_TICK_MS = 250;
+const size_t EXPIRY_SLOTS = 256;
+
+// Upper bound on threads that read snapshots at the same time
+const int MAX_READERS = 64;
+
+bool peer_key_equal(const PeerKey &a, const PeerKey &b) {
+    return a.node_id == b.node_id && memcmp(a.addr, b.addr, sizeof(a.addr)) == 0;
+}
+
+// 64-bit mix (splitmix64 finaliser) over the folded key
+static uint32_t hash_addr(const uint8_t *addr, uint64_t node_id) {
+    uint64_t lo, hi;
+    memcpy(&lo, addr, 8);
+    memcpy(&hi, addr + 8, 8);
+
+    uint64_t h = node_id ^ (lo * 0x9e3779b97f4a7c15ull) ^ hi;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+uint32_t peer_key_hash(const PeerKey &key) {
+    return hash_addr(key.addr, key.node_id);
+}
+
+void peer_key_init(PeerKey *key, const struct sockaddr *from, uint64_t node_id) {
+    memset(key, 0, sizeof(*key));
+    key->node_id = node_id;
+
+    if (from->sa_family == AF_INET6) {
+        memcpy(key->addr, &((const struct sockaddr_in6 *)from)->sin6_addr, 16);
+    } else {
+        key->addr[10] = 0xff;
+        key->addr[11] = 0xff;
+        memcpy(key->addr + 12, &((const struct sockaddr_in *)from)->sin_addr, 4);
+    }
+}
+
+void peer_format_addr(const PeerKey *key, char *buf, size_t len) {
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)key->addr)) {
+        inet_ntop(AF_INET, key->addr + 12, buf, len);
+    } else {
+        inet_ntop(AF_INET6, key->addr, buf, len);
+    }
+}
+
+// PeerTable
+
+PeerTable::PeerTable(size_t capacity) {
+    size_t cap = 16;
+    while (cap < capacity) cap <<= 1;
+    slots.assign(cap, Slot{0, 0});
+    addr_slots.assign(cap, Slot{0, 0});
+    mask = cap - 1;
+}
+
+// Slot holding key, or the empty slot where it would go
+size_t PeerTable::probe(const PeerKey &key, uint32_t hash) const {
+    size_t i = hash & mask;
+    for (;;) {
+        const Slot &s = slots[i];
+        if (s.index == 0) return i;
+        if (s.hash == hash && peer_key_equal(nodes[s.index - 1].key, key)) return i;
+        i = (i + 1) & mask;
+    }
+}
+
+Node *PeerTable::find(const PeerKey &key) {
+    const Slot &s = slots[probe(key, peer_key_hash(key))];
+    return s.index ? &nodes[s.index - 1] : NULL;
+}
+
+const Node *PeerTable::find(const PeerKey &key) const {
+    const Slot &s = slots[probe(key, peer_key_hash(key))];
+    return s.index ? &nodes[s.index - 1] : NULL;
+}
+
+// The newest node announcing from addr. Nodes sharing an address share a
+// probe run in addr_slots, so only that run is compared.
+const Node *PeerTable::find_addr(const uint8_t *addr) const {
+    uint32_t hash = hash_addr(addr, 0);
+    const Node *newest = NULL;
+    for (size_t i = hash & mask; addr_slots[i].index; i = (i + 1) & mask) {
+        const Slot &s = addr_slots[i];
+        if (s.hash != hash) continue;
+        const Node *node = &nodes[s.index - 1];
+        if (memcmp(node->key.addr, addr, sizeof(node->key.addr)) != 0) continue;
+        if (newest == NULL || node->last_seen_ms > newest->last_seen_ms) newest = node;
+    }
+    return newest;
+}
+
+// The addr_slots entry pointing at nodes[index - 1]
+size_t PeerTable::addr_slot(uint32_t index) const {
+    size_t i = hash_addr(nodes[index - 1].key.addr, 0) & mask;
+    while (addr_slots[i].index != index) i = (i + 1) & mask;
+    return i;
+}
+
+void PeerTable::place(std::vector<Slot> &slots, size_t mask, const Slot &slot) {
+    size_t i = slot.hash & mask;
+    while (slots[i].index) i = (i + 1) & mask;
+    slots[i] = slot;
+}
+
+// Backward-shift deletion: pull later members of the probe run into the
+// hole so lookups never need tombstones
+void PeerTable::remove_slot(std::vector<Slot> &slots, size_t mask, size_t i) {
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (slots[j].index == 0) break;
+        size_t home = slots[j].hash & mask;
+        bool between = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (between) continue;
+        slots[i] = slots[j];
+        i = j;
+    }
+    slots[i] = Slot{0, 0};
+}
+
+Node *PeerTable::insert(const PeerKey &key, bool *inserted) {
+    uint32_t hash = peer_key_hash(key);
+    size_t i = probe(key, hash);
+    if (slots[i].index) {
+        *inserted = false;
+        return &nodes[slots[i].index - 1];
+    }
+
+    // Keep the load factor under 0.7 so probe runs stay short
+    if ((nodes.size() + 1) * 10 > slots.size() * 7) {
+        grow();
+        i = probe(key, hash);
+    }
+
+    Node node;
+    memset(&node, 0, sizeof(node));
+    node.key = key;
+    nodes.push_back(node);
+    slots[i].hash = hash;
+    slots[i].index = (uint32_t)nodes.size();
+    place(addr_slots, mask, Slot{hash_addr(key.addr, 0), (uint32_t)nodes.size()});
+    *inserted = true;
+    return &nodes.back();
+}
+
+bool PeerTable::erase(const PeerKey &key) {
+    size_t i = probe(key, peer_key_hash(key));
+    if (slots[i].index == 0) return false;
+    uint32_t index = slots[i].index;
+    remove_slot(slots, mask, i);
+    remove_slot(addr_slots, mask, addr_slot(index));
+
+    // Keep nodes dense by moving the last one into the gap
+    if (index != nodes.size()) {
+        addr_slots[addr_slot((uint32_t)nodes.size())].index = index;
+        nodes[index - 1] = nodes.back();
+        slots[probe(nodes[index - 1].key, peer_key_hash(nodes[index - 1].key))].index = index;
+    }
+    nodes.pop_back();
+    return true;
+}
+
+void PeerTable::grow() {
+    std::vector<Slot> old, old_addr;
+    old.swap(slots);
+    old_addr.swap(addr_slots);
+    slots.assign(old.size() * 2, Slot{0, 0});
+    addr_slots.assign(old.size() * 2, Slot{0, 0});
+    mask = slots.size() - 1;
+
+    for (const Slot &s : old) {
+        if (s.index) place(slots, mask, s);
+    }
+    for (const Slot &s : old_addr) {
+        if (s.index) place(addr_slots, mask, s);
+    }
+}
+
+// Epoch-based reclamation. A reader publishes the global epoch it entered at;
+// a snapshot replaced at epoch E is freed once every active reader entered
+// after E.
+
+struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch;  // 0 while the thread is not reading
+    std::atomic<bool> used;
+};
+
+static ReaderSlot reader_slots[MAX_READERS];
+static std::atomic<uint64_t> global_epoch(1);
+static std::atomic<const PeerSnapshot *> current_snapshot(new PeerSnapshot{0, PeerTable()});
+
+// Gives the thread's slot back when the thread exits
+struct ReaderRegistration {
+    ReaderSlot *slot = NULL;
+    int nesting = 0;
+    ~ReaderRegistration() {
+        if (slot) slot->used.store(false);
+    }
+};
+
+static thread_local ReaderRegistration reader;
+
+static ReaderSlot *claim_reader_slot() {
+    for (int i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (reader_slots[i].used.compare_exchange_strong(expected, true)) {
+            return &reader_slots[i];
+        }
+    }
+    fprintf(stderr, "peers: more than %d reader threads\n", MAX_READERS);
+    abort();
+}
+
+PeerReader::PeerReader() {
+    if (reader.slot == NULL) reader.slot = claim_reader_slot();
+    if (reader.nesting++ == 0) {
+        reader.slot->epoch.store(global_epoch.load());
+    }
+    snapshot = current_snapshot.load();
+}
+
+PeerReader::~PeerReader() {
+    if (--reader.nesting == 0) {
+        reader.slot->epoch.store(0);
+    }
+}
+
+// Writer state, touched by the discovery thread only
+static PeerTable online_nodes;
+static TimerWheel<PeerKey> expiry_wheel(EXPIRY_TICK_MS, EXPIRY_SLOTS, monotonic_ms());
+static std::vector<std::pair<const PeerSnapshot *, uint64_t>> retired;
+static uint64_t published_version = 0;
+static uint64_t last_publish_ms = 0;
+static bool dirty = false;
+static bool membership_changed = false;
+static std::atomic<peers_changed_hook> changed_hook(NULL);
+
+// Serial number comparison so the sequence can wrap
+static bool seq_newer(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+void peers_update(const struct sockaddr *from, const Announcement *a, uint64_t now_ms) {
+    PeerKey key;
+    peer_key_init(&key, from, a->node_id);
+
+    if (a->ttl == 0) {
+        if (online_nodes.erase(key)) {
+            dirty = membership_changed = true;
+        }
+        return;
+    }
+
+    bool inserted;
+    Node *node = online_nodes.insert(key, &inserted);
+
+    // Late or duplicated heartbeat
+    if (!inserted && !seq_newer(a->seq, node->seq)) return;
+
+    if (inserted || strcmp(node->name, a->name) != 0) {
+        memcpy(node->name, a->name, sizeof(node->name));
+        membership_changed = true;
+    }
+    node->capabilities = a->capabilities;
+    memcpy(node->public_key, a->public_key, sizeof(node->public_key));
+    node->seq = a->seq;
+    node->last_seen_ms = now_ms;
+    node->expires_ms = now_ms + a->ttl * 1000ull;
+    dirty = true;
+
+    if (inserted) expiry_wheel.schedule(key, node->expires_ms);
+}
+
+size_t peers_expire(uint64_t now_ms) {
+    size_t removed = 0;
+    expiry_wheel.advance(now_ms, [&](const PeerKey &key) {
+        Node *node = online_nodes.find(key);
+        if (node == NULL) return;   // left with a ttl 0 goodbye
+        if (node->expires_ms > now_ms) {
+            expiry_wheel.schedule(key, node->expires_ms);
+            return;
+        }
+        online_nodes.erase(key);
+        removed++;
+    });
+
+    if (removed) dirty = membership_changed = true;
+    return removed;
+}
+
+static void reclaim_snapshots() {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < MAX_READERS; i++) {
+        uint64_t e = reader_slots[i].epoch.load();
+        if (e != 0 && e < oldest) oldest = e;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        if (retired[i].second < oldest) delete retired[i].first;
+        else retired[kept++] = retired[i];
+    }
+    retired.resize(kept);
+}
+
+void peers_publish(uint64_t now_ms) {
+    if (!retired.empty()) reclaim_snapshots();
+
+    if (!dirty) return;
+    if (!membership_changed && now_ms - last_publish_ms < PEERS_PUBLISH_MS) return;
+
+    const PeerSnapshot *next = new PeerSnapshot{++published_version, online_nodes};
+    const PeerSnapshot *prev = current_snapshot.exchange(next);
+    retired.push_back(std::make_pair(prev, global_epoch.fetch_add(1)));
+    reclaim_snapshots();
+
+    peers_changed_hook hook = changed_hook.load();
+    if (membership_changed && hook) hook();
+
+    last_publish_ms = now_ms;
+    dirty = membership_changed = false;
+}
+
+void peers_set_changed_hook(peers_changed_hook hook) {
+    changed_hook.store(hook);
+}
+
+size_t peers_count() {
+    PeerReader snapshot;
+    return snapshot->table.size();
+}
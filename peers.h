@@ -0,0 +1,124 @@
+#ifndef PUTTYNET_PEERS_H
+#define PUTTYNET_PEERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <sys/socket.h>
+
+#include "announce.h"
+
+// A peer is identified by where it announces from plus its node id. IPv4
+// addresses are stored v4-mapped so both families share one layout.
+struct PeerKey {
+    uint8_t addr[16];
+    uint64_t node_id;
+};
+
+// One discovered peer
+struct Node {
+    PeerKey key;
+    char name[ANNOUNCE_MAX_NAME + 1];
+    uint32_t capabilities;
+    uint32_t seq;
+    uint8_t public_key[ANNOUNCE_KEY_SIZE];   // with CAP_SECURE
+    uint64_t last_seen_ms;
+    uint64_t expires_ms;
+};
+
+void peer_key_init(PeerKey *key, const struct sockaddr *from, uint64_t node_id);
+uint32_t peer_key_hash(const PeerKey &key);
+bool peer_key_equal(const PeerKey &a, const PeerKey &b);
+
+// Dotted quad for IPv4 peers, RFC 5952 text for IPv6 ones
+void peer_format_addr(const PeerKey *key, char *buf, size_t len);
+
+// Open-addressing hash table. Nodes are kept dense so iteration and copying
+// are linear scans; the slot array is probed linearly and compares a 32-bit
+// hash before touching a node. A second slot array indexes the nodes by
+// address alone, for callers that know where a packet came from but not
+// its node id.
+class PeerTable {
+public:
+    explicit PeerTable(size_t capacity = 64);
+
+    Node *find(const PeerKey &key);
+    const Node *find(const PeerKey &key) const;
+
+    // Find key or add a zeroed node for it
+    Node *insert(const PeerKey &key, bool *inserted);
+
+    bool erase(const PeerKey &key);
+
+    // The most recently seen node announcing from addr (PeerKey::addr
+    // layout), or NULL
+    const Node *find_addr(const uint8_t *addr) const;
+
+    size_t size() const { return nodes.size(); }
+    const std::vector<Node> &all() const { return nodes; }
+
+private:
+    struct Slot {
+        uint32_t hash;
+        uint32_t index;  // position in nodes plus one, 0 for an empty slot
+    };
+
+    static void place(std::vector<Slot> &slots, size_t mask, const Slot &slot);
+    static void remove_slot(std::vector<Slot> &slots, size_t mask, size_t i);
+    size_t probe(const PeerKey &key, uint32_t hash) const;
+    size_t addr_slot(uint32_t index) const;
+    void grow();
+
+    std::vector<Slot> slots;
+    std::vector<Slot> addr_slots;   // by address only; one entry per node
+    std::vector<Node> nodes;
+    size_t mask;
+};
+
+// Immutable view of the table as of one publish
+struct PeerSnapshot {
+    uint64_t version;
+    PeerTable table;
+};
+
+// Pins the current snapshot for as long as it lives. Readers never block the
+// discovery thread and it never blocks them; old snapshots are freed once no
+// reader can still see them. Keep it scoped to one piece of work.
+class PeerReader {
+public:
+    PeerReader();
+    ~PeerReader();
+
+    const PeerSnapshot *operator->() const { return snapshot; }
+
+private:
+    PeerReader(const PeerReader &) = delete;
+    PeerReader &operator=(const PeerReader &) = delete;
+
+    const PeerSnapshot *snapshot;
+};
+
+// Number of peers in the current snapshot
+size_t peers_count();
+
+// Called on the discovery thread after a publish that added, removed or
+// renamed a peer. It must be cheap and must not block; hand off to your own
+// thread. Heartbeat-only publishes do not call it.
+typedef void (*peers_changed_hook)();
+void peers_set_changed_hook(peers_changed_hook hook);
+
+// The functions below are for the discovery thread only
+
+// Record an announcement from a peer; a ttl of 0 removes it
+void peers_update(const struct sockaddr *from, const Announcement *a, uint64_t now_ms);
+
+// Drop peers whose ttl ran out, returns how many were removed
+size_t peers_expire(uint64_t now_ms);
+
+// Make pending updates visible to readers. Joins and leaves publish at once,
+// heartbeat refreshes at most every PEERS_PUBLISH_MS.
+void peers_publish(uint64_t now_ms);
+
+const uint64_t PEERS_PUBLISH_MS = 100;
+
+#endif
@@ -0,0 +1,258 @@
+#include "probes.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+static const char *const PROBE_NAMES[PROBE_COUNT] = {
+    "discovery.packet",
+    "discovery.publish",
+    "messenger.lock_wait",
+    "reliable.lock_wait",
+    "gl.frame",
+    "node_list.sync",
+};
+
+static const char *const COUNTER_NAMES[COUNTER_COUNT] = {
+    "messenger.lock",
+    "reliable.lock",
+    "discovery.wakeups",
+};
+
+struct ProbeHistogram {
+    std::atomic<uint64_t> buckets[PROBE_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+};
+
+// Written only by its thread; kept after the thread exits so its counts
+// survive
+struct ThreadProbes {
+    ProbeHistogram probes[PROBE_COUNT];
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    uint32_t tid;
+};
+
+static std::mutex threads_lock;
+static std::vector<ThreadProbes *> threads;
+static thread_local ThreadProbes *local = NULL;
+
+// The owner is the only writer, so a load and a store do what fetch_add
+// would without the locked instruction
+static inline void bump(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static uint32_t current_tid() {
+    return (uint32_t)syscall(SYS_gettid);
+}
+
+static ThreadProbes *thread_probes() {
+    if (local == NULL) {
+        local = new ThreadProbes();
+        local->tid = current_tid();
+        for (ProbeHistogram &h : local->probes) h.min.store(UINT64_MAX, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(threads_lock);
+        threads.push_back(local);
+    }
+    return local;
+}
+
+static inline int bucket_index(uint64_t ns) {
+    if (ns < (uint64_t)PROBE_SUB_BUCKETS) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int exponent = msb - PROBE_SUB_BITS + 1;
+    if (exponent > PROBE_MAX_EXPONENT) return PROBE_BUCKETS - 1;
+    int mantissa = (int)(ns >> (exponent - 1)) & (PROBE_SUB_BUCKETS - 1);
+    return exponent * PROBE_SUB_BUCKETS + mantissa;
+}
+
+// Middle of the bucket's range
+static double bucket_value(int index) {
+    int exponent = index / PROBE_SUB_BUCKETS;
+    int mantissa = index % PROBE_SUB_BUCKETS;
+    if (exponent == 0) return mantissa;
+    double low = (double)((uint64_t)(PROBE_SUB_BUCKETS + mantissa) << (exponent - 1));
+    double width = (double)(1ull << (exponent - 1));
+    return low + width / 2;
+}
+
+void probe_record(Probe probe, uint64_t ns) {
+    ProbeHistogram &h = thread_probes()->probes[probe];
+    bump(h.buckets[bucket_index(ns)], 1);
+    bump(h.count, 1);
+    bump(h.sum, ns);
+    if (ns < h.min.load(std::memory_order_relaxed)) h.min.store(ns, std::memory_order_relaxed);
+    if (ns > h.max.load(std::memory_order_relaxed)) h.max.store(ns, std::memory_order_relaxed);
+}
+
+void counter_add(Counter counter, uint64_t n) {
+    bump(thread_probes()->counters[counter], n);
+}
+
+const char *probe_name(Probe probe) {
+    return PROBE_NAMES[probe];
+}
+
+const char *counter_name(Counter counter) {
+    return COUNTER_NAMES[counter];
+}
+
+static double percentile(const std::vector<uint64_t> &buckets, uint64_t count, double p) {
+    uint64_t rank = (uint64_t)(p / 100 * count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < PROBE_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return bucket_value(i);
+    }
+    return bucket_value(PROBE_BUCKETS - 1);
+}
+
+void probe_get(Probe probe, ProbeStats *stats) {
+    std::vector<uint64_t> buckets(PROBE_BUCKETS, 0);
+    uint64_t count = 0, sum = 0, low = UINT64_MAX, high = 0;
+    {
+        std::lock_guard<std::mutex> guard(threads_lock);
+        for (ThreadProbes *t : threads) {
+            const ProbeHistogram &h = t->probes[probe];
+            uint64_t n = h.count.load(std::memory_order_relaxed);
+            if (n == 0) continue;
+            for (int i = 0; i < PROBE_BUCKETS; i++) buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+            sum += h.sum.load(std::memory_order_relaxed);
+            low = std::min(low, h.min.load(std::memory_order_relaxed));
+            high = std::max(high, h.max.load(std::memory_order_relaxed));
+        }
+    }
+    // Buckets rather than the count fields, so a record half done on
+    // another thread cannot leave the percentiles past the end
+    for (uint64_t b : buckets) count += b;
+
+    *stats = ProbeStats();
+    stats->count = count;
+    if (count == 0) return;
+    stats->min_ns = low;
+    stats->max_ns = high;
+    stats->mean_ns = (double)sum / count;
+    stats->p50_ns = percentile(buckets, count, 50);
+    stats->p90_ns = percentile(buckets, count, 90);
+    stats->p99_ns = percentile(buckets, count, 99);
+    stats->p999_ns = percentile(buckets, count, 99.9);
+}
+
+uint64_t counter_get(Counter counter) {
+    uint64_t total = 0;
+    std::lock_guard<std::mutex> guard(threads_lock);
+    for (ThreadProbes *t : threads) total += t->counters[counter].load(std::memory_order_relaxed);
+    return total;
+}
+
+// Racy against a recording thread by design: a record in flight may
+// survive the reset
+void probes_reset() {
+    std::lock_guard<std::mutex> guard(threads_lock);
+    for (ThreadProbes *t : threads) {
+        for (ProbeHistogram &h : t->probes) {
+            for (auto &b : h.buckets) b.store(0, std::memory_order_relaxed);
+            h.count.store(0, std::memory_order_relaxed);
+            h.sum.store(0, std::memory_order_relaxed);
+            h.min.store(UINT64_MAX, std::memory_order_relaxed);
+            h.max.store(0, std::memory_order_relaxed);
+        }
+        for (auto &c : t->counters) c.store(0, std::memory_order_relaxed);
+    }
+}
+
+void probes_dump(FILE *out) {
+    fprintf(out, "%-22s %10s %10s %10s %10s %10s %10s (us)\n", "probe", "count", "mean", "p50", "p99", "p99.9",
+            "max");
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ProbeStats s;
+        probe_get((Probe)i, &s);
+        fprintf(out, "%-22s %10llu %10.2f %10.2f %10.2f %10.2f %10.2f\n", PROBE_NAMES[i],
+                (unsigned long long)s.count, s.mean_ns / 1000, s.p50_ns / 1000, s.p99_ns / 1000, s.p999_ns / 1000,
+                s.max_ns / 1000.0);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(out, "%-22s %10llu\n", COUNTER_NAMES[i], (unsigned long long)counter_get((Counter)i));
+    }
+    fflush(out);
+}
+
+// Trace ring. A writer claims a slot with one fetch_add and brackets its
+// stores with an odd and then an even sequence number; the reader keeps a
+// slot only if it saw the same even number before and after copying it.
+
+struct TraceSlot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> duration_ns;
+    std::atomic<uint32_t> tid;
+    std::atomic<uint8_t> probe;
+};
+
+std::atomic<bool> trace_enabled(false);
+static TraceSlot *ring = NULL;
+static std::atomic<uint64_t> ring_head(0);
+static std::once_flag ring_once;
+
+void trace_enable(bool on) {
+    std::call_once(ring_once, [] { ring = new TraceSlot[TRACE_RING_SIZE](); });
+    trace_enabled.store(on, std::memory_order_release);
+}
+
+void trace_span(Probe probe, uint64_t start_ns, uint64_t end_ns) {
+    if (ring == NULL) return;
+    ThreadProbes *t = thread_probes();
+    uint64_t n = ring_head.fetch_add(1, std::memory_order_relaxed);
+    TraceSlot &slot = ring[n & (TRACE_RING_SIZE - 1)];
+
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.duration_ns.store(end_ns - start_ns, std::memory_order_relaxed);
+    slot.tid.store(t->tid, std::memory_order_relaxed);
+    slot.probe.store((uint8_t)probe, std::memory_order_relaxed);
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+bool trace_write_chrome(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return false;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    int pid = getpid();
+    for (size_t i = 0; ring != NULL && i < TRACE_RING_SIZE; i++) {
+        TraceSlot &slot = ring[i];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq == 0 || (seq & 1)) continue;
+        uint64_t start = slot.start_ns.load(std::memory_order_relaxed);
+        uint64_t duration = slot.duration_ns.load(std::memory_order_relaxed);
+        uint32_t tid = slot.tid.load(std::memory_order_relaxed);
+        uint8_t probe = slot.probe.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq || probe >= PROBE_COUNT) continue;
+
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"puttynet\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"pid\":%d,\"tid\":%u}",
+                first ? "" : ",\n", PROBE_NAMES[probe], start / 1000.0, duration / 1000.0, pid, tid);
+        first = false;
+    }
+
+    // Counter totals at the end of the trace, as counter events
+    uint64_t now = probe_now_ns();
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"puttynet\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+                   "\"args\":{\"total\":%llu}}",
+                first ? "" : ",\n", COUNTER_NAMES[i], now / 1000.0, pid,
+                (unsigned long long)counter_get((Counter)i));
+        first = false;
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
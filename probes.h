@@ -0,0 +1,125 @@
+#ifndef PUTTYNET_PROBES_H
+#define PUTTYNET_PROBES_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Hot-path instrumentation. Probes are latency histograms, counters count
+// events; both live in per-thread blocks, so recording is a few relaxed
+// loads and stores with no shared cache line and no lock. Readers sum the
+// blocks of every thread that ever recorded.
+//
+// Histograms are HDR-style: 32 linear sub-buckets per power of two, so any
+// value is reported within 3%, from 1 ns up to about 18 minutes, in 9 kB
+// per probe per thread.
+//
+// Trace spans are off unless trace_enable() is called. They go into one
+// lock-free ring of the last TRACE_RING_SIZE spans, which
+// trace_write_chrome() turns into Chrome trace JSON for chrome://tracing or
+// ui.perfetto.dev.
+
+enum Probe {
+    PROBE_DISCOVERY_PACKET,     // handle_discovery_packet()
+    PROBE_DISCOVERY_PUBLISH,    // peers_publish() after a batch
+    PROBE_MESSENGER_LOCK,       // waits for Messenger::queue_mutex, contended only
+    PROBE_RELIABLE_LOCK,        // waits for Reliable::send_mutex, contended only
+    PROBE_GL_FRAME,             // render_gl(), CPU side
+    PROBE_NODE_LIST_SYNC,       // sync_node_store(), which blocks the GTK main loop
+    PROBE_COUNT,
+};
+
+enum Counter {
+    COUNTER_MESSENGER_LOCK,     // Messenger::queue_mutex acquisitions
+    COUNTER_RELIABLE_LOCK,      // Reliable::send_mutex acquisitions
+    COUNTER_DISCOVERY_WAKEUPS,  // discovery thread epoll_wait returns
+    COUNTER_COUNT,
+};
+
+const int PROBE_SUB_BITS = 5;
+const int PROBE_SUB_BUCKETS = 1 << PROBE_SUB_BITS;
+const int PROBE_MAX_EXPONENT = 36;   // 2^40 ns
+const int PROBE_BUCKETS = (PROBE_MAX_EXPONENT + 1) * PROBE_SUB_BUCKETS;
+
+const size_t TRACE_RING_SIZE = 1 << 16;
+
+struct ProbeStats {
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    double mean_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double p999_ns;
+};
+
+static inline uint64_t probe_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void probe_record(Probe probe, uint64_t ns);
+void counter_add(Counter counter, uint64_t n = 1);
+
+const char *probe_name(Probe probe);
+const char *counter_name(Counter counter);
+void probe_get(Probe probe, ProbeStats *stats);
+uint64_t counter_get(Counter counter);
+
+// Zero every thread's histograms and counters
+void probes_reset();
+
+// Live stats: one line per probe and counter
+void probes_dump(FILE *out);
+
+extern std::atomic<bool> trace_enabled;
+void trace_enable(bool on);
+void trace_span(Probe probe, uint64_t start_ns, uint64_t end_ns);
+bool trace_write_chrome(const char *path);
+
+// Times its scope into a probe, and into the trace when enabled
+class ProbeScope {
+public:
+    explicit ProbeScope(Probe probe) : probe(probe), start(probe_now_ns()) {}
+    ~ProbeScope() {
+        uint64_t end = probe_now_ns();
+        probe_record(probe, end - start);
+        if (trace_enabled.load(std::memory_order_relaxed)) trace_span(probe, start, end);
+    }
+
+    ProbeScope(const ProbeScope &) = delete;
+    ProbeScope &operator=(const ProbeScope &) = delete;
+
+private:
+    Probe probe;
+    uint64_t start;
+};
+
+// lock_guard that counts acquisitions and times only the contended ones,
+// so an uncontended lock costs one try_lock as before
+template <typename Mutex>
+class ProbedLock {
+public:
+    ProbedLock(Mutex &mutex, Probe probe, Counter counter) : mutex(mutex) {
+        counter_add(counter);
+        if (mutex.try_lock()) return;
+        uint64_t start = probe_now_ns();
+        mutex.lock();
+        uint64_t end = probe_now_ns();
+        probe_record(probe, end - start);
+        if (trace_enabled.load(std::memory_order_relaxed)) trace_span(probe, start, end);
+    }
+    ~ProbedLock() { mutex.unlock(); }
+
+    ProbedLock(const ProbedLock &) = delete;
+    ProbedLock &operator=(const ProbedLock &) = delete;
+
+private:
+    Mutex &mutex;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include "proximity.h"
+
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "timer_wheel.h"
+
+// The ARP table is read again at most this often
+const uint64_t ARP_REFRESH_MS = 1000;
+
+static uint64_t mac_key(const uint8_t *mac) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < WIFI_MAC_SIZE; i++) key = key << 8 | mac[i];
+    return key + 1;
+}
+
+static void key_mac(uint64_t key, uint8_t *mac) {
+    for (size_t i = 0; i < WIFI_MAC_SIZE; i++) mac[i] = (uint8_t)((key - 1) >> (8 * (WIFI_MAC_SIZE - 1 - i)));
+}
+
+ProximityTable::ProximityTable(const ProximityConfig &config) : config(config) {
+    measurement_variance = config.measurement_noise_db * config.measurement_noise_db;
+    drift_variance_per_ns = config.drift_db * config.drift_db / 1e9f;
+    distance_scale = 1 / (10 * config.path_loss_exponent);
+    ttl_ns = config.ttl_ms * 1000000;
+
+    // Twice the devices, so probe windows rarely fill before the table does
+    size_t size = PROXIMITY_PROBE;
+    shift = 64 - 4;
+    while (size < 2 * config.max_devices) {
+        size *= 2;
+        shift--;
+    }
+    slots.assign(size, Slot());
+    mask = size - 1;
+}
+
+// The device's slot, claiming one for it if it is new
+ProximityTable::Slot *ProximityTable::slot_for(uint64_t key, uint64_t now_ns) {
+    size_t home = (size_t)((key * 0x9e3779b97f4a7c15ull) >> shift);
+    Slot *free = NULL;
+    Slot *stalest = NULL;
+    for (size_t i = 0; i < PROXIMITY_PROBE; i++) {
+        Slot *slot = &slots[(home + i) & mask];
+        if (slot->key == key) return slot;
+        if (slot->key == 0) {
+            // Nothing was ever placed past a slot never used
+            if (free == NULL) free = slot;
+            break;
+        }
+        if (free == NULL && slot->last_ns + ttl_ns < now_ns) free = slot;
+        if (stalest == NULL || slot->last_ns < stalest->last_ns) stalest = slot;
+    }
+    if (free == NULL) {
+        free = stalest;
+        stat_evictions++;
+    }
+    free->key = key;
+    free->frames = 0;
+    return free;
+}
+
+const ProximityTable::Slot *ProximityTable::lookup(uint64_t key) const {
+    size_t home = (size_t)((key * 0x9e3779b97f4a7c15ull) >> shift);
+    for (size_t i = 0; i < PROXIMITY_PROBE; i++) {
+        const Slot *slot = &slots[(home + i) & mask];
+        if (slot->key == key) return slot;
+        if (slot->key == 0) break;
+    }
+    return NULL;
+}
+
+void ProximityTable::update(const WifiFrame *frames, size_t count) {
+    // Hash the batch first and prefetch every slot, so with a table bigger
+    // than the cache the misses overlap instead of queueing one by one
+    uint64_t keys[CAPTURE_BATCH];
+    while (count > 0) {
+        size_t n = count < CAPTURE_BATCH ? count : CAPTURE_BATCH;
+        for (size_t i = 0; i < n; i++) {
+            const WifiFrame &f = frames[i];
+            // The group bit is never set in a real transmitter address
+            bool usable = f.transmitter && f.has_signal && !f.bad_fcs && !(f.transmitter[0] & 1);
+            keys[i] = usable ? mac_key(f.transmitter) : 0;
+            if (keys[i]) __builtin_prefetch(&slots[(size_t)((keys[i] * 0x9e3779b97f4a7c15ull) >> shift)], 1);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (keys[i] == 0) {
+                stat_skipped++;
+                continue;
+            }
+            uint64_t now = frames[i].time_ns;
+            float reading = frames[i].signal_dbm;
+            Slot *slot = slot_for(keys[i], now);
+            if (slot->frames == 0) {
+                slot->rssi = reading;
+                slot->variance = measurement_variance;
+                slot->last_ns = now;
+            } else {
+                // Predict: the device may have moved since its last frame
+                float dt = now > slot->last_ns ? (float)(now - slot->last_ns) : 0;
+                float predicted = slot->variance + drift_variance_per_ns * dt;
+                float gain = predicted / (predicted + measurement_variance);
+                slot->rssi += gain * (reading - slot->rssi);
+                slot->variance = (1 - gain) * predicted;
+                if (now > slot->last_ns) slot->last_ns = now;
+            }
+            slot->frames++;
+            stat_frames++;
+            if (now > latest_ns) latest_ns = now;
+        }
+        frames += n;
+        count -= n;
+    }
+}
+
+void ProximityTable::estimate(const Slot &slot, ProximityEstimate *out) const {
+    key_mac(slot.key, out->mac);
+    float sd = sqrtf(slot.variance);
+    out->rssi_dbm = slot.rssi;
+    out->rssi_sd_db = sd;
+    out->distance_m = powf(10, (config.tx_power_dbm - slot.rssi) * distance_scale);
+    out->distance_low_m = powf(10, (config.tx_power_dbm - slot.rssi - sd) * distance_scale);
+    out->distance_high_m = powf(10, (config.tx_power_dbm - slot.rssi + sd) * distance_scale);
+    out->frames = slot.frames;
+    out->last_ns = slot.last_ns;
+}
+
+bool ProximityTable::stale(const Slot &slot, uint64_t now_ns) const {
+    return slot.last_ns + ttl_ns < (now_ns ? now_ns : latest_ns);
+}
+
+bool ProximityTable::find(const uint8_t *mac, ProximityEstimate *out, uint64_t now_ns) const {
+    const Slot *slot = lookup(mac_key(mac));
+    if (slot == NULL || stale(*slot, now_ns)) return false;
+    estimate(*slot, out);
+    return true;
+}
+
+void ProximityTable::all(std::vector<ProximityEstimate> *out, uint64_t now_ns) const {
+    out->clear();
+    for (const Slot &slot : slots) {
+        if (slot.key == 0 || stale(slot, now_ns)) continue;
+        out->emplace_back();
+        estimate(slot, &out->back());
+    }
+}
+
+void ProximityTable::get_stats(ProximityStats *stats, uint64_t now_ns) const {
+    stats->frames = stat_frames;
+    stats->skipped = stat_skipped;
+    stats->evictions = stat_evictions;
+    stats->table_bytes = slots.size() * sizeof(Slot);
+    stats->devices = 0;
+    for (const Slot &slot : slots) {
+        if (slot.key != 0 && !stale(slot, now_ns)) stats->devices++;
+    }
+}
+
+// Live: a table per capture thread. A shard's lock is only ever shared
+// with lookups, never with another capture thread.
+
+struct Shard {
+    std::mutex lock;
+    ProximityTable table;           // covered by lock
+
+    explicit Shard(const ProximityConfig &config) : table(config) {}
+};
+
+static std::mutex shards_lock;
+static std::vector<std::unique_ptr<Shard>> shards;     // covered by shards_lock; fixed while capturing
+static Capture *capture = NULL;
+
+// Peer address to MAC, from /proc/net/arp
+static std::mutex arp_lock;
+static std::unordered_map<uint32_t, uint64_t> arp;      // covered by arp_lock, as are the two below
+static uint64_t arp_read_ms = 0;
+static bool arp_read = false;
+
+// Ring timestamps are the kernel's realtime clock
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The shards are made before the capture threads start and go after they
+// are joined, so the vector itself needs no lock here
+static void on_frames(const WifiFrame *frames, size_t count, void *) {
+    Shard *shard = shards[capture_thread()].get();
+    std::lock_guard<std::mutex> lock(shard->lock);
+    shard->table.update(frames, count);
+}
+
+bool proximity_start(const char *interface, const ProximityConfig &config, int threads) {
+    if (capture != NULL) return true;
+    threads = std::max(threads, 1);
+    ProximityConfig shard_config = config;
+    shard_config.max_devices = (config.max_devices + threads - 1) / threads;
+    {
+        std::lock_guard<std::mutex> lock(shards_lock);
+        for (int i = 0; i < threads; i++) shards.emplace_back(new Shard(shard_config));
+    }
+
+    CaptureConfig capture_config;
+    capture_config.interface = interface;
+    capture_config.threads = threads;
+    capture_config.fanout = CAPTURE_FANOUT_TRANSMITTER;
+    capture = new Capture();
+    if (!capture->start(capture_config, on_frames, NULL)) {
+        proximity_stop();
+        return false;
+    }
+    return true;
+}
+
+void proximity_stop() {
+    delete capture;         // stops and joins the capture threads
+    capture = NULL;
+    std::lock_guard<std::mutex> lock(shards_lock);
+    shards.clear();
+}
+
+bool proximity_running() {
+    return capture != NULL;
+}
+
+bool proximity_find(const uint8_t *mac, ProximityEstimate *out) {
+    uint64_t now = realtime_ns();
+    std::lock_guard<std::mutex> lock(shards_lock);
+    if (shards.empty()) return false;
+    Shard *shard = shards[capture_transmitter_thread(mac, (int)shards.size())].get();
+    std::lock_guard<std::mutex> shard_lock(shard->lock);
+    return shard->table.find(mac, out, now);
+}
+
+// Complete IPv4 entries only; the file is small and read at most once a second
+static void read_arp(uint64_t now_ms) {
+    if (arp_read && now_ms - arp_read_ms < ARP_REFRESH_MS) return;
+    arp_read = true;
+    arp_read_ms = now_ms;
+    arp.clear();
+
+    FILE *f = fopen("/proc/net/arp", "r");
+    if (f == NULL) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char ip[64], hw[32];
+        unsigned int type, flags;
+        unsigned int mac[WIFI_MAC_SIZE];
+        struct in_addr addr;
+        if (sscanf(line, "%63s 0x%x 0x%x %31s", ip, &type, &flags, hw) != 4) continue;
+        if (!(flags & 0x2) || inet_pton(AF_INET, ip, &addr) != 1) continue;     // ATF_COM
+        if (sscanf(hw, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6) continue;
+        uint8_t bytes[WIFI_MAC_SIZE];
+        for (size_t i = 0; i < WIFI_MAC_SIZE; i++) bytes[i] = (uint8_t)mac[i];
+        arp[addr.s_addr] = mac_key(bytes);
+    }
+    fclose(f);
+}
+
+bool proximity_peer(const struct sockaddr_in *addr, ProximityEstimate *out) {
+    if (capture == NULL) return false;
+    uint64_t key;
+    {
+        std::lock_guard<std::mutex> lock(arp_lock);
+        read_arp(monotonic_ms());
+        auto it = arp.find(addr->sin_addr.s_addr);
+        if (it == arp.end()) return false;
+        key = it->second;
+    }
+    uint8_t mac[WIFI_MAC_SIZE];
+    key_mac(key, mac);
+    return proximity_find(mac, out);
+}
+
+void proximity_get_stats(ProximityStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    uint64_t now = realtime_ns();
+    std::lock_guard<std::mutex> lock(shards_lock);
+    for (auto &shard : shards) {
+        ProximityStats one;
+        {
+            std::lock_guard<std::mutex> shard_lock(shard->lock);
+            shard->table.get_stats(&one, now);
+        }
+        stats->frames += one.frames;
+        stats->skipped += one.skipped;
+        stats->devices += one.devices;
+        stats->evictions += one.evictions;
+        stats->table_bytes += one.table_bytes;
+    }
+}
@@ -0,0 +1,134 @@
+#ifndef PUTTYNET_PROXIMITY_H
+#define PUTTYNET_PROXIMITY_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "wifi.h"
+
+// How far away nearby devices are, from the signal strength radiotap
+// reports for every frame they transmit.
+//
+// Each transmitter gets a one-dimensional Kalman filter over its RSSI in
+// dBm. Between frames the estimate's variance grows by drift_db² per
+// second, so a device that moves is followed; each frame pulls it toward
+// the reading by the usual gain, with measurement_noise_db as the spread of
+// one reading (shadowing and multipath, mostly). The filtered RSSI becomes
+// a distance through the log-distance path-loss model:
+//
+//   d = 10 ^ ((tx_power_dbm - rssi) / (10 n))
+//
+// where tx_power_dbm is what a device reads at 1 m and n is the path-loss
+// exponent, 2 in free space and 2.5-4 indoors. Both depend on the room and
+// the devices; the defaults are typical for phones and laptops indoors.
+// Time is the frames' own, so a replayed recording gives the same answer
+// every time. Live lookups instead pass the clock the frames are stamped
+// with, so a device that has gone quiet ages out even when no other frame
+// arrives.
+//
+// Devices live in a fixed open-addressing table sized once from
+// max_devices: a frame from a new device takes a free slot within
+// PROXIMITY_PROBE slots of its hash, or one not heard from in ttl_ms, or
+// else evicts the least recently heard device in that window. Memory stays
+// bounded however many randomized MACs a crowd of phones probes with.
+
+// Slots a device may be found in, from its hash on
+const size_t PROXIMITY_PROBE = 16;
+
+struct ProximityConfig {
+    float tx_power_dbm = -40;           // RSSI at 1 m
+    float path_loss_exponent = 2.7f;
+    float measurement_noise_db = 4;     // standard deviation of one reading
+    float drift_db = 1;                 // standard deviation of a second's change
+    size_t max_devices = 8192;          // the table has twice this many slots, rounded up to a power of two
+    uint64_t ttl_ms = 60000;            // a device not heard from this long may be replaced
+};
+
+struct ProximityEstimate {
+    uint8_t mac[WIFI_MAC_SIZE];
+    float rssi_dbm;                     // filtered
+    float rssi_sd_db;                   // its standard deviation
+    float distance_m;
+    float distance_low_m;               // one standard deviation closer
+    float distance_high_m;              // one standard deviation further
+    uint32_t frames;
+    uint64_t last_ns;                   // time of the last frame
+};
+
+struct ProximityStats {
+    uint64_t frames;                    // readings taken
+    uint64_t skipped;                   // frames without a transmitter, a signal or a good FCS
+    uint64_t devices;                   // in the table now
+    uint64_t evictions;                 // devices pushed out by new ones
+    uint64_t table_bytes;
+};
+
+// The estimator. One thread updates it; callers sharing it across threads
+// lock around it, as proximity_start() does.
+//
+// Lookups judge staleness at now_ns, on the frames' clock; 0 takes the
+// latest frame's time, as a replay wants.
+class ProximityTable {
+public:
+    explicit ProximityTable(const ProximityConfig &config = ProximityConfig());
+
+    // Take the readings in a batch of parsed frames
+    void update(const WifiFrame *frames, size_t count);
+
+    bool find(const uint8_t *mac, ProximityEstimate *out, uint64_t now_ns = 0) const;
+
+    // Every device heard within ttl_ms
+    void all(std::vector<ProximityEstimate> *out, uint64_t now_ns = 0) const;
+
+    void get_stats(ProximityStats *stats, uint64_t now_ns = 0) const;
+
+private:
+    struct Slot {
+        uint64_t key;                   // MAC + 1, 0 for a slot never used
+        float rssi;
+        float variance;
+        uint64_t last_ns;
+        uint32_t frames;
+    };
+
+    Slot *slot_for(uint64_t key, uint64_t now_ns);
+    const Slot *lookup(uint64_t key) const;
+    bool stale(const Slot &slot, uint64_t now_ns) const;
+    void estimate(const Slot &slot, ProximityEstimate *out) const;
+
+    ProximityConfig config;
+    float measurement_variance;
+    float drift_variance_per_ns;
+    float distance_scale;               // 1 / (10 n)
+    uint64_t ttl_ns;
+    std::vector<Slot> slots;
+    size_t mask;
+    int shift;
+    uint64_t latest_ns = 0;
+    uint64_t stat_frames = 0;
+    uint64_t stat_skipped = 0;
+    uint64_t stat_evictions = 0;
+};
+
+// Live estimates from a monitor-mode interface, on capture threads of
+// their own (capture.h). Frames fan out by transmitter, and each thread
+// feeds a table of its own holding max_devices / threads, so the threads
+// never wait on each other and a lookup goes to the one table that can
+// hold the device.
+
+bool proximity_start(const char *interface, const ProximityConfig &config, int threads = 1);
+void proximity_stop();
+bool proximity_running();
+
+// The estimate for mac, if it has been heard within ttl_ms of now
+bool proximity_find(const uint8_t *mac, ProximityEstimate *out);
+
+// The estimate for the IPv4 peer at addr: its MAC comes from the kernel's
+// ARP table, so only peers on our own link are found
+bool proximity_peer(const struct sockaddr_in *addr, ProximityEstimate *out);
+
+void proximity_get_stats(ProximityStats *stats);
+
+#endif
@@ -5,264 +5,292 @@
 #include <gio/gio.h>
 #include <gst/gst.h>
 #include <epoxy/gl.h>
-#include <thread>
+#include <atomic>
 #include <mutex>
-#include <unordered_map>
-#include <vector>
 #include <string>
+#include <vector>
+#include <string.h>
 
-// Networking headers
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <ifaddrs.h>
-#include <unistd.h>
-
-// Constants
-const int MESSAGE_PORT = 12345;
-const int VOICE_PORT = 12346;
-const int DISCOVERY_PORT = 12347;
+#include "core.h"
+#include "conference.h"
+#include "discovery.h"
+#include "effects.h"
+#include "node_list.h"
+#include "peer_map.h"
+#include "peers.h"
+#include "probes.h"
 
 // Global variables
-static guint wave_timeout_id = 0;
-static double wave_radius = 0;
-static double icon_scale = 1.0;
-static std::unordered_map<std::string, std::string> online_nodes; // IP -> Name
-static std::mutex nodes_mutex;
-static int discovery_socket = -1;
-static bool running = true;
-
-// GStreamer elements
-GstElement *voice_pipeline = NULL;
-GstElement *sound_pipeline = NULL;
-
-// OpenGL variables
-GLuint program;
-GLuint vao;
-GLuint vbo;
-
-// Shader sources
-const char *vertex_shader_source =
-    "#version 330 core\n"
-    "layout (location = 0) in vec2 position;\n"
-    "void main() {\n"
-    "    gl_Position = vec4(position, 0.0, 1.0);\n"
-    "}\n";
-
-const char *fragment_shader_source =
-    "#version 330 core\n"
-    "out vec4 FragColor;\n"
-    "uniform vec4 color;\n"
-    "void main() {\n"
-    "    FragColor = color;\n"
-    "}\n";
+static Core *core = NULL;     // the node itself; this file is only its window
+
+// Sound effects, decoded into memory at startup
+static const char *const SOUND_EFFECTS[] = {"hover_sound.ogg", "call_start.ogg", "call_end.ogg"};
+
+// The header's live map of the network, while the GL area is realized.
+// It gets frames from the frame clock only while it animates; otherwise
+// activity and snapshot changes ask for single redraws.
+static GtkWidget *header = NULL;
+static PeerMap *peer_map = NULL;
+static guint header_tick = 0;
+static uint64_t header_version = 0;    // snapshot drawn last
+static std::atomic<bool> activity_pending(false);
+
+// The conversation open in the message window, if any; main thread only
+static GtkWidget *chat_window = NULL;
+static GtkWidget *chat_view = NULL;
+static GtkWidget *chat_entry = NULL;
+static std::string chat_ip;
+
+// Messages shown when a conversation opens, the newest ones
+const size_t CHAT_BACKLOG = 200;
+
+// Texts received on the messaging thread, for the message window
+struct IncomingText {
+    std::string ip;
+    std::string text;
+};
+static std::mutex incoming_lock;
+static std::vector<IncomingText> incoming;     // covered by incoming_lock
+static std::atomic<bool> incoming_pending(false);
+
+// The footer's status line, drawn into a surface again only when it changes
+static char footer_text[192];
+static cairo_surface_t *footer_surface = NULL;
+static int footer_surface_width = 0;
 
 // Function prototypes
 void init_gstreamer();
 void init_opengl(GtkWidget *gl_area);
 void draw_gl_scene(GtkWidget *gl_area);
-void discover_nodes();
-void handle_discovery_packet();
-void send_discovery_packet();
+bool send_text_message(const std::string &ip, const std::string &text);
 void start_voice_chat(const std::string &ip);
 void stop_voice_chat();
 void play_sound_effect(const char *filename);
-void draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data);
-void draw_icon(GtkWidget *widget, cairo_t *cr, gpointer data);
-gboolean animate_wave(GtkWidget *widget);
-gboolean on_hover(GtkWidget *widget, GdkEvent *event, gpointer data);
-gboolean on_leave(GtkWidget *widget, GdkEvent *event, gpointer data);
+gboolean draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data);
 gboolean render_gl(GtkWidget *widget, GdkGLContext *context, gpointer data);
 void realize_gl(GtkWidget *widget, gpointer data);
+void unrealize_gl(GtkWidget *widget, gpointer data);
 
 // Initialize GStreamer
 void init_gstreamer() {
     gst_init(NULL, NULL);
 
-    // Pipeline for sound effects
-    sound_pipeline = gst_parse_launch("playbin uri=file:///home/ed/gtk-apps/hover_sound.ogg", NULL);
-    if (!sound_pipeline) {
-        g_warning("Failed to create sound GStreamer pipeline");
+    // Effects come from PUTTYNET_SOUNDS, or the working directory
+    const char *sounds = g_getenv("PUTTYNET_SOUNDS");
+    if (!effects_init(sounds ? sounds : ".", SOUND_EFFECTS, G_N_ELEMENTS(SOUND_EFFECTS))) {
+        g_warning("Sound effects unavailable");
     }
-
-    // Pipeline for voice chat (will be initialized when needed)
-    voice_pipeline = NULL;
 }
 
 // Initialize OpenGL
 void init_opengl(GtkWidget *gl_area) {
-    // Compile vertex shader
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_source, NULL);
-    glCompileShader(vertex_shader);
-
-    // Compile fragment shader
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
-    glCompileShader(fragment_shader);
-
-    // Link shaders
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-
-    // Clean up shaders
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-
-    // Set up vertex data
-    GLfloat vertices[] = {
-        -0.5f, -0.5f,
-         0.5f, -0.5f,
-         0.0f,  0.5f
-    };
-
-    glGenVertexArrays(1, &vao);
-    glGenBuffers(1, &vbo);
-
-    glBindVertexArray(vao);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), (void*)0);
-    glEnableVertexAttribArray(0);
-
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    peer_map = peer_map_new();
+    if (peer_map == NULL) g_warning("Failed to set up the network map");
 }
 
-// Draw OpenGL scene
+// Draw OpenGL scene: the peer snapshot, pinned for just this frame
 void draw_gl_scene(GtkWidget *gl_area) {
-    gtk_gl_area_make_current(GTK_GL_AREA(gl_area));
+    if (peer_map == NULL) return;
+    int scale = gtk_widget_get_scale_factor(gl_area);
+    int width = gtk_widget_get_allocated_width(gl_area) * scale;
+    int height = gtk_widget_get_allocated_height(gl_area) * scale;
+
+    PeerReader snapshot;
+    peer_map_draw(peer_map, snapshot->table, snapshot->version, width, height);
+    header_version = snapshot->version;
+}
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+// Any thread: the header shows the change on its next frame
+static gboolean redraw_header(gpointer) {
+    if (header != NULL) gtk_gl_area_queue_render(GTK_GL_AREA(header));
+    return G_SOURCE_REMOVE;
+}
 
-    glUseProgram(program);
+static gboolean redraw_activity(gpointer data) {
+    activity_pending.store(false);
+    return redraw_header(data);
+}
 
-    // Set color (blue)
-    GLint color_loc = glGetUniformLocation(program, "color");
-    glUniform4f(color_loc, 0.0f, 0.0f, 1.0f, 1.0f);
+// Runs per message; coalesces a burst into one idle callback
+static void note_activity(const char *ip) {
+    peer_map_activity(ip);
+    if (!activity_pending.exchange(true)) {
+        g_idle_add(redraw_activity, NULL);
+    }
+}
 
-    glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    glBindVertexArray(0);
+static void chat_append(bool outgoing, const std::string &text) {
+    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(chat_view));
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    gtk_text_buffer_insert(buffer, &end, outgoing ? "me: " : "them: ", -1);
+    gtk_text_buffer_insert(buffer, &end, text.data(), (gint)text.size());
+    gtk_text_buffer_insert(buffer, &end, "\n", -1);
+    gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(chat_view), &end, 0, FALSE, 0, 0);
 }
 
-// Node discovery thread
-void discover_nodes() {
-    discovery_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (discovery_socket < 0) {
-        perror("socket");
-        return;
+// Whatever arrived since the last call, in one go
+static gboolean show_incoming(gpointer) {
+    incoming_pending.store(false);
+    std::vector<IncomingText> arrived;
+    {
+        std::lock_guard<std::mutex> lock(incoming_lock);
+        arrived.swap(incoming);
+    }
+    for (const IncomingText &in : arrived) {
+        if (chat_window != NULL && in.ip == chat_ip) chat_append(false, in.text);
     }
+    return G_SOURCE_REMOVE;
+}
 
-    // Set socket to allow broadcast
-    int broadcast = 1;
-    if (setsockopt(discovery_socket, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
-        perror("setsockopt");
-        close(discovery_socket);
-        return;
+// Runs on the messaging thread
+static void on_text_message(const char *ip, uint64_t, const char *text, size_t len, void *) {
+    g_message("Message from %s: %.*s", ip, (int)len, text);
+    note_activity(ip);
+    {
+        std::lock_guard<std::mutex> lock(incoming_lock);
+        incoming.push_back(IncomingText{ip, std::string(text, len)});
+    }
+    if (!incoming_pending.exchange(true)) {
+        g_idle_add(show_incoming, NULL);
     }
+}
 
-    // Bind to discovery port
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(DISCOVERY_PORT);
+bool send_text_message(const std::string &ip, const std::string &text) {
+    if (!core->send_text(ip, text)) return false;
+    note_activity(ip.c_str());
+    return true;
+}
 
-    if (bind(discovery_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(discovery_socket);
+static void on_chat_send(GtkWidget *, gpointer) {
+    std::string text = gtk_entry_get_text(GTK_ENTRY(chat_entry));
+    if (text.empty()) return;
+    if (!send_text_message(chat_ip, text)) {
+        g_warning("Sending to %s failed", chat_ip.c_str());
         return;
     }
+    chat_append(true, text);
+    gtk_entry_set_text(GTK_ENTRY(chat_entry), "");
+}
 
-    // Start discovery thread
-    std::thread discovery_thread([]() {
-        while (running) {
-            handle_discovery_packet();
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
-    });
-    discovery_thread.detach();
-
-    // Send initial discovery packet
-    send_discovery_packet();
+static void on_chat_destroyed(GtkWidget *, gpointer) {
+    chat_window = NULL;
+    chat_ip.clear();
 }
 
-void handle_discovery_packet() {
-    char buffer[1024];
-    struct sockaddr_in from;
-    socklen_t from_len = sizeof(from);
+// The message window for ip: the stored conversation, then what is sent
+// and received while it is open. One conversation at a time.
+void open_conversation(const char *ip) {
+    if (chat_window != NULL) gtk_widget_destroy(chat_window);
+    chat_ip = ip;
 
-    int n = recvfrom(discovery_socket, buffer, sizeof(buffer), 0, (struct sockaddr*)&from, &from_len);
-    if (n > 0) {
-        buffer[n] = '\0';
-        std::string ip = inet_ntoa(from.sin_addr);
-        std::string name(buffer);
+    chat_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gchar *title = g_strdup_printf("Messages with %s", ip);
+    gtk_window_set_title(GTK_WINDOW(chat_window), title);
+    g_free(title);
+    gtk_window_set_default_size(GTK_WINDOW(chat_window), 480, 360);
+    g_signal_connect(chat_window, "destroy", G_CALLBACK(on_chat_destroyed), NULL);
 
-        std::lock_guard<std::mutex> lock(nodes_mutex);
-        online_nodes[ip] = name;
-    }
-}
+    GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+    gtk_container_add(GTK_CONTAINER(chat_window), vbox);
 
-void send_discovery_packet() {
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-    addr.sin_port = htons(DISCOVERY_PORT);
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    chat_view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(chat_view), FALSE);
+    gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(chat_view), GTK_WRAP_WORD_CHAR);
+    gtk_container_add(GTK_CONTAINER(scrolled), chat_view);
+    gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
 
-    const char *name = "MyNode";
-    sendto(discovery_socket, name, strlen(name), 0, (struct sockaddr*)&addr, sizeof(addr));
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    chat_entry = gtk_entry_new();
+    g_signal_connect(chat_entry, "activate", G_CALLBACK(on_chat_send), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), chat_entry, TRUE, TRUE, 0);
+    GtkWidget *button = gtk_button_new_with_label("Send");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_chat_send), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+
+    size_t stored = core->history_count(chat_ip);
+    size_t first = stored > CHAT_BACKLOG ? stored - CHAT_BACKLOG : 0;
+    std::vector<HistoryMessage> messages;
+    core->read_history(chat_ip, first, stored - first, &messages);
+    for (const HistoryMessage &m : messages) chat_append(m.outgoing, m.text);
+
+    gtk_widget_show_all(chat_window);
+    gtk_widget_grab_focus(chat_entry);
 }
 
 void start_voice_chat(const std::string &ip) {
-    if (voice_pipeline) {
-        gst_element_set_state(voice_pipeline, GST_STATE_NULL);
-        gst_object_unref(voice_pipeline);
-    }
-
-    std::string pipeline_str = "autoaudiosrc ! audioconvert ! opusenc ! rtpopuspay ! "
-                              "udpsink host=" + ip + " port=" + std::to_string(VOICE_PORT) + " "
-                              "udpsrc port=" + std::to_string(VOICE_PORT + 1) + " ! "
-                              "application/x-rtp,media=audio,encoding-name=OPUS ! "
-                              "rtpjitterbuffer ! rtpopusdepay ! opusdec ! audioconvert ! autoaudiosink";
-
-    voice_pipeline = gst_parse_launch(pipeline_str.c_str(), NULL);
-    if (!voice_pipeline) {
-        g_warning("Failed to create voice GStreamer pipeline");
-        return;
-    }
-
-    gst_element_set_state(voice_pipeline, GST_STATE_PLAYING);
-    play_sound_effect("call_start.ogg");
+    CallState before = core->call_state();
+    if (!core->call(ip)) return;
+    peer_map_set_call(ip.c_str(), true);
+    redraw_header(NULL);
+    if (before == CALL_IDLE) play_sound_effect("call_start.ogg");
 }
 
 void stop_voice_chat() {
-    if (voice_pipeline) {
-        gst_element_set_state(voice_pipeline, GST_STATE_NULL);
-        gst_object_unref(voice_pipeline);
-        voice_pipeline = NULL;
-    }
+    core->hang_up();
+    peer_map_clear_calls();
+    redraw_header(NULL);
     play_sound_effect("call_end.ogg");
 }
 
+// Called by the node list once a second with a monitor interface
+static bool peer_distance(const char *ip, double *metres) {
+    ProximityEstimate estimate;
+    if (!core->peer_distance(ip, &estimate)) return false;
+    *metres = estimate.distance_m;
+    return true;
+}
+
 void play_sound_effect(const char *filename) {
-    if (sound_pipeline) {
-        g_object_set(sound_pipeline, "uri", g_strdup_printf("file://%s", filename), NULL);
-        gst_element_set_state(sound_pipeline, GST_STATE_PLAYING);
-    }
+    effects_play(filename);
 }
 
 // GTK Drawing Functions
 
-void draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data) {
-    int width = gtk_widget_get_allocated_width(widget);
-    int height = gtk_widget_get_allocated_height(widget);
+// Discovery packets per second since the footer last asked
+static double discovery_rate(uint64_t packets) {
+    static uint64_t last_packets = 0;
+    static gint64 last_us = 0;
+    gint64 now_us = g_get_monotonic_time();
+    double rate = last_us && now_us > last_us ? (packets - last_packets) * 1e6 / (now_us - last_us) : 0;
+    last_packets = packets;
+    last_us = now_us;
+    return rate;
+}
+
+static void format_footer(char *status, size_t size) {
+    DiscoveryStats stats;
+    discovery_get_stats(&stats);
+
+    VoiceStats voice;
+    voice_get_stats(&voice);
+
+    int len = snprintf(status, size, "Online nodes: %zu    Discovery: %.0f pkt/s, %llu dropped",
+                       peers_count(), discovery_rate(stats.packets),
+                       (unsigned long long)(stats.drops + stats.truncated));
+    ConferenceStats conference;
+    conference_get_stats(&conference);
+    if (conference.active) {
+        snprintf(status + len, size - len, "    Conference: %zu peers, mix %.0f us (%s)",
+                 conference.participants, conference.avg_mix_us, conference.kernels);
+    } else if (voice.in_call) {
+        snprintf(status + len, size - len, "    Mouth to ear: %.0f ms (jitter %.1f, buffer %.0f)",
+                 voice.mouth_to_ear_ms, voice.jitter_ms, voice.jitter_buffer_ms);
+    } else if (voice.calls > 0) {
+        snprintf(status + len, size - len, "    Call setup: %.0f ms (avg %.0f)",
+                 voice.last_setup_ms, voice.avg_setup_ms);
+    }
+}
+
+static void render_footer(GtkWidget *widget, int width, int height) {
+    if (footer_surface) cairo_surface_destroy(footer_surface);
+    footer_surface = gdk_window_create_similar_image_surface(gtk_widget_get_window(widget), CAIRO_FORMAT_ARGB32,
+                                                             width, height, gtk_widget_get_scale_factor(widget));
+    footer_surface_width = width;
 
+    cairo_t *cr = cairo_create(footer_surface);
     cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.7);
     cairo_rectangle(cr, 0, height - 40, width, 40);
     cairo_fill(cr);
@@ -270,59 +298,59 @@ void draw_footer(GtkWidget *widget, cairo_t *cr, gpointer data) {
     cairo_set_source_rgb(cr, 1, 1, 1);
     cairo_select_font_face(cr, "Arial", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
     cairo_set_font_size(cr, 14);
-
-    std::lock_guard<std::mutex> lock(nodes_mutex);
-    std::string status = "Online nodes: " + std::to_string(online_nodes.size());
     cairo_move_to(cr, 20, height - 15);
-    cairo_show_text(cr, status.c_str());
+    cairo_show_text(cr, footer_text);
+    cairo_destroy(cr);
 }
 
-void draw_icon(GtkWidget *widget, cairo_t *cr, gpointer data) {
+gboolean draw_footer(GtkWidget *widget, cairo_t *cr, gpointer) {
     int width = gtk_widget_get_allocated_width(widget);
     int height = gtk_widget_get_allocated_height(widget);
 
-    GtkImage *icon = GTK_IMAGE(data);
-    GdkPixbuf *pixbuf = gtk_image_get_pixbuf(icon);
-
-    if (pixbuf != NULL) {
-        int img_width = gdk_pixbuf_get_width(pixbuf);
-        int img_height = gdk_pixbuf_get_height(pixbuf);
-
-        int scaled_width = (int)(img_width * icon_scale);
-        int scaled_height = (int)(img_height * icon_scale);
-
-        int x = (width - scaled_width) / 2;
-        int y = (height - scaled_height) / 2;
-
-        gdk_cairo_set_source_pixbuf(cr, pixbuf, x, y);
-        cairo_paint(cr);
-    }
+    if (footer_text[0] == '\0') format_footer(footer_text, sizeof(footer_text));
+    if (footer_surface == NULL || footer_surface_width != width) render_footer(widget, width, height);
+    cairo_set_source_surface(cr, footer_surface, 0, 0);
+    cairo_paint(cr);
+    return FALSE;
 }
 
-gboolean animate_wave(GtkWidget *widget) {
-    wave_radius += 10;
-    if (wave_radius > 200) {
-        wave_radius = 0;
+// Once a second: redraw the footer if its line changed, and the header if
+// the snapshot moved on while it was at rest
+static gboolean refresh_status(gpointer data) {
+    char status[sizeof(footer_text)];
+    format_footer(status, sizeof(status));
+    if (strcmp(status, footer_text) != 0) {
+        memcpy(footer_text, status, sizeof(footer_text));
+        if (footer_surface) cairo_surface_destroy(footer_surface);
+        footer_surface = NULL;
+        gtk_widget_queue_draw(GTK_WIDGET(data));
     }
-    gtk_widget_queue_draw(widget);
-    return TRUE;
-}
 
-gboolean on_hover(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    play_sound_effect("hover_sound.ogg");
-    icon_scale = 1.1;
-    gtk_widget_queue_draw(widget);
-    return FALSE;
+    if (header_tick == 0 && peer_map != NULL) {
+        PeerReader snapshot;
+        if (snapshot->version != header_version) redraw_header(NULL);
+    }
+    return G_SOURCE_CONTINUE;
 }
 
-gboolean on_leave(GtkWidget *widget, GdkEvent *event, gpointer data) {
-    icon_scale = 1.0;
-    gtk_widget_queue_draw(widget);
-    return FALSE;
+// The map animates in its shaders; a frame is only a redraw request
+static gboolean tick_gl(GtkWidget *widget, GdkFrameClock *, gpointer) {
+    gtk_gl_area_queue_render(GTK_GL_AREA(widget));
+    return G_SOURCE_CONTINUE;
 }
 
 gboolean render_gl(GtkWidget *widget, GdkGLContext *context, gpointer data) {
+    ProbeScope probe(PROBE_GL_FRAME);
     draw_gl_scene(widget);
+
+    // Frames from the clock while the map moves, none once it rests
+    bool animating = peer_map != NULL && peer_map_animating(peer_map);
+    if (animating && header_tick == 0) {
+        header_tick = gtk_widget_add_tick_callback(widget, tick_gl, NULL, NULL);
+    } else if (!animating && header_tick != 0) {
+        gtk_widget_remove_tick_callback(widget, header_tick);
+        header_tick = 0;
+    }
     return TRUE;
 }
 
@@ -335,22 +363,45 @@ void realize_gl(GtkWidget *widget, gpointer data) {
     init_opengl(widget);
 }
 
+void unrealize_gl(GtkWidget *widget, gpointer) {
+    gtk_gl_area_make_current(GTK_GL_AREA(widget));
+    peer_map_free(peer_map);
+    peer_map = NULL;
+    if (header_tick != 0) gtk_widget_remove_tick_callback(widget, header_tick);
+    header_tick = 0;
+}
+
 // Callback for node selection
-void on_node_selected(GtkWidget *widget, gpointer data) {
-    const char *ip = (const char *)data;
+void on_node_selected(const char *ip) {
     start_voice_chat(ip);
 }
 
+// Runs on the transfer's thread
+static void on_file_sent(uint64_t, bool ok, void *user) {
+    char *path = (char *)user;
+    if (ok) g_message("Sent %s", path);
+    else g_warning("Sending %s failed", path);
+    g_free(path);
+}
+
+void on_send_file(const char *ip) {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Send file", NULL, GTK_FILE_CHOOSER_ACTION_OPEN,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL, "_Send", GTK_RESPONSE_ACCEPT,
+                                                    NULL);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        char *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        if (core->send_file(ip, path, on_file_sent, path) == 0) g_free(path);
+        else note_activity(ip);
+    }
+    gtk_widget_destroy(dialog);
+}
+
 // Create the main window
 GtkWidget* create_main_window() {
     GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(window), "Decentralized Network");
     gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
-    g_signal_connect(window, "destroy", G_CALLBACK([](GtkWidget *widget, gpointer data) {
-        running = false;
-        if (discovery_socket != -1) close(discovery_socket);
-        gtk_main_quit();
-    }), NULL);
+    g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
 
     // Set dark theme
     GtkCssProvider *provider = gtk_css_provider_new();
@@ -367,17 +418,20 @@ GtkWidget* create_main_window() {
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_container_add(GTK_CONTAINER(window), vbox);
 
-    // Header with OpenGL animation
+    // Header with the network map
     GtkWidget *gl_area = gtk_gl_area_new();
+    header = gl_area;
     gtk_widget_set_size_request(gl_area, 800, 200);
+    gtk_gl_area_set_required_version(GTK_GL_AREA(gl_area), 3, 3);
     g_signal_connect(gl_area, "realize", G_CALLBACK(realize_gl), NULL);
+    g_signal_connect(gl_area, "unrealize", G_CALLBACK(unrealize_gl), NULL);
     g_signal_connect(gl_area, "render", G_CALLBACK(render_gl), NULL);
     gtk_box_pack_start(GTK_BOX(vbox), gl_area, FALSE, FALSE, 0);
 
-    // Online nodes list
+    // Online nodes list, with how far away each is when there is a monitor interface
     GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
-    GtkWidget *nodes_list = gtk_list_box_new();
-    gtk_list_box_set_selection_mode(GTK_LIST_BOX(nodes_list), GTK_SELECTION_SINGLE);
+    GtkWidget *nodes_list = node_list_new(open_conversation, on_node_selected, on_send_file);
+    if (proximity_running()) node_list_show_distances(peer_distance);
     gtk_container_add(GTK_CONTAINER(scrolled), nodes_list);
     gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
 
@@ -387,40 +441,8 @@ GtkWidget* create_main_window() {
     g_signal_connect(footer, "draw", G_CALLBACK(draw_footer), NULL);
     gtk_box_pack_start(GTK_BOX(vbox), footer, FALSE, FALSE, 0);
 
-    // Start node discovery
-    discover_nodes();
-
-    // Timer to update node list
-    g_timeout_add(1000, [](gpointer data) -> gboolean {
-        GtkWidget *list = (GtkWidget *)data;
-
-        // Clear current list
-        GList *children = gtk_container_get_children(GTK_CONTAINER(list));
-        for (GList *iter = children; iter != NULL; iter = iter->next) {
-            gtk_container_remove(GTK_CONTAINER(list), GTK_WIDGET(iter->data));
-        }
-        g_list_free(children);
-
-        // Add online nodes
-        std::lock_guard<std::mutex> lock(nodes_mutex);
-        for (const auto &node : online_nodes) {
-            GtkWidget *row = gtk_list_box_row_new();
-            GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
-            gtk_container_add(GTK_CONTAINER(row), hbox);
-
-            GtkWidget *label = gtk_label_new(node.second.c_str());
-            gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, TRUE, 0);
-
-            GtkWidget *button = gtk_button_new_with_label("Call");
-            g_signal_connect(button, "clicked", G_CALLBACK(on_node_selected), (gpointer)node.first.c_str());
-            gtk_box_pack_start(GTK_BOX(hbox), button, FALSE, FALSE, 0);
-
-            gtk_container_add(GTK_CONTAINER(list), row);
-        }
-
-        gtk_widget_show_all(list);
-        return TRUE;
-    }, nodes_list);
+    // Check once a second that the discovery rate and call latency are current
+    g_timeout_add_seconds(1, refresh_status, footer);
 
     return window;
 }
@@ -429,20 +451,21 @@ int main(int argc, char *argv[]) {
     gtk_init(&argc, &argv);
     init_gstreamer();
 
+    // The core's timers run on the same main context as GTK, so gtk_main() drives both
+    CoreConfig config;
+    core_config_from_env(&config);
+    core = new Core(config);
+    core->set_text_handler(on_text_message, NULL);
+    if (!core->start()) g_warning("Networking unavailable");
+
     GtkWidget *window = create_main_window();
     gtk_widget_show_all(window);
 
     gtk_main();
 
     // Clean up
-    if (voice_pipeline) {
-        gst_element_set_state(voice_pipeline, GST_STATE_NULL);
-        gst_object_unref(voice_pipeline);
-    }
-    if (sound_pipeline) {
-        gst_element_set_state(sound_pipeline, GST_STATE_NULL);
-        gst_object_unref(sound_pipeline);
-    }
+    delete core;
+    effects_shutdown();
 
     return 0;
 }
@@ -0,0 +1,113 @@
+// puttynetd: a puttyNet node without a display, for relays and always-on
+// nodes on servers. It discovers and announces, keeps message history and
+// compacts it every hour, takes files, answers on the metrics socket and,
+// with audio, can be called.
+//
+// Usage: puttynetd [--name NAME] [--no-audio] [--no-history] [--no-files] [--memory SECONDS]
+//                  [--wifi INTERFACE]
+//
+// Startup time and memory are logged once the node is up, then every
+// --memory seconds (default 60, 0 for never) to show where steady state
+// settles. The same figures are on the metrics socket. kill -USR1 dumps
+// the hot-path probes to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "core.h"
+#include "message_log.h"
+#include "probes.h"
+
+const guint COMPACT_INTERVAL_SEC = 3600;
+
+static void log_memory(const char *when, const Core *core) {
+    ProcessMemory memory;
+    if (!process_memory(&memory)) return;
+    g_message("%s: %zu kB resident, %zu kB peak, %zu kB data; started in %.1f ms", when, memory.rss_kb,
+              memory.peak_rss_kb, memory.heap_kb, core->startup_ms());
+}
+
+static void on_text(const char *ip, uint64_t sender, const char *text, size_t len, void *) {
+    g_message("Message from %s (%016llx): %.*s", ip, (unsigned long long)sender, (int)len, text);
+}
+
+static gboolean on_signal(gpointer user) {
+    ((Core *)user)->quit();
+    return G_SOURCE_REMOVE;
+}
+
+// SIGUSR1 dumps the hot-path probes
+static gboolean on_dump(gpointer) {
+    probes_dump(stderr);
+    return G_SOURCE_CONTINUE;
+}
+
+// Forgotten conversations leave the disk; nothing else reads the log, so
+// no read() pointers are held across it
+static gboolean on_compact_timer(gpointer user) {
+    MessageLog *history = ((Core *)user)->message_history();
+    if (history && !history->compact(g_get_real_time() / 1000)) g_warning("Message history compaction failed");
+    return TRUE;
+}
+
+static gboolean on_memory_timer(gpointer user) {
+    log_memory("Steady state", (const Core *)user);
+    return TRUE;
+}
+
+static void usage(const char *self) {
+    fprintf(stderr, "usage: %s [--name NAME] [--no-audio] [--no-history] [--no-files] [--memory SECONDS] "
+            "[--wifi INTERFACE]\n", self);
+}
+
+int main(int argc, char *argv[]) {
+    CoreConfig config;
+    core_config_from_env(&config);
+    int memory_interval = 60;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            config.name = argv[++i];
+        } else if (strcmp(argv[i], "--no-audio") == 0) {
+            config.audio = false;
+        } else if (strcmp(argv[i], "--no-history") == 0) {
+            config.history = false;
+        } else if (strcmp(argv[i], "--no-files") == 0) {
+            config.files = false;
+        } else if (strcmp(argv[i], "--wifi") == 0 && i + 1 < argc) {
+            config.wifi_interface = argv[++i];
+        } else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+            memory_interval = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    // A peer hanging up mid-write must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    Core core(config);
+    core.set_text_handler(on_text, NULL);
+    if (!core.start()) {
+        fprintf(stderr, "puttynetd: failed to start\n");
+        return 1;
+    }
+    log_memory("Started", &core);
+
+    g_unix_signal_add(SIGINT, on_signal, &core);
+    g_unix_signal_add(SIGTERM, on_signal, &core);
+    g_unix_signal_add(SIGUSR1, on_dump, NULL);
+    if (memory_interval > 0) g_timeout_add_seconds(memory_interval, on_memory_timer, &core);
+    g_timeout_add_seconds(COMPACT_INTERVAL_SEC, on_compact_timer, &core);
+
+    core.run();
+
+    log_memory("Stopping", &core);
+    core.stop();
+    return 0;
+}
@@ -0,0 +1,637 @@
+#include "reliable.h"
+
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "probes.h"
+
+// Retransmit timer bounds (RFC 6298 with a LAN-sized floor)
+const uint64_t RTO_INITIAL_US = 200000;
+const uint64_t RTO_MIN_US = 20000;
+const uint64_t RTO_MAX_US = 2000000;
+
+// Acks are held at most this long hoping to cover a second data frame
+const uint64_t DELAYED_ACK_US = 2000;
+
+// A hole is declared lost once a message this far past it was SACKed
+const uint32_t REORDER_THRESHOLD = 3;
+
+// Pacing allows short bursts of up to this many datagrams, or one tick's
+// worth when the rate is higher than the millisecond tick can spread out
+const double PACING_BURST = 8;
+
+// Congestion window bounds, in bytes: a few full datagrams at least, and
+// never more than the receive window could hold
+const double INITIAL_CWND = 10 * MESSAGE_MTU;
+const double MIN_CWND = 4 * MESSAGE_MTU;
+const double MAX_CWND = (double)RELIABLE_WINDOW * MESSAGE_MTU;
+
+// The window is this many bandwidth-delay products, so acks that come back
+// late or bunched up do not stall the sender
+const double CWND_GAIN = 2;
+
+// Start-up ends after this many rounds that did not raise bandwidth by a quarter
+const uint32_t STARTUP_FLAT_ROUNDS = 3;
+const double STARTUP_GROWTH = 1.25;
+
+// After a lossy round the window is capped at this share of what was in flight
+const double LOSS_BETA = 0.7;
+
+// The minimum RTT is sampled afresh after this long, in case the path changed
+const uint64_t MIN_RTT_WINDOW_US = 10000000;
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Serial number arithmetic so sequence numbers can wrap
+static bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static uint64_t peer_id(const struct sockaddr_in *addr) {
+    return (uint64_t)ntohl(addr->sin_addr.s_addr) << 16 | ntohs(addr->sin_port);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// What a message takes up in a datagram
+static size_t wire_size(const ReliableSlot &slot) {
+    return MESSAGE_FRAME_HEADER_SIZE + RELIABLE_HEADER_SIZE + slot.data.size();
+}
+
+static void reset_congestion(ReliablePeer *peer) {
+    peer->in_flight = peer->lost = 0;
+    peer->highest_sacked = 0;
+    peer->cwnd = INITIAL_CWND;
+    peer->cwnd_cap = 0;
+    peer->tokens = PACING_BURST * MESSAGE_MTU;
+    peer->last_pace_us = 0;
+    peer->srtt_us = peer->rttvar_us = 0;
+    peer->rto_us = RTO_INITIAL_US;
+    peer->rto_deadline_us = 0;
+    peer->rack_sent_us = 0;
+    peer->startup = true;
+    peer->delivered = peer->round_delivered = 0;
+    peer->round_start_us = 0;
+    peer->round_lost = 0;
+    peer->round_end = peer->snd_nxt;
+    peer->rounds = peer->flat_rounds = 0;
+    peer->full_bw = 0;
+    for (double &bw : peer->bw) bw = 0;
+    peer->min_rtt_us = peer->min_rtt_stamp_us = 0;
+}
+
+static double max_bw(const ReliablePeer *peer) {
+    double best = 0;
+    for (double bw : peer->bw) {
+        if (bw > best) best = bw;
+    }
+    return best;
+}
+
+static void reset_receive(ReliablePeer *peer) {
+    for (ReliableSlot &slot : peer->in) slot.present = false;
+    peer->rcv_nxt = peer->rcv_high = 0;
+    peer->unacked_rx = 0;
+    peer->ack_deadline_us = 0;
+    peer->ack_now = false;
+}
+
+Reliable::Reliable(Messenger *m, message_handler on_deliver, void *data)
+    : messenger(m), handler(on_deliver), user(data),
+      stat_sent(0), stat_retransmits(0), stat_timeouts(0),
+      stat_delivered(0), stat_duplicates(0), stat_acks_sent(0), stat_refused(0) {
+    messenger->set_tick(on_tick, this);
+}
+
+void Reliable::set_admit(reliable_admit fn, void *data) {
+    admit = fn;
+    admit_user = data;
+}
+
+// Look up or create the state for addr; call with send_mutex held. NULL
+// for a peer that may not have state, or with the table full. The windows
+// are left for the first message either way.
+ReliablePeer *Reliable::peer_for(const struct sockaddr_in *addr, uint64_t now) {
+    auto it = peers.find(peer_id(addr));
+    if (it != peers.end()) {
+        it->second.active_us = now;
+        return &it->second;
+    }
+    if (peers.size() >= RELIABLE_MAX_PEERS || (admit != NULL && !admit(addr, admit_user))) {
+        stat_refused.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+
+    ReliablePeer &peer = peers[peer_id(addr)];
+    peer.addr = *addr;
+    peer.active_us = now;
+    peer.snd_una = peer.snd_nxt = peer.snd_end = 0;
+    reset_congestion(&peer);
+    peer.ack_remote_id = 0;
+    peer.remote_id = 0;
+    reset_receive(&peer);
+    return &peer;
+}
+
+bool Reliable::send(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len) {
+    if (len > RELIABLE_MAX_PAYLOAD) return false;
+
+    {
+        ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+        ReliablePeer *peer = peer_for(to, monotonic_us());
+        if (peer == NULL || peer->snd_end - peer->snd_una >= RELIABLE_QUEUE) return false;
+        if (peer->out.empty()) peer->out.resize(RELIABLE_QUEUE);
+
+        ReliableSlot &slot = peer->out[peer->snd_end % RELIABLE_QUEUE];
+        slot.type = type;
+        slot.sent = slot.acked = slot.lost = false;
+        slot.retries = 0;
+        slot.data.assign((const uint8_t *)data, (const uint8_t *)data + len);
+        peer->snd_end++;
+    }
+
+    // The messaging thread transmits as the window and pacing allow
+    messenger->kick();
+    return true;
+}
+
+void Reliable::on_message(const struct sockaddr_in *from, uint64_t sender, uint8_t type,
+                          const uint8_t *data, size_t len, void *user) {
+    Reliable *self = (Reliable *)user;
+    if (type != FRAME_DATA && type != FRAME_ACK) {
+        self->handler(from, sender, type, data, len, self->user);
+        return;
+    }
+
+    uint64_t now = monotonic_us();
+    ReliablePeer *peer;
+    if (type == FRAME_ACK) {
+        ProbedLock<std::mutex> lock(self->send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+        peer = self->peer_for(from, now);
+        if (peer == NULL) return;
+        if (peer->ack_remote_id != sender) {
+            if (peer->ack_remote_id != 0) self->restart_send(peer);
+            peer->ack_remote_id = sender;
+        }
+        self->handle_ack(peer, data, len, now);
+        return;
+    }
+
+    {
+        ProbedLock<std::mutex> lock(self->send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+        peer = self->peer_for(from, now);
+    }
+    if (peer == NULL) return;
+
+    // A new node id on the same address is a restarted peer with a fresh sequence
+    if (peer->remote_id != sender) {
+        if (peer->remote_id != 0) reset_receive(peer);
+        peer->remote_id = sender;
+    }
+    self->handle_data(peer, data, len, now);
+}
+
+// Receive side, messaging thread only, no lock held
+void Reliable::handle_data(ReliablePeer *peer, const uint8_t *data, size_t len, uint64_t now) {
+    if (len < RELIABLE_HEADER_SIZE) return;
+    if (peer->in.empty()) peer->in.resize(RELIABLE_WINDOW);
+    uint32_t seq = get_u32(data);
+    uint8_t type = data[4];
+    const uint8_t *payload = data + RELIABLE_HEADER_SIZE;
+    size_t payload_len = len - RELIABLE_HEADER_SIZE;
+
+    int32_t ahead = (int32_t)(seq - peer->rcv_nxt);
+    if (ahead < 0 || ahead >= (int32_t)RELIABLE_WINDOW) {
+        // Already delivered (our ack was lost) or beyond the window: re-ack now
+        stat_duplicates.fetch_add(1, std::memory_order_relaxed);
+        peer->ack_now = true;
+        return;
+    }
+
+    if (ahead == 0) {
+        handler(&peer->addr, peer->remote_id, type, payload, payload_len, user);
+        peer->rcv_nxt++;
+        uint64_t delivered = 1;
+
+        // Release whatever was waiting behind the hole
+        for (;;) {
+            ReliableSlot &next = peer->in[peer->rcv_nxt % RELIABLE_WINDOW];
+            if (!next.present) break;
+            handler(&peer->addr, peer->remote_id, next.type, next.data.data(), next.data.size(), user);
+            next.present = false;
+            peer->rcv_nxt++;
+            delivered++;
+        }
+        stat_delivered.fetch_add(delivered, std::memory_order_relaxed);
+    } else {
+        ReliableSlot &slot = peer->in[seq % RELIABLE_WINDOW];
+        if (slot.present) {
+            stat_duplicates.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            slot.present = true;
+            slot.type = type;
+            slot.data.assign(payload, payload + payload_len);
+            if (seq_before(peer->rcv_high, seq + 1)) peer->rcv_high = seq + 1;
+        }
+        // Out of order: tell the sender about the hole straight away
+        peer->ack_now = true;
+    }
+
+    if (++peer->unacked_rx >= 2) peer->ack_now = true;
+    else if (peer->ack_deadline_us == 0) peer->ack_deadline_us = now + DELAYED_ACK_US;
+}
+
+// As many bitmap words as reach the highest message held, at least one
+void Reliable::send_ack(ReliablePeer *peer) {
+    uint32_t span = seq_before(peer->rcv_nxt + 1, peer->rcv_high) ? peer->rcv_high - peer->rcv_nxt - 1 : 0;
+    uint32_t words = (span + 63) / 64;
+    if (words == 0) words = 1;
+    if (words > RELIABLE_SACK_WORDS) words = RELIABLE_SACK_WORDS;
+
+    uint8_t buf[4 + 8 * RELIABLE_SACK_WORDS];
+    put_u32(buf, peer->rcv_nxt);
+    for (uint32_t w = 0; w < words; w++) {
+        uint64_t sack = 0;
+        for (uint32_t i = 0; i < 64; i++) {
+            if (peer->in[(peer->rcv_nxt + 1 + 64 * w + i) % RELIABLE_WINDOW].present) sack |= 1ull << i;
+        }
+        put_u32(buf + 4 + 8 * w, (uint32_t)(sack >> 32));
+        put_u32(buf + 8 + 8 * w, (uint32_t)sack);
+    }
+    if (messenger->send(&peer->addr, FRAME_ACK, buf, 4 + 8 * words)) {
+        stat_acks_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    peer->unacked_rx = 0;
+    peer->ack_deadline_us = 0;
+    peer->ack_now = false;
+}
+
+// The peer restarted and expects sequence 0 again: renumber everything not
+// yet acked from 0 and start over with fresh congestion state
+void Reliable::restart_send(ReliablePeer *peer) {
+    std::vector<ReliableSlot> pending;
+    for (uint32_t seq = peer->snd_una; seq_before(seq, peer->snd_end); seq++) {
+        ReliableSlot &slot = peer->out[seq % RELIABLE_QUEUE];
+        if (!slot.acked) pending.push_back(std::move(slot));
+    }
+
+    peer->out.clear();
+    if (!pending.empty()) peer->out.resize(RELIABLE_QUEUE);
+    for (size_t i = 0; i < pending.size(); i++) {
+        ReliableSlot &slot = peer->out[i];
+        slot = std::move(pending[i]);
+        slot.sent = slot.acked = slot.lost = false;
+        slot.retries = 0;
+    }
+
+    peer->snd_una = peer->snd_nxt = 0;
+    peer->snd_end = (uint32_t)pending.size();
+    reset_congestion(peer);
+}
+
+// Returns true if seq was not acked before; round_done once it was sent
+// after the current round began
+bool Reliable::mark_acked(ReliablePeer *peer, uint32_t seq, uint64_t now, uint64_t *rtt_sample, bool *round_done) {
+    ReliableSlot &slot = peer->out[seq % RELIABLE_QUEUE];
+    if (!slot.sent || slot.acked) return false;
+
+    slot.acked = true;
+    size_t size = wire_size(slot);
+    if (slot.lost) {
+        slot.lost = false;
+        peer->lost--;
+    } else {
+        peer->in_flight -= size;
+    }
+
+    // Karn: only never-retransmitted messages give an unambiguous RTT
+    if (slot.retries == 0) *rtt_sample = now - slot.sent_us;
+    if (slot.sent_us > peer->rack_sent_us) peer->rack_sent_us = slot.sent_us;
+    if (!seq_before(seq, peer->round_end)) *round_done = true;
+
+    // Start-up grows the window by what was acked, doubling it each round;
+    // afterwards it only grows back towards the bandwidth-delay product
+    peer->delivered += size;
+    double target = CWND_GAIN * max_bw(peer) * peer->min_rtt_us;
+    if (peer->startup) peer->cwnd += size;
+    else peer->cwnd = peer->cwnd + size < target ? peer->cwnd + size : target;
+    if (peer->cwnd_cap && peer->cwnd > peer->cwnd_cap) peer->cwnd = peer->cwnd_cap;
+    if (peer->cwnd < MIN_CWND) peer->cwnd = MIN_CWND;
+    if (peer->cwnd > MAX_CWND) peer->cwnd = MAX_CWND;
+    return true;
+}
+
+// One round trip's worth acked: take a bandwidth sample, decide whether
+// start-up is over and respond to the round's loss rate
+void Reliable::end_round(ReliablePeer *peer, uint64_t now) {
+    uint64_t acked = peer->delivered - peer->round_delivered;
+    if (peer->round_start_us && now > peer->round_start_us) {
+        peer->bw[peer->rounds % RELIABLE_BW_ROUNDS] = (double)acked / (now - peer->round_start_us);
+        peer->rounds++;
+    }
+
+    double bw = max_bw(peer);
+    double loss = acked + peer->round_lost ? (double)peer->round_lost / (acked + peer->round_lost) : 0;
+    if (loss > RELIABLE_LOSS_TOLERANCE) {
+        double cap = (peer->in_flight + peer->round_lost) * LOSS_BETA;
+        peer->cwnd_cap = cap < MIN_CWND ? MIN_CWND : cap;
+        if (peer->cwnd > peer->cwnd_cap) peer->cwnd = peer->cwnd_cap;
+        peer->startup = false;
+    } else if (peer->cwnd_cap) {
+        peer->cwnd_cap += MESSAGE_MTU;
+        if (peer->cwnd_cap >= CWND_GAIN * bw * peer->min_rtt_us) peer->cwnd_cap = 0;
+    }
+
+    if (peer->startup && peer->rounds) {
+        if (bw >= peer->full_bw * STARTUP_GROWTH) {
+            peer->full_bw = bw;
+            peer->flat_rounds = 0;
+        } else if (++peer->flat_rounds >= STARTUP_FLAT_ROUNDS) {
+            peer->startup = false;
+        }
+    }
+
+    peer->round_delivered = peer->delivered;
+    peer->round_start_us = now;
+    peer->round_lost = 0;
+    peer->round_end = peer->snd_nxt;
+}
+
+// Send side, send_mutex held
+void Reliable::handle_ack(ReliablePeer *peer, const uint8_t *data, size_t len, uint64_t now) {
+    if (len < 12) return;
+    uint32_t cum = get_u32(data);
+    uint32_t words = (uint32_t)(len - 4) / 8;
+    if (words > RELIABLE_SACK_WORDS) words = RELIABLE_SACK_WORDS;
+
+    // Ignore acks for data we never sent
+    if (seq_before(peer->snd_nxt, cum)) return;
+
+    uint64_t rtt_sample = 0;
+    bool progress = false;
+    bool round_done = false;
+    for (uint32_t seq = peer->snd_una; seq_before(seq, cum); seq++) {
+        progress |= mark_acked(peer, seq, now, &rtt_sample, &round_done);
+    }
+    for (uint32_t w = 0; w < words; w++) {
+        const uint8_t *p = data + 4 + 8 * w;
+        uint64_t sack = (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+        for (uint32_t i = 0; i < 64 && sack; i++) {
+            if (!(sack & (1ull << i))) continue;
+            uint32_t seq = cum + 1 + 64 * w + i;
+            if (seq_before(seq, peer->snd_una) || !seq_before(seq, peer->snd_nxt)) continue;
+            progress |= mark_acked(peer, seq, now, &rtt_sample, &round_done);
+            if (seq_before(peer->highest_sacked, seq)) peer->highest_sacked = seq;
+        }
+    }
+
+    while (seq_before(peer->snd_una, peer->snd_nxt) && peer->out[peer->snd_una % RELIABLE_QUEUE].acked) {
+        peer->snd_una++;
+    }
+    if (seq_before(peer->highest_sacked, peer->snd_una)) peer->highest_sacked = peer->snd_una;
+
+    if (rtt_sample) {
+        if (peer->srtt_us == 0) {
+            peer->srtt_us = rtt_sample;
+            peer->rttvar_us = rtt_sample / 2;
+        } else {
+            uint64_t err = rtt_sample > peer->srtt_us ? rtt_sample - peer->srtt_us : peer->srtt_us - rtt_sample;
+            peer->rttvar_us = (3 * peer->rttvar_us + err) / 4;
+            peer->srtt_us = (7 * peer->srtt_us + rtt_sample) / 8;
+        }
+        peer->rto_us = peer->srtt_us + 4 * peer->rttvar_us;
+        if (peer->rto_us < RTO_MIN_US) peer->rto_us = RTO_MIN_US;
+        if (peer->rto_us > RTO_MAX_US) peer->rto_us = RTO_MAX_US;
+
+        if (peer->min_rtt_us == 0 || rtt_sample <= peer->min_rtt_us ||
+            now > peer->min_rtt_stamp_us + MIN_RTT_WINDOW_US) {
+            peer->min_rtt_us = rtt_sample;
+            peer->min_rtt_stamp_us = now;
+        }
+    }
+
+    // Holes well behind the highest SACK are lost; resend them, not the window.
+    // A hole only counts as lost once something sent a quarter RTT after it
+    // has been acked (RACK): a datagram holds many messages, so one datagram
+    // overtaken on the way opens a hole far wider than the threshold, and a
+    // repair must not be resent on every later ack either.
+    // With too little in flight for three later messages to be SACKed the
+    // threshold drops so tail losses do not wait for the timer (RFC 5827).
+    uint64_t reorder_us = peer->srtt_us / 4;
+    uint32_t outstanding = peer->snd_nxt - peer->snd_una;
+    uint32_t threshold = outstanding <= REORDER_THRESHOLD ? 1 : REORDER_THRESHOLD;
+    for (uint32_t seq = peer->snd_una; seq_before(seq + threshold, peer->highest_sacked + 1); seq++) {
+        ReliableSlot &slot = peer->out[seq % RELIABLE_QUEUE];
+        if (slot.sent_us + reorder_us >= peer->rack_sent_us) continue;
+        if (slot.sent && !slot.acked && !slot.lost) {
+            slot.lost = true;
+            peer->in_flight -= wire_size(slot);
+            peer->round_lost += wire_size(slot);
+            peer->lost++;
+        }
+    }
+    if (round_done) end_round(peer, now);
+
+    // Restart the timer whenever new data is acked, SACKed included, so a
+    // hole being repaired does not also time out (RFC 6298 5.3)
+    if (progress) peer->rto_deadline_us = peer->in_flight || peer->lost ? now + peer->rto_us : 0;
+    last_acked = peer;
+
+    transmit(peer, now);
+}
+
+// Send what the congestion window and pacing allow: repairs first, then new data
+void Reliable::transmit(ReliablePeer *peer, uint64_t now) {
+    // Tokens are bytes; a message may overdraw them and the next one waits
+    if (peer->srtt_us && peer->last_pace_us) {
+        double interval = (double)peer->srtt_us / peer->cwnd;
+        double burst = 1000 / interval > PACING_BURST * MESSAGE_MTU ? 1000 / interval : PACING_BURST * MESSAGE_MTU;
+        peer->tokens += (now - peer->last_pace_us) / interval;
+        if (peer->tokens > burst) peer->tokens = burst;
+    } else {
+        peer->tokens = PACING_BURST * MESSAGE_MTU;
+    }
+    peer->last_pace_us = now;
+
+    uint8_t buf[MESSAGE_MAX_PAYLOAD];
+    uint32_t repair_from = peer->snd_una;
+
+    while (peer->tokens > 0 && peer->in_flight < peer->cwnd) {
+        uint32_t seq;
+        bool repair = false;
+
+        if (peer->lost) {
+            seq = repair_from;
+            while (!peer->out[seq % RELIABLE_QUEUE].lost) seq++;
+            repair_from = seq + 1;
+            repair = true;
+        } else if (seq_before(peer->snd_nxt, peer->snd_end) &&
+                   peer->snd_nxt - peer->snd_una < RELIABLE_WINDOW) {
+            seq = peer->snd_nxt;
+        } else {
+            break;
+        }
+
+        ReliableSlot &slot = peer->out[seq % RELIABLE_QUEUE];
+        put_u32(buf, seq);
+        buf[4] = slot.type;
+        memcpy(buf + RELIABLE_HEADER_SIZE, slot.data.data(), slot.data.size());
+        if (!messenger->send(&peer->addr, FRAME_DATA, buf, RELIABLE_HEADER_SIZE + slot.data.size())) break;
+
+        if (repair) {
+            slot.lost = false;
+            slot.retries++;
+            peer->lost--;
+            stat_retransmits.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            slot.sent = true;
+            peer->snd_nxt++;
+            stat_sent.fetch_add(1, std::memory_order_relaxed);
+        }
+        slot.sent_us = now;
+        peer->in_flight += wire_size(slot);
+        peer->tokens -= wire_size(slot);
+        if (peer->rto_deadline_us == 0) peer->rto_deadline_us = now + peer->rto_us;
+    }
+}
+
+// Nothing queued or unacked to the peer, nothing held or unacked from it
+static bool peer_idle(const ReliablePeer &peer, uint64_t now) {
+    if (now < peer.active_us + RELIABLE_IDLE_MS * 1000) return false;
+    if (peer.snd_una != peer.snd_end || peer.unacked_rx || peer.ack_now) return false;
+    for (const ReliableSlot &slot : peer.in) {
+        if (slot.present) return false;
+    }
+    return true;
+}
+
+// Free idle peers' windows, and with the table half full forget idle peers
+// the admit hook no longer accepts. Messaging thread only, so no handle_data() is holding a peer;
+// the hook runs outside send_mutex since it may walk the discovery table.
+void Reliable::sweep(uint64_t now) {
+    swept_us = now;
+    idle.clear();
+    {
+        ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+        for (auto &entry : peers) {
+            ReliablePeer &peer = entry.second;
+            if (!peer_idle(peer, now)) continue;
+            std::vector<ReliableSlot>().swap(peer.out);
+            std::vector<ReliableSlot>().swap(peer.in);
+            if (admit != NULL && peers.size() > RELIABLE_MAX_PEERS / 2) idle.push_back(entry.first);
+        }
+    }
+
+    size_t gone = 0;
+    for (uint64_t id : idle) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl((uint32_t)(id >> 16));
+        addr.sin_port = htons((uint16_t)id);
+        if (!admit(&addr, admit_user)) idle[gone++] = id;
+    }
+    if (gone == 0) return;
+
+    ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+    for (size_t i = 0; i < gone; i++) {
+        auto it = peers.find(idle[i]);
+        if (it == peers.end() || !peer_idle(it->second, now)) continue;
+        if (last_acked == &it->second) last_acked = NULL;
+        peers.erase(it);
+    }
+}
+
+int Reliable::on_tick(void *user) {
+    return ((Reliable *)user)->tick();
+}
+
+// Acks, retransmit timers and paced sends; returns ms until the next deadline
+int Reliable::tick() {
+    uint64_t now = monotonic_us();
+    uint64_t next = UINT64_MAX;
+
+    if (now >= swept_us + RELIABLE_SWEEP_MS * 1000) sweep(now);
+
+    ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+    for (auto &entry : peers) {
+        ReliablePeer *peer = &entry.second;
+
+        if (peer->ack_now || (peer->ack_deadline_us && now >= peer->ack_deadline_us)) {
+            send_ack(peer);
+        }
+        if (peer->ack_deadline_us && peer->ack_deadline_us < next) next = peer->ack_deadline_us;
+
+        if (peer->rto_deadline_us && now >= peer->rto_deadline_us) {
+            // Timeout: everything outstanding is presumed lost, back off the timer
+            for (uint32_t seq = peer->snd_una; seq_before(seq, peer->snd_nxt); seq++) {
+                ReliableSlot &slot = peer->out[seq % RELIABLE_QUEUE];
+                if (slot.sent && !slot.acked && !slot.lost) {
+                    slot.lost = true;
+                    peer->in_flight -= wire_size(slot);
+                    peer->lost++;
+                }
+            }
+            // Start over from a few datagrams; acks grow the window back to
+            // the bandwidth estimate within a round or two
+            peer->cwnd = MIN_CWND;
+            peer->round_end = peer->snd_nxt;
+            peer->rto_us = peer->rto_us * 2 > RTO_MAX_US ? RTO_MAX_US : peer->rto_us * 2;
+            peer->rto_deadline_us = 0;
+            stat_timeouts.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        transmit(peer, now);
+
+        if (peer->rto_deadline_us && peer->rto_deadline_us < next) next = peer->rto_deadline_us;
+
+        // Still holding sendable data: come back when pacing has a token
+        bool backlog = peer->lost || (seq_before(peer->snd_nxt, peer->snd_end) &&
+                                      peer->snd_nxt - peer->snd_una < RELIABLE_WINDOW);
+        if (backlog && peer->in_flight < peer->cwnd) {
+            double owed = peer->tokens > 0 ? 0 : 1 - peer->tokens;
+            uint64_t wait = peer->srtt_us ? (uint64_t)(owed * peer->srtt_us / peer->cwnd) : 0;
+            if (now + wait < next) next = now + wait;
+        }
+    }
+
+    if (next == UINT64_MAX) return -1;
+    if (next <= now) return 0;
+    return (int)((next - now + 999) / 1000);
+}
+
+void Reliable::get_stats(ReliableStats *out) {
+    out->sent = stat_sent.load(std::memory_order_relaxed);
+    out->retransmits = stat_retransmits.load(std::memory_order_relaxed);
+    out->timeouts = stat_timeouts.load(std::memory_order_relaxed);
+    out->delivered = stat_delivered.load(std::memory_order_relaxed);
+    out->duplicates = stat_duplicates.load(std::memory_order_relaxed);
+    out->acks_sent = stat_acks_sent.load(std::memory_order_relaxed);
+    out->refused = stat_refused.load(std::memory_order_relaxed);
+
+    ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+    out->srtt_us = last_acked ? last_acked->srtt_us : 0;
+    out->cwnd = last_acked ? last_acked->cwnd : 0;
+    out->bandwidth = last_acked ? (uint64_t)(max_bw(last_acked) * 1e6) : 0;
+}
+
+uint64_t Reliable::srtt(const struct sockaddr_in *to) {
+    ProbedLock<std::mutex> lock(send_mutex, PROBE_RELIABLE_LOCK, COUNTER_RELIABLE_LOCK);
+    auto it = peers.find(peer_id(to));
+    return it != peers.end() ? it->second.srtt_us : 0;
+}
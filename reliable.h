@@ -0,0 +1,204 @@
+#ifndef PUTTYNET_RELIABLE_H
+#define PUTTYNET_RELIABLE_H
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "messaging.h"
+
+// Reliable, ordered delivery on top of Messenger frames.
+//
+// FRAME_DATA payload: sequence number (4 bytes), inner frame type (1 byte),
+// message. FRAME_ACK payload: cumulative ack (4 bytes, the next sequence
+// number expected) and a SACK bitmap of one to RELIABLE_SACK_WORDS 64-bit
+// words where bit i means cum + 1 + i arrived. The bitmap reaches as far as
+// the highest message held out of order, so one lost datagram does not hide
+// everything sent after the first 64 messages behind it.
+//
+// Each peer gets its own sequence space, a sliding send window bounded by a
+// congestion window, pacing at cwnd per smoothed RTT, and RFC 6298 retransmit
+// timers with exponential backoff. Losses are inferred from the SACK bitmap
+// three sequence numbers past a hole, so only the missing messages are resent
+// and most repairs take one RTT rather than a timeout.
+//
+// The congestion window is counted in bytes on the wire, since many messages
+// share a datagram, and follows the delivery rate rather than loss: once per
+// round trip the bytes acked over the time taken give a bandwidth sample,
+// and the window is twice the best recent sample times the minimum RTT
+// (the bandwidth-delay product, as in BBR). Start-up doubles it each round
+// until the samples stop growing. Wi-Fi drops frames whether or not a queue
+// is full, so a loss alone does not shrink the window; only a round that
+// loses more than RELIABLE_LOSS_TOLERANCE of its bytes caps it, and the cap
+// is lifted again a datagram per clean round.
+//
+// State is only created for peers the admit hook accepts (set_admit()), at
+// most RELIABLE_MAX_PEERS of them. The windows are allocated when the first
+// message goes out or arrives and released again once a peer has been idle
+// for RELIABLE_IDLE_MS, with nothing unacked either way. What remains is a
+// few hundred bytes of sequence numbers, which a peer returning with the
+// same node id still counts on; idle peers the hook no longer accepts are
+// forgotten once more than half the table is in use.
+
+const size_t RELIABLE_HEADER_SIZE = 5;
+const size_t RELIABLE_MAX_PAYLOAD = MESSAGE_MAX_PAYLOAD - RELIABLE_HEADER_SIZE;
+
+// Receive window in messages; the sender never runs further ahead than this
+const uint32_t RELIABLE_WINDOW = 1024;
+
+// SACK bitmap words; enough to cover the receive window
+const uint32_t RELIABLE_SACK_WORDS = RELIABLE_WINDOW / 64;
+
+// Messages a peer may have queued, in flight or not yet sent
+const uint32_t RELIABLE_QUEUE = 4096;
+
+// Peers with state at once; past this, new ones are refused until idle ones go
+const size_t RELIABLE_MAX_PEERS = 1024;
+
+// Share of a round's bytes that may be lost before the window is capped
+const double RELIABLE_LOSS_TOLERANCE = 0.1;
+
+// Bandwidth samples kept, one per round trip; the estimate is their maximum
+const int RELIABLE_BW_ROUNDS = 10;
+
+// Idle this long, a peer's windows are freed; peers are checked this often
+const uint64_t RELIABLE_IDLE_MS = 30000;
+const uint64_t RELIABLE_SWEEP_MS = 5000;
+
+// Whether the peer at addr may have state: Core accepts the discovery table.
+// Called on the messaging thread and from send().
+typedef bool (*reliable_admit)(const struct sockaddr_in *addr, void *user);
+
+struct ReliableStats {
+    uint64_t sent;             // first transmissions
+    uint64_t retransmits;      // messages resent, after a SACK hole or a timeout
+    uint64_t timeouts;         // retransmit timer expiries
+    uint64_t delivered;
+    uint64_t duplicates;
+    uint64_t acks_sent;
+    uint64_t refused;          // frames and sends for peers that may not have state
+    uint64_t srtt_us;          // of the most recently acked peer
+    double cwnd;               // of the most recently acked peer, in bytes
+    uint64_t bandwidth;        // of the most recently acked peer, estimated bytes per second
+};
+
+struct ReliableSlot {
+    uint8_t type;
+    bool present;   // receive side: holds an out-of-order message
+    bool sent;
+    bool acked;
+    bool lost;
+    uint8_t retries;
+    uint64_t sent_us;
+    std::vector<uint8_t> data;  // capacity is kept when the slot is reused
+};
+
+struct ReliablePeer {
+    struct sockaddr_in addr;
+
+    // Send side, guarded by Reliable::send_mutex
+    uint64_t ack_remote_id;     // node id the acks come from
+    std::vector<ReliableSlot> out;
+    uint32_t snd_una;       // oldest unacked
+    uint32_t snd_nxt;       // next never-sent
+    uint32_t snd_end;       // next to be queued
+    uint64_t in_flight;     // bytes sent and neither acked nor lost
+    uint32_t lost;          // messages waiting to be resent
+    uint32_t highest_sacked;
+    double cwnd;            // bytes
+    double cwnd_cap;        // bytes after a lossy round, 0 for none
+    double tokens;          // bytes
+    uint64_t last_pace_us;
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    uint64_t rto_us;
+    uint64_t rto_deadline_us;   // 0 while nothing is in flight
+    uint64_t rack_sent_us;      // latest send time among acked messages
+
+    // Delivery rate. A round ends when a message sent after it began is acked.
+    bool startup;
+    uint64_t delivered;         // bytes acked so far
+    uint64_t round_delivered;   // delivered when the round began
+    uint64_t round_start_us;
+    uint64_t round_lost;        // bytes declared lost this round
+    uint32_t round_end;         // snd_nxt when the round began
+    uint32_t rounds;
+    uint32_t flat_rounds;       // start-up rounds without bandwidth growth
+    double full_bw;             // bandwidth start-up last grew to
+    double bw[RELIABLE_BW_ROUNDS];  // bytes per microsecond, by round
+    uint64_t min_rtt_us;
+    uint64_t min_rtt_stamp_us;
+
+    // Receive side, messaging thread only
+    uint64_t remote_id;
+    std::vector<ReliableSlot> in;
+    uint32_t rcv_nxt;
+    uint32_t rcv_high;      // one past the highest message held out of order
+    uint32_t unacked_rx;
+    uint64_t ack_deadline_us;
+    bool ack_now;
+
+    uint64_t active_us;     // last message queued or frame received, under send_mutex
+};
+
+class Reliable {
+public:
+    // Frames other than FRAME_DATA/FRAME_ACK are passed straight to handler;
+    // FRAME_DATA messages reach it in order with their inner type.
+    Reliable(Messenger *messenger, message_handler handler, void *user);
+
+    // Install before Messenger::start(); without it every peer is accepted
+    void set_admit(reliable_admit admit, void *admit_user);
+
+    // Pass to Messenger::start() together with this object
+    static void on_message(const struct sockaddr_in *from, uint64_t sender, uint8_t type,
+                           const uint8_t *data, size_t len, void *user);
+
+    // Returns false if the message is too large or the peer's queue is full
+    bool send(const struct sockaddr_in *to, uint8_t type, const void *data, size_t len);
+
+    void get_stats(ReliableStats *stats);
+
+    // Smoothed RTT to a peer in microseconds, 0 before the first ack
+    uint64_t srtt(const struct sockaddr_in *to);
+
+private:
+    static int on_tick(void *user);
+
+    ReliablePeer *peer_for(const struct sockaddr_in *addr, uint64_t now);
+    void sweep(uint64_t now);
+    void handle_data(ReliablePeer *peer, const uint8_t *data, size_t len, uint64_t now);
+    void handle_ack(ReliablePeer *peer, const uint8_t *data, size_t len, uint64_t now);
+    void restart_send(ReliablePeer *peer);
+    bool mark_acked(ReliablePeer *peer, uint32_t seq, uint64_t now, uint64_t *rtt_sample, bool *round_done);
+    void end_round(ReliablePeer *peer, uint64_t now);
+    void transmit(ReliablePeer *peer, uint64_t now);
+    void send_ack(ReliablePeer *peer);
+    int tick();
+
+    Messenger *messenger;
+    message_handler handler;
+    void *user;
+    reliable_admit admit = NULL;
+    void *admit_user = NULL;
+    uint64_t swept_us = 0;      // messaging thread only
+    std::vector<uint64_t> idle; // messaging thread only
+
+    std::mutex send_mutex;
+    std::unordered_map<uint64_t, ReliablePeer> peers;  // ip:port -> state, guarded by send_mutex
+    ReliablePeer *last_acked = NULL;
+
+    std::atomic<uint64_t> stat_sent;
+    std::atomic<uint64_t> stat_retransmits;
+    std::atomic<uint64_t> stat_timeouts;
+    std::atomic<uint64_t> stat_delivered;
+    std::atomic<uint64_t> stat_duplicates;
+    std::atomic<uint64_t> stat_acks_sent;
+    std::atomic<uint64_t> stat_refused;
+};
+
+#endif
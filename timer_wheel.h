@@ -0,0 +1,66 @@
+#ifndef PUTTYNET_TIMER_WHEEL_H
+#define PUTTYNET_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+// Milliseconds on the monotonic clock
+static inline uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Hashed timing wheel. Timers are never cancelled: when one fires, the owner
+// checks whether its deadline moved and reschedules it if so. That keeps
+// refreshes (the common case) at zero cost and one entry per key.
+template <typename Key>
+class TimerWheel {
+public:
+    TimerWheel(uint64_t tick, size_t slot_count, uint64_t now_ms)
+        : tick_ms(tick), slots(slot_count), current(now_ms / tick) {}
+
+    void schedule(const Key &key, uint64_t deadline_ms) {
+        uint64_t tick = deadline_ms / tick_ms;
+        if (tick < current) tick = current;
+        slots[tick % slots.size()].push_back(Entry{key, tick});
+    }
+
+    // Call fire(key) for every timer due at or before now_ms
+    template <typename F>
+    void advance(uint64_t now_ms, F fire) {
+        uint64_t target = now_ms / tick_ms;
+        if (target < current) return;
+
+        uint64_t start = current;
+        uint64_t steps = target - start + 1;
+        if (steps > slots.size()) steps = slots.size();
+
+        // Timers rescheduled from fire() land on the next tick at the earliest
+        current = target + 1;
+
+        for (uint64_t i = 0; i < steps; i++) {
+            std::vector<Entry> &slot = slots[(start + i) % slots.size()];
+            std::vector<Entry> due;
+            due.swap(slot);
+            for (const Entry &e : due) {
+                if (e.tick > target) slot.push_back(e);  // a later lap of the wheel
+                else fire(e.key);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        Key key;
+        uint64_t tick;
+    };
+
+    uint64_t tick_ms;
+    std::vector<std::vector<Entry>> slots;
+    uint64_t current;
+};
+
+#endif
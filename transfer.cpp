@@ -0,0 +1,892 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+// Chunk sizes a receiver accepts; both are whole pages on any Linux
+const uint32_t MIN_CHUNK = 64 << 10;
+const uint32_t MAX_CHUNK = 64 << 20;
+const size_t MAX_NAME = 255;
+const int PIPE_SIZE = 1 << 20;
+const int HELLO_TIMEOUT_SEC = 10;
+
+// State file: 'P' 'S', transfer id (8), size (8), chunk size (4), then one
+// byte per chunk, 1 once it is verified and on disk
+const size_t STATE_HEADER_SIZE = 22;
+
+static std::atomic<uint64_t> stat_bytes_sent(0);
+static std::atomic<uint64_t> stat_bytes_received(0);
+static std::atomic<uint64_t> stat_chunks_sent(0);
+static std::atomic<uint64_t> stat_chunks_received(0);
+static std::atomic<uint64_t> stat_chunks_resent(0);
+static std::atomic<uint64_t> stat_chunks_resumed(0);
+static std::atomic<uint64_t> stat_hash_failures(0);
+static std::atomic<uint64_t> stat_sends_completed(0);
+static std::atomic<uint64_t> stat_receives_completed(0);
+static std::atomic<uint64_t> stat_failed(0);
+
+// XXH64
+
+const uint64_t XXH_P1 = 11400714785074694791ull;
+const uint64_t XXH_P2 = 14029467366897019727ull;
+const uint64_t XXH_P3 = 1609587929392839161ull;
+const uint64_t XXH_P4 = 9650029242287828579ull;
+const uint64_t XXH_P5 = 2870177450012600261ull;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;   // little-endian hosts only, as XXH64 is defined
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t transfer_hash(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hash a range of a file through a read-only mapping, so the data is read
+// from the page cache rather than copied anywhere
+static bool hash_range(int fd, uint64_t offset, size_t len, uint64_t *hash) {
+    if (len == 0) {
+        *hash = transfer_hash(NULL, 0);
+        return true;
+    }
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset & ~(page - 1);
+    size_t skip = offset - start;
+    void *map = mmap(NULL, len + skip, PROT_READ, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED) return false;
+    madvise(map, len + skip, MADV_SEQUENTIAL);
+    *hash = transfer_hash((const uint8_t *)map + skip, len);
+    munmap(map, len + skip);
+    return true;
+}
+
+// Wire helpers
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (24 - 8 * i);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (56 - 8 * i);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get64(const uint8_t *p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static bool send_all(int fd, const void *buf, size_t len, int flags = 0) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len) {
+    uint8_t *p = (uint8_t *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void put_hello(uint8_t *p, uint8_t kind, uint64_t id) {
+    p[0] = 'P';
+    p[1] = 'F';
+    p[2] = TRANSFER_VERSION;
+    p[3] = kind;
+    put64(p + 4, id);
+}
+
+static uint32_t chunk_count(uint64_t size, uint32_t chunk_size) {
+    return (uint32_t)((size + chunk_size - 1) / chunk_size);
+}
+
+static size_t chunk_length(uint64_t size, uint32_t chunk_size, uint32_t index) {
+    uint64_t offset = (uint64_t)index * chunk_size;
+    return (size_t)std::min<uint64_t>(chunk_size, size - offset);
+}
+
+// Threads. Connections and sends run on detached threads that are counted,
+// and their sockets are registered so transfer_stop() can shut them down.
+
+static std::mutex threads_lock;
+static std::condition_variable threads_done;
+static int active_threads = 0;
+static std::set<int> open_sockets;
+static bool stopping = false;
+
+// sendfile() has no MSG_NOSIGNAL; a peer that goes away must give EPIPE
+// on these threads, not kill the process
+static void block_sigpipe() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+template <typename F>
+static bool spawn(F body) {
+    std::lock_guard<std::mutex> guard(threads_lock);
+    if (stopping) return false;
+    active_threads++;
+    std::thread([body] {
+        block_sigpipe();
+        body();
+        std::lock_guard<std::mutex> guard(threads_lock);
+        if (--active_threads == 0) threads_done.notify_all();
+    }).detach();
+    return true;
+}
+
+static bool track_socket(int fd) {
+    std::lock_guard<std::mutex> guard(threads_lock);
+    if (stopping) return false;
+    open_sockets.insert(fd);
+    return true;
+}
+
+static void close_socket(int fd) {
+    {
+        std::lock_guard<std::mutex> guard(threads_lock);
+        open_sockets.erase(fd);
+    }
+    close(fd);
+}
+
+// Receive side
+
+struct Incoming {
+    uint64_t id;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;
+    std::string part_path;
+    std::string state_path;
+    std::string final_path;
+    int fd = -1;
+    int state_fd = -1;
+
+    std::mutex lock;               // covers have and verified
+    std::vector<uint8_t> have;
+    uint32_t verified = 0;
+
+    ~Incoming() {
+        if (fd != -1) close(fd);
+        if (state_fd != -1) close(state_fd);
+    }
+};
+
+static std::string receive_dir;
+static transfer_admit admit_fn = NULL;
+static void *admit_user_data = NULL;
+static int listen_fd = -1;
+static int stop_fd = -1;
+static std::thread listen_thread;
+
+static std::mutex incoming_lock;
+static std::unordered_map<uint64_t, std::shared_ptr<Incoming>> incoming;
+
+// A plain file name: no directories, nothing hidden, no control characters
+static bool valid_name(const std::string &name) {
+    if (name.empty() || name.size() > MAX_NAME || name[0] == '.') return false;
+    for (unsigned char c : name) {
+        if (c == '/' || c < 0x20 || c == 0x7f) return false;
+    }
+    return true;
+}
+
+// Pick up an earlier attempt's verified chunks if its state file is for
+// the same transfer; otherwise start over
+static bool open_part(Incoming *in) {
+    std::vector<uint8_t> state(STATE_HEADER_SIZE + in->chunks);
+    in->state_fd = open(in->state_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (in->state_fd < 0) return false;
+
+    struct stat part;
+    bool resume = pread(in->state_fd, state.data(), state.size(), 0) == (ssize_t)state.size() &&
+                  state[0] == 'P' && state[1] == 'S' && get64(&state[2]) == in->id &&
+                  get64(&state[10]) == in->size && get32(&state[18]) == in->chunk_size &&
+                  stat(in->part_path.c_str(), &part) == 0 && (uint64_t)part.st_size == in->size;
+
+    in->fd = open(in->part_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0600);
+    if (in->fd < 0) return false;
+
+    in->have.assign(in->chunks, 0);
+    if (resume) {
+        for (uint32_t i = 0; i < in->chunks; i++) {
+            in->have[i] = state[STATE_HEADER_SIZE + i] == 1;
+            in->verified += in->have[i];
+        }
+        return true;
+    }
+
+    // Reserve the blocks now, so a full disk shows up before any data moves.
+    // Only a file system that cannot preallocate gets a sparse file instead,
+    // and only if the free space would hold it; ENOSPC and the rest refuse
+    // the offer and leave nothing behind.
+    struct statvfs fs;
+    bool room = fstatvfs(in->fd, &fs) != 0 || (uint64_t)fs.f_bavail * fs.f_frsize >= in->size;
+    bool reserved = in->size == 0 || (room && fallocate(in->fd, 0, 0, in->size) == 0);
+    if (!room) errno = ENOSPC;
+    if (!reserved && (!room || (errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(in->fd, in->size) < 0)) {
+        int saved = errno;
+        unlink(in->part_path.c_str());
+        unlink(in->state_path.c_str());
+        errno = saved;
+        return false;
+    }
+    memset(state.data(), 0, state.size());
+    state[0] = 'P';
+    state[1] = 'S';
+    put64(&state[2], in->id);
+    put64(&state[10], in->size);
+    put32(&state[18], in->chunk_size);
+    return ftruncate(in->state_fd, 0) == 0 && pwrite(in->state_fd, state.data(), state.size(), 0) == (ssize_t)state.size();
+}
+
+// The name, or name.1, name.2, ... for the first one not taken
+static bool move_into_place(const std::string &from, const std::string &to, std::string *placed) {
+    for (int i = 0; i < 1000; i++) {
+        std::string target = i == 0 ? to : to + "." + std::to_string(i);
+        if (renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, target.c_str(), RENAME_NOREPLACE) == 0) {
+            *placed = target;
+            return true;
+        }
+        if (errno == EINVAL) {
+            // A file system without RENAME_NOREPLACE
+            if (access(target.c_str(), F_OK) == 0) continue;
+            if (rename(from.c_str(), target.c_str()) != 0) return false;
+            *placed = target;
+            return true;
+        }
+        if (errno != EEXIST) return false;
+    }
+    return false;
+}
+
+static void handle_control(int sock, const struct sockaddr_in *from, uint64_t id) {
+    uint8_t offer[14];
+    if (!recv_all(sock, offer, sizeof(offer))) return;
+    uint64_t size = get64(offer);
+    uint32_t chunk_size = get32(offer + 8);
+    std::string name(get16(offer + 12), '\0');
+    if (!recv_all(sock, &name[0], name.size())) return;
+
+    uint8_t status = TRANSFER_OK;
+    if (!valid_name(name) || chunk_size < MIN_CHUNK || chunk_size > MAX_CHUNK || chunk_size % 4096 != 0 ||
+        chunk_count(size, chunk_size) > (1u << 24)) {
+        status = TRANSFER_REFUSED;
+    }
+
+    auto in = std::make_shared<Incoming>();
+    in->id = id;
+    in->size = size;
+    in->chunk_size = chunk_size;
+    in->chunks = status == TRANSFER_OK ? chunk_count(size, chunk_size) : 0;
+    char sender[INET_ADDRSTRLEN];
+    char part[INET_ADDRSTRLEN + 40];
+    inet_ntop(AF_INET, &from->sin_addr, sender, sizeof(sender));
+    snprintf(part, sizeof(part), "/.puttyNet-%s-%016llx.part", sender, (unsigned long long)id);
+    in->final_path = receive_dir + "/" + name;
+    in->part_path = receive_dir + part;
+    in->state_path = in->part_path + ".state";
+
+    // A sender that reconnects at once can beat the end of its last attempt
+    // here, so give that a moment to wind down before refusing
+    for (int tries = 0; status == TRANSFER_OK; tries++) {
+        {
+            std::lock_guard<std::mutex> guard(incoming_lock);
+            if (incoming.emplace(id, in).second) break;
+        }
+        if (tries == 20) status = TRANSFER_REFUSED;
+        else usleep(50000);
+    }
+    bool registered = status == TRANSFER_OK;
+    if (status == TRANSFER_OK && !open_part(in.get())) {
+        fprintf(stderr, "transfer: cannot open %s: %s\n", in->part_path.c_str(), strerror(errno));
+        status = TRANSFER_FAILED;
+    }
+
+    std::vector<uint8_t> answer(status == TRANSFER_OK ? 1 + in->chunks : 1);
+    answer[0] = status;
+    if (status == TRANSFER_OK) {
+        std::copy(in->have.begin(), in->have.end(), answer.begin() + 1);
+        stat_chunks_resumed.fetch_add(in->verified, std::memory_order_relaxed);
+    }
+
+    // The sender's finish byte comes once every chunk is acked; a broken
+    // connection leaves the part file for the next attempt
+    uint8_t finish;
+    bool ok = false;
+    if (send_all(sock, answer.data(), answer.size()) && status == TRANSFER_OK && recv_all(sock, &finish, 1)) {
+        bool complete;
+        {
+            std::lock_guard<std::mutex> guard(in->lock);
+            complete = in->verified == in->chunks;
+        }
+        std::string placed;
+        status = TRANSFER_FAILED;
+        if (complete && fdatasync(in->fd) == 0 && move_into_place(in->part_path, in->final_path, &placed)) {
+            unlink(in->state_path.c_str());
+            status = TRANSFER_OK;
+            ok = true;
+        }
+        send_all(sock, &status, 1);
+    }
+
+    if (registered) {
+        std::lock_guard<std::mutex> guard(incoming_lock);
+        incoming.erase(id);
+    }
+    if (ok) stat_receives_completed.fetch_add(1, std::memory_order_relaxed);
+    else if (status != TRANSFER_OK || registered) stat_failed.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Socket to file through a pipe: the data moves between kernel buffers
+// and never reaches user space
+static bool splice_chunk(int sock, int pipe_fds[2], int fd, uint64_t offset, size_t len) {
+    loff_t out = offset;
+    while (len > 0) {
+        ssize_t n = splice(sock, NULL, pipe_fds[1], NULL, std::min<size_t>(len, PIPE_SIZE),
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        len -= n;
+        while (n > 0) {
+            ssize_t m = splice(pipe_fds[0], NULL, fd, &out, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return false;
+            n -= m;
+        }
+    }
+    return true;
+}
+
+static void handle_data(int sock, uint64_t id) {
+    std::shared_ptr<Incoming> in;
+    {
+        std::lock_guard<std::mutex> guard(incoming_lock);
+        auto it = incoming.find(id);
+        if (it == incoming.end()) return;
+        in = it->second;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) return;
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    uint8_t header[TRANSFER_CHUNK_HEADER_SIZE];
+    while (recv_all(sock, header, sizeof(header))) {
+        uint32_t index = get32(header);
+        size_t len = get32(header + 4);
+        uint64_t hash = get64(header + 8);
+        if (index >= in->chunks || len != chunk_length(in->size, in->chunk_size, index)) break;
+
+        uint64_t offset = (uint64_t)index * in->chunk_size;
+        if (!splice_chunk(sock, pipe_fds, in->fd, offset, len)) break;
+        stat_bytes_received.fetch_add(len, std::memory_order_relaxed);
+
+        // On disk before the state file says so, then out of the page
+        // cache, so a multi-GB file does not push everything else out
+        uint8_t status = TRANSFER_OK;
+        uint64_t actual;
+        if (sync_file_range(in->fd, offset, len,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0 ||
+            !hash_range(in->fd, offset, len, &actual)) {
+            status = TRANSFER_FAILED;
+        } else if (actual != hash) {
+            status = TRANSFER_BAD_HASH;
+            stat_hash_failures.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            std::lock_guard<std::mutex> guard(in->lock);
+            if (!in->have[index]) {
+                uint8_t one = 1;
+                if (pwrite(in->state_fd, &one, 1, STATE_HEADER_SIZE + index) != 1) {
+                    status = TRANSFER_FAILED;
+                } else {
+                    in->have[index] = 1;
+                    in->verified++;
+                }
+            }
+        }
+        posix_fadvise(in->fd, offset, len, POSIX_FADV_DONTNEED);
+        if (status == TRANSFER_OK) stat_chunks_received.fetch_add(1, std::memory_order_relaxed);
+
+        uint8_t ack[TRANSFER_ACK_SIZE];
+        put32(ack, index);
+        ack[4] = status;
+        if (!send_all(sock, ack, sizeof(ack)) || status == TRANSFER_FAILED) break;
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+static void handle_connection(int sock, const struct sockaddr_in &from) {
+    struct timeval timeout = {HELLO_TIMEOUT_SEC, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint8_t hello[TRANSFER_HELLO_SIZE];
+    bool ok = recv_all(sock, hello, sizeof(hello)) && hello[0] == 'P' && hello[1] == 'F' &&
+              hello[2] == TRANSFER_VERSION;
+
+    // Chunks and the finish byte may be a long time coming
+    timeout.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (ok && hello[3] == TRANSFER_CONTROL) handle_control(sock, &from, get64(hello + 4));
+    else if (ok && hello[3] == TRANSFER_DATA) handle_data(sock, get64(hello + 4));
+    close_socket(sock);
+}
+
+static void listen_loop() {
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return;
+        }
+        if (fds[1].revents) return;
+        if (!(fds[0].revents & POLLIN)) continue;
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int sock = accept4(listen_fd, (struct sockaddr *)&from, &from_len, SOCK_CLOEXEC);
+        if (sock < 0) continue;
+        if (admit_fn != NULL && !admit_fn(&from, admit_user_data)) {
+            close(sock);
+            continue;
+        }
+        if (!track_socket(sock) || !spawn([sock, from] { handle_connection(sock, from); })) close_socket(sock);
+    }
+}
+
+bool transfer_listen(int port, const char *dir, transfer_admit admit, void *admit_user) {
+    if (listen_fd != -1) return true;
+    {
+        std::lock_guard<std::mutex> guard(threads_lock);
+        stopping = false;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (listen_fd < 0 || stop_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 16) < 0) {
+        perror("transfer listen");
+        if (listen_fd != -1) close(listen_fd);
+        if (stop_fd != -1) close(stop_fd);
+        listen_fd = stop_fd = -1;
+        return false;
+    }
+
+    receive_dir = dir;
+    admit_fn = admit;
+    admit_user_data = admit_user;
+    listen_thread = std::thread(listen_loop);
+    return true;
+}
+
+// Send side
+
+struct Outgoing {
+    uint64_t id;                       // on the wire, the same for every receiver
+    uint64_t handle;                   // this send: the id and the receiver
+    struct sockaddr_in to;
+    std::string name;
+    int fd = -1;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint32_t chunks;
+    int streams;
+    transfer_done done;
+    void *user;
+
+    std::atomic<bool> failed{false};
+    std::atomic<uint64_t> acked{0};
+
+    std::mutex lock;                   // covers the work queue and the sockets
+    std::condition_variable changed;
+    std::deque<uint32_t> todo;
+    std::vector<uint8_t> retries;
+    uint32_t in_flight = 0;
+    std::vector<int> sockets;
+
+    ~Outgoing() {
+        if (fd != -1) close(fd);
+    }
+};
+
+static std::mutex outgoing_lock;
+static std::unordered_map<uint64_t, std::shared_ptr<Outgoing>> outgoing;
+
+static int connect_to(Outgoing *out, uint8_t kind) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (!track_socket(sock)) {
+        close(sock);
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> guard(out->lock);
+        out->sockets.push_back(sock);
+    }
+    uint8_t hello[TRANSFER_HELLO_SIZE];
+    put_hello(hello, kind, out->id);
+    if (out->failed.load() || connect(sock, (struct sockaddr *)&out->to, sizeof(out->to)) < 0 ||
+        !send_all(sock, hello, sizeof(hello), kind == TRANSFER_DATA ? MSG_MORE : 0)) {
+        return -1;   // closed with the others when the transfer ends
+    }
+    return sock;
+}
+
+static void fail(Outgoing *out) {
+    std::lock_guard<std::mutex> guard(out->lock);
+    out->failed.store(true);
+    for (int sock : out->sockets) shutdown(sock, SHUT_RDWR);
+    out->changed.notify_all();
+}
+
+// Next chunk to send, or false once there is nothing left for this stream
+static bool next_chunk(Outgoing *out, uint32_t *index) {
+    std::unique_lock<std::mutex> guard(out->lock);
+    out->changed.wait(guard, [out] { return out->failed.load() || !out->todo.empty() || out->in_flight == 0; });
+    if (out->failed.load() || out->todo.empty()) return false;
+    *index = out->todo.front();
+    out->todo.pop_front();
+    out->in_flight++;
+    return true;
+}
+
+static bool send_chunk(Outgoing *out, int sock, uint32_t index) {
+    uint64_t offset = (uint64_t)index * out->chunk_size;
+    size_t len = chunk_length(out->size, out->chunk_size, index);
+
+    uint8_t header[TRANSFER_CHUNK_HEADER_SIZE];
+    uint64_t hash;
+    if (!hash_range(out->fd, offset, len, &hash)) return false;
+    put32(header, index);
+    put32(header + 4, len);
+    put64(header + 8, hash);
+    if (!send_all(sock, header, sizeof(header), MSG_MORE)) return false;
+
+    // Straight from the page cache the hash just warmed
+    off_t pos = offset;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = sendfile(sock, out->fd, &pos, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        left -= n;
+    }
+    stat_bytes_sent.fetch_add(len, std::memory_order_relaxed);
+    stat_chunks_sent.fetch_add(1, std::memory_order_relaxed);
+
+    uint8_t ack[TRANSFER_ACK_SIZE];
+    if (!recv_all(sock, ack, sizeof(ack)) || get32(ack) != index) return false;
+
+    std::lock_guard<std::mutex> guard(out->lock);
+    out->in_flight--;
+    if (ack[4] == TRANSFER_OK) {
+        out->acked.fetch_add(len);
+    } else if (ack[4] == TRANSFER_BAD_HASH && ++out->retries[index] <= TRANSFER_MAX_RETRIES) {
+        out->todo.push_back(index);
+        stat_chunks_resent.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        return false;
+    }
+    out->changed.notify_all();
+    return true;
+}
+
+static void run_stream(Outgoing *out) {
+    block_sigpipe();
+    int sock = connect_to(out, TRANSFER_DATA);
+    uint32_t index;
+    while (sock >= 0 && next_chunk(out, &index)) {
+        if (!send_chunk(out, sock, index)) {
+            fail(out);
+            return;
+        }
+    }
+    if (sock < 0) fail(out);
+}
+
+static bool run_send(Outgoing *out) {
+    int control = connect_to(out, TRANSFER_CONTROL);
+    if (control < 0) return false;
+
+    std::vector<uint8_t> offer(14 + out->name.size());
+    put64(&offer[0], out->size);
+    put32(&offer[8], out->chunk_size);
+    put16(&offer[12], out->name.size());
+    memcpy(&offer[14], out->name.data(), out->name.size());
+
+    std::vector<uint8_t> have(out->chunks);
+    uint8_t status;
+    if (!send_all(control, offer.data(), offer.size()) || !recv_all(control, &status, 1) ||
+        status != TRANSFER_OK || !recv_all(control, have.data(), have.size())) {
+        return false;
+    }
+
+    uint32_t resumed = 0;
+    for (uint32_t i = 0; i < out->chunks; i++) {
+        if (have[i]) {
+            out->acked.fetch_add(chunk_length(out->size, out->chunk_size, i));
+            resumed++;
+        } else {
+            out->todo.push_back(i);
+        }
+    }
+    stat_chunks_resumed.fetch_add(resumed, std::memory_order_relaxed);
+
+    int streams = (int)std::min<size_t>(out->streams, out->todo.size());
+    std::vector<std::thread> threads;
+    for (int i = 0; i < streams; i++) threads.emplace_back(run_stream, out);
+    for (std::thread &t : threads) t.join();
+
+    uint8_t finish = 1;
+    return !out->failed.load() && out->acked.load() == out->size && send_all(control, &finish, 1) &&
+           recv_all(control, &status, 1) && status == TRANSFER_OK;
+}
+
+uint64_t transfer_send(const char *ip, int port, const char *path, int streams, transfer_done done, void *user) {
+    auto out = std::make_shared<Outgoing>();
+    memset(&out->to, 0, sizeof(out->to));
+    out->to.sin_family = AF_INET;
+    out->to.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &out->to.sin_addr) != 1) return 0;
+
+    out->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (out->fd < 0 || fstat(out->fd, &st) < 0 || !S_ISREG(st.st_mode)) return 0;
+
+    const char *slash = strrchr(path, '/');
+    out->name = slash ? slash + 1 : path;
+    if (!valid_name(out->name)) return 0;
+    out->size = st.st_size;
+    out->chunk_size = TRANSFER_CHUNK;
+    out->chunks = chunk_count(out->size, out->chunk_size);
+    out->streams = std::max(1, std::min(streams, TRANSFER_MAX_STREAMS));
+    out->retries.assign(out->chunks, 0);
+    out->done = done;
+    out->user = user;
+    posix_fadvise(out->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // The same file, unchanged, gets the same id and so resumes
+    struct {
+        uint64_t size, inode, mtime_ns;
+    } identity = {(uint64_t)st.st_size, (uint64_t)st.st_ino,
+                  (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec};
+    out->id = transfer_hash(&identity, sizeof(identity), transfer_hash(out->name.data(), out->name.size()));
+    out->handle = transfer_hash(&out->to, sizeof(out->to), out->id);
+    if (out->handle == 0) out->handle = 1;
+
+    {
+        std::lock_guard<std::mutex> guard(outgoing_lock);
+        if (!outgoing.emplace(out->handle, out).second) return 0;   // already on its way there
+    }
+
+    bool started = spawn([out] {
+        bool ok = run_send(out.get());
+        {
+            std::lock_guard<std::mutex> guard(out->lock);
+            for (int sock : out->sockets) close_socket(sock);
+            out->sockets.clear();
+        }
+        {
+            std::lock_guard<std::mutex> guard(outgoing_lock);
+            outgoing.erase(out->handle);
+        }
+        if (ok) stat_sends_completed.fetch_add(1, std::memory_order_relaxed);
+        else stat_failed.fetch_add(1, std::memory_order_relaxed);
+        if (out->done) out->done(out->handle, ok, out->user);
+    });
+    if (!started) {
+        std::lock_guard<std::mutex> guard(outgoing_lock);
+        outgoing.erase(out->handle);
+        return 0;
+    }
+    return out->handle;
+}
+
+void transfer_cancel(uint64_t id) {
+    std::shared_ptr<Outgoing> out;
+    {
+        std::lock_guard<std::mutex> guard(outgoing_lock);
+        auto it = outgoing.find(id);
+        if (it == outgoing.end()) return;
+        out = it->second;
+    }
+    fail(out.get());
+}
+
+bool transfer_progress(uint64_t id, uint64_t *done, uint64_t *size) {
+    std::lock_guard<std::mutex> guard(outgoing_lock);
+    auto it = outgoing.find(id);
+    if (it == outgoing.end()) return false;
+    *done = it->second->acked.load();
+    *size = it->second->size;
+    return true;
+}
+
+void transfer_stop() {
+    if (listen_thread.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0) perror("transfer stop");
+        listen_thread.join();
+    }
+    if (listen_fd != -1) close(listen_fd);
+    if (stop_fd != -1) close(stop_fd);
+    listen_fd = stop_fd = -1;
+
+    {
+        std::lock_guard<std::mutex> guard(outgoing_lock);
+        for (auto &entry : outgoing) {
+            Outgoing *out = entry.second.get();
+            std::lock_guard<std::mutex> out_guard(out->lock);
+            out->failed.store(true);
+            out->changed.notify_all();
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(threads_lock);
+    stopping = true;
+    for (int sock : open_sockets) shutdown(sock, SHUT_RDWR);
+    threads_done.wait(guard, [] { return active_threads == 0; });
+}
+
+void transfer_get_stats(TransferStats *stats) {
+    stats->bytes_sent = stat_bytes_sent.load(std::memory_order_relaxed);
+    stats->bytes_received = stat_bytes_received.load(std::memory_order_relaxed);
+    stats->chunks_sent = stat_chunks_sent.load(std::memory_order_relaxed);
+    stats->chunks_received = stat_chunks_received.load(std::memory_order_relaxed);
+    stats->chunks_resent = stat_chunks_resent.load(std::memory_order_relaxed);
+    stats->chunks_resumed = stat_chunks_resumed.load(std::memory_order_relaxed);
+    stats->hash_failures = stat_hash_failures.load(std::memory_order_relaxed);
+    stats->sends_completed = stat_sends_completed.load(std::memory_order_relaxed);
+    stats->receives_completed = stat_receives_completed.load(std::memory_order_relaxed);
+    stats->failed = stat_failed.load(std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> guard(outgoing_lock);
+        stats->active = outgoing.size();
+    }
+    std::lock_guard<std::mutex> guard(incoming_lock);
+    stats->active += incoming.size();
+}
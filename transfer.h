@@ -0,0 +1,100 @@
+#ifndef PUTTYNET_TRANSFER_H
+#define PUTTYNET_TRANSFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// File transfer to a discovered peer over TCP, in fixed-size chunks spread
+// over several parallel streams. The file is never read into the heap: the
+// sender hashes each chunk through mmap and sends it with sendfile(), and
+// the receiver splices from the socket through a pipe into the file, then
+// checks the chunk's hash through mmap. A chunk that fails its hash is
+// sent again.
+//
+// The receiver writes .puttyNet-<sender ip>-<id>.part next to a .state
+// file with one byte per verified chunk, and renames it to the offered name
+// once complete, so offers of the same name never share a part file. A
+// transfer that breaks off resumes from the chunks already verified, as
+// long as the sender's file is unchanged: the transfer id is a hash of its
+// name, size, inode and mtime. Offers are taken only from hosts the admit
+// hook accepts and only if they fit in the free space.
+//
+// Every connection starts, big-endian:
+//
+//   0  magic 'P' 'F'     2 bytes
+//   2  version           1 byte
+//   3  kind              1 byte, TRANSFER_CONTROL or TRANSFER_DATA
+//   4  transfer id       8 bytes
+//
+// The control connection goes on with size (8), chunk size (4), name
+// length (2) and the name. The receiver answers with a status byte and,
+// when it accepts, one byte per chunk it already has. Data connections
+// then carry chunks: index (4), length (4), XXH64 of the data (8) and the
+// data, each answered with index (4) and a status byte. Once every chunk
+// is in, the sender writes one byte on the control connection and the
+// receiver answers with the final status as it renames the file into place.
+
+const uint8_t TRANSFER_VERSION = 1;
+const uint8_t TRANSFER_CONTROL = 0;
+const uint8_t TRANSFER_DATA = 1;
+
+const size_t TRANSFER_HELLO_SIZE = 12;
+const size_t TRANSFER_CHUNK_HEADER_SIZE = 16;
+const size_t TRANSFER_ACK_SIZE = 5;
+
+// Status bytes
+const uint8_t TRANSFER_OK = 0;
+const uint8_t TRANSFER_REFUSED = 1;      // bad name, size or chunk size
+const uint8_t TRANSFER_BAD_HASH = 2;
+const uint8_t TRANSFER_FAILED = 3;       // I/O error on the receiver
+
+const uint32_t TRANSFER_CHUNK = 4 << 20;
+const int TRANSFER_STREAMS = 4;
+const int TRANSFER_MAX_STREAMS = 16;
+const int TRANSFER_MAX_RETRIES = 3;      // per chunk, for bad hashes
+
+struct TransferStats {
+    uint64_t bytes_sent;          // chunk payload, resends included
+    uint64_t bytes_received;
+    uint64_t chunks_sent;
+    uint64_t chunks_received;
+    uint64_t chunks_resent;       // after a bad hash
+    uint64_t chunks_resumed;      // already on the receiver from an earlier attempt
+    uint64_t hash_failures;       // receive side
+    uint64_t sends_completed;
+    uint64_t receives_completed;
+    uint64_t failed;
+    size_t active;                // transfers in flight, both directions
+};
+
+// Called on the transfer's own thread when it finishes
+typedef void (*transfer_done)(uint64_t id, bool ok, void *user);
+
+// Whether to take connections from addr; Core accepts discovered peers
+typedef bool (*transfer_admit)(const struct sockaddr_in *addr, void *user);
+
+// Accept files into dir on port, from every host without admit
+bool transfer_listen(int port, const char *dir, transfer_admit admit = NULL, void *admit_user = NULL);
+
+// Send path to ip:port. Returns an id for this send, or 0 if the file cannot
+// be opened or is already on its way there; the rest happens on the
+// transfer's threads.
+uint64_t transfer_send(const char *ip, int port, const char *path, int streams = TRANSFER_STREAMS,
+                       transfer_done done = NULL, void *user = NULL);
+
+// Break off a send; the receiver keeps what it has verified
+void transfer_cancel(uint64_t id);
+
+// Bytes of an outgoing transfer acknowledged so far, false once it is gone
+bool transfer_progress(uint64_t id, uint64_t *done, uint64_t *size);
+
+// Cancel sends, close the listener and join every thread
+void transfer_stop();
+
+void transfer_get_stats(TransferStats *stats);
+
+// XXH64
+uint64_t transfer_hash(const void *data, size_t len, uint64_t seed = 0);
+
+#endif
@@ -0,0 +1,574 @@
+#include "voice.h"
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <string.h>
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/net/gstnetaddressmeta.h>
+
+#include "crypto.h"
+
+// RTP caps for the receive side; udpsrc cannot guess them. srtpdec hands
+// them on as application/x-rtp.
+static const char *VOICE_SRTP_CAPS =
+    "application/x-srtp,media=audio,clock-rate=48000,encoding-name=OPUS,payload=96";
+
+// srtpenc starts out passing plain RTP; voice_start() sets the cipher
+static const char *SRTP_PLAIN = "rtp-cipher=null rtp-auth=null rtcp-cipher=null rtcp-auth=null";
+
+static GstElement *send_pipeline = NULL;
+static GstElement *receive_pipeline = NULL;
+static GstElement *voice_out = NULL;      // udpsink
+static GstElement *voice_in = NULL;       // udpsrc
+static GstElement *jitter = NULL;         // rtpjitterbuffer
+static GstElement *send_session = NULL;   // rtpsession for the stream we send
+static GstElement *receive_session = NULL;
+static GstElement *send_rtcp = NULL;      // udpsink for sender reports
+static GstElement *receive_rtcp = NULL;   // udpsink for receiver reports
+static GstElement *encrypt = NULL;        // srtpenc, our stream and sender reports
+static GstElement *encrypt_reports = NULL; // srtpenc, our receiver reports
+static GstElement *decrypt = NULL;        // srtpdec, the peer's stream and sender reports
+static GstElement *decrypt_reports = NULL; // srtpdec, the peer's receiver reports
+static VoiceProfile profile;
+static guint adapt_timer = 0;
+
+// The peer we accept audio from, swapped by voice_start() and read on the
+// udpsrc streaming thread
+static std::mutex peer_lock;
+static GInetAddress *peer_addr = NULL;
+
+// SRTP keys, read on the srtpdec streaming threads. Everything a peer sends
+// is under the key it sent us for the call; a plain call takes none.
+struct SrtpKey {
+    uint8_t master[SRTP_MASTER_SIZE];
+};
+static std::mutex key_lock;
+static bool secure_call = false;
+static std::string call_host;
+static std::unordered_map<std::string, SrtpKey> receive_keys;   // host -> its send key
+
+// Setup timing: voice_start() stores its start time, the first packet into
+// udpsink after it takes the time back and records the difference
+static std::atomic<gint64> setup_start_us(0);
+static std::mutex stats_lock;
+static VoiceStats stats;
+static double total_setup_ms = 0;
+static double rtt_ms = 0;
+
+// Jitter buffer control, all under stats_lock. Jitter is kept in RTP clock
+// units (48 kHz) as RFC 3550 does.
+const double RTP_CLOCK_KHZ = 48;
+const int ADAPT_INTERVAL_MS = 250;
+const int SHRINK_AFTER = 8;               // quiet intervals before shrinking, 2 s
+const int SAMPLE_EVERY = 4;               // intervals between call quality samples, 1 s
+static int intervals = 0;
+static bool have_transit = false;
+static uint32_t last_transit = 0;
+static double jitter_ticks = 0;
+static uint64_t last_late = 0;
+static int quiet_intervals = 0;
+
+static GstPadProbeReturn on_outgoing(GstPad *, GstPadProbeInfo *, gpointer) {
+    gint64 start = setup_start_us.exchange(0);
+    if (start == 0) return GST_PAD_PROBE_OK;
+
+    double ms = (g_get_monotonic_time() - start) / 1000.0;
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats.calls++;
+    stats.last_setup_ms = ms;
+    total_setup_ms += ms;
+    stats.avg_setup_ms = total_setup_ms / stats.calls;
+    if (ms > stats.max_setup_ms) stats.max_setup_ms = ms;
+    if (ms > VOICE_SETUP_GOAL_MS) g_message("Voice call setup took %.1f ms", ms);
+    return GST_PAD_PROBE_OK;
+}
+
+// RFC 3550 section 6.4.1: the smoothed difference in transit time between
+// consecutive packets. Arrival time is converted to RTP clock units so the
+// unknown offset between the two clocks cancels out.
+static void track_jitter(GstBuffer *buffer) {
+    uint8_t header[8];
+    if (gst_buffer_extract(buffer, 0, header, sizeof(header)) != sizeof(header)) return;
+    uint32_t timestamp = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+    uint32_t arrival = (uint32_t)(g_get_monotonic_time() * RTP_CLOCK_KHZ / 1000);
+    uint32_t transit = arrival - timestamp;
+
+    std::lock_guard<std::mutex> guard(stats_lock);
+    if (have_transit) {
+        double d = fabs((double)(int32_t)(transit - last_transit));
+        jitter_ticks += (d - jitter_ticks) / 16;
+    }
+    last_transit = transit;
+    have_transit = true;
+}
+
+// Late packets from the previous peer must not play into the new call
+static GstPadProbeReturn on_incoming(GstPad *, GstPadProbeInfo *info, gpointer) {
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    GstNetAddressMeta *meta = gst_buffer_get_net_address_meta(buffer);
+    if (meta == NULL || !G_IS_INET_SOCKET_ADDRESS(meta->addr)) return GST_PAD_PROBE_OK;
+
+    GInetAddress *from = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(meta->addr));
+    {
+        std::lock_guard<std::mutex> guard(peer_lock);
+        if (peer_addr != NULL && g_inet_address_equal(from, peer_addr)) {
+            track_jitter(buffer);
+            return GST_PAD_PROBE_OK;
+        }
+    }
+
+    std::lock_guard<std::mutex> stats_guard(stats_lock);
+    stats.foreign++;
+    return GST_PAD_PROBE_DROP;
+}
+
+static GstCaps *srtp_caps(const char *cipher, const SrtpKey *key) {
+    GstCaps *caps = gst_caps_new_simple("application/x-srtp", "srtp-cipher", G_TYPE_STRING, cipher,
+                                        "srtp-auth", G_TYPE_STRING, "null", "srtcp-cipher", G_TYPE_STRING, cipher,
+                                        "srtcp-auth", G_TYPE_STRING, "null", NULL);
+    if (key != NULL) {
+        GstBuffer *buffer = gst_buffer_new_allocate(NULL, sizeof(key->master), NULL);
+        gst_buffer_fill(buffer, 0, key->master, sizeof(key->master));
+        gst_caps_set_simple(caps, "srtp-key", GST_TYPE_BUFFER, buffer, NULL);
+        gst_buffer_unref(buffer);
+    }
+    return caps;
+}
+
+// srtpdec asks when a stream's first packet arrives and again after
+// clear-keys. Without the peer's key yet its packets are dropped.
+static GstCaps *on_request_key(GstElement *, guint, gpointer) {
+    std::lock_guard<std::mutex> guard(key_lock);
+    if (!secure_call) return srtp_caps("null", NULL);
+    auto it = receive_keys.find(call_host);
+    return it != receive_keys.end() ? srtp_caps("aes-256-gcm", &it->second) : NULL;
+}
+
+// GCM authenticates by itself, so the auth settings stay null
+static void set_send_key(GstElement *encrypter, const uint8_t *master) {
+    const char *cipher = master ? "aes-256-gcm" : "null";
+    gst_util_set_object_arg(G_OBJECT(encrypter), "rtp-cipher", cipher);
+    gst_util_set_object_arg(G_OBJECT(encrypter), "rtcp-cipher", cipher);
+    if (master == NULL) return;
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, SRTP_MASTER_SIZE, NULL);
+    gst_buffer_fill(buffer, 0, master, SRTP_MASTER_SIZE);
+    g_object_set(encrypter, "key", buffer, NULL);
+    gst_buffer_unref(buffer);
+}
+
+static void forget_receive_keys() {
+    if (decrypt) g_signal_emit_by_name(decrypt, "clear-keys");
+    if (decrypt_reports) g_signal_emit_by_name(decrypt_reports, "clear-keys");
+}
+
+static double query_latency_ms(GstQuery *query, bool answered) {
+    GstClockTime min = 0;
+    gboolean live = FALSE;
+    if (answered) gst_query_parse_latency(query, &live, &min, NULL);
+    gst_query_unref(query);
+    return answered && GST_CLOCK_TIME_IS_VALID(min) ? min / 1e6 : 0;
+}
+
+static GstStructure *session_stats(GstElement *session) {
+    GObject *internal = NULL;
+    GstStructure *result = NULL;
+    g_object_get(session, "internal-session", &internal, NULL);
+    if (internal == NULL) return NULL;
+    g_object_get(internal, "stats", &result, NULL);
+    g_object_unref(internal);
+    return result;
+}
+
+// Each source in a session's stats, ours and the peer's
+template <typename F>
+static void for_each_source(GstStructure *session, F visit) {
+    const GValue *value = session ? gst_structure_get_value(session, "source-stats") : NULL;
+    if (value == NULL || !G_VALUE_HOLDS_BOXED(value)) return;
+    GValueArray *sources = (GValueArray *)g_value_get_boxed(value);
+    for (guint i = 0; sources && i < sources->n_values; i++) {
+        const GstStructure *source = gst_value_get_structure(&sources->values[i]);
+        if (source) visit(source);
+    }
+}
+
+static bool flag(const GstStructure *source, const char *name) {
+    gboolean value = FALSE;
+    return gst_structure_get_boolean(source, name, &value) && value;
+}
+
+// What the receive session knows about the peer's stream and what the
+// peer's receiver reports say about ours
+static void sample_rtcp(guint64 concealed) {
+    uint64_t received = 0, receive_bps = 0, send_bps = 0;
+    int64_t lost = 0;
+    double rtt = 0, peer_loss = -1;
+
+    GstStructure *incoming = session_stats(receive_session);
+    for_each_source(incoming, [&](const GstStructure *source) {
+        if (flag(source, "internal") || !flag(source, "is-sender")) return;
+        guint64 packets = 0, bitrate = 0;
+        gint packets_lost = 0;
+        gst_structure_get_uint64(source, "packets-received", &packets);
+        gst_structure_get_int(source, "packets-lost", &packets_lost);
+        gst_structure_get_uint64(source, "bitrate", &bitrate);
+        received += packets;
+        lost += packets_lost;
+        receive_bps += bitrate;
+    });
+    if (incoming) gst_structure_free(incoming);
+
+    // Round trip comes from the LSR/DLSR echo in the peer's receiver reports
+    GstStructure *outgoing = session_stats(send_session);
+    for_each_source(outgoing, [&](const GstStructure *source) {
+        guint64 bitrate = 0;
+        guint round_trip = 0, fraction = 0;
+        if (flag(source, "internal")) {
+            if (gst_structure_get_uint64(source, "bitrate", &bitrate)) send_bps += bitrate;
+        } else if (flag(source, "have-rb")) {
+            if (gst_structure_get_uint(source, "rb-round-trip", &round_trip) && round_trip) {
+                rtt = round_trip * 1000.0 / 65536;
+            }
+            if (gst_structure_get_uint(source, "rb-fractionlost", &fraction)) peer_loss = fraction * 100.0 / 256;
+        }
+    });
+    if (outgoing) gst_structure_free(outgoing);
+
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats.packets_received = received;
+    stats.packets_lost = lost;
+    stats.receive_kbps = receive_bps / 1000.0;
+    stats.send_kbps = send_bps / 1000.0;
+    stats.concealed = concealed;
+    if (rtt > 0) stats.rtcp_rtt_ms = rtt;
+    if (peer_loss >= 0) stats.peer_loss_percent = peer_loss;
+}
+
+static int initial_jitter_ms() {
+    return std::min(profile.jitter_max_ms, profile.jitter_min_ms + 3 * profile.frame_us / 1000);
+}
+
+// Aim the jitter buffer at one frame plus four times the measured jitter.
+// Late packets mean the estimate is behind, so grow by two frames at once;
+// shrink only after SHRINK_AFTER quiet intervals, and then only halfway.
+static gboolean adapt_jitter(gpointer) {
+    if (jitter == NULL) return TRUE;
+
+    guint current = 0;
+    guint64 late = 0, lost = 0;
+    GstStructure *jitter_stats = NULL;
+    g_object_get(jitter, "latency", &current, "stats", &jitter_stats, NULL);
+    if (jitter_stats) {
+        gst_structure_get_uint64(jitter_stats, "num-late", &late);
+        gst_structure_get_uint64(jitter_stats, "num-lost", &lost);
+        gst_structure_free(jitter_stats);
+    }
+
+    double frame_ms = profile.frame_us / 1000.0;
+    guint next = current;
+    {
+        std::lock_guard<std::mutex> guard(stats_lock);
+        if (!stats.in_call) return TRUE;
+
+        stats.jitter_ms = jitter_ticks / RTP_CLOCK_KHZ;
+        double target = frame_ms + 4 * stats.jitter_ms;
+        if (late > last_late) target = std::max(target, current + 2 * frame_ms);
+        stats.late += late > last_late ? late - last_late : 0;
+        last_late = late;
+
+        guint wanted = (guint)std::min<double>(std::max<double>(ceil(target), profile.jitter_min_ms),
+                                               profile.jitter_max_ms);
+        if (wanted > current) {
+            next = wanted;
+            quiet_intervals = 0;
+        } else if (wanted + 2 < current && ++quiet_intervals >= SHRINK_AFTER) {
+            next = current - (current - wanted) / 2;
+            quiet_intervals = 0;
+        } else if (wanted + 2 >= current) {
+            quiet_intervals = 0;
+        }
+        stats.jitter_buffer_ms = next;
+    }
+    // Posts a LATENCY message; on_bus_message redistributes it
+    if (next != current) g_object_set(jitter, "latency", next, NULL);
+
+    // The send side ends in a sink that does not sync, so ask upstream of it
+    GstQuery *query = gst_query_new_latency();
+    GstPad *pad = gst_element_get_static_pad(voice_out, "sink");
+    double send_ms = query_latency_ms(query, gst_pad_peer_query(pad, query));
+    gst_object_unref(pad);
+    query = gst_query_new_latency();
+    double receive_ms = query_latency_ms(query, gst_element_query(receive_pipeline, query));
+
+    if (++intervals % SAMPLE_EVERY == 0) sample_rtcp(lost);
+
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats.send_latency_ms = send_ms;
+    stats.receive_latency_ms = receive_ms;
+    double rtt = stats.rtcp_rtt_ms > 0 ? stats.rtcp_rtt_ms : rtt_ms;
+    stats.mouth_to_ear_ms = send_ms + rtt / 2 + receive_ms;
+    return TRUE;
+}
+
+static gboolean on_bus_message(GstBus *, GstMessage *message, gpointer pipeline) {
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_LATENCY) {
+        gst_bin_recalculate_latency(GST_BIN(pipeline));
+    } else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        GError *error = NULL;
+        gchar *debug = NULL;
+        gst_message_parse_error(message, &error, &debug);
+        g_warning("Voice pipeline %s: %s", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), error->message);
+        g_error_free(error);
+        g_free(debug);
+    }
+    return TRUE;
+}
+
+static GstElement *build(const std::string &description) {
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error != NULL) {
+        g_warning("Failed to create voice pipeline: %s", error->message);
+        g_error_free(error);
+        if (pipeline) gst_object_unref(pipeline);
+        return NULL;
+    }
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_add_watch(bus, on_bus_message, pipeline);
+    gst_object_unref(bus);
+    return pipeline;
+}
+
+static void destroy(GstElement **pipeline) {
+    if (*pipeline == NULL) return;
+    gst_element_set_state(*pipeline, GST_STATE_NULL);
+    GstBus *bus = gst_element_get_bus(*pipeline);
+    gst_bus_remove_watch(bus);
+    gst_object_unref(bus);
+    gst_object_unref(*pipeline);
+    *pipeline = NULL;
+}
+
+// Wait out an asynchronous state change; live pipelines answer NO_PREROLL
+static bool settle(GstElement *pipeline, GstState state) {
+    GstStateChangeReturn ret = gst_element_set_state(pipeline, state);
+    if (ret == GST_STATE_CHANGE_ASYNC) {
+        ret = gst_element_get_state(pipeline, NULL, NULL, 2 * GST_SECOND);
+    }
+    return ret != GST_STATE_CHANGE_FAILURE;
+}
+
+// opusenc takes frame sizes and the low-delay mode as enum nicks
+static void configure_encoder(GstElement *encoder) {
+    std::string frame = profile.frame_us == 2500 ? "2.5" : std::to_string(profile.frame_us / 1000);
+    gst_util_set_object_arg(G_OBJECT(encoder), "frame-size", frame.c_str());
+    g_object_set(encoder, "inband-fec", (gboolean)profile.fec, "packet-loss-percentage", profile.expected_loss,
+                 "dtx", (gboolean)profile.dtx, NULL);
+    if (profile.low_delay) gst_util_set_object_arg(G_OBJECT(encoder), "audio-type", "restricted-lowdelay");
+}
+
+bool voice_init(int port, const VoiceProfile &chosen, const char *source, const char *sink) {
+    if (send_pipeline != NULL) return true;
+    gint64 start = g_get_monotonic_time();
+    profile = chosen;
+
+    // udpsinks must not wait for preroll or PAUSED would never complete.
+    // drop-on-latency keeps a shrinking jitter buffer from holding on to
+    // audio that is already too old; do-lost tells the decoder to conceal.
+    // RTCP goes nowhere (port 9) until voice_start() names the peer.
+    // Both directions of RTP and RTCP pass through SRTP, plain until a
+    // call brings keys.
+    std::string rtcp_port = std::to_string(port + VOICE_RTCP_OFFSET);
+    std::string report_port = std::to_string(port + VOICE_RTCP_OFFSET + 1);
+    send_pipeline = build(
+        "rtpsession name=send_session srtpenc name=encrypt " + std::string(SRTP_PLAIN) + " "
+        "srtpdec name=decrypt_reports "
+        + std::string(source) + " ! audioconvert ! audioresample ! opusenc name=encoder ! rtpopuspay ! "
+        "send_session.send_rtp_sink "
+        "send_session.send_rtp_src ! encrypt.rtp_sink_0 "
+        "encrypt.rtp_src_0 ! udpsink name=voice_out host=127.0.0.1 port=9 sync=false async=false "
+        "send_session.send_rtcp_src ! encrypt.rtcp_sink_0 "
+        "encrypt.rtcp_src_0 ! udpsink name=send_rtcp host=127.0.0.1 port=9 sync=false async=false "
+        "udpsrc port=" + report_port + " caps=application/x-srtcp ! decrypt_reports.rtcp_sink "
+        "decrypt_reports.rtcp_src ! send_session.recv_rtcp_sink");
+    receive_pipeline = build(
+        "rtpsession name=receive_session srtpdec name=decrypt "
+        "srtpenc name=encrypt_reports " + std::string(SRTP_PLAIN) + " "
+        "udpsrc name=voice_in port=" + std::to_string(port) + " caps=\"" + VOICE_SRTP_CAPS + "\" ! "
+        "decrypt.rtp_sink decrypt.rtp_src ! receive_session.recv_rtp_sink "
+        "receive_session.recv_rtp_src ! "
+        "rtpjitterbuffer name=jitter drop-on-latency=true do-lost=true latency=" +
+        std::to_string(initial_jitter_ms()) + " ! "
+        "rtpopusdepay ! opusdec plc=true use-inband-fec=" + (profile.fec ? "true" : "false") + " ! "
+        "audioconvert ! audioresample ! " + sink + " "
+        "udpsrc port=" + rtcp_port + " caps=application/x-srtcp ! decrypt.rtcp_sink "
+        "decrypt.rtcp_src ! receive_session.recv_rtcp_sink "
+        "receive_session.send_rtcp_src ! encrypt_reports.rtcp_sink_0 "
+        "encrypt_reports.rtcp_src_0 ! udpsink name=receive_rtcp host=127.0.0.1 port=9 sync=false async=false");
+    if (send_pipeline == NULL || receive_pipeline == NULL) {
+        voice_shutdown();
+        return false;
+    }
+
+    voice_out = gst_bin_get_by_name(GST_BIN(send_pipeline), "voice_out");
+    voice_in = gst_bin_get_by_name(GST_BIN(receive_pipeline), "voice_in");
+    jitter = gst_bin_get_by_name(GST_BIN(receive_pipeline), "jitter");
+    send_session = gst_bin_get_by_name(GST_BIN(send_pipeline), "send_session");
+    receive_session = gst_bin_get_by_name(GST_BIN(receive_pipeline), "receive_session");
+    send_rtcp = gst_bin_get_by_name(GST_BIN(send_pipeline), "send_rtcp");
+    receive_rtcp = gst_bin_get_by_name(GST_BIN(receive_pipeline), "receive_rtcp");
+    encrypt = gst_bin_get_by_name(GST_BIN(send_pipeline), "encrypt");
+    encrypt_reports = gst_bin_get_by_name(GST_BIN(receive_pipeline), "encrypt_reports");
+    decrypt = gst_bin_get_by_name(GST_BIN(receive_pipeline), "decrypt");
+    decrypt_reports = gst_bin_get_by_name(GST_BIN(send_pipeline), "decrypt_reports");
+    g_signal_connect(decrypt, "request-key", G_CALLBACK(on_request_key), NULL);
+    g_signal_connect(decrypt_reports, "request-key", G_CALLBACK(on_request_key), NULL);
+    GstElement *encoder = gst_bin_get_by_name(GST_BIN(send_pipeline), "encoder");
+    configure_encoder(encoder);
+    gst_object_unref(encoder);
+
+    GstPad *pad = gst_element_get_static_pad(voice_out, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_outgoing, NULL, NULL);
+    gst_object_unref(pad);
+    pad = gst_element_get_static_pad(voice_in, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_incoming, NULL, NULL);
+    gst_object_unref(pad);
+
+    // PAUSED opens the devices and links everything, but live sources
+    // produce nothing until PLAYING
+    if (!settle(send_pipeline, GST_STATE_PAUSED) || !settle(receive_pipeline, GST_STATE_PAUSED)) {
+        g_warning("Voice pipelines failed to reach PAUSED");
+        voice_shutdown();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats = VoiceStats();
+    total_setup_ms = 0;
+    last_late = 0;
+    intervals = 0;
+    stats.warmup_ms = (g_get_monotonic_time() - start) / 1000.0;
+    stats.jitter_buffer_ms = initial_jitter_ms();
+    return true;
+}
+
+bool voice_start(const char *host, int port, const uint8_t *send_key) {
+    if (send_pipeline == NULL) return false;
+
+    GInetAddress *addr = g_inet_address_new_from_string(host);
+    if (addr == NULL) return false;
+    {
+        std::lock_guard<std::mutex> guard(peer_lock);
+        if (peer_addr) g_object_unref(peer_addr);
+        peer_addr = addr;
+    }
+
+    // A new key restarts srtpenc's session, and with it the rollover count
+    set_send_key(encrypt, send_key);
+    set_send_key(encrypt_reports, send_key);
+    {
+        std::lock_guard<std::mutex> guard(key_lock);
+        secure_call = send_key != NULL;
+        call_host = host;
+    }
+    forget_receive_keys();
+
+    setup_start_us.store(g_get_monotonic_time());
+    g_object_set(voice_out, "host", host, "port", port, NULL);
+    g_object_set(send_rtcp, "host", host, "port", port + VOICE_RTCP_OFFSET, NULL);
+    g_object_set(receive_rtcp, "host", host, "port", port + VOICE_RTCP_OFFSET + 1, NULL);
+
+    // A new peer is a new network path; measure it from scratch
+    {
+        std::lock_guard<std::mutex> guard(stats_lock);
+        have_transit = false;
+        jitter_ticks = 0;
+        quiet_intervals = 0;
+        stats.jitter_buffer_ms = initial_jitter_ms();
+    }
+    g_object_set(jitter, "latency", (guint)initial_jitter_ms(), NULL);
+
+    // A no-op when switching peers mid-call; the jitter buffer is only
+    // adapted while there is a call, so a warm chain takes no wakeups
+    gst_element_set_state(receive_pipeline, GST_STATE_PLAYING);
+    gst_element_set_state(send_pipeline, GST_STATE_PLAYING);
+    if (adapt_timer == 0) adapt_timer = g_timeout_add(ADAPT_INTERVAL_MS, adapt_jitter, NULL);
+
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats.in_call = true;
+    return true;
+}
+
+void voice_set_receive_key(const char *host, const uint8_t *key) {
+    bool current;
+    {
+        std::lock_guard<std::mutex> guard(key_lock);
+        memcpy(receive_keys[host].master, key, SRTP_MASTER_SIZE);
+        current = call_host == host;
+    }
+    if (current) forget_receive_keys();
+}
+
+bool voice_get_receive_key(const char *host, uint8_t *key) {
+    std::lock_guard<std::mutex> guard(key_lock);
+    auto it = receive_keys.find(host);
+    if (it == receive_keys.end()) return false;
+    memcpy(key, it->second.master, SRTP_MASTER_SIZE);
+    return true;
+}
+
+void voice_stop() {
+    if (send_pipeline == NULL) return;
+    if (adapt_timer) g_source_remove(adapt_timer);
+    adapt_timer = 0;
+    gst_element_set_state(send_pipeline, GST_STATE_PAUSED);
+    gst_element_set_state(receive_pipeline, GST_STATE_PAUSED);
+    setup_start_us.store(0);
+
+    {
+        std::lock_guard<std::mutex> guard(peer_lock);
+        if (peer_addr) g_object_unref(peer_addr);
+        peer_addr = NULL;
+    }
+    std::lock_guard<std::mutex> guard(stats_lock);
+    stats.in_call = false;
+}
+
+void voice_shutdown() {
+    if (adapt_timer) g_source_remove(adapt_timer);
+    adapt_timer = 0;
+    destroy(&send_pipeline);
+    destroy(&receive_pipeline);
+    GstElement **elements[] = {&voice_out, &voice_in, &jitter, &send_session, &receive_session,
+                               &send_rtcp, &receive_rtcp, &encrypt, &encrypt_reports, &decrypt,
+                               &decrypt_reports};
+    for (GstElement **element : elements) {
+        if (*element) gst_object_unref(*element);
+        *element = NULL;
+    }
+
+    std::lock_guard<std::mutex> guard(peer_lock);
+    if (peer_addr) g_object_unref(peer_addr);
+    peer_addr = NULL;
+}
+
+void voice_get_stats(VoiceStats *out) {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    *out = stats;
+}
+
+void voice_set_rtt(double ms) {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    rtt_ms = ms;
+}
+
+GstElement *voice_get_element(const char *name) {
+    GstElement *element = NULL;
+    if (send_pipeline) element = gst_bin_get_by_name(GST_BIN(send_pipeline), name);
+    if (element == NULL && receive_pipeline) element = gst_bin_get_by_name(GST_BIN(receive_pipeline), name);
+    return element;
+}
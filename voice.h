@@ -0,0 +1,109 @@
+#ifndef PUTTYNET_VOICE_H
+#define PUTTYNET_VOICE_H
+
+#include <stdint.h>
+#include <gst/gst.h>
+
+// Voice calls as Opus over RTP. The capture/encode chain and the
+// decode/playback chain are built once by voice_init() and parked in
+// PAUSED with the audio devices open. A call only points the chains at the
+// peer and sets them PLAYING; switching peers mid-call only retargets them.
+//
+// The jitter buffer adapts during a call: it follows the RFC 3550 jitter of
+// the incoming stream, grows at once when packets arrive late and shrinks
+// back slowly once the network settles.
+//
+// Each direction is its own RTP session with RTCP, so both ends learn loss,
+// jitter and round trip from sender and receiver reports. Call quality is
+// sampled from the sessions and the jitter buffer once a second.
+//
+// Both directions, RTP and RTCP, go through SRTP with AES-256-GCM under
+// master keys of SRTP_MASTER_SIZE bytes (crypto.h): each end sends under
+// a key of its own choosing, which the other learns with
+// voice_set_receive_key(). A call started without a key is plain RTP.
+
+// Opus framing and jitter buffer bounds. In-band FEC lives in the SILK
+// layer, so it needs frames of 10 ms or more and no low_delay.
+struct VoiceProfile {
+    int frame_us;            // 2500, 5000, 10000 or 20000
+    bool fec;                // in-band FEC, sized for expected_loss
+    int expected_loss;       // percent
+    bool dtx;
+    bool low_delay;          // CELT only: 2.5 ms less look-ahead, no FEC
+    int jitter_min_ms;       // the jitter buffer stays within these
+    int jitter_max_ms;
+};
+
+// What the chains used to be: opusenc defaults and a fixed 200 ms buffer
+const VoiceProfile VOICE_PROFILE_DEFAULT = {20000, false, 0, false, false, 200, 200};
+
+// 10 ms frames with FEC; the default
+const VoiceProfile VOICE_PROFILE_LOW_LATENCY = {10000, true, 10, false, false, 10, 120};
+
+// 2.5 ms frames for a quiet LAN; loss is concealed, not repaired
+const VoiceProfile VOICE_PROFILE_ULTRA_LOW = {2500, false, 0, false, true, 5, 60};
+
+struct VoiceStats {
+    double warmup_ms;        // voice_init(): element creation, negotiation, device open
+    double last_setup_ms;    // voice_start() until the first RTP packet left for the peer
+    double avg_setup_ms;
+    double max_setup_ms;
+    uint64_t calls;          // setups measured
+    uint64_t foreign;        // packets dropped because they came from someone other than the peer
+    uint64_t late;           // packets that missed the jitter buffer
+    uint64_t concealed;      // packets declared lost and concealed by the decoder
+    uint64_t packets_received; // RTP from the peer, per RTCP accounting
+    int64_t packets_lost;    // expected minus received
+    double peer_loss_percent; // loss of our stream, from the peer's last receiver report
+    double rtcp_rtt_ms;      // from the peer's receiver reports, 0 before the first
+    double send_kbps;
+    double receive_kbps;
+    double jitter_ms;        // RFC 3550 interarrival jitter of the peer's stream
+    double jitter_buffer_ms; // current jitter buffer latency
+    double send_latency_ms;  // capture and encoding, from a latency query
+    double receive_latency_ms; // jitter buffer, decoding and playback
+    double mouth_to_ear_ms;  // peer's send latency (taken to be ours) + RTT / 2 + receive latency
+    bool in_call;
+};
+
+// RTCP about the stream we receive arrives on the voice port plus this,
+// reports about the stream we send one port above that
+const int VOICE_RTCP_OFFSET = 100;
+
+// Call setup target; slower setups are logged
+const double VOICE_SETUP_GOAL_MS = 50;
+
+// Build both chains, receive on port, and bring them to PAUSED. source and
+// sink are the audio devices; the loopback harness swaps in test elements.
+bool voice_init(int port, const VoiceProfile &profile = VOICE_PROFILE_LOW_LATENCY,
+                const char *source = "autoaudiosrc", const char *sink = "autoaudiosink");
+
+// Start a call with host:port, or move the running call there. send_key
+// is the fresh master key we send under; NULL for plain RTP, as the
+// loopback harnesses use.
+bool voice_start(const char *host, int port, const uint8_t *send_key = NULL);
+
+// The master key host sends under. Its packets are dropped until this
+// arrives; safe from any thread.
+void voice_set_receive_key(const char *host, const uint8_t *key);
+
+// The key host last sent; kept across voice_shutdown() so a call can turn
+// into a conference without asking for it again
+bool voice_get_receive_key(const char *host, uint8_t *key);
+
+// Hang up: back to PAUSED, devices stay open for the next call
+void voice_stop();
+
+// Tear everything down
+void voice_shutdown();
+
+void voice_get_stats(VoiceStats *stats);
+
+// Round trip to the peer, for the network part of mouth_to_ear_ms until
+// RTCP has measured one
+void voice_set_rtt(double ms);
+
+// A named element from either chain, with a reference; for test harnesses
+GstElement *voice_get_element(const char *name);
+
+#endif
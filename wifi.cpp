@@ -0,0 +1,142 @@
+#include "wifi.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Radiotap present bits read here
+enum {
+    RT_TSFT = 0,
+    RT_FLAGS = 1,
+    RT_RATE = 2,
+    RT_CHANNEL = 3,
+    RT_FHSS = 4,
+    RT_SIGNAL = 5,
+    RT_NOISE = 6,
+    RT_EXT = 31,
+};
+
+// Alignment and size of the fields before RT_NOISE, in bit order
+static const uint8_t rt_align[] = { 8, 1, 1, 2, 1, 1, 1 };
+static const uint8_t rt_size[] = { 8, 1, 1, 4, 2, 1, 1 };
+
+const uint8_t RT_FLAG_FCS = 0x10;       // the frame ends in a 4-byte FCS
+const uint8_t RT_FLAG_BAD_FCS = 0x40;
+
+const size_t HEADER_MIN = 10;           // frame control, duration, addr1
+const size_t HEADER_ADDR2 = 16;
+const size_t HEADER_MANAGEMENT = 24;
+const size_t FIXED_BEACON = 12;         // timestamp, interval, capabilities
+
+const uint8_t IE_SSID = 0;
+
+static uint16_t get_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)get_le16(p) | (uint32_t)get_le16(p + 2) << 16;
+}
+
+// Fill in what the radiotap header says and return its length, or 0
+static size_t parse_radiotap(const uint8_t *data, size_t len, WifiFrame *out) {
+    if (len < 8 || data[0] != 0) return 0;
+    size_t rt_len = get_le16(data + 2);
+    if (rt_len < 8 || rt_len > len) return 0;
+
+    uint32_t present = get_le32(data + 4);
+    size_t off = 8;
+    for (uint32_t word = present; word & (1u << RT_EXT); off += 4) {
+        if (off + 4 > rt_len) return 0;
+        word = get_le32(data + off);
+    }
+
+    uint8_t rt_flags = 0;
+    for (int bit = RT_TSFT; bit <= RT_NOISE; bit++) {
+        if (!(present & (1u << bit))) continue;
+        off = (off + rt_align[bit] - 1) & ~(size_t)(rt_align[bit] - 1);
+        if (off + rt_size[bit] > rt_len) return 0;
+        const uint8_t *field = data + off;
+        switch (bit) {
+        case RT_FLAGS:
+            rt_flags = field[0];
+            break;
+        case RT_CHANNEL:
+            out->channel_mhz = get_le16(field);
+            break;
+        case RT_SIGNAL:
+            out->signal_dbm = (int8_t)field[0];
+            out->has_signal = true;
+            break;
+        case RT_NOISE:
+            out->noise_dbm = (int8_t)field[0];
+            out->has_noise = true;
+            break;
+        }
+        off += rt_size[bit];
+    }
+
+    if (rt_flags & RT_FLAG_FCS) {
+        if (len - rt_len < 4) return 0;
+        out->len -= 4;
+    }
+    out->bad_fcs = (rt_flags & RT_FLAG_BAD_FCS) != 0;
+    return rt_len;
+}
+
+// The SSID element, if it is where beacons and probes put it: first
+static void parse_ssid(const uint8_t *body, size_t len, WifiFrame *out) {
+    if (len < 2 || body[0] != IE_SSID) return;
+    size_t ssid_len = body[1];
+    if (ssid_len > WIFI_MAX_SSID || ssid_len > len - 2) return;
+    out->ssid = body + 2;
+    out->ssid_len = (uint8_t)ssid_len;
+}
+
+bool wifi_parse(const uint8_t *data, size_t len, uint32_t link, uint64_t time_ns, WifiFrame *out) {
+    memset(out, 0, sizeof(*out));
+    out->time_ns = time_ns;
+    out->len = (uint32_t)len;
+
+    size_t skip = 0;
+    if (link == WIFI_LINK_RADIOTAP) {
+        skip = parse_radiotap(data, len, out);
+        if (!skip) return false;
+        out->len -= (uint32_t)skip;
+    } else if (link != WIFI_LINK_80211) {
+        return false;
+    }
+
+    const uint8_t *frame = data + skip;
+    size_t frame_len = out->len;
+    if (frame_len < HEADER_MIN) return false;
+
+    out->frame = frame;
+    out->type = (frame[0] >> 2) & 3;
+    out->subtype = frame[0] >> 4;
+    out->flags = frame[1];
+    out->receiver = frame + 4;
+    if (frame[0] & 3) return false;           // protocol version 0 is the only one
+
+    // ACK and CTS are the control frames with only a receiver
+    bool receiver_only = out->type == WIFI_TYPE_CONTROL && (out->subtype == 12 || out->subtype == 13);
+    if (receiver_only) return true;
+    if (frame_len < HEADER_ADDR2) return false;
+    out->transmitter = frame + 10;
+
+    if (out->type != WIFI_TYPE_MANAGEMENT) return true;
+    if (frame_len < HEADER_MANAGEMENT) return false;
+    out->bssid = frame + 16;
+
+    size_t body = HEADER_MANAGEMENT;
+    if (out->subtype == WIFI_BEACON || out->subtype == WIFI_PROBE_RESPONSE) {
+        body += FIXED_BEACON;
+    } else if (out->subtype != WIFI_PROBE_REQUEST) {
+        return true;
+    }
+    if (frame_len > body) parse_ssid(frame + body, frame_len - body, out);
+    return true;
+}
+
+void wifi_format_mac(const uint8_t *mac, char *buf) {
+    snprintf(buf, 18, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
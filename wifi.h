@@ -0,0 +1,68 @@
+#ifndef PUTTYNET_WIFI_H
+#define PUTTYNET_WIFI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 802.11 frames as a monitor-mode interface hands them over, parsed in
+// place: nothing is copied, a WifiFrame only points into the buffer it was
+// parsed from and lives no longer than that.
+//
+// Monitor mode puts a radiotap header in front of every frame:
+//
+//   0  version           1 byte, 0
+//   1  pad               1 byte
+//   2  length            2 bytes, little-endian, the whole header
+//   4  present           4 bytes, little-endian; bit 31 chains another word
+//      fields            in bit order, each aligned to its own size
+//
+// Only the first word's fields up to the antenna noise are read: TSFT,
+// flags, rate, channel, FHSS, antenna signal and noise. Fields are laid
+// out in bit order, so whatever follows, extended bitmaps and vendor
+// namespaces included, can be skipped using the length alone.
+
+// Link types, as pcap numbers them
+const uint32_t WIFI_LINK_80211 = 105;            // bare 802.11
+const uint32_t WIFI_LINK_RADIOTAP = 127;         // radiotap, then 802.11
+
+const size_t WIFI_MAC_SIZE = 6;
+const size_t WIFI_MAX_SSID = 32;
+
+// Frame types
+const uint8_t WIFI_TYPE_MANAGEMENT = 0;
+const uint8_t WIFI_TYPE_CONTROL = 1;
+const uint8_t WIFI_TYPE_DATA = 2;
+
+// Management subtypes
+const uint8_t WIFI_PROBE_REQUEST = 4;
+const uint8_t WIFI_PROBE_RESPONSE = 5;
+const uint8_t WIFI_BEACON = 8;
+
+struct WifiFrame {
+    const uint8_t *frame;          // the 802.11 header
+    uint32_t len;                  // without the FCS
+    uint64_t time_ns;              // capture time, from the ring or the file
+    const uint8_t *receiver;       // addr1
+    const uint8_t *transmitter;    // addr2, NULL for ACK and CTS, which have none
+    const uint8_t *bssid;          // management frames only, else NULL
+    const uint8_t *ssid;           // beacons and probes, else NULL; not NUL terminated
+    uint8_t ssid_len;
+    uint8_t type;
+    uint8_t subtype;
+    uint8_t flags;                 // the frame control flags byte
+    uint16_t channel_mhz;          // 0 if radiotap did not say
+    int8_t signal_dbm;             // valid with has_signal
+    int8_t noise_dbm;              // valid with has_noise
+    bool has_signal;
+    bool has_noise;
+    bool bad_fcs;                  // the driver saw a checksum error; addresses may be garbage
+};
+
+// Parse one captured frame of link type link into out. False for frames
+// too short or malformed to trust.
+bool wifi_parse(const uint8_t *data, size_t len, uint32_t link, uint64_t time_ns, WifiFrame *out);
+
+// "aa:bb:cc:dd:ee:ff"; buf needs 18 bytes
+void wifi_format_mac(const uint8_t *mac, char *buf);
+
+#endif